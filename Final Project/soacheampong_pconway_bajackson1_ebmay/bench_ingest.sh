@@ -0,0 +1,87 @@
+#!/bin/bash
+#
+# Ingest throughput: one write_file process per file vs. one batch call,
+# then qfs_pack and qfs_unpack of the whole directory against cp
+#
+# Usage: ./bench_ingest.sh [<number of files>] [<file size in bytes>] [<image size in MB>]
+#
+
+set -e
+
+NUM_FILES=${1:-250}
+FILE_SIZE=${2:-4096}
+IMAGE_MB=${3:-120}
+
+TEMP_DIR="bench_tmp"
+
+CYAN="\033[0;36m"
+NC="\033[0m"
+
+cleanup() {
+    rm -rf "$TEMP_DIR"
+}
+
+trap cleanup EXIT
+
+# Current time in nanoseconds
+now() {
+    date +%s%N
+}
+
+# Print files per second for a run: <label> <start ns> <end ns>
+report() {
+    awk -v label="$1" -v n="$NUM_FILES" -v t0="$2" -v t1="$3" 'BEGIN {
+        secs = (t1 - t0) / 1e9
+        printf "%-22s %8.3f s  %10.1f files/s\n", label, secs, n / secs
+    }'
+}
+
+make all > /dev/null
+
+mkdir -p "$TEMP_DIR/files"
+
+echo -e "${CYAN}Generating $NUM_FILES files of $FILE_SIZE bytes...${NC}"
+for i in $(seq 1 "$NUM_FILES"); do
+    head -c "$FILE_SIZE" /dev/urandom > "$TEMP_DIR/files/f$i"
+done
+ls "$TEMP_DIR"/files/* > "$TEMP_DIR/list.txt"
+
+new_image() {
+    dd if=/dev/zero of="$TEMP_DIR/disk.img" bs=1M count="$IMAGE_MB" status=none
+    ./mkfs_qfs "$TEMP_DIR/disk.img"
+}
+
+echo -e "${CYAN}Writing into a ${IMAGE_MB}MB image${NC}"
+
+# One process per file (the old loop)
+new_image
+T0=$(now)
+while read -r f; do
+    ./write_file "$TEMP_DIR/disk.img" "$f" > /dev/null
+done < "$TEMP_DIR/list.txt"
+T1=$(now)
+report "per-file processes" "$T0" "$T1"
+
+# One batch invocation
+new_image
+T0=$(now)
+./write_file --from-list "$TEMP_DIR/list.txt" "$TEMP_DIR/disk.img" > /dev/null
+T1=$(now)
+report "batch (--from-list)" "$T0" "$T1"
+
+echo -e "${CYAN}Whole directory${NC}"
+
+T0=$(now)
+cp -r "$TEMP_DIR/files" "$TEMP_DIR/copy"
+T1=$(now)
+report "cp -r" "$T0" "$T1"
+
+T0=$(now)
+./qfs_pack "$TEMP_DIR/files" "$TEMP_DIR/packed.img" > /dev/null
+T1=$(now)
+report "qfs_pack" "$T0" "$T1"
+
+T0=$(now)
+./qfs_unpack "$TEMP_DIR/packed.img" "$TEMP_DIR/unpacked" > /dev/null
+T1=$(now)
+report "qfs_unpack" "$T0" "$T1"
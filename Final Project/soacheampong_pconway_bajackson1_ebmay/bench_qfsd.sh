@@ -0,0 +1,113 @@
+#!/bin/bash
+#
+# Request latency: per-process tools vs. the same tools routed through qfsd
+#
+# Usage: ./bench_qfsd.sh [<requests per operation>] [<number of files>] [<image size in MB>]
+#
+
+set -e
+
+NUM_REQS=${1:-200}
+NUM_FILES=${2:-200}
+IMAGE_MB=${3:-120}
+
+TEMP_DIR="bench_tmp"
+SOCKET="$PWD/$TEMP_DIR/qfsd.sock"
+
+CYAN="\033[0;36m"
+NC="\033[0m"
+
+QFSD_PID=""
+
+cleanup() {
+    if [ -n "$QFSD_PID" ]; then
+        kill "$QFSD_PID" 2> /dev/null || true
+        wait "$QFSD_PID" 2> /dev/null || true
+    fi
+    rm -rf "$TEMP_DIR"
+}
+
+trap cleanup EXIT
+
+# Current time in nanoseconds
+now() {
+    date +%s%N
+}
+
+# Run a command once per request and print each latency in microseconds
+time_op() {
+    for i in $(seq 1 "$NUM_REQS"); do
+        T0=$(now)
+        "$@" "$i" > /dev/null
+        T1=$(now)
+        echo $(( (T1 - T0) / 1000 ))
+    done
+}
+
+# Write a file then delete it again, so the directory never fills up
+time_write_delete() {
+    for i in $(seq 1 "$NUM_REQS"); do
+        T0=$(now)
+        op_write "$i" > /dev/null
+        T1=$(now)
+        op_del "$i" > /dev/null
+        T2=$(now)
+        echo $(( (T1 - T0) / 1000 )) >> "$1"
+        echo $(( (T2 - T1) / 1000 )) >> "$2"
+    done
+}
+
+# Print p50/p99 of a list of latencies: <label> <file>
+report() {
+    sort -n "$2" | awk -v label="$1" '{ v[NR] = $1 } END {
+        p50 = v[int(NR * 0.50) > 0 ? int(NR * 0.50) : 1]
+        p99 = v[int(NR * 0.99) > 0 ? int(NR * 0.99) : 1]
+        printf "%-28s p50 %8.3f ms   p99 %8.3f ms\n", label, p50 / 1000, p99 / 1000
+    }'
+}
+
+# The operations, each takes the request number last
+op_list()  { ./list_information "$TEMP_DIR/disk.img"; }
+op_read()  { ./read_file "$TEMP_DIR/disk.img" "$TEMP_DIR/files/f$(( $1 % NUM_FILES + 1 ))" -; }
+op_write() { ./write_file "$TEMP_DIR/disk.img" "$TEMP_DIR/new/n$1"; }
+op_del()   { ./delete_file "$TEMP_DIR/disk.img" "$TEMP_DIR/new/n$1"; }
+
+run_all() {
+    local mode="$1"
+    time_op op_list  > "$TEMP_DIR/list.$mode"
+    time_op op_read  > "$TEMP_DIR/read.$mode"
+    time_write_delete "$TEMP_DIR/write.$mode" "$TEMP_DIR/del.$mode"
+}
+
+make all > /dev/null
+
+mkdir -p "$TEMP_DIR/files" "$TEMP_DIR/new"
+
+echo -e "${CYAN}Filling a ${IMAGE_MB}MB image with $NUM_FILES files...${NC}"
+for i in $(seq 1 "$NUM_FILES"); do
+    head -c $(( IMAGE_MB * 1024 * 1024 / NUM_FILES / 2 )) /dev/urandom > "$TEMP_DIR/files/f$i"
+done
+for i in $(seq 1 "$NUM_REQS"); do
+    head -c 4096 /dev/urandom > "$TEMP_DIR/new/n$i"
+done
+ls "$TEMP_DIR"/files/* > "$TEMP_DIR/list.txt"
+
+./mkfs_qfs -s "${IMAGE_MB}M" "$TEMP_DIR/disk.img" > /dev/null
+./write_file --from-list "$TEMP_DIR/list.txt" "$TEMP_DIR/disk.img" > /dev/null
+
+echo -e "${CYAN}$NUM_REQS requests per operation, per-process tools${NC}"
+run_all local
+
+echo -e "${CYAN}Same requests through qfsd${NC}"
+./qfsd -s "$SOCKET" "$TEMP_DIR/disk.img" > /dev/null &
+QFSD_PID=$!
+while [ ! -S "$SOCKET" ]; do
+    sleep 0.05
+done
+export QFS_SOCKET="$SOCKET"
+run_all qfsd
+
+for op in list read write del; do
+    report "$op (per-process)" "$TEMP_DIR/$op.local"
+    report "$op (qfsd)" "$TEMP_DIR/$op.qfsd"
+done
@@ -1,17 +1,68 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 #include "qfs.h"
+#include "qfs_image.h"
+#include "qfs_dir.h"
+#include "qfs_file.h"
+#include "qfs_proto.h"
+
+// Have qfsd delete the file instead of opening the image
+static int delete_remote(const char *sock_path, const char *image_path, const char *name) {
+    int fd = qfs_client_connect(sock_path);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot reach qfsd at %s: %s\n", sock_path, qfs_strerror(fd));
+        return 2;
+    }
+
+    qfs_resp_hdr_t resp;
+    qfs_file_info_t info;
+    int err = qfs_client_call(fd, QFS_OP_DELETE, 0, image_path, name, NULL, 0, &resp);
+
+    if (err == QFS_ENOENT) {
+        fprintf(stderr, "Error: File '%s' not found.\n", name);
+        close(fd);
+        return 4;
+    }
+    if (err != QFS_OK && err != QFS_EFORMAT) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", image_path, qfs_strerror(err));
+        close(fd);
+        return 2;
+    }
+    if (resp.data_len != sizeof(info) || qfs_recv_all(fd, &info, sizeof(info)) != QFS_OK) {
+        fprintf(stderr, "Error: Bad reply from qfsd.\n");
+        close(fd);
+        return 3;
+    }
+    close(fd);
+
+    printf("Deleting file '%s' (Size: %u, Start Block: %u)...\n", 
+           info.entry.filename, info.entry.file_size, info.start);
+
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Chain left the image, truncated.\n");
+    }
+
+    printf("File deleted successfully.\n");
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <disk image file> <file to remove>\n", argv[0]);
+    if (qfs_stats_args(&argc, argv) != QFS_OK || argc != 3) {
+        fprintf(stderr, "Usage: %s [--stats[=json]] <disk image file> <file to remove>\n", argv[0]);
         return 1;
     }
 
-    FILE *fp = fopen(argv[1], "rb+");
-    if (!fp) {
-        perror("fopen");
+    const char *sock_path = qfs_client_socket();
+    if (sock_path) {
+        return delete_remote(sock_path, argv[1], argv[2]);
+    }
+
+    qfs_image_t img;
+    int err = qfs_open(&img, argv[1], QFS_RDWR);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", argv[1], qfs_strerror(err));
         return 2;
     }
 
@@ -19,100 +70,42 @@ int main(int argc, char *argv[]) {
     printf("Opened disk image: %s\n", argv[1]);
 #endif
 
-    // Read superblock
-    superblock_t sb;
-
-    if (fread(&sb, sizeof(superblock_t), 1, fp) != 1) {
-        fprintf(stderr, "Error: Failed to read superblock.\n");
-        fclose(fp);
+    // Find file through the directory index
+    qfs_dir_t *dir = qfs_get_dir(&img);
+    if (!dir) {
+        fprintf(stderr, "Error: Failed to load directory.\n");
+        qfs_close(&img);
         return 3;
     }
 
-    // Find file in directory entries
-    direntry_t entry;
-    int entry_index = -1;
-    long entry_offset = 0;
-
-    // Seek to start of directory entries
-    fseek(fp, sizeof(superblock_t), SEEK_SET);
-
-    for (int i = 0; i < sb.total_direntries; i++) {
-        // Store current offset to jump back to write later updates
-        long current_pos = ftell(fp);
-        fread(&entry, sizeof(direntry_t), 1, fp);
-        
-        // Check if matching filename and not deleted
-        if (entry.filename[0] != '\0' && strcmp(entry.filename, argv[2]) == 0) {
-            entry_index = i;
-            entry_offset = current_pos;
-            break; 
-        }
-    }
+    int slot = qfs_dir_lookup(dir, argv[2]);
 
-    if (entry_index == -1) {
+    if (slot < 0) {
         fprintf(stderr, "Error: File '%s' not found.\n", argv[2]);
-        fclose(fp);
+        qfs_close(&img);
         return 4;
     }
 
-    // Prepare to delete when file found
-    uint16_t current_block = entry.starting_block;
-    uint32_t file_size = entry.file_size;
-    
+    const direntry_t *entry = &dir->entries[slot];
+
     printf("Deleting file '%s' (Size: %u, Start Block: %u)...\n", 
-           entry.filename, file_size, current_block);
-
-    // Mark free directory entry
-    // Set first char of filename to '\0'
-    fseek(fp, entry_offset, SEEK_SET); 
-    char empty_byte = '\0';
-    fwrite(&empty_byte, 1, 1, fp);
-
-    // Update superblock for one more available directory entry
-    sb.available_direntries++;
-
-    // Traverse/free Blocks
-    long data_start_offset = sizeof(superblock_t) + (sizeof(direntry_t) * 255);
-
-    // Calculate data in one block
-    // Need to know if at last block
-    uint32_t bytes_remaining = file_size;
-    uint32_t data_per_block = sb.bytes_per_block - 3;
-
-    while (bytes_remaining > 0) {
-        // Calculate offset of current block
-        long block_offset = data_start_offset + (current_block * sb.bytes_per_block);
-        
-        // Mark block as free
-        fseek(fp, block_offset, SEEK_SET);
-        uint8_t free_flag = 0;
-        fwrite(&free_flag, 1, 1, fp);
-        
-        // Update superblock count
-        sb.available_blocks++;
-
-        // Determine next block
-        // Look up next pointer if too much data for block
-        if (bytes_remaining > data_per_block) {
-            // Pointer at end of the block
-            fseek(fp, block_offset + sb.bytes_per_block - 2, SEEK_SET);
-            uint16_t next_block_val;
-            fread(&next_block_val, sizeof(uint16_t), 1, fp);
-            
-            current_block = next_block_val;
-            bytes_remaining -= data_per_block;
-        } else {
-            // Last block
-            bytes_remaining = 0;
-        }
+           entry->filename, entry->file_size, qfs_entry_start(entry, img.version));
+
+    // Free the entry and the chain's blocks, busy bytes are written back on close
+    err = qfs_delete_file(&img, slot);
+    if (err == QFS_ESYS) {
+        fprintf(stderr, "Error: Failed to build free-block bitmap.\n");
+        qfs_close(&img);
+        return 3;
     }
 
-    // Write updated superblock to disk
-    fseek(fp, 0, SEEK_SET);
-    fwrite(&sb, sizeof(superblock_t), 1, fp);
+    // Stop on a corrupt chain instead of freeing blocks outside the image
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Chain left the image, truncated.\n");
+    }
 
     printf("File deleted successfully.\n");
 
-    fclose(fp);
+    qfs_close(&img);
     return 0;
 }
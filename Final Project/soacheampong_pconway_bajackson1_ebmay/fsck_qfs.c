@@ -0,0 +1,148 @@
+/*
+**Program to check the consistency of a QFS image
+**
+** Usage: fsck_qfs [-j <threads>] [-r|--repair] <disk image file>
+**
+** Every file chain is walked (one directory entry per task) and checked
+** for blocks past the end of the image, loops and blocks shared with
+** another file. Busy bytes are compared with the blocks the chains reach
+** and the superblock counters with the busy bytes and directory.
+**
+** With --repair broken chains are cut back to their good blocks (files
+** left with none are removed, a cross-linked block stays with the lower
+** directory slot), orphaned blocks are freed and the counters rewritten.
+** Dedup hash entries no file shares any more are removed with their blocks.
+**
+** Exit status: 0 clean (or fully repaired), 4 problems left on the image.
+**
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include "qfs.h"
+#include "qfs_image.h"
+#include "qfs_dir.h"
+#include "qfs_check.h"
+
+static int usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-j <threads>] [-r|--repair] <disk image file>\n", prog);
+    return 1;
+}
+
+// Print the problems in a report
+static void print_report(const qfs_image_t *img, const qfs_dir_t *dir, const qfs_check_t *rep) {
+    for (int slot = 0; slot < rep->n_slots; slot++) {
+        const qfs_check_file_t *f = &rep->files[slot];
+        const char *name = dir->entries[slot].filename;
+
+        if (f->problem == QFS_CHECK_RANGE) {
+            printf("File '%s': block %u out of range after %u of %u blocks\n",
+                   name, f->bad_block, f->good, f->blocks);
+        } else if (f->problem == QFS_CHECK_CYCLE) {
+            printf("File '%s': chain loops back to block %u after %u of %u blocks\n",
+                   name, f->bad_block, f->good, f->blocks);
+        } else if (f->problem == QFS_CHECK_CROSS) {
+            printf("File '%s': cross-linked with '%s' at block %u after %u of %u blocks\n",
+                   name, dir->entries[f->other].filename, f->bad_block, f->good, f->blocks);
+        }
+    }
+
+    if (rep->orphaned > 0) {
+        printf("%u block(s) marked busy but not in any file\n", rep->orphaned);
+    }
+    if (rep->unmarked > 0) {
+        printf("%u block(s) in use but marked free\n", rep->unmarked);
+    }
+    if (rep->unused_hashes > 0) {
+        printf("%d dedup hash entr%s not shared by any file\n",
+               rep->unused_hashes, rep->unused_hashes == 1 ? "y" : "ies");
+    }
+
+    if (qfs_sb_available(img) != rep->expect_blocks) {
+        printf("Superblock: available_blocks is %u, should be %u\n",
+               qfs_sb_available(img), rep->expect_blocks);
+    }
+    if (img->sb->available_direntries != rep->expect_direntries) {
+        printf("Superblock: available_direntries is %u, should be %u\n",
+               img->sb->available_direntries, rep->expect_direntries);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int threads = 0;
+    int repair = 0;
+    int opt;
+
+    static const struct option long_opts[] = {
+        {"repair", no_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "j:r", long_opts, NULL)) != -1) {
+        if (opt == 'j') {
+            if (qfs_parse_int(optarg, 1, QFS_THREADS_MAX, &threads) != QFS_OK) {
+                fprintf(stderr, "Error: Thread count must be 1 to %d.\n", QFS_THREADS_MAX);
+                return 1;
+            }
+        } else if (opt == 'r') {
+            repair = 1;
+        } else {
+            return usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 1) {
+        return usage(argv[0]);
+    }
+
+    const char *path = argv[optind];
+
+    qfs_image_t img;
+    int err = qfs_open(&img, path, repair ? QFS_RDWR : QFS_RDONLY);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", path, qfs_strerror(err));
+        return 2;
+    }
+
+#ifdef DEBUG
+    printf("Opened disk image: %s\n", path);
+#endif
+
+    qfs_check_t rep;
+    err = qfs_check(&img, threads, &rep);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Check failed: %s\n", qfs_strerror(err));
+        qfs_close(&img);
+        return 3;
+    }
+
+    // Names come from the directory index the check was run against
+    qfs_dir_t *dir = qfs_get_dir(&img);
+
+    print_report(&img, dir, &rep);
+
+    int problems = qfs_check_problems(&rep);
+
+    printf("%s: %d file(s), %u of %u blocks in use, %u cross-linked, %d problem(s)\n",
+           path, rep.n_files, rep.busy, img.total_blocks, rep.cross_linked, problems);
+
+    if (problems > 0 && repair) {
+        int changes = qfs_check_repair(&img, threads, &rep);
+        if (changes < 0) {
+            fprintf(stderr, "Error: Repair failed: %s\n", qfs_strerror(changes));
+            qfs_close(&img);
+            return 3;
+        }
+
+        problems = qfs_check_problems(&rep);
+        printf("Repaired: %d change(s), %d problem(s) left\n", changes, problems);
+    } else if (problems > 0) {
+        printf("Run with --repair to fix.\n");
+    }
+
+    qfs_check_free(&rep);
+    qfs_close(&img);
+    return problems > 0 ? 4 : 0;
+}
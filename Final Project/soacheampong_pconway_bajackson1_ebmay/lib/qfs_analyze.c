@@ -0,0 +1,161 @@
+/*
+** Space and fragmentation analysis (libqfs)
+**
+** Threads take files off a shared counter, as in qfs_check(), and each
+** writes only its own files' results, so nothing else is shared.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "qfs_analyze.h"
+#include "qfs_bitmap.h"
+#include "qfs_dir.h"
+#include "qfs_chain.h"
+
+// Shared state for the threads walking file chains
+typedef struct analyze_ctx {
+    const qfs_image_t *img;
+    const direntry_t  *entries;
+    qfs_analysis_t    *an;
+    int                next;        // Next file to take (atomic)
+} analyze_ctx_t;
+
+static void walk_one(const analyze_ctx_t *ctx, qfs_file_layout_t *f) {
+    const direntry_t *entry = &ctx->entries[f->slot];
+    const qfs_image_t *img = ctx->img;
+
+    qfs_chain_t chain;
+    qfs_extent_t run;
+
+    qfs_chain_init(&chain, img, qfs_entry_start(entry, img->version), entry->file_size);
+
+    while (qfs_chain_next_run(&chain, &run) > 0) {
+        f->blocks += run.count;
+        f->extents++;
+    }
+
+    f->error = chain.error;
+    if (entry->file_size > 0) {
+        uint32_t tail = entry->file_size % img->payload;
+        f->slack = tail ? img->payload - tail : 0;
+    }
+}
+
+static void *analyze_worker(void *arg) {
+    analyze_ctx_t *ctx = arg;
+
+    for (;;) {
+        int i = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED);
+        if (i >= ctx->an->n_files) {
+            break;
+        }
+        walk_one(ctx, &ctx->an->files[i]);
+    }
+    return NULL;
+}
+
+// Histogram bucket of a free run: floor(log2(len)), capped
+static int free_bucket(uint32_t len) {
+    int b = 0;
+    while (len > 1 && b < QFS_FREE_BUCKETS - 1) {
+        len >>= 1;
+        b++;
+    }
+    return b;
+}
+
+int qfs_analyze(qfs_image_t *img, int threads, qfs_analysis_t *an) {
+    memset(an, 0, sizeof(qfs_analysis_t));
+
+    qfs_dir_t *dir = qfs_get_dir(img);
+    qfs_bitmap_t *bm = qfs_get_bitmap(img);
+    if (!dir || !bm) {
+        return QFS_ESYS;
+    }
+
+    an->files = calloc(dir->n_used ? dir->n_used : 1, sizeof(qfs_file_layout_t));
+    if (!an->files) {
+        return QFS_ESYS;
+    }
+    for (int slot = 0; slot < dir->n_slots && an->n_files < dir->n_used; slot++) {
+        if (qfs_dir_is_file(dir, slot)) {
+            an->files[an->n_files++].slot = slot;
+        }
+    }
+
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int) cpus : 1;
+    }
+    if (threads > an->n_files) {
+        threads = an->n_files > 0 ? an->n_files : 1;
+    }
+
+    analyze_ctx_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.img = img;
+    ctx.entries = dir->entries;
+    ctx.an = an;
+
+    // The calling thread walks chains too
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    int started = 0;
+
+    for (int t = 1; tids && t < threads; t++, started++) {
+        if (pthread_create(&tids[t], NULL, analyze_worker, &ctx) != 0) {
+            break;
+        }
+    }
+    analyze_worker(&ctx);
+    for (int t = 1; t <= started; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    free(tids);
+
+    // Totals over the files
+    uint32_t framing = img->block_size - img->payload;
+    uint64_t chained = 0;
+
+    for (int i = 0; i < an->n_files; i++) {
+        const qfs_file_layout_t *f = &an->files[i];
+
+        an->file_bytes += dir->entries[f->slot].file_size;
+        an->blocks += f->blocks;
+        an->extents += f->extents;
+        an->slack_bytes += f->slack;
+        an->framing_bytes += (uint64_t) f->blocks * framing;
+        an->fragmented += f->extents > 1;
+        an->broken += f->error != QFS_OK;
+        chained += f->extents > 0;
+    }
+    if (an->blocks > chained) {
+        an->score = 100.0 * (double) (an->extents - chained) / (double) (an->blocks - chained);
+    }
+
+    // Free space, one run at a time
+    uint32_t start, len;
+    for (uint32_t pos = 0; (len = qfs_bitmap_next_run(bm, pos, &start)) > 0; pos = start + len) {
+        an->free_blocks += len;
+        an->free_runs++;
+        an->free_hist[free_bucket(len)]++;
+        if (len > an->largest_free) {
+            an->largest_free = len;
+        }
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "Analyze: %d files on %d thread(s), %u free runs\n",
+            an->n_files, threads, an->free_runs);
+#endif
+
+    return QFS_OK;
+}
+
+void qfs_analysis_free(qfs_analysis_t *an) {
+    free(an->files);
+    an->files = NULL;
+}
@@ -0,0 +1,61 @@
+/*
+**
+** Space and fragmentation analysis (libqfs)
+**
+** Walks every file chain on a pool of threads over the one mapping of
+** the image, recording how many runs of contiguous blocks each file is
+** stored in, the bytes its last block leaves unused and the framing (busy
+** byte and next_block pointer) its blocks carry. The free blocks are
+** summed up as a histogram of free run lengths.
+**
+** A chain shared through the dedup index is counted for every file that
+** uses it, so the totals describe what reading each file costs.
+**
+** Usage: #include "qfs_analyze.h"
+**
+*/
+
+#ifndef QFS_ANALYZE_H
+#define QFS_ANALYZE_H
+
+#include <stdint.h>
+#include "qfs_image.h"
+
+// Buckets of the free run histogram, bucket i counts runs of 2^i to
+// 2^(i+1) - 1 blocks and the last one everything longer
+#define QFS_FREE_BUCKETS  20
+
+// One file's chain
+typedef struct qfs_file_layout {
+    int      slot;          // Directory slot
+    uint32_t blocks;        // Blocks walked
+    uint32_t extents;       // Runs of contiguous blocks
+    uint32_t slack;         // Unused bytes in the last block
+    int      error;         // QFS_EFORMAT if the chain leaves the image
+} qfs_file_layout_t;
+
+typedef struct qfs_analysis {
+    qfs_file_layout_t *files;       // One per file, in slot order
+    int       n_files;
+    int       fragmented;           // Files in more than one run
+    int       broken;               // Files whose chain leaves the image
+    uint64_t  file_bytes;           // Bytes stored, as the entries give them
+    uint64_t  blocks;               // Blocks in all chains
+    uint64_t  extents;              // Runs in all chains
+    uint64_t  slack_bytes;          // Unused bytes in last blocks
+    uint64_t  framing_bytes;        // Busy bytes and next_block pointers of chain blocks
+    double    score;                // Percent of chain links that jump (as qfs_frag_stats())
+    uint32_t  free_blocks;
+    uint32_t  free_runs;
+    uint32_t  largest_free;         // Longest run of free blocks
+    uint32_t  free_hist[QFS_FREE_BUCKETS];
+} qfs_analysis_t;
+
+// Function to analyze an image on threads threads (0 for one per CPU),
+// returns QFS_OK or QFS_ESYS
+int qfs_analyze(qfs_image_t *img, int threads, qfs_analysis_t *an);
+
+// Function to release an analysis
+void qfs_analysis_free(qfs_analysis_t *an);
+
+#endif // QFS_ANALYZE_H
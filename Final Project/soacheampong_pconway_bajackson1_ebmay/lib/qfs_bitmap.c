@@ -0,0 +1,391 @@
+/*
+** In-memory free-block bitmap (libqfs)
+**
+** Replaces the per-block seek + 1-byte read used to find free blocks.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "qfs_bitmap.h"
+
+// Allocate the word arrays and set the padding bits past the last block
+static int bitmap_alloc_words(qfs_bitmap_t *bm, uint32_t nblocks) {
+    memset(bm, 0, sizeof(qfs_bitmap_t));
+    bm->nblocks = nblocks;
+    bm->nwords = (nblocks + 63) / 64;
+
+    bm->words = calloc(bm->nwords ? bm->nwords : 1, sizeof(uint64_t));
+    bm->dirty = calloc(bm->nwords ? bm->nwords : 1, sizeof(uint64_t));
+    if (!bm->words || !bm->dirty) {
+        qfs_bitmap_destroy(bm);
+        return QFS_ESYS;
+    }
+
+    // Padding bits count as busy so they are never allocated
+    if (nblocks & 63) {
+        bm->words[bm->nwords - 1] = ~0ULL << (nblocks & 63);
+    }
+
+    return QFS_OK;
+}
+
+qfs_bitmap_t *qfs_get_bitmap(qfs_image_t *img) {
+    if (img->bitmap) {
+        return img->bitmap;
+    }
+
+    qfs_bitmap_t *bm = malloc(sizeof(qfs_bitmap_t));
+    if (!bm) {
+        return NULL;
+    }
+
+    uint64_t t0 = qfs_phase_begin();
+    int err = qfs_bitmap_load(bm, img);
+    qfs_phase_end(QFS_PHASE_ALLOC, t0);
+
+    if (err != QFS_OK) {
+        free(bm);
+        return NULL;
+    }
+
+    // Written back and released by qfs_close()
+    img->bitmap = bm;
+    return bm;
+}
+
+int qfs_bitmap_load(qfs_bitmap_t *bm, const qfs_image_t *img) {
+    int err = bitmap_alloc_words(bm, img->total_blocks);
+    if (err != QFS_OK) {
+        return err;
+    }
+
+    // Busy bytes are read front to back, let the kernel read ahead
+    // (the data area starts at 8192, or 12288 on v2, both page aligned)
+    size_t span = (size_t) img->total_blocks * img->block_size;
+    madvise(img->data, span, MADV_SEQUENTIAL);
+    QFS_STAT_ADD(syscalls, 2);
+
+    // One pass over the busy bytes, 64 blocks per word
+    const uint8_t *p = img->data;
+    for (uint32_t w = 0; w < bm->nwords; w++) {
+        uint32_t first = w * 64;
+        uint32_t count = (img->total_blocks - first < 64) ? img->total_blocks - first : 64;
+        uint64_t bits = 0;
+
+        for (uint32_t i = 0; i < count; i++) {
+            if (*p != QFS_BLOCK_FREE) {
+                bits |= 1ULL << i;
+            }
+            p += img->block_size;
+        }
+
+        bm->words[w] |= bits;
+        bm->free_count += count - (uint32_t) __builtin_popcountll(bits);
+    }
+
+    madvise(img->data, span, MADV_NORMAL);
+
+#ifdef DEBUG
+    fprintf(stderr, "Bitmap: %u of %u blocks free\n", bm->free_count, bm->nblocks);
+#endif
+
+    return QFS_OK;
+}
+
+void qfs_bitmap_destroy(qfs_bitmap_t *bm) {
+    free(bm->words);
+    free(bm->dirty);
+    bm->words = NULL;
+    bm->dirty = NULL;
+    bm->nblocks = 0;
+    bm->nwords = 0;
+    bm->free_count = 0;
+}
+
+void qfs_bitmap_set(qfs_bitmap_t *bm, uint32_t block, int busy) {
+    uint64_t mask = 1ULL << (block & 63);
+    uint64_t *word = &bm->words[block >> 6];
+
+    // Nothing to do if the block is already in the requested state
+    if (((*word & mask) != 0) == (busy != 0)) {
+        return;
+    }
+
+    if (busy) {
+        *word |= mask;
+        bm->free_count--;
+    } else {
+        *word &= ~mask;
+        bm->free_count++;
+
+        // Freed space before the hint becomes the next candidate
+        if ((block >> 6) < bm->hint) {
+            bm->hint = block >> 6;
+        }
+    }
+
+    bm->dirty[block >> 6] |= mask;
+}
+
+// Find the first zero bit in words [from, to), QFS_NO_BLOCK if none
+static uint32_t bitmap_scan(const qfs_bitmap_t *bm, uint32_t from_block, uint32_t to_word) {
+    uint32_t w = from_block >> 6;
+    if (w >= to_word) {
+        return QFS_NO_BLOCK;
+    }
+
+    // Ignore bits before the starting block in the first word
+    uint64_t free_bits = ~bm->words[w] & (~0ULL << (from_block & 63));
+
+    for (;;) {
+        if (free_bits) {
+            return w * 64 + (uint32_t) __builtin_ctzll(free_bits);
+        }
+        if (++w >= to_word) {
+            return QFS_NO_BLOCK;
+        }
+        free_bits = ~bm->words[w];
+    }
+}
+
+uint32_t qfs_bitmap_alloc(qfs_bitmap_t *bm, uint32_t start) {
+    if (bm->free_count == 0) {
+        return QFS_NO_BLOCK;
+    }
+
+    // Everything before the hint word is known to be busy
+    if (start < bm->hint * 64) {
+        start = bm->hint * 64;
+    }
+    if (start >= bm->nblocks) {
+        start = 0;
+    }
+
+    uint32_t block = bitmap_scan(bm, start, bm->nwords);
+    if (block == QFS_NO_BLOCK) {
+        // Wrap around to the blocks before the starting point
+        block = bitmap_scan(bm, 0, (start >> 6) + 1);
+    }
+    if (block == QFS_NO_BLOCK || block >= bm->nblocks) {
+        return QFS_NO_BLOCK;
+    }
+
+    qfs_bitmap_set(bm, block, 1);
+
+    // Remember where the busy prefix ends when allocating from the front
+    while (bm->hint < bm->nwords && bm->words[bm->hint] == ~0ULL) {
+        bm->hint++;
+    }
+
+    return block;
+}
+
+// Find the first set bit at or after a block (padding bits guarantee one)
+static uint32_t bitmap_scan_busy(const qfs_bitmap_t *bm, uint32_t from_block) {
+    uint32_t w = from_block >> 6;
+    if (w >= bm->nwords) {
+        return bm->nblocks;
+    }
+
+    uint64_t busy_bits = bm->words[w] & (~0ULL << (from_block & 63));
+
+    for (;;) {
+        if (busy_bits) {
+            uint32_t block = w * 64 + (uint32_t) __builtin_ctzll(busy_bits);
+            return block < bm->nblocks ? block : bm->nblocks;
+        }
+        if (++w >= bm->nwords) {
+            return bm->nblocks;
+        }
+        busy_bits = bm->words[w];
+    }
+}
+
+uint32_t qfs_bitmap_next_run(const qfs_bitmap_t *bm, uint32_t from, uint32_t *start) {
+    uint32_t first = bitmap_scan(bm, from, bm->nwords);
+    if (first == QFS_NO_BLOCK || first >= bm->nblocks) {
+        return 0;
+    }
+
+    *start = first;
+    return bitmap_scan_busy(bm, first) - first;
+}
+
+// Order runs by length, longest first
+static int run_cmp_len(const void *a, const void *b) {
+    const qfs_extent_t *x = a, *y = b;
+    if (x->count != y->count) {
+        return x->count > y->count ? -1 : 1;
+    }
+    return x->start < y->start ? -1 : (x->start > y->start);
+}
+
+// Order runs by position on disk
+static int run_cmp_start(const void *a, const void *b) {
+    const qfs_extent_t *x = a, *y = b;
+    return x->start < y->start ? -1 : (x->start > y->start);
+}
+
+int qfs_bitmap_alloc_extents(qfs_bitmap_t *bm, uint32_t n, int policy,
+                             qfs_extent_t *ext, uint32_t max_ext) {
+    if (n == 0) {
+        return 0;
+    }
+    if (bm->free_count < n) {
+        return QFS_ENOSPC;
+    }
+    if (max_ext == 0) {
+        return QFS_EINVAL;
+    }
+
+    // Collect every free run in one pass over the bitmap
+    uint32_t nruns = 0, cap = 64;
+    qfs_extent_t *runs = malloc(cap * sizeof(qfs_extent_t));
+    if (!runs) {
+        return QFS_ESYS;
+    }
+
+    uint32_t pos = bm->hint * 64, start, len;
+    uint32_t fit = QFS_NO_BLOCK;
+
+    while ((len = qfs_bitmap_next_run(bm, pos, &start)) > 0) {
+        if (nruns == cap) {
+            cap *= 2;
+            qfs_extent_t *grown = realloc(runs, cap * sizeof(qfs_extent_t));
+            if (!grown) {
+                free(runs);
+                return QFS_ESYS;
+            }
+            runs = grown;
+        }
+
+        // Track a run that holds the whole request under the chosen policy
+        if (len >= n) {
+            if (fit == QFS_NO_BLOCK || (policy == QFS_ALLOC_BEST_FIT && len < runs[fit].count)) {
+                fit = nruns;
+            }
+        }
+
+        runs[nruns].start = start;
+        runs[nruns].count = len;
+        nruns++;
+
+        // First fit can stop at the first run that is large enough
+        if (policy == QFS_ALLOC_FIRST_FIT && fit != QFS_NO_BLOCK) {
+            break;
+        }
+        // A perfect fit cannot be improved on
+        if (len == n) {
+            break;
+        }
+
+        pos = start + len;
+    }
+
+    int next = 0;
+
+    if (fit != QFS_NO_BLOCK) {
+        // Whole file in one contiguous run
+        ext[0].start = runs[fit].start;
+        ext[0].count = n;
+        next = 1;
+    } else {
+        // No single run is large enough: take the longest runs so the file
+        // ends up in the fewest fragments, and best-fit the final piece
+        qsort(runs, nruns, sizeof(qfs_extent_t), run_cmp_len);
+
+        uint32_t remaining = n;
+        uint32_t i = 0;
+
+        while (remaining > 0 && i < nruns) {
+            uint32_t pick = i;
+
+            if (runs[i].count >= remaining) {
+                // Smallest unused run that still holds the rest
+                pick = nruns - 1;
+                while (runs[pick].count < remaining) {
+                    pick--;
+                }
+            }
+
+            if ((uint32_t) next == max_ext) {
+                free(runs);
+                return QFS_EINVAL;
+            }
+
+            uint32_t take = runs[pick].count < remaining ? runs[pick].count : remaining;
+            ext[next].start = runs[pick].start;
+            ext[next].count = take;
+            next++;
+            remaining -= take;
+
+            // Move the chosen run out of the unused range
+            runs[pick] = runs[i];
+            i++;
+        }
+
+        // Chain the fragments in ascending block order
+        qsort(ext, next, sizeof(qfs_extent_t), run_cmp_start);
+    }
+
+    free(runs);
+
+    // Claim the blocks
+    for (int e = 0; e < next; e++) {
+        for (uint32_t b = 0; b < ext[e].count; b++) {
+            qfs_bitmap_set(bm, ext[e].start + b, 1);
+        }
+    }
+
+    while (bm->hint < bm->nwords && bm->words[bm->hint] == ~0ULL) {
+        bm->hint++;
+    }
+
+    return next;
+}
+
+void qfs_bitmap_release(qfs_bitmap_t *bm, const qfs_extent_t *ext, int n_ext) {
+    for (int e = 0; e < n_ext; e++) {
+        for (uint32_t b = 0; b < ext[e].count; b++) {
+            qfs_bitmap_set(bm, ext[e].start + b, 0);
+        }
+    }
+}
+
+int qfs_bitmap_sync_block(const qfs_bitmap_t *bm, qfs_image_t *img, uint32_t block) {
+    uint8_t *busy = qfs_block_get(img, block, QFS_BLK_WRITE);
+    if (!busy) {
+        return QFS_ESYS;
+    }
+    *busy = qfs_bitmap_test(bm, block) ? QFS_BLOCK_BUSY : QFS_BLOCK_FREE;
+    qfs_block_put(img, block);
+    return QFS_OK;
+}
+
+uint32_t qfs_bitmap_sync(qfs_bitmap_t *bm, qfs_image_t *img) {
+    uint32_t written = 0;
+
+    for (uint32_t w = 0; w < bm->nwords; w++) {
+        uint64_t bits = bm->dirty[w];
+
+        while (bits) {
+            uint32_t block = w * 64 + (uint32_t) __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            if (qfs_bitmap_sync_block(bm, img, block) == QFS_OK) {
+                written++;
+            }
+        }
+
+        bm->dirty[w] = 0;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "Bitmap: wrote back %u busy bytes\n", written);
+#endif
+
+    return written;
+}
@@ -0,0 +1,77 @@
+/*
+**
+** In-memory free-block bitmap (libqfs)
+**
+** One bit per data block (1 = busy, 0 = free), built from the busy bytes
+** in a single sequential pass. Allocation scans 64 blocks at a time for
+** the first zero bit. Blocks whose state changes are marked dirty and
+** only their busy bytes are written back by qfs_bitmap_sync().
+**
+** Usage: #include "qfs_bitmap.h"
+**
+*/
+
+#ifndef QFS_BITMAP_H
+#define QFS_BITMAP_H
+
+#include <stdint.h>
+#include "qfs_image.h"
+
+// Extent allocation policies
+#define QFS_ALLOC_BEST_FIT   1    // Smallest free run that holds the whole file
+#define QFS_ALLOC_FIRST_FIT  2    // First free run that holds the whole file
+
+// Run of physically contiguous blocks
+typedef struct qfs_extent {
+    uint32_t start;         // First block of the run
+    uint32_t count;         // Number of blocks in the run
+} qfs_extent_t;
+
+typedef struct qfs_bitmap {
+    uint64_t *words;        // Busy bits, padding bits past nblocks are set
+    uint64_t *dirty;        // Blocks whose busy byte must be written back
+    uint32_t  nblocks;      // Number of data blocks
+    uint32_t  nwords;       // Number of 64-bit words
+    uint32_t  free_count;   // Number of zero bits
+    uint32_t  hint;         // Word to start the next allocation search at
+} qfs_bitmap_t;
+
+// Function to get the image's bitmap, building it on first use (NULL on failure)
+qfs_bitmap_t *qfs_get_bitmap(qfs_image_t *img);
+
+// Function to build the bitmap from the busy bytes of an image
+int qfs_bitmap_load(qfs_bitmap_t *bm, const qfs_image_t *img);
+
+// Function to release the bitmap memory
+void qfs_bitmap_destroy(qfs_bitmap_t *bm);
+
+// Function to mark a block busy or free
+void qfs_bitmap_set(qfs_bitmap_t *bm, uint32_t block, int busy);
+
+// Function to allocate the first free block at or after start (QFS_NO_BLOCK if full)
+uint32_t qfs_bitmap_alloc(qfs_bitmap_t *bm, uint32_t start);
+
+// Function to find the next run of free blocks at or after a block (0 if none)
+uint32_t qfs_bitmap_next_run(const qfs_bitmap_t *bm, uint32_t from, uint32_t *start);
+
+// Function to allocate n blocks in as few runs as possible, returns the
+// number of extents written to ext (in block order) or an error code
+int qfs_bitmap_alloc_extents(qfs_bitmap_t *bm, uint32_t n, int policy,
+                             qfs_extent_t *ext, uint32_t max_ext);
+
+// Function to return the blocks of a list of extents to the free pool
+void qfs_bitmap_release(qfs_bitmap_t *bm, const qfs_extent_t *ext, int n_ext);
+
+// Function to write the busy bytes of all dirty blocks back to the image
+uint32_t qfs_bitmap_sync(qfs_bitmap_t *bm, qfs_image_t *img);
+
+// Function to write one block's busy byte back to the image whether or
+// not it is marked dirty, returns QFS_OK or QFS_ESYS
+int qfs_bitmap_sync_block(const qfs_bitmap_t *bm, qfs_image_t *img, uint32_t block);
+
+// Test whether a block is busy
+static inline int qfs_bitmap_test(const qfs_bitmap_t *bm, uint32_t block) {
+    return (bm->words[block >> 6] >> (block & 63)) & 1;
+}
+
+#endif // QFS_BITMAP_H
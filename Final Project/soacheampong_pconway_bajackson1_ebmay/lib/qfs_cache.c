@@ -0,0 +1,380 @@
+/*
+** Block cache (libqfs)
+**
+** Each shard keeps a hash table of its blocks and one LRU list, most
+** recently used at the head. Eviction takes the unpinned block nearest
+** the tail. If every block in a shard is pinned the shard goes over its
+** share of the budget and shrinks again as blocks are put back.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "qfs_cache.h"
+#include "qfs_image.h"
+
+typedef struct frame {
+    uint32_t      block;
+    uint32_t      pins;
+    int           dirty;
+    struct frame *hnext;           // Hash chain
+    struct frame *prev, *next;     // LRU list
+    uint8_t      *bytes;
+} frame_t;
+
+typedef struct shard {
+    pthread_mutex_t mu;
+    frame_t  **buckets;
+    uint32_t   n_buckets;          // Power of two
+    frame_t   *head, *tail;        // Most and least recently used
+    size_t     n_frames;
+    size_t     cap;                // This shard's share of the budget
+    uint64_t   hits, misses, evictions, writebacks;
+} shard_t;
+
+struct qfs_cache {
+    int      fd;
+    off_t    base;
+    uint32_t block_size;
+    uint32_t total_blocks;
+    size_t   capacity;
+    int      error;                // A write-back on eviction failed
+    shard_t  shards[QFS_CACHE_SHARDS];
+};
+
+size_t qfs_cache_budget(void) {
+    const char *s = getenv(QFS_CACHE_ENV);
+    if (!s || !*s) {
+        return 0;
+    }
+
+    uint64_t max = QFS_CACHE_MAX < SIZE_MAX ? QFS_CACHE_MAX : SIZE_MAX;
+    uint64_t n;
+    if (qfs_parse_size(s, max, &n, NULL) != QFS_OK) {
+        fprintf(stderr, "Warning: Ignoring invalid %s='%s', the block cache is off.\n", QFS_CACHE_ENV, s);
+        return 0;
+    }
+    return (size_t) n;
+}
+
+// Consecutive blocks land in different shards
+static shard_t *shard_of(struct qfs_cache *c, uint32_t block) {
+    return &c->shards[block & (QFS_CACHE_SHARDS - 1)];
+}
+
+static uint32_t bucket_of(const shard_t *s, uint32_t block) {
+    return (block / QFS_CACHE_SHARDS) & (s->n_buckets - 1);
+}
+
+static frame_t *lookup(shard_t *s, uint32_t block) {
+    frame_t *f = s->buckets[bucket_of(s, block)];
+    while (f && f->block != block) {
+        f = f->hnext;
+    }
+    return f;
+}
+
+static void hash_remove(shard_t *s, frame_t *f) {
+    frame_t **pp = &s->buckets[bucket_of(s, f->block)];
+    while (*pp != f) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = f->hnext;
+}
+
+static void lru_unlink(shard_t *s, frame_t *f) {
+    if (f->prev) {
+        f->prev->next = f->next;
+    } else {
+        s->head = f->next;
+    }
+    if (f->next) {
+        f->next->prev = f->prev;
+    } else {
+        s->tail = f->prev;
+    }
+    f->prev = f->next = NULL;
+}
+
+static void lru_push(shard_t *s, frame_t *f) {
+    f->prev = NULL;
+    f->next = s->head;
+    if (s->head) {
+        s->head->prev = f;
+    } else {
+        s->tail = f;
+    }
+    s->head = f;
+}
+
+static int pread_full(int fd, uint8_t *buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, off);
+        QFS_STAT_ADD(syscalls, 1);
+        if (n <= 0) {
+            return QFS_ESYS;
+        }
+        buf += n;
+        len -= (size_t) n;
+        off += n;
+    }
+    return QFS_OK;
+}
+
+static int pwrite_full(int fd, const uint8_t *buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        QFS_STAT_ADD(syscalls, 1);
+        if (n <= 0) {
+            return QFS_ESYS;
+        }
+        buf += n;
+        len -= (size_t) n;
+        off += n;
+    }
+    return QFS_OK;
+}
+
+// Write a dirty block back to the image (shard lock held)
+static int write_back(struct qfs_cache *c, shard_t *s, frame_t *f) {
+    off_t off = c->base + (off_t) f->block * c->block_size;
+
+    if (pwrite_full(c->fd, f->bytes, c->block_size, off) != QFS_OK) {
+        return QFS_ESYS;
+    }
+    s->writebacks++;
+    return QFS_OK;
+}
+
+// Drop an unpinned block from the shard, writing it back first if needed
+static void evict(struct qfs_cache *c, shard_t *s, frame_t *f) {
+    if (f->dirty && write_back(c, s, f) != QFS_OK) {
+        c->error = 1;
+    }
+    hash_remove(s, f);
+    lru_unlink(s, f);
+    s->evictions++;
+}
+
+// A frame to load a block into: a new one while the shard has room,
+// otherwise the least recently used unpinned one
+static frame_t *take_frame(struct qfs_cache *c, shard_t *s) {
+    if (s->n_frames >= s->cap) {
+        for (frame_t *f = s->tail; f; f = f->prev) {
+            if (f->pins == 0) {
+                evict(c, s, f);
+                return f;
+            }
+        }
+    }
+
+    frame_t *f = calloc(1, sizeof(frame_t));
+    if (!f || !(f->bytes = malloc(c->block_size))) {
+        free(f);
+        return NULL;
+    }
+    s->n_frames++;
+    return f;
+}
+
+static void free_frame(shard_t *s, frame_t *f) {
+    free(f->bytes);
+    free(f);
+    s->n_frames--;
+}
+
+struct qfs_cache *qfs_cache_create(int fd, off_t base, uint32_t block_size,
+                                   uint32_t total_blocks, size_t budget) {
+    struct qfs_cache *c = calloc(1, sizeof(struct qfs_cache));
+    if (!c) {
+        return NULL;
+    }
+
+    c->fd = fd;
+    c->base = base;
+    c->block_size = block_size;
+    c->total_blocks = total_blocks;
+
+    // At least one block per shard, at most the whole image, which also
+    // keeps the bucket counts below in range
+    c->capacity = budget / block_size;
+    if (c->capacity > total_blocks) {
+        c->capacity = total_blocks;
+    }
+    if (c->capacity < QFS_CACHE_SHARDS) {
+        c->capacity = QFS_CACHE_SHARDS;
+    }
+
+    size_t per_shard = (c->capacity + QFS_CACHE_SHARDS - 1) / QFS_CACHE_SHARDS;
+
+    for (int i = 0; i < QFS_CACHE_SHARDS; i++) {
+        shard_t *s = &c->shards[i];
+
+        // About two buckets per block
+        s->n_buckets = 1;
+        while (s->n_buckets < 2 * per_shard) {
+            s->n_buckets <<= 1;
+        }
+        s->buckets = calloc(s->n_buckets, sizeof(frame_t *));
+        s->cap = per_shard;
+        pthread_mutex_init(&s->mu, NULL);
+
+        if (!s->buckets) {
+            for (int j = 0; j <= i; j++) {
+                free(c->shards[j].buckets);
+                pthread_mutex_destroy(&c->shards[j].mu);
+            }
+            free(c);
+            return NULL;
+        }
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "Cache: %zu blocks of %u bytes in %d shards\n",
+            c->capacity, block_size, QFS_CACHE_SHARDS);
+#endif
+
+    return c;
+}
+
+uint8_t *qfs_cache_get(struct qfs_cache *c, uint32_t block, int mode) {
+    if (block >= c->total_blocks) {
+        return NULL;
+    }
+
+    shard_t *s = shard_of(c, block);
+    pthread_mutex_lock(&s->mu);
+
+    frame_t *f = lookup(s, block);
+    if (f) {
+        s->hits++;
+        lru_unlink(s, f);
+    } else {
+        s->misses++;
+
+        f = take_frame(c, s);
+        if (!f) {
+            pthread_mutex_unlock(&s->mu);
+            return NULL;
+        }
+        if (pread_full(c->fd, f->bytes, c->block_size,
+                       c->base + (off_t) block * c->block_size) != QFS_OK) {
+            free_frame(s, f);
+            pthread_mutex_unlock(&s->mu);
+            return NULL;
+        }
+
+        f->block = block;
+        f->pins = 0;
+        f->dirty = 0;
+
+        uint32_t b = bucket_of(s, block);
+        f->hnext = s->buckets[b];
+        s->buckets[b] = f;
+    }
+
+    lru_push(s, f);
+    f->pins++;
+    if (mode == QFS_BLK_WRITE) {
+        f->dirty = 1;
+    }
+
+    pthread_mutex_unlock(&s->mu);
+    return f->bytes;
+}
+
+void qfs_cache_put(struct qfs_cache *c, uint32_t block) {
+    shard_t *s = shard_of(c, block);
+    pthread_mutex_lock(&s->mu);
+
+    frame_t *f = lookup(s, block);
+    if (f && f->pins > 0 && --f->pins == 0 && s->n_frames > s->cap) {
+        // Back under budget once the overflow is no longer pinned
+        evict(c, s, f);
+        free_frame(s, f);
+    }
+
+    pthread_mutex_unlock(&s->mu);
+}
+
+int qfs_cache_flush(struct qfs_cache *c, uint32_t first, uint32_t count) {
+    int err = QFS_OK;
+
+    for (int i = 0; i < QFS_CACHE_SHARDS; i++) {
+        shard_t *s = &c->shards[i];
+        pthread_mutex_lock(&s->mu);
+
+        for (frame_t *f = s->head; f; f = f->next) {
+            if (!f->dirty || f->block < first || f->block - first >= count) {
+                continue;
+            }
+            if (write_back(c, s, f) != QFS_OK) {
+                err = QFS_ESYS;
+                continue;
+            }
+
+            // A pinned block may still be changing, so it stays dirty
+            if (f->pins == 0) {
+                f->dirty = 0;
+            }
+        }
+
+        pthread_mutex_unlock(&s->mu);
+    }
+
+    if (c->error) {
+        c->error = 0;
+        err = QFS_ESYS;
+    }
+    return err;
+}
+
+void qfs_cache_stats(struct qfs_cache *c, qfs_cache_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    st->capacity = c->capacity;
+
+    for (int i = 0; i < QFS_CACHE_SHARDS; i++) {
+        shard_t *s = &c->shards[i];
+        pthread_mutex_lock(&s->mu);
+        st->hits += s->hits;
+        st->misses += s->misses;
+        st->evictions += s->evictions;
+        st->writebacks += s->writebacks;
+        st->resident += s->n_frames;
+        pthread_mutex_unlock(&s->mu);
+    }
+}
+
+int qfs_cache_destroy(struct qfs_cache *c) {
+    if (!c) {
+        return QFS_OK;
+    }
+
+    int err = qfs_cache_flush(c, 0, c->total_blocks);
+
+#ifdef DEBUG
+    qfs_cache_stats_t st;
+    qfs_cache_stats(c, &st);
+    fprintf(stderr, "Cache: %llu hits, %llu misses, %llu evictions, %llu write-backs\n",
+            (unsigned long long) st.hits, (unsigned long long) st.misses,
+            (unsigned long long) st.evictions, (unsigned long long) st.writebacks);
+#endif
+
+    for (int i = 0; i < QFS_CACHE_SHARDS; i++) {
+        shard_t *s = &c->shards[i];
+        frame_t *f = s->head;
+        while (f) {
+            frame_t *next = f->next;
+            free_frame(s, f);
+            f = next;
+        }
+        free(s->buckets);
+        pthread_mutex_destroy(&s->mu);
+    }
+    free(c);
+
+    return err;
+}
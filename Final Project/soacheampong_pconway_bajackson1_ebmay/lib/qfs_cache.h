@@ -0,0 +1,78 @@
+/*
+**
+** Block cache (libqfs)
+**
+** A write-back cache of whole data blocks, keyed by block number and read
+** with pread. Blocks are spread over independently locked shards, each
+** with its own LRU list, so threads working on different blocks rarely
+** wait for each other. A block handed out by qfs_cache_get() is pinned
+** and is never evicted until it is given back with qfs_cache_put();
+** dirty blocks are written back with pwrite when they are evicted or
+** flushed.
+**
+** The tools do not use this directly: qfs_block_get() in qfs_image.h goes
+** through the cache when QFS_CACHE is set, for example QFS_CACHE=16M,
+** and straight to the mapping otherwise.
+**
+** Usage: #include "qfs_cache.h"
+**
+*/
+
+#ifndef QFS_CACHE_H
+#define QFS_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Environment variable holding the cache budget in bytes ([K|M|G] suffix)
+#define QFS_CACHE_ENV     "QFS_CACHE"
+
+// Largest budget QFS_CACHE may ask for, anything above is taken for a typo
+#define QFS_CACHE_MAX     (1ULL << 40)
+
+#define QFS_CACHE_SHARDS  16    // Power of two
+
+// qfs_cache_get() modes
+#define QFS_BLK_READ   0
+#define QFS_BLK_WRITE  1    // The block is marked dirty
+
+typedef struct qfs_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;     // Dirty blocks written to the image
+    size_t   resident;       // Blocks held right now
+    size_t   capacity;       // Blocks the budget allows
+} qfs_cache_stats_t;
+
+struct qfs_cache;
+
+// Function to read the budget from QFS_CACHE, returns 0 when unset or
+// not a valid size (with a warning)
+size_t qfs_cache_budget(void);
+
+// Function to create a cache over the blocks of an open image file.
+// Blocks start at byte offset base and are block_size bytes apart.
+// Returns NULL if memory runs out.
+struct qfs_cache *qfs_cache_create(int fd, off_t base, uint32_t block_size,
+                                   uint32_t total_blocks, size_t budget);
+
+// Function to pin a block and return its bytes, reading it on a miss.
+// Returns NULL if the block cannot be read.
+uint8_t *qfs_cache_get(struct qfs_cache *c, uint32_t block, int mode);
+
+// Function to unpin a block
+void qfs_cache_put(struct qfs_cache *c, uint32_t block);
+
+// Function to write back the dirty blocks in [first, first + count),
+// returns QFS_OK or QFS_ESYS (also for a failed write-back on eviction)
+int qfs_cache_flush(struct qfs_cache *c, uint32_t first, uint32_t count);
+
+// Function to sum the counters of every shard
+void qfs_cache_stats(struct qfs_cache *c, qfs_cache_stats_t *st);
+
+// Function to write back every dirty block and free the cache
+int qfs_cache_destroy(struct qfs_cache *c);
+
+#endif // QFS_CACHE_H
@@ -0,0 +1,584 @@
+/*
+** JPEG carving helpers (libqfs)
+**
+** Each thread scans its own slice of the buffer and may peek one byte
+** past the end of the slice, so a marker split across two slices is
+** found exactly once, by the slice holding its 0xFF byte.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "qfs_image.h"
+#include "qfs_file.h"
+#include "qfs_carve.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+// Smallest slice worth handing to a thread
+#define MIN_SLICE (1 << 20)
+
+static int marker_push(qfs_markers_t *m, size_t offset, uint8_t type) {
+    if (m->count == m->cap) {
+        size_t cap = m->cap ? m->cap * 2 : 256;
+        qfs_marker_t *grown = realloc(m->items, cap * sizeof(qfs_marker_t));
+        if (!grown) {
+            return QFS_ESYS;
+        }
+        m->items = grown;
+        m->cap = cap;
+    }
+
+    m->items[m->count].offset = offset;
+    m->items[m->count].type = type;
+    m->count++;
+    return QFS_OK;
+}
+
+// Scan positions [from, to) of buf, pairs may look at buf[len - 1] at most
+static int scan_scalar(const uint8_t *buf, size_t len, size_t from, size_t to, qfs_markers_t *out) {
+    for (size_t i = from; i < to && i + 1 < len; i++) {
+        if (buf[i] == 0xFF && (buf[i + 1] == QFS_JPEG_SOI || buf[i + 1] == QFS_JPEG_EOI)) {
+            if (marker_push(out, i, buf[i + 1]) != QFS_OK) {
+                return QFS_ESYS;
+            }
+        }
+    }
+    return QFS_OK;
+}
+
+// Push the markers for a bit mask of 0xFF positions starting at base
+static int push_mask(const uint8_t *buf, size_t base, uint32_t mask, qfs_markers_t *out) {
+    while (mask) {
+        size_t i = base + (size_t) __builtin_ctz(mask);
+        mask &= mask - 1;
+        if (marker_push(out, i, buf[i + 1]) != QFS_OK) {
+            return QFS_ESYS;
+        }
+    }
+    return QFS_OK;
+}
+
+#ifdef HAVE_X86_SIMD
+
+// 16 positions per step: 0xFF at i and 0xD8/0xD9 at i + 1
+__attribute__((target("sse2")))
+static int scan_sse2(const uint8_t *buf, size_t len, size_t from, size_t to, qfs_markers_t *out) {
+    const __m128i ff = _mm_set1_epi8((char) 0xFF);
+    const __m128i d8 = _mm_set1_epi8((char) QFS_JPEG_SOI);
+    const __m128i d9 = _mm_set1_epi8((char) QFS_JPEG_EOI);
+    size_t i = from;
+
+    for (; i + 16 <= to && i + 17 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (buf + i));
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(a, ff));
+        if (!mask) {
+            continue;
+        }
+
+        __m128i b = _mm_loadu_si128((const __m128i *) (buf + i + 1));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(b, d8), _mm_cmpeq_epi8(b, d9));
+        mask &= (uint32_t) _mm_movemask_epi8(hit);
+
+        if (push_mask(buf, i, mask, out) != QFS_OK) {
+            return QFS_ESYS;
+        }
+    }
+
+    return scan_scalar(buf, len, i, to, out);
+}
+
+// 32 positions per step
+__attribute__((target("avx2")))
+static int scan_avx2(const uint8_t *buf, size_t len, size_t from, size_t to, qfs_markers_t *out) {
+    const __m256i ff = _mm256_set1_epi8((char) 0xFF);
+    const __m256i d8 = _mm256_set1_epi8((char) QFS_JPEG_SOI);
+    const __m256i d9 = _mm256_set1_epi8((char) QFS_JPEG_EOI);
+    size_t i = from;
+
+    for (; i + 32 <= to && i + 33 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (buf + i));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, ff));
+        if (!mask) {
+            continue;
+        }
+
+        __m256i b = _mm256_loadu_si256((const __m256i *) (buf + i + 1));
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(b, d8), _mm256_cmpeq_epi8(b, d9));
+        mask &= (uint32_t) _mm256_movemask_epi8(hit);
+
+        if (push_mask(buf, i, mask, out) != QFS_OK) {
+            return QFS_ESYS;
+        }
+    }
+
+    return scan_sse2(buf, len, i, to, out);
+}
+
+#endif // HAVE_X86_SIMD
+
+typedef int (*scan_fn)(const uint8_t *, size_t, size_t, size_t, qfs_markers_t *);
+
+// Pick the widest scanner the CPU supports
+static scan_fn pick_scanner(const char **name) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return scan_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        *name = "sse2";
+        return scan_sse2;
+    }
+#endif
+    *name = "scalar";
+    return scan_scalar;
+}
+
+const char *qfs_scan_impl(void) {
+    const char *name;
+    pick_scanner(&name);
+    return name;
+}
+
+// One slice of the buffer for one thread
+typedef struct scan_job {
+    const uint8_t *buf;
+    size_t         len;
+    size_t         from;
+    size_t         to;
+    scan_fn        scan;
+    qfs_markers_t  found;
+    int            status;
+} scan_job_t;
+
+static void *scan_worker(void *arg) {
+    scan_job_t *job = arg;
+    job->status = job->scan(job->buf, job->len, job->from, job->to, &job->found);
+    return NULL;
+}
+
+int qfs_scan_markers(const uint8_t *buf, size_t len, int threads, qfs_markers_t *out) {
+    memset(out, 0, sizeof(qfs_markers_t));
+    QFS_STAT_ADD(bytes_read, len);
+
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int) cpus : 1;
+    }
+
+    // Do not split small buffers finer than MIN_SLICE
+    size_t max_threads = len / MIN_SLICE + 1;
+    if ((size_t) threads > max_threads) {
+        threads = (int) max_threads;
+    }
+
+    const char *name;
+    scan_fn scan = pick_scanner(&name);
+
+    scan_job_t *jobs = calloc(threads, sizeof(scan_job_t));
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    if (!jobs || !tids) {
+        free(jobs);
+        free(tids);
+        return QFS_ESYS;
+    }
+
+    size_t slice = (len + threads - 1) / threads;
+
+    for (int t = 0; t < threads; t++) {
+        jobs[t].buf = buf;
+        jobs[t].len = len;
+        jobs[t].from = (size_t) t * slice < len ? (size_t) t * slice : len;
+        jobs[t].to = jobs[t].from + slice < len ? jobs[t].from + slice : len;
+        jobs[t].scan = scan;
+    }
+
+    // Slice 0 runs on the calling thread
+    int started = 1;
+    for (int t = 1; t < threads; t++, started++) {
+        if (pthread_create(&tids[t], NULL, scan_worker, &jobs[t]) != 0) {
+            break;
+        }
+    }
+    scan_worker(&jobs[0]);
+
+    // Slices that did not get a thread are scanned here
+    for (int t = started; t < threads; t++) {
+        scan_worker(&jobs[t]);
+    }
+    for (int t = 1; t < started; t++) {
+        pthread_join(tids[t], NULL);
+    }
+
+    // Concatenate in slice order, which keeps the offsets sorted
+    int status = QFS_OK;
+    size_t total = 0;
+
+    for (int t = 0; t < threads; t++) {
+        if (jobs[t].status != QFS_OK) {
+            status = jobs[t].status;
+        }
+        total += jobs[t].found.count;
+    }
+
+    if (status == QFS_OK && total > 0) {
+        out->items = malloc(total * sizeof(qfs_marker_t));
+        if (!out->items) {
+            status = QFS_ESYS;
+        }
+    }
+
+    for (int t = 0; t < threads; t++) {
+        if (status == QFS_OK && jobs[t].found.count > 0) {
+            memcpy(out->items + out->count, jobs[t].found.items,
+                   jobs[t].found.count * sizeof(qfs_marker_t));
+            out->count += jobs[t].found.count;
+        }
+        qfs_markers_free(&jobs[t].found);
+    }
+    out->cap = out->count;
+
+#ifdef DEBUG
+    fprintf(stderr, "Scanned %zu bytes on %d thread(s) with %s: %zu markers\n",
+            len, threads, name, out->count);
+#endif
+
+    free(jobs);
+    free(tids);
+    return status;
+}
+
+int qfs_pair_markers(const uint8_t *buf, size_t len, const qfs_markers_t *m, qfs_span_t **spans) {
+    size_t cap = 16, count = 0;
+    qfs_span_t *list = malloc(cap * sizeof(qfs_span_t));
+    if (!list) {
+        return QFS_ESYS;
+    }
+
+    size_t start = 0;
+    int depth = 0;
+
+    for (size_t i = 0; i < m->count; i++) {
+        const qfs_marker_t *mk = &m->items[i];
+
+        if (mk->type == QFS_JPEG_SOI) {
+            // A real image starts FF D8 FF (the first segment marker)
+            if (mk->offset + 2 >= len || buf[mk->offset + 2] != 0xFF) {
+                continue;
+            }
+            // Embedded thumbnails nest one SOI/EOI pair, anything deeper
+            // means the previous image never ended: start over here
+            if (depth == 0 || depth == 2) {
+                start = mk->offset;
+                depth = 0;
+            }
+            depth++;
+        } else if (depth > 0 && --depth == 0) {
+            if (count == cap) {
+                cap *= 2;
+                qfs_span_t *grown = realloc(list, cap * sizeof(qfs_span_t));
+                if (!grown) {
+                    free(list);
+                    return QFS_ESYS;
+                }
+                list = grown;
+            }
+            list[count].start = start;
+            list[count].length = mk->offset + 2 - start;
+            count++;
+        }
+    }
+
+    *spans = list;
+    return (int) count;
+}
+
+// Shared state for the threads rebuilding files from block payloads
+typedef struct carve_ctx {
+    const qfs_image_t *img;
+    const uint8_t     *is_start;    // 1 for blocks that begin a JPEG
+    const uint32_t    *starts;      // Candidate blocks in ascending order
+    uint32_t           n_starts;
+    uint32_t           next;        // Next candidate to take (atomic)
+    qfs_carved_t      *files;       // One result per candidate
+    int                status;
+} carve_ctx_t;
+
+// A block can continue a file if it is in range, unused by this file and
+// not the start of another JPEG
+static int chain_plausible(const carve_ctx_t *ctx, const uint64_t *visited, uint32_t block) {
+    return block < ctx->img->total_blocks
+        && !((visited[block >> 6] >> (block & 63)) & 1)
+        && !ctx->is_start[block];
+}
+
+// Rebuild the file starting at one block, visited is all zero on entry and exit
+static int carve_one(const carve_ctx_t *ctx, uint32_t start, uint64_t *visited, qfs_carved_t *out) {
+    const qfs_image_t *img = ctx->img;
+    uint32_t cap = 16;
+
+    memset(out, 0, sizeof(qfs_carved_t));
+    out->blocks = malloc(cap * sizeof(uint32_t));
+    if (!out->blocks) {
+        return QFS_ESYS;
+    }
+
+    uint32_t block = start;
+    uint32_t i = 2;          // Skip the FF D8 that made this a candidate
+    int depth = 1;           // Open SOI markers (thumbnails nest one more)
+    int prev_ff = 0;         // Last payload byte seen was 0xFF
+
+    for (;;) {
+        if (out->n_blocks == cap) {
+            cap *= 2;
+            uint32_t *grown = realloc(out->blocks, cap * sizeof(uint32_t));
+            if (!grown) {
+                return QFS_ESYS;
+            }
+            out->blocks = grown;
+        }
+        out->blocks[out->n_blocks++] = block;
+        visited[block >> 6] |= 1ULL << (block & 63);
+
+        // Look for the end marker in this payload, carrying a trailing 0xFF over
+        const uint8_t *p = qfs_block_get(img, block, QFS_BLK_READ);
+        uint32_t n = img->payload;
+
+        if (!p) {
+            return QFS_ESYS;
+        }
+        p++;
+
+        while (i < n) {
+            if (prev_ff) {
+                prev_ff = 0;
+                if (p[i] == QFS_JPEG_EOI && --depth == 0) {
+                    out->last_len = i + 1;
+                    out->complete = 1;
+                    break;
+                } else if (p[i] == QFS_JPEG_SOI && depth < 2) {
+                    depth++;
+                } else if (p[i] == 0xFF) {
+                    prev_ff = 1;
+                }
+                i++;
+                continue;
+            }
+
+            const uint8_t *ff = memchr(p + i, 0xFF, n - i);
+            if (!ff) {
+                break;
+            }
+            i = (uint32_t) (ff - p) + 1;
+            prev_ff = 1;
+        }
+        qfs_block_put(img, block);
+
+        if (out->complete) {
+            break;
+        }
+
+        // Prefer the stale next_block pointer, then the physically next block
+        uint32_t ptr = qfs_next_block(img, block);
+        QFS_STAT_ADD(chain_hops, 1);
+        uint32_t next = QFS_NO_BLOCK;
+
+        if (chain_plausible(ctx, visited, ptr)) {
+            next = ptr;
+        } else if (chain_plausible(ctx, visited, block + 1)) {
+            next = block + 1;
+        }
+
+        if (next == QFS_NO_BLOCK) {
+            out->last_len = n;
+            break;
+        }
+        if (next != block + 1) {
+            out->followed = 1;
+        }
+
+        block = next;
+        i = 0;
+    }
+
+    out->length = (size_t) (out->n_blocks - 1) * img->payload + out->last_len;
+
+    // Leave the visited map clean for the next file
+    for (uint32_t b = 0; b < out->n_blocks; b++) {
+        visited[out->blocks[b] >> 6] &= ~(1ULL << (out->blocks[b] & 63));
+    }
+
+    return QFS_OK;
+}
+
+static void *carve_worker(void *arg) {
+    carve_ctx_t *ctx = arg;
+    uint64_t *visited = calloc((ctx->img->total_blocks + 63) / 64 + 1, sizeof(uint64_t));
+    if (!visited) {
+        ctx->status = QFS_ESYS;
+        return NULL;
+    }
+
+    // Take candidates one at a time, results land in the candidate's slot
+    for (;;) {
+        uint32_t k = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED);
+        if (k >= ctx->n_starts) {
+            break;
+        }
+        if (carve_one(ctx, ctx->starts[k], visited, &ctx->files[k]) != QFS_OK) {
+            ctx->status = QFS_ESYS;
+        }
+    }
+
+    free(visited);
+    return NULL;
+}
+
+static int carve_blocks(const qfs_image_t *img, int threads, qfs_carved_t **files) {
+    *files = NULL;
+
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int) cpus : 1;
+    }
+
+    // Find start markers across the data region with the parallel scanner
+    size_t span = (size_t) img->total_blocks * img->block_size;
+    qfs_markers_t markers;
+    int err = qfs_scan_markers(img->data, span, threads, &markers);
+    if (err != QFS_OK) {
+        return err;
+    }
+
+    // Keep the ones sitting at the start of a block payload
+    uint8_t *is_start = calloc(img->total_blocks + 1, 1);
+    uint32_t *starts = malloc((markers.count + 1) * sizeof(uint32_t));
+    uint32_t n_starts = 0;
+
+    if (!is_start || !starts) {
+        free(is_start);
+        free(starts);
+        qfs_markers_free(&markers);
+        return QFS_ESYS;
+    }
+
+    for (size_t i = 0; i < markers.count; i++) {
+        size_t off = markers.items[i].offset;
+        if (markers.items[i].type == QFS_JPEG_SOI && off % img->block_size == 1
+            && img->payload > 2 && img->data[off + 2] == 0xFF) {
+            uint32_t block = (uint32_t) (off / img->block_size);
+            is_start[block] = 1;
+            starts[n_starts++] = block;
+        }
+    }
+    qfs_markers_free(&markers);
+
+    carve_ctx_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.img = img;
+    ctx.is_start = is_start;
+    ctx.starts = starts;
+    ctx.n_starts = n_starts;
+    ctx.files = calloc(n_starts + 1, sizeof(qfs_carved_t));
+    ctx.status = ctx.files ? QFS_OK : QFS_ESYS;
+
+    if (ctx.status == QFS_OK) {
+        if ((uint32_t) threads > n_starts) {
+            threads = n_starts > 0 ? (int) n_starts : 1;
+        }
+
+        pthread_t *tids = calloc(threads, sizeof(pthread_t));
+        int started = 0;
+
+        for (int t = 1; tids && t < threads; t++, started++) {
+            if (pthread_create(&tids[t], NULL, carve_worker, &ctx) != 0) {
+                break;
+            }
+        }
+        carve_worker(&ctx);
+        for (int t = 1; t <= started; t++) {
+            pthread_join(tids[t], NULL);
+        }
+        free(tids);
+    }
+
+    free(is_start);
+    free(starts);
+
+    if (ctx.status != QFS_OK) {
+        qfs_carved_free(ctx.files, (int) n_starts);
+        return ctx.status;
+    }
+
+    *files = ctx.files;
+    return (int) n_starts;
+}
+
+int qfs_carve_blocks(const qfs_image_t *img, int threads, qfs_carved_t **files) {
+    uint64_t t0 = qfs_phase_begin();
+    int n = carve_blocks(img, threads, files);
+    qfs_phase_end(QFS_PHASE_DATA, t0);
+    return n;
+}
+
+int qfs_carved_write_fd(const qfs_image_t *img, const qfs_carved_t *file, int fd) {
+    uint64_t t0 = qfs_phase_begin();
+    int err = QFS_OK;
+    struct iovec iov[QFS_IOV_BATCH];
+    int n_iov = 0;
+
+    // Payloads only: busy bytes and next_block pointers are skipped. The
+    // blocks of a batch stay pinned until it has been written.
+    for (uint32_t b = 0; b < file->n_blocks; b++) {
+        uint8_t *p = qfs_block_get(img, file->blocks[b], QFS_BLK_READ);
+        if (!p) {
+            qfs_blocks_put(img, file->blocks + b - n_iov, n_iov);
+            err = QFS_ESYS;
+            break;
+        }
+
+        iov[n_iov].iov_base = p + 1;
+        iov[n_iov].iov_len = (b + 1 == file->n_blocks) ? file->last_len : img->payload;
+        n_iov++;
+
+        if (n_iov == QFS_IOV_BATCH || b + 1 == file->n_blocks) {
+            err = qfs_writev_all(fd, iov, n_iov);
+            qfs_blocks_put(img, file->blocks + b + 1 - n_iov, n_iov);
+            if (err != QFS_OK) {
+                break;
+            }
+            n_iov = 0;
+        }
+    }
+
+    if (err == QFS_OK) {
+        QFS_STAT_ADD(bytes_read, file->length);
+    }
+    qfs_phase_end(QFS_PHASE_DATA, t0);
+    return err;
+}
+
+void qfs_carved_free(qfs_carved_t *files, int n) {
+    if (!files) {
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        free(files[i].blocks);
+    }
+    free(files);
+}
+
+void qfs_markers_free(qfs_markers_t *m) {
+    free(m->items);
+    m->items = NULL;
+    m->count = 0;
+    m->cap = 0;
+}
@@ -0,0 +1,79 @@
+/*
+**
+** JPEG carving helpers (libqfs)
+**
+** Scans a buffer for JPEG start (0xFF 0xD8) and end (0xFF 0xD9) markers
+** on a pool of threads, with SSE2/AVX2 compares where the CPU has them
+** and a scalar loop otherwise. Markers come back sorted by offset no
+** matter how the threads were scheduled.
+**
+** Usage: #include "qfs_carve.h"
+**
+*/
+
+#ifndef QFS_CARVE_H
+#define QFS_CARVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "qfs_image.h"
+
+// Second byte of the markers
+#define QFS_JPEG_SOI  0xD8
+#define QFS_JPEG_EOI  0xD9
+
+typedef struct qfs_marker {
+    size_t  offset;     // Offset of the 0xFF byte
+    uint8_t type;       // QFS_JPEG_SOI or QFS_JPEG_EOI
+} qfs_marker_t;
+
+typedef struct qfs_markers {
+    qfs_marker_t *items;
+    size_t        count;
+    size_t        cap;
+} qfs_markers_t;
+
+// A carved file: a byte range of the scanned buffer
+typedef struct qfs_span {
+    size_t start;
+    size_t length;
+} qfs_span_t;
+
+// A JPEG rebuilt from QFS block payloads
+typedef struct qfs_carved {
+    uint32_t *blocks;      // Blocks holding the file, in order
+    uint32_t  n_blocks;
+    uint32_t  last_len;    // Payload bytes used in the last block
+    size_t    length;      // Total file length
+    int       complete;    // 1 if the end marker was found
+    int       followed;    // 1 if a next_block pointer jump was taken
+} qfs_carved_t;
+
+// Function to find every marker in buf on up to threads threads (0 = one per CPU)
+int qfs_scan_markers(const uint8_t *buf, size_t len, int threads, qfs_markers_t *out);
+
+// Function to pair start and end markers into JPEG byte ranges, returns the
+// number of spans stored in *spans (caller frees) or an error code
+int qfs_pair_markers(const uint8_t *buf, size_t len, const qfs_markers_t *m, qfs_span_t **spans);
+
+// Function to rebuild the JPEGs stored in an image's block payloads.
+// Candidates are blocks whose payload starts FF D8 FF. Each is followed
+// through its next_block pointers while they form a plausible chain, or
+// through the physically next block otherwise, with the busy byte and
+// pointer of every block stripped. Returns the number of files stored
+// in *files (sorted by starting block) or an error code.
+int qfs_carve_blocks(const qfs_image_t *img, int threads, qfs_carved_t **files);
+
+// Function to stream a rebuilt file to a file descriptor straight from the mapping
+int qfs_carved_write_fd(const qfs_image_t *img, const qfs_carved_t *file, int fd);
+
+// Function to release the files returned by qfs_carve_blocks()
+void qfs_carved_free(qfs_carved_t *files, int n);
+
+// Function to release a marker list
+void qfs_markers_free(qfs_markers_t *m);
+
+// Name of the scanner picked for this CPU ("avx2", "sse2" or "scalar")
+const char *qfs_scan_impl(void);
+
+#endif // QFS_CARVE_H
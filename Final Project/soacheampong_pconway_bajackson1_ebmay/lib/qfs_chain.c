@@ -0,0 +1,96 @@
+/*
+** Block chain walker (libqfs)
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "qfs_chain.h"
+
+void qfs_chain_init(qfs_chain_t *c, const qfs_image_t *img, uint32_t start, uint32_t size) {
+    c->img = img;
+    c->block = start;
+    c->remaining = size;
+    c->prefetched = start;
+    c->error = QFS_OK;
+}
+
+// Ask the kernel to start reading blocks [from, from + count)
+static void chain_prefetch(qfs_chain_t *c, uint32_t from, uint32_t count) {
+    const qfs_image_t *img = c->img;
+
+    if (from >= img->total_blocks) {
+        return;
+    }
+    if (count > img->total_blocks - from) {
+        count = img->total_blocks - from;
+    }
+
+    // madvise needs a page aligned start
+    uintptr_t addr = (uintptr_t) qfs_block_addr(img, from);
+    uintptr_t page = addr & ~((uintptr_t) 4095);
+    size_t len = (size_t) count * img->block_size + (addr - page);
+
+    madvise((void *) page, len, MADV_WILLNEED);
+    QFS_STAT_ADD(syscalls, 1);
+    c->prefetched = from + count;
+}
+
+uint32_t qfs_chain_next_run(qfs_chain_t *c, qfs_extent_t *run) {
+    const qfs_image_t *img = c->img;
+
+    if (c->remaining == 0 || c->error != QFS_OK) {
+        return 0;
+    }
+    if (c->block >= img->total_blocks) {
+        c->error = QFS_EFORMAT;
+        return 0;
+    }
+
+    uint32_t block = c->block;
+    uint32_t bytes = 0;
+
+    run->start = block;
+    run->count = 0;
+    QFS_STAT_ADD(seeks, 1);
+
+    // Read ahead on the assumption that the chain continues in place,
+    // unless a jump landed inside the window already requested
+    if (block >= c->prefetched || block + QFS_READAHEAD_BLOCKS < c->prefetched) {
+        chain_prefetch(c, block, QFS_READAHEAD_BLOCKS);
+    }
+
+    for (;;) {
+        uint32_t chunk = c->remaining > img->payload ? img->payload : c->remaining;
+
+        run->count++;
+        bytes += chunk;
+        c->remaining -= chunk;
+
+        if (c->remaining == 0) {
+            break;
+        }
+
+        uint32_t next = qfs_next_block(img, block);
+        c->block = next;
+        QFS_STAT_ADD(chain_hops, 1);
+
+        // Run ends where the chain jumps elsewhere
+        if (next != block + 1) {
+            break;
+        }
+
+        // Keep the prefetch window ahead of the walker
+        if (next + QFS_READAHEAD_BLOCKS / 2 >= c->prefetched) {
+            chain_prefetch(c, c->prefetched, QFS_READAHEAD_BLOCKS);
+        }
+
+        if (next >= img->total_blocks) {
+            c->error = QFS_EFORMAT;
+            break;
+        }
+        block = next;
+    }
+
+    return bytes;
+}
@@ -0,0 +1,39 @@
+/*
+**
+** Block chain walker (libqfs)
+**
+** Follows a file's next_block pointers from starting_block and hands the
+** chain back as runs of physically contiguous blocks. The blocks after
+** the current run are prefetched as the walk goes, so a file stored
+** contiguously streams with the kernel reading ahead of the walker.
+**
+** Usage: #include "qfs_chain.h"
+**
+*/
+
+#ifndef QFS_CHAIN_H
+#define QFS_CHAIN_H
+
+#include <stdint.h>
+#include "qfs_image.h"
+#include "qfs_bitmap.h"
+
+// Blocks to prefetch ahead of the walker
+#define QFS_READAHEAD_BLOCKS  64
+
+typedef struct qfs_chain {
+    const qfs_image_t *img;
+    uint32_t block;          // Next block to visit
+    uint32_t remaining;      // File bytes not yet returned
+    uint32_t prefetched;     // Blocks before this one have been prefetched
+    int      error;          // QFS_EFORMAT if the chain leaves the image
+} qfs_chain_t;
+
+// Function to start walking the chain of a file
+void qfs_chain_init(qfs_chain_t *c, const qfs_image_t *img, uint32_t start, uint32_t size);
+
+// Function to return the next run of contiguous blocks in the chain and
+// the number of file bytes it holds, returns 0 at the end of the file
+uint32_t qfs_chain_next_run(qfs_chain_t *c, qfs_extent_t *run);
+
+#endif // QFS_CHAIN_H
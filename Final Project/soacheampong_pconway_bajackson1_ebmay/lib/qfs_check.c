@@ -0,0 +1,374 @@
+/*
+** Consistency checker (libqfs)
+**
+** Threads claim blocks with an atomic compare-and-swap that keeps the
+** lowest slot, so the owner map comes out the same however the walks
+** were scheduled and the lower slot wins every cross-link.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "qfs_check.h"
+#include "qfs_bitmap.h"
+#include "qfs_dir.h"
+#include "qfs_chain.h"
+#include "qfs_dedup.h"
+
+// Shared state for the threads walking file chains
+typedef struct check_ctx {
+    const qfs_image_t *img;
+    const direntry_t  *entries;     // Directory index copy (sees pending edits)
+    qfs_check_t       *rep;
+    int                next;        // Next slot to take (atomic)
+    int                status;
+} check_ctx_t;
+
+// Record that a slot reaches a block, keeping the lowest slot as the owner
+static void claim_block(check_ctx_t *ctx, uint32_t block, int slot) {
+    qfs_check_t *rep = ctx->rep;
+    uint32_t mine = (uint32_t) slot + 1;
+    uint32_t cur = __atomic_load_n(&rep->owner[block], __ATOMIC_RELAXED);
+
+    while (cur == 0 || cur > mine) {
+        if (__atomic_compare_exchange_n(&rep->owner[block], &cur, mine, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    // Someone else reached it too, both files are resolved after the walk
+    if (cur != 0) {
+        __atomic_store_n(&rep->shared[block], 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&rep->files[cur - 1].crossed, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&rep->files[slot].crossed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Walk one file's chain, stamp holds slot + 1 for blocks this file has visited
+static void check_one(check_ctx_t *ctx, int slot, uint32_t *stamp) {
+    const direntry_t *entry = &ctx->entries[slot];
+    qfs_check_file_t *f = &ctx->rep->files[slot];
+    uint32_t mine = (uint32_t) slot + 1;
+
+    f->blocks = qfs_blocks_for(ctx->img, entry->file_size);
+
+    qfs_chain_t chain;
+    qfs_extent_t run;
+    uint32_t steps = 0;
+
+    qfs_chain_init(&chain, ctx->img, qfs_entry_start(entry, ctx->img->version), entry->file_size);
+
+    while (f->problem == QFS_CHECK_OK && qfs_chain_next_run(&chain, &run) > 0) {
+        for (uint32_t b = run.start; b < run.start + run.count; b++) {
+            if (stamp[b] == mine) {
+                f->problem = QFS_CHECK_CYCLE;
+                f->bad_block = b;
+                break;
+            }
+            stamp[b] = mine;
+            claim_block(ctx, b, slot);
+            steps++;
+        }
+    }
+
+    if (f->problem == QFS_CHECK_OK && chain.error != QFS_OK) {
+        f->problem = QFS_CHECK_RANGE;
+        f->bad_block = chain.block;
+    }
+
+    f->good = steps;
+}
+
+static void *check_worker(void *arg) {
+    check_ctx_t *ctx = arg;
+    uint32_t *stamp = calloc((size_t) ctx->img->total_blocks + 1, sizeof(uint32_t));
+    if (!stamp) {
+        ctx->status = QFS_ESYS;
+        return NULL;
+    }
+
+    // One task per used directory entry
+    for (;;) {
+        int slot = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED);
+        if (slot >= ctx->rep->n_slots) {
+            break;
+        }
+        if (ctx->entries[slot].filename[0] != '\0' && ctx->rep->alias[slot] < 0) {
+            check_one(ctx, slot, stamp);
+        }
+    }
+
+    free(stamp);
+    return NULL;
+}
+
+// Find where a file sharing blocks first runs into a lower slot's block
+static void resolve_cross(const qfs_image_t *img, const direntry_t *entry, int slot, qfs_check_t *rep) {
+    qfs_check_file_t *f = &rep->files[slot];
+    uint32_t mine = (uint32_t) slot + 1;
+
+    qfs_chain_t chain;
+    qfs_extent_t run;
+    uint32_t steps = 0;
+
+    qfs_chain_init(&chain, img, qfs_entry_start(entry, img->version), entry->file_size);
+
+    // Only the blocks the first walk accepted are revisited
+    while (steps < f->good && qfs_chain_next_run(&chain, &run) > 0) {
+        for (uint32_t b = run.start; b < run.start + run.count && steps < f->good; b++, steps++) {
+            if (rep->owner[b] != mine) {
+                f->problem = QFS_CHECK_CROSS;
+                f->bad_block = b;
+                f->other = (int) rep->owner[b] - 1;
+                f->good = steps;
+                return;
+            }
+        }
+    }
+}
+
+int qfs_check(qfs_image_t *img, int threads, qfs_check_t *rep) {
+    memset(rep, 0, sizeof(qfs_check_t));
+
+    qfs_dir_t *dir = qfs_get_dir(img);
+    qfs_bitmap_t *bm = qfs_get_bitmap(img);
+    qfs_dedup_t *dd = qfs_get_dedup(img);
+    if (!dir || !bm || !dd) {
+        return QFS_ESYS;
+    }
+
+    rep->n_slots = dir->n_slots;
+    rep->files = calloc(rep->n_slots ? rep->n_slots : 1, sizeof(qfs_check_file_t));
+    rep->owner = calloc((size_t) img->total_blocks + 1, sizeof(uint32_t));
+    rep->shared = calloc(img->total_blocks + 1, 1);
+    rep->alias = malloc((rep->n_slots ? rep->n_slots : 1) * sizeof(int));
+    if (!rep->files || !rep->owner || !rep->shared || !rep->alias) {
+        qfs_check_free(rep);
+        return QFS_ESYS;
+    }
+
+    // Files sharing a chain are not walked, only its hash entry is
+    for (int slot = 0; slot < rep->n_slots; slot++) {
+        const direntry_t *entry = &dir->entries[slot];
+        int r = -1;
+
+        if (dd->n_recs > 0 && qfs_dir_is_file(dir, slot)) {
+            r = qfs_dedup_find_start(dd, qfs_entry_start(entry, img->version));
+        }
+        rep->alias[slot] = r >= 0 && dd->recs[r].size == entry->file_size ? dd->recs[r].slot : -1;
+    }
+
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int) cpus : 1;
+    }
+    if (threads > rep->n_slots) {
+        threads = rep->n_slots > 0 ? rep->n_slots : 1;
+    }
+
+    check_ctx_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.img = img;
+    ctx.entries = dir->entries;
+    ctx.rep = rep;
+    ctx.status = QFS_OK;
+
+    // The calling thread walks chains too
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    int started = 0;
+
+    for (int t = 1; tids && t < threads; t++, started++) {
+        if (pthread_create(&tids[t], NULL, check_worker, &ctx) != 0) {
+            break;
+        }
+    }
+    check_worker(&ctx);
+    for (int t = 1; t <= started; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    free(tids);
+
+    if (ctx.status != QFS_OK) {
+        qfs_check_free(rep);
+        return ctx.status;
+    }
+
+    // Cross-links are rare, settle them serially now the owners are final
+    for (int slot = 0; slot < rep->n_slots; slot++) {
+        if (dir->entries[slot].filename[0] != '\0' && rep->files[slot].crossed) {
+            resolve_cross(img, &dir->entries[slot], slot, rep);
+        }
+    }
+
+    // Files sharing a chain take its result, hash entries count who shares them
+    int root_used = 0;
+    uint8_t *used_hash = calloc(rep->n_slots ? rep->n_slots : 1, 1);
+    if (!used_hash) {
+        qfs_check_free(rep);
+        return QFS_ESYS;
+    }
+
+    for (int slot = 0; slot < rep->n_slots; slot++) {
+        if (dir->entries[slot].filename[0] == '\0') {
+            continue;
+        }
+        rep->n_files += qfs_dir_is_file(dir, slot);
+        root_used += slot < dir->n_root;
+
+        if (rep->alias[slot] >= 0) {
+            rep->files[slot] = rep->files[rep->alias[slot]];
+            used_hash[rep->alias[slot]] = 1;
+        }
+        if (rep->files[slot].problem != QFS_CHECK_OK) {
+            rep->n_bad_files++;
+        }
+    }
+
+    for (int slot = 0; slot < rep->n_slots; slot++) {
+        if (dir->entries[slot].filename[0] != '\0' && !used_hash[slot]
+            && (dir->entries[slot].permissions & QFS_TYPE_MASK) == QFS_TYPE_HASH) {
+            rep->unused_hashes++;
+        }
+    }
+    free(used_hash);
+
+    // Compare reachability with the busy-byte bitmap
+    for (uint32_t b = 0; b < img->total_blocks; b++) {
+        int reached = rep->owner[b] != 0;
+        int busy = qfs_bitmap_test(bm, b);
+
+        rep->reachable += reached;
+        rep->busy += busy;
+        rep->cross_linked += rep->shared[b];
+
+        if (busy && !reached) {
+            rep->orphaned++;
+        } else if (reached && !busy) {
+            rep->unmarked++;
+        }
+    }
+
+    // Counters must agree with the busy bytes and used entries
+    rep->expect_blocks = bm->free_count;
+    rep->expect_direntries = (uint32_t) (dir->n_root - root_used);
+    rep->bad_counters = (qfs_sb_available(img) != rep->expect_blocks)
+                      + (img->sb->available_direntries != rep->expect_direntries);
+
+#ifdef DEBUG
+    fprintf(stderr, "Check: %d files on %d thread(s), %u reachable, %u busy\n",
+            rep->n_files, threads, rep->reachable, rep->busy);
+#endif
+
+    return QFS_OK;
+}
+
+int qfs_check_repair(qfs_image_t *img, int threads, qfs_check_t *rep) {
+    qfs_dir_t *dir = qfs_get_dir(img);
+    qfs_bitmap_t *bm = qfs_get_bitmap(img);
+    if (!dir || !bm) {
+        return QFS_ESYS;
+    }
+    if (!(img->flags & QFS_RDWR)) {
+        return QFS_EINVAL;
+    }
+
+    int changes = 0;
+
+    // Cut broken chains back to the blocks that are good, drop empty files
+    for (int slot = 0; slot < rep->n_slots; slot++) {
+        const qfs_check_file_t *f = &rep->files[slot];
+        if (f->problem == QFS_CHECK_OK) {
+            continue;
+        }
+
+        if (f->good == 0) {
+            qfs_dir_remove(dir, slot);
+        } else {
+            dir->entries[slot].file_size = f->good * img->payload;
+            qfs_dir_touch(dir, slot);
+        }
+        changes++;
+    }
+
+    // Hash entries left with no file sharing them go, their blocks are
+    // freed as orphans below
+    if (rep->unused_hashes > 0) {
+        uint8_t *used_hash = calloc(rep->n_slots ? rep->n_slots : 1, 1);
+        if (!used_hash) {
+            return QFS_ESYS;
+        }
+        for (int slot = 0; slot < rep->n_slots; slot++) {
+            if (rep->alias[slot] >= 0 && dir->entries[slot].filename[0] != '\0') {
+                used_hash[rep->alias[slot]] = 1;
+            }
+        }
+        for (int slot = 0; slot < rep->n_slots; slot++) {
+            if (dir->entries[slot].filename[0] != '\0' && !used_hash[slot]
+                && (dir->entries[slot].permissions & QFS_TYPE_MASK) == QFS_TYPE_HASH) {
+                qfs_dir_remove(dir, slot);
+                changes++;
+            }
+        }
+        free(used_hash);
+    }
+
+    // Truncated hash entries change the index, it is read again
+    qfs_dedup_forget(dir);
+
+    // Reachability changed with the truncated files, check again
+    qfs_check_free(rep);
+    int err = qfs_check(img, threads, rep);
+    if (err != QFS_OK) {
+        return err;
+    }
+
+    // Busy bytes follow the chains: orphans are freed, unmarked blocks claimed
+    if (rep->orphaned > 0 || rep->unmarked > 0) {
+        for (uint32_t b = 0; b < img->total_blocks; b++) {
+            int reached = rep->owner[b] != 0;
+            if (reached != qfs_bitmap_test(bm, b)) {
+                qfs_bitmap_set(bm, b, reached);
+                changes++;
+            }
+        }
+    }
+
+    // Counters last, from the repaired bitmap and directory
+    if (qfs_sb_available(img) != bm->free_count) {
+        qfs_sb_set_available(img, bm->free_count);
+        changes++;
+    }
+    if (img->sb->available_direntries != rep->expect_direntries) {
+        img->sb->available_direntries = (uint8_t) rep->expect_direntries;
+        changes++;
+    }
+
+    // Report the state the image is left in
+    qfs_check_free(rep);
+    err = qfs_check(img, threads, rep);
+    if (err != QFS_OK) {
+        return err;
+    }
+
+    return changes;
+}
+
+int qfs_check_problems(const qfs_check_t *rep) {
+    return rep->n_bad_files + (int) rep->orphaned + (int) rep->unmarked + rep->bad_counters
+         + rep->unused_hashes;
+}
+
+void qfs_check_free(qfs_check_t *rep) {
+    free(rep->files);
+    free(rep->owner);
+    free(rep->shared);
+    free(rep->alias);
+    rep->files = NULL;
+    rep->alias = NULL;
+    rep->owner = NULL;
+    rep->shared = NULL;
+}
@@ -0,0 +1,72 @@
+/*
+**
+** Consistency checker (libqfs)
+**
+** Walks every file chain on a pool of threads, one directory entry per
+** task, and records which file reaches each block. The result is compared
+** with the busy-byte bitmap to find cross-linked, orphaned and
+** out-of-range blocks, chain cycles and wrong superblock counters.
+** qfs_check_repair() fixes what it can and checks the image again.
+**
+** A chain shared through the dedup index (see qfs_dedup.h) is walked once,
+** for its hash entry, and the files sharing it take that result. A hash
+** entry no file shares any more is a problem, repair removes it.
+**
+** Usage: #include "qfs_check.h"
+**
+*/
+
+#ifndef QFS_CHECK_H
+#define QFS_CHECK_H
+
+#include <stdint.h>
+#include "qfs_image.h"
+
+// Problems found in a file's chain
+#define QFS_CHECK_OK     0
+#define QFS_CHECK_RANGE  1    // Chain points past the last block
+#define QFS_CHECK_CYCLE  2    // Chain loops back to one of its own blocks
+#define QFS_CHECK_CROSS  3    // Chain runs into a block of a lower slot
+
+typedef struct qfs_check_file {
+    uint32_t blocks;        // Blocks the file size calls for
+    uint32_t good;          // Blocks walked before the problem
+    uint32_t bad_block;     // Block the problem was found at
+    int      problem;       // QFS_CHECK_* code
+    int      other;         // Slot the file is cross-linked with
+    int      crossed;       // Shares at least one block (set by the walkers)
+} qfs_check_file_t;
+
+typedef struct qfs_check {
+    qfs_check_file_t *files;        // One result per directory slot
+    uint32_t *owner;                // Lowest slot + 1 reaching each block, 0 if none
+    uint8_t  *shared;               // 1 for blocks reached by more than one file
+    int      *alias;                // Hash entry slot whose chain a file shares, -1 if none
+    int       n_slots;              // Directory slots checked
+    int       n_files;              // Files in the directory
+    int       n_bad_files;          // Files with a QFS_CHECK_* problem
+    uint32_t  reachable;            // Blocks reached from some file
+    uint32_t  busy;                 // Blocks with the busy byte set
+    uint32_t  orphaned;             // Busy but not reached from any file
+    uint32_t  unmarked;             // Reached from a file but marked free
+    uint32_t  cross_linked;         // Reached from more than one file
+    int       unused_hashes;        // Hash entries no file shares
+    uint32_t  expect_blocks;        // Correct available_blocks
+    uint32_t  expect_direntries;    // Correct available_direntries (free root slots)
+    int       bad_counters;         // Superblock counters that are wrong
+} qfs_check_t;
+
+// Function to check an image, returns QFS_OK or an error code
+int qfs_check(qfs_image_t *img, int threads, qfs_check_t *rep);
+
+// Function to repair the problems in a report (image opened QFS_RDWR) and
+// check again, returns the number of changes made or an error code
+int qfs_check_repair(qfs_image_t *img, int threads, qfs_check_t *rep);
+
+// Function to count the problems in a report
+int qfs_check_problems(const qfs_check_t *rep);
+
+// Function to release a report
+void qfs_check_free(qfs_check_t *rep);
+
+#endif // QFS_CHECK_H
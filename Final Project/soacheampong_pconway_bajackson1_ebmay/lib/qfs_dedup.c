@@ -0,0 +1,364 @@
+/*
+** Whole-file deduplication (libqfs)
+**
+** The index is two chained hash tables over one array of records, one
+** keyed by content hash for writes and one by starting block for deletes.
+** Freed records are kept on a list and handed out again.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qfs_dedup.h"
+#include "qfs_dir.h"
+
+#define PRIME1  0x9E3779B185EBCA87ULL
+#define PRIME2  0xC2B2AE3D27D4EB4FULL
+#define PRIME3  0x165667B19E3779F9ULL
+#define PRIME4  0x85EBCA77C2B2AE63ULL
+#define PRIME5  0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t hash_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    return rotl64(acc, 31) * PRIME1;
+}
+
+static uint64_t hash_merge(uint64_t acc, uint64_t v) {
+    acc ^= hash_round(0, v);
+    return acc * PRIME1 + PRIME4;
+}
+
+// Take in one 32-byte stripe, a lane per 8 bytes
+static void hash_stripe(qfs_hasher_t *h, const uint8_t *p) {
+    h->v[0] = hash_round(h->v[0], read64(p));
+    h->v[1] = hash_round(h->v[1], read64(p + 8));
+    h->v[2] = hash_round(h->v[2], read64(p + 16));
+    h->v[3] = hash_round(h->v[3], read64(p + 24));
+}
+
+void qfs_hash_init(qfs_hasher_t *h, uint64_t seed) {
+    memset(h, 0, sizeof(qfs_hasher_t));
+    h->seed = seed;
+    h->v[0] = seed + PRIME1 + PRIME2;
+    h->v[1] = seed + PRIME2;
+    h->v[2] = seed;
+    h->v[3] = seed - PRIME1;
+}
+
+void qfs_hash_update(qfs_hasher_t *h, const void *data, size_t len) {
+    const uint8_t *p = data;
+    const uint8_t *end = p + len;
+
+    h->total += len;
+
+    // Finish a stripe left over from the last call
+    if (h->used > 0) {
+        size_t take = 32 - h->used < len ? 32 - h->used : len;
+        memcpy(h->buf + h->used, p, take);
+        h->used += (uint32_t) take;
+        p += take;
+        if (h->used < 32) {
+            return;
+        }
+        hash_stripe(h, h->buf);
+        h->used = 0;
+    }
+
+    while (end - p >= 32) {
+        hash_stripe(h, p);
+        p += 32;
+    }
+
+    memcpy(h->buf, p, (size_t) (end - p));
+    h->used = (uint32_t) (end - p);
+}
+
+uint64_t qfs_hash_final(const qfs_hasher_t *h) {
+    uint64_t acc;
+
+    if (h->total >= 32) {
+        acc = rotl64(h->v[0], 1) + rotl64(h->v[1], 7) + rotl64(h->v[2], 12) + rotl64(h->v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            acc = hash_merge(acc, h->v[i]);
+        }
+    } else {
+        acc = h->seed + PRIME5;
+    }
+    acc += h->total;
+
+    const uint8_t *p = h->buf;
+    const uint8_t *end = p + h->used;
+
+    while (end - p >= 8) {
+        acc ^= hash_round(0, read64(p));
+        acc = rotl64(acc, 27) * PRIME1 + PRIME4;
+        p += 8;
+    }
+    if (end - p >= 4) {
+        acc ^= (uint64_t) read32(p) * PRIME1;
+        acc = rotl64(acc, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    while (p < end) {
+        acc ^= *p++ * PRIME5;
+        acc = rotl64(acc, 11) * PRIME1;
+    }
+
+    // Avalanche
+    acc ^= acc >> 33;
+    acc *= PRIME2;
+    acc ^= acc >> 29;
+    acc *= PRIME3;
+    acc ^= acc >> 32;
+    return acc;
+}
+
+static uint32_t bucket_of_hash(const qfs_dedup_t *dd, uint64_t hash) {
+    return (uint32_t) (hash ^ (hash >> 32)) & dd->mask;
+}
+
+static uint32_t bucket_of_start(const qfs_dedup_t *dd, uint32_t start) {
+    return (uint32_t) ((start * 2654435761u) >> 7) & dd->mask;
+}
+
+// Link a record into both tables
+static void link_rec(qfs_dedup_t *dd, int r) {
+    qfs_dedup_rec_t *rec = &dd->recs[r];
+    uint32_t hb = bucket_of_hash(dd, rec->hash);
+    uint32_t sb = bucket_of_start(dd, rec->start);
+
+    rec->next_hash = dd->by_hash[hb];
+    dd->by_hash[hb] = r;
+    rec->next_start = dd->by_start[sb];
+    dd->by_start[sb] = r;
+}
+
+// Double the records and buckets, relinking every record in use
+static int grow(qfs_dedup_t *dd) {
+    int cap = dd->cap ? dd->cap * 2 : 64;
+
+    qfs_dedup_rec_t *recs = realloc(dd->recs, (size_t) cap * sizeof(qfs_dedup_rec_t));
+    if (!recs) {
+        return QFS_ESYS;
+    }
+    dd->recs = recs;
+
+    int *by_hash = malloc((size_t) cap * sizeof(int));
+    int *by_start = malloc((size_t) cap * sizeof(int));
+    if (!by_hash || !by_start) {
+        free(by_hash);
+        free(by_start);
+        return QFS_ESYS;
+    }
+    free(dd->by_hash);
+    free(dd->by_start);
+    dd->by_hash = by_hash;
+    dd->by_start = by_start;
+    dd->mask = (uint32_t) cap - 1;
+    memset(by_hash, 0xFF, (size_t) cap * sizeof(int));
+    memset(by_start, 0xFF, (size_t) cap * sizeof(int));
+
+    // Every record is in use when the array fills, the new ones go on the free list
+    for (int r = 0; r < dd->cap; r++) {
+        link_rec(dd, r);
+    }
+    for (int r = cap - 1; r >= dd->cap; r--) {
+        dd->recs[r].refs = 0;
+        dd->recs[r].slot = -1;
+        dd->recs[r].next_hash = dd->free_rec;
+        dd->free_rec = r;
+    }
+    dd->cap = cap;
+    return QFS_OK;
+}
+
+// Read the hash back out of a hash entry's name
+static int parse_name(const direntry_t *entry, uint64_t *hash) {
+    char *end;
+    char name[QFS_NAME_MAX + 1];
+
+    memcpy(name, entry->filename, QFS_NAME_MAX);
+    name[QFS_NAME_MAX] = '\0';
+    if (name[0] != QFS_DEDUP_PREFIX) {
+        return QFS_EFORMAT;
+    }
+
+    *hash = strtoull(name + 1, &end, 16);
+    return end == name + 17 && *end == '\0' ? QFS_OK : QFS_EFORMAT;
+}
+
+// Index every hash entry, then count the files that share each chain
+static int dedup_load(qfs_dedup_t *dd, qfs_image_t *img, const qfs_dir_t *dir) {
+    memset(dd, 0, sizeof(qfs_dedup_t));
+    dd->free_rec = -1;
+    if (grow(dd) != QFS_OK) {
+        return QFS_ESYS;
+    }
+
+    for (int slot = 0; slot < dir->n_slots; slot++) {
+        const direntry_t *entry = &dir->entries[slot];
+        uint64_t hash;
+
+        if (entry->filename[0] == '\0' || (entry->permissions & QFS_TYPE_MASK) != QFS_TYPE_HASH) {
+            continue;
+        }
+        // A damaged name only costs the chance to share that content
+        if (parse_name(entry, &hash) != QFS_OK) {
+            hash = 0;
+        }
+        if (qfs_dedup_add(dd, hash, qfs_entry_start(entry, img->version), entry->file_size, slot) < 0) {
+            return QFS_ESYS;
+        }
+    }
+
+    for (int slot = 0; dd->n_recs > 0 && slot < dir->n_slots; slot++) {
+        const direntry_t *entry = &dir->entries[slot];
+        if (!qfs_dir_is_file(dir, slot)) {
+            continue;
+        }
+
+        int r = qfs_dedup_find_start(dd, qfs_entry_start(entry, img->version));
+        if (r >= 0 && dd->recs[r].size == entry->file_size) {
+            dd->recs[r].refs++;
+        }
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "Dedup: %d distinct file(s) indexed\n", dd->n_recs);
+#endif
+
+    return QFS_OK;
+}
+
+qfs_dedup_t *qfs_get_dedup(qfs_image_t *img) {
+    qfs_dir_t *dir = qfs_get_dir(img);
+    if (!dir) {
+        return NULL;
+    }
+    if (dir->dedup) {
+        return dir->dedup;
+    }
+
+    qfs_dedup_t *dd = malloc(sizeof(qfs_dedup_t));
+    if (!dd) {
+        return NULL;
+    }
+    if (dedup_load(dd, img, dir) != QFS_OK) {
+        qfs_dedup_destroy(dd);
+        free(dd);
+        return NULL;
+    }
+
+    // Released with the directory, which drops it if fsck_qfs removes a hash entry
+    dir->dedup = dd;
+    return dd;
+}
+
+void qfs_dedup_destroy(qfs_dedup_t *dd) {
+    free(dd->recs);
+    free(dd->by_hash);
+    free(dd->by_start);
+    memset(dd, 0, sizeof(qfs_dedup_t));
+}
+
+void qfs_dedup_forget(qfs_dir_t *dir) {
+    if (dir->dedup) {
+        qfs_dedup_destroy(dir->dedup);
+        free(dir->dedup);
+        dir->dedup = NULL;
+    }
+}
+
+int qfs_dedup_find(const qfs_dedup_t *dd, uint64_t hash, int after) {
+    int r = after < 0 ? dd->by_hash[bucket_of_hash(dd, hash)] : dd->recs[after].next_hash;
+
+    while (r >= 0 && dd->recs[r].hash != hash) {
+        r = dd->recs[r].next_hash;
+    }
+    return r;
+}
+
+int qfs_dedup_find_start(const qfs_dedup_t *dd, uint32_t start) {
+    int r = dd->by_start[bucket_of_start(dd, start)];
+
+    while (r >= 0 && dd->recs[r].start != start) {
+        r = dd->recs[r].next_start;
+    }
+    return r;
+}
+
+int qfs_dedup_of(const qfs_dedup_t *dd, const qfs_image_t *img, const direntry_t *entry) {
+    int r = dd->n_recs > 0 ? qfs_dedup_find_start(dd, qfs_entry_start(entry, img->version)) : -1;
+    return r >= 0 && dd->recs[r].size == entry->file_size ? r : -1;
+}
+
+int qfs_dedup_add(qfs_dedup_t *dd, uint64_t hash, uint32_t start, uint32_t size, int slot) {
+    if (dd->free_rec < 0 && grow(dd) != QFS_OK) {
+        return QFS_ESYS;
+    }
+
+    int r = dd->free_rec;
+    qfs_dedup_rec_t *rec = &dd->recs[r];
+    dd->free_rec = rec->next_hash;
+
+    rec->hash = hash;
+    rec->start = start;
+    rec->size = size;
+    rec->refs = 0;
+    rec->slot = slot;
+    rec->req = -1;
+    link_rec(dd, r);
+    dd->n_recs++;
+    return r;
+}
+
+// Take a record out of a bucket list threaded through next_hash or next_start
+static void unlink_rec(qfs_dedup_t *dd, int *head, int r, int by_start) {
+    int *link = head;
+
+    while (*link >= 0 && *link != r) {
+        link = by_start ? &dd->recs[*link].next_start : &dd->recs[*link].next_hash;
+    }
+    if (*link == r) {
+        *link = by_start ? dd->recs[r].next_start : dd->recs[r].next_hash;
+    }
+}
+
+void qfs_dedup_del(qfs_dedup_t *dd, int r) {
+    qfs_dedup_rec_t *rec = &dd->recs[r];
+
+    unlink_rec(dd, &dd->by_hash[bucket_of_hash(dd, rec->hash)], r, 0);
+    unlink_rec(dd, &dd->by_start[bucket_of_start(dd, rec->start)], r, 1);
+
+    rec->refs = 0;
+    rec->slot = -1;
+    rec->next_hash = dd->free_rec;
+    dd->free_rec = r;
+    dd->n_recs--;
+}
+
+void qfs_dedup_set_entry(const qfs_image_t *img, const qfs_dedup_rec_t *rec, direntry_t *entry) {
+    memset(entry, 0, sizeof(direntry_t));
+    snprintf(entry->filename, sizeof(entry->filename), "%c%016llx",
+             QFS_DEDUP_PREFIX, (unsigned long long) rec->hash);
+    entry->permissions = QFS_TYPE_HASH;
+    entry->file_size = rec->size;
+    qfs_entry_set_start(entry, img->version, rec->start);
+}
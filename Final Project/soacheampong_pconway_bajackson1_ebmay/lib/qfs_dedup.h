@@ -0,0 +1,111 @@
+/*
+**
+** Whole-file deduplication (libqfs)
+**
+** Files written with deduplication are indexed by a 64-bit hash of their
+** stored bytes. The index is kept in the directory as hidden entries of
+** file type QFS_TYPE_HASH, one per distinct content, named '#' and the
+** hash in hex, with the starting block and size of the chain holding that
+** content. A new file whose bytes are already indexed gets a directory
+** entry pointing at the same chain instead of blocks of its own. The
+** bytes are compared before a chain is shared, the hash only finds it.
+**
+** Reference counts are not stored: a hash entry's count is the number of
+** file entries that start at its block, counted when the index is loaded
+** and kept up to date by qfs_write_files() and qfs_delete_file(). When
+** the last of them is deleted the hash entry and the blocks go with it.
+** Since the hash entries live in the directory, a file and its index
+** change are committed together.
+**
+** Tools that predate the index see the hash entries as files, and shared
+** chains as cross-linked.
+**
+** Usage: #include "qfs_dedup.h"
+**
+*/
+
+#ifndef QFS_DEDUP_H
+#define QFS_DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "qfs_image.h"
+
+struct qfs_dir;
+
+// First character of a hash entry's name
+#define QFS_DEDUP_PREFIX  '#'
+
+// Streaming 64-bit content hash (the xxHash64 algorithm)
+typedef struct qfs_hasher {
+    uint64_t v[4];          // Lane accumulators
+    uint64_t total;         // Bytes hashed
+    uint8_t  buf[32];       // Bytes waiting for a full stripe
+    uint32_t used;
+    uint64_t seed;
+} qfs_hasher_t;
+
+// One distinct content in the index
+typedef struct qfs_dedup_rec {
+    uint64_t hash;
+    uint32_t start;         // First block of the shared chain
+    uint32_t size;          // Stored bytes
+    uint32_t refs;          // File entries sharing the chain
+    int      slot;          // Directory slot of the hash entry
+    int      req;           // Request of the batch being written that supplies the chain, -1 once committed
+    int      next_hash;     // Next record in the same hash bucket (or free record), -1 at the end
+    int      next_start;    // Next record in the same start bucket
+} qfs_dedup_rec_t;
+
+typedef struct qfs_dedup {
+    qfs_dedup_rec_t *recs;  // Records, unused ones on a free list
+    int              n_recs;
+    int              cap;
+    int              free_rec;
+    int             *by_hash;     // Bucket heads, by hash
+    int             *by_start;    // and by starting block
+    uint32_t         mask;        // Buckets - 1
+} qfs_dedup_t;
+
+// Function to start hashing with a seed
+void qfs_hash_init(qfs_hasher_t *h, uint64_t seed);
+
+// Function to hash the next len bytes
+void qfs_hash_update(qfs_hasher_t *h, const void *data, size_t len);
+
+// Function to get the hash of everything passed to qfs_hash_update()
+uint64_t qfs_hash_final(const qfs_hasher_t *h);
+
+// Function to get the image's dedup index, loading it from the directory
+// on first use (NULL on failure)
+qfs_dedup_t *qfs_get_dedup(qfs_image_t *img);
+
+// Function to release the memory of an index
+void qfs_dedup_destroy(qfs_dedup_t *dd);
+
+// Function to drop a directory's loaded index, so the next qfs_get_dedup()
+// reads it again after hash entries were changed behind its back
+void qfs_dedup_forget(struct qfs_dir *dir);
+
+// Function to find the next record with a hash after record after (-1 to
+// start), returns its index or -1
+int qfs_dedup_find(const qfs_dedup_t *dd, uint64_t hash, int after);
+
+// Function to find the record of the chain starting at a block, returns
+// its index or -1
+int qfs_dedup_find_start(const qfs_dedup_t *dd, uint32_t start);
+
+// Function to find the record of the chain a file entry uses (same
+// starting block and size), returns its index or -1
+int qfs_dedup_of(const qfs_dedup_t *dd, const qfs_image_t *img, const direntry_t *entry);
+
+// Function to add a record, returns its index or QFS_ESYS
+int qfs_dedup_add(qfs_dedup_t *dd, uint64_t hash, uint32_t start, uint32_t size, int slot);
+
+// Function to remove a record
+void qfs_dedup_del(qfs_dedup_t *dd, int rec);
+
+// Function to fill in the hash entry for a record
+void qfs_dedup_set_entry(const qfs_image_t *img, const qfs_dedup_rec_t *rec, direntry_t *entry);
+
+#endif // QFS_DEDUP_H
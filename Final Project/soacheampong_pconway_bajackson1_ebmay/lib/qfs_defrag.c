@@ -0,0 +1,761 @@
+/*
+** Fragmentation analysis and defragmentation (libqfs)
+**
+** Blocks are copied mapping to mapping, so the only memory a move needs
+** is the list of the file's blocks.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qfs_defrag.h"
+#include "qfs_dir.h"
+#include "qfs_chain.h"
+#include "qfs_dedup.h"
+
+// Test whether other files share a file's chain through the dedup index
+static int is_shared(const qfs_dedup_t *dd, const qfs_image_t *img, const direntry_t *entry) {
+    int r = qfs_dedup_of(dd, img, entry);
+    return r >= 0 && dd->recs[r].refs > 1;
+}
+
+// Point a file at a new first block, along with the hash entry indexing
+// its chain if it was written with deduplication
+static void switch_start(qfs_image_t *img, qfs_dedup_t *dd, int slot, uint32_t start) {
+    qfs_dir_t *dir = img->dirindex;
+    direntry_t *entry = &dir->entries[slot];
+
+    int r = qfs_dedup_of(dd, img, entry);
+    if (r >= 0) {
+        qfs_dedup_rec_t rec = dd->recs[r];
+
+        // The record freed is the one taken back, so this cannot fail
+        qfs_dedup_del(dd, r);
+        r = qfs_dedup_add(dd, rec.hash, start, rec.size, rec.slot);
+        dd->recs[r].refs = rec.refs;
+
+        qfs_entry_set_start(&dir->entries[rec.slot], img->version, start);
+        qfs_dir_touch(dir, rec.slot);
+    }
+
+    qfs_entry_set_start(entry, img->version, start);
+    qfs_dir_touch(dir, slot);
+}
+
+int qfs_file_extents(const qfs_image_t *img, const direntry_t *entry, qfs_extent_t **ext) {
+    int n = 0, cap = 8;
+
+    *ext = malloc(cap * sizeof(qfs_extent_t));
+    if (!*ext) {
+        return QFS_ESYS;
+    }
+
+    qfs_chain_t chain;
+    qfs_extent_t run;
+
+    // The walker already splits the chain where it stops being contiguous
+    qfs_chain_init(&chain, img, qfs_entry_start(entry, img->version), entry->file_size);
+
+    while (qfs_chain_next_run(&chain, &run) > 0) {
+        if (n == cap) {
+            cap *= 2;
+            qfs_extent_t *grown = realloc(*ext, cap * sizeof(qfs_extent_t));
+            if (!grown) {
+                free(*ext);
+                *ext = NULL;
+                return QFS_ESYS;
+            }
+            *ext = grown;
+        }
+        (*ext)[n++] = run;
+    }
+
+    if (chain.error != QFS_OK) {
+        free(*ext);
+        *ext = NULL;
+        return chain.error;
+    }
+
+    return n;
+}
+
+int qfs_frag_stats(qfs_image_t *img, qfs_frag_stats_t *st) {
+    memset(st, 0, sizeof(qfs_frag_stats_t));
+
+    qfs_dir_t *dir = qfs_get_dir(img);
+    if (!dir) {
+        return QFS_ESYS;
+    }
+
+    for (int slot = 0; slot < dir->n_slots; slot++) {
+        const direntry_t *entry = &dir->entries[slot];
+        if (!qfs_dir_is_file(dir, slot) || entry->file_size == 0) {
+            continue;
+        }
+
+        qfs_extent_t *ext;
+        int n = qfs_file_extents(img, entry, &ext);
+        if (n == QFS_ESYS) {
+            return n;
+        }
+        if (n < 0) {
+            // Broken chains are fsck_qfs's business
+            continue;
+        }
+
+        st->files++;
+        st->extents += (uint32_t) n;
+        st->fragmented += n > 1;
+        for (int e = 0; e < n; e++) {
+            st->blocks += ext[e].count;
+        }
+        free(ext);
+    }
+
+    // Share of links between blocks that are not to the next block on disk
+    if (st->blocks > st->files) {
+        st->score = 100.0 * (st->extents - st->files) / (st->blocks - st->files);
+    }
+
+    return QFS_OK;
+}
+
+/*
+** qfs_defrag() packs the files into one ascending layout from the start
+** of the image, in their current order, around the blocks it must leave
+** where they are (the directory extension, shared and broken chains).
+** Each file in turn gets the next stretch of blocks holding it whole.
+** Blocks of other files in that stretch are first slid out of the way
+** into free blocks outside it (a small file in one run into one free
+** run, so it stays whole), then the file's own blocks are moved in.
+**
+** The layout is first played through on copies of the block owners, the
+** bitmap and the chains. The pass then only goes as far as the last file
+** placed within the budget with no file left in more extents than it
+** started with, so a pass cut short never fragments a file further.
+**
+** Every step is the same move: at most QFS_DEFRAG_STAGE blocks of one
+** chain are copied to free blocks and committed, the links to them are
+** switched and committed, and only then are the old blocks freed. Copies
+** hold the same bytes and link to each other, so a chain stays whole
+** whichever of its links a crash catches switched, and the image needs
+** no more free space than one step.
+*/
+
+#define OWNER_FREE    -1        // Block is free
+#define OWNER_FIXED   -2        // Block is busy and no file that can move holds it
+#define OWNER_PINNED  -3        // Block of a file left where it is
+
+// A file to lay out
+typedef struct defrag_cand {
+    int       slot;
+    int       extents;          // Extents before the pass
+    uint32_t  blocks;
+    uint32_t *chain;            // Blocks of the chain in order, kept up to date
+    uint32_t  start;            // First block before the pass
+    uint32_t  target;           // First block in the layout, QFS_NO_BLOCK if it does not fit
+    int       pending;          // Not in one run yet
+    int       worse;            // In more extents than before the pass
+} defrag_cand_t;
+
+typedef struct defrag_ctx {
+    qfs_image_t         *img;
+    qfs_dir_t           *dir;
+    qfs_bitmap_t        *bm;
+    qfs_dedup_t         *dd;
+    defrag_cand_t       *cand;
+    int                  n_cand;
+    int32_t             *owner;     // Candidate holding each block, or OWNER_*
+    uint32_t            *fixed_at;  // First fixed block at or after each block
+    uint32_t             low;       // No free block below this one
+    uint32_t             high;      // No free block above this one
+    int                  left;      // Candidates with a target not yet in one run
+    int                  spoiled;   // Candidates in more extents than before the pass
+    int                  dry;       // Only play the moves through, nothing is written
+    int                  clean;     // Last candidate placed with none spoiled, or -1
+    int                  stopped;   // The budget ran out
+    qfs_defrag_result_t *res;
+} defrag_ctx_t;
+
+// Make everything changed so far durable before the next step relies on it
+static int defrag_commit(qfs_image_t *img) {
+    int err = qfs_commit(img);
+    if (err == QFS_OK && !img->journal) {
+        err = qfs_flush(img);
+    }
+    return err;
+}
+
+// Copy chain positions pos[0..k) of candidate c to the free blocks dst
+// and link them in, copy -> commit -> relink -> commit
+static int copy_blocks(defrag_ctx_t *ctx, int c, const uint32_t *pos, const uint32_t *dst, uint32_t k) {
+    qfs_image_t *img = ctx->img;
+    const uint32_t *chain = ctx->cand[c].chain;
+    uint32_t n = ctx->cand[c].blocks;
+    int slot = ctx->cand[c].slot;
+    int err = QFS_OK;
+
+    // Where each position will be, for the links out of the copies
+    uint32_t *next = malloc(n * sizeof(uint32_t));
+    if (!next) {
+        return QFS_ESYS;
+    }
+    memcpy(next, chain, n * sizeof(uint32_t));
+    for (uint32_t i = 0; i < k; i++) {
+        next[pos[i]] = dst[i];
+    }
+
+    // 1. Copy, the copies linked to where their successors will be
+    for (uint32_t i = 0; i < k; i++) {
+        qfs_bitmap_set(ctx->bm, dst[i], 1);
+
+        const uint8_t *from = qfs_block_get(img, chain[pos[i]], QFS_BLK_READ);
+        uint8_t *to = qfs_block_get(img, dst[i], QFS_BLK_WRITE);
+        if (from && to) {
+            memcpy(to + 1, from + 1, img->block_size - 1);
+        }
+        if (from) {
+            qfs_block_put(img, chain[pos[i]]);
+        }
+        if (to) {
+            qfs_block_put(img, dst[i]);
+        }
+        if (!from || !to) {
+            err = QFS_ESYS;
+        }
+        if (pos[i] + 1 < n) {
+            qfs_set_next_block(img, dst[i], next[pos[i] + 1]);
+        }
+    }
+    qfs_sb_set_available(img, qfs_sb_available(img) - k);
+
+    if (err == QFS_OK) {
+        err = defrag_commit(img);
+    }
+    if (err != QFS_OK) {
+        // Nothing links to the copies yet
+        for (uint32_t i = 0; i < k; i++) {
+            qfs_bitmap_set(ctx->bm, dst[i], 0);
+        }
+        qfs_sb_set_available(img, qfs_sb_available(img) + k);
+        free(next);
+        return err;
+    }
+
+    // 2. Switch the links into the copies from blocks that stay, or the
+    //    directory entry for the first block
+    for (uint32_t i = 0; i < k; i++) {
+        uint32_t p = pos[i];
+        if (p == 0) {
+            switch_start(img, ctx->dd, slot, next[0]);
+        } else if (next[p - 1] == chain[p - 1]) {
+            qfs_set_next_block(img, chain[p - 1], next[p]);
+        }
+    }
+    qfs_dir_drop_map(ctx->dir, slot);
+
+    free(next);
+    return defrag_commit(img);
+}
+
+// Count the runs of contiguous blocks in a candidate's chain
+static uint32_t chain_runs(const defrag_cand_t *cd) {
+    uint32_t runs = cd->blocks > 0;
+    for (uint32_t p = 1; p < cd->blocks; p++) {
+        runs += cd->chain[p] != cd->chain[p - 1] + 1;
+    }
+    return runs;
+}
+
+// Move chain positions pos[0..k) of candidate c to the free blocks dst,
+// copy -> commit -> relink -> commit -> free
+static int move_blocks(defrag_ctx_t *ctx, int c, const uint32_t *pos, const uint32_t *dst, uint32_t k) {
+    defrag_cand_t *cd = &ctx->cand[c];
+    uint32_t *chain = cd->chain;
+
+    if (!ctx->dry) {
+        int err = copy_blocks(ctx, c, pos, dst, k);
+        if (err != QFS_OK) {
+            return err;
+        }
+    }
+
+    // 3. Free the old blocks (their busy bytes go with the next commit)
+    for (uint32_t i = 0; i < k; i++) {
+        uint32_t old = chain[pos[i]];
+
+        qfs_bitmap_set(ctx->bm, dst[i], 1);
+        qfs_bitmap_set(ctx->bm, old, 0);
+        ctx->owner[old] = OWNER_FREE;
+        ctx->owner[dst[i]] = c;
+        ctx->low = old < ctx->low ? old : ctx->low;
+        ctx->high = old > ctx->high ? old : ctx->high;
+        chain[pos[i]] = dst[i];
+    }
+
+    int worse = chain_runs(cd) > (uint32_t) cd->extents;
+    ctx->spoiled += worse - cd->worse;
+    cd->worse = worse;
+
+    if (!ctx->dry) {
+        qfs_sb_set_available(ctx->img, qfs_sb_available(ctx->img) + k);
+    }
+
+    ctx->res->moved_bytes += (size_t) k * ctx->img->block_size;
+    return QFS_OK;
+}
+
+// A free block outside [lo, lo + n) to slide a block into: below the
+// layout built so far if one is left there, else the highest one
+static uint32_t stage_block(defrag_ctx_t *ctx, uint32_t lo, uint32_t n) {
+    qfs_bitmap_t *bm = ctx->bm;
+    uint32_t start;
+
+    if (ctx->low < lo && qfs_bitmap_next_run(bm, ctx->low, &start) > 0 && start < lo) {
+        ctx->low = start;
+        return start;
+    }
+    ctx->low = lo;
+
+    // Padding bits past the last block are set, so they are never taken
+    for (uint32_t w = ctx->high / 64 + 1; w-- > (lo + n) / 64; ) {
+        uint64_t bits = ~bm->words[w];
+        if (w == (lo + n) / 64) {
+            bits &= ~0ULL << ((lo + n) & 63);
+        }
+        if (bits) {
+            ctx->high = w * 64 + 63 - (uint32_t) __builtin_clzll(bits);
+            return ctx->high;
+        }
+    }
+    ctx->high = 0;
+    return QFS_NO_BLOCK;
+}
+
+// The highest free run above [lo, lo + n) that holds count blocks,
+// QFS_NO_BLOCK if there is none
+static uint32_t stage_run(const defrag_ctx_t *ctx, uint32_t lo, uint32_t n, uint32_t count) {
+    uint32_t found = QFS_NO_BLOCK, start, got;
+
+    for (uint32_t from = lo + n; (got = qfs_bitmap_next_run(ctx->bm, from, &start)) > 0; from = start + got) {
+        if (got >= count) {
+            found = start + got - count;
+        }
+    }
+    return found;
+}
+
+// Slide the blocks of the first other chain found in [t, t + n) that
+// are not yet in place out of that stretch
+static int evict(defrag_ctx_t *ctx, uint32_t t, uint32_t n, uint32_t first,
+                 uint32_t *pos, uint32_t *dst) {
+    int c = ctx->owner[first];
+    defrag_cand_t *cd = &ctx->cand[c];
+
+    // A block of the file being placed is only in the way at another position
+    int self = cd->target == t;
+    uint32_t k = 0;
+
+    // Slid aside whole into one free run, a file stays in one run until
+    // its turn comes
+    uint32_t run = QFS_NO_BLOCK;
+    if (!self && cd->blocks <= QFS_DEFRAG_STAGE && chain_runs(cd) == 1) {
+        run = stage_run(ctx, t, n, cd->blocks);
+    }
+    if (run != QFS_NO_BLOCK) {
+        for (; k < cd->blocks; k++) {
+            pos[k] = k;
+            dst[k] = run + k;
+        }
+        return move_blocks(ctx, c, pos, dst, k);
+    }
+
+    for (uint32_t p = 0; p < cd->blocks && k < QFS_DEFRAG_STAGE; p++) {
+        uint32_t b = cd->chain[p];
+        if (b < t || b >= t + n || (self && b == t + p)) {
+            continue;
+        }
+
+        uint32_t to = stage_block(ctx, t, n);
+        if (to == QFS_NO_BLOCK) {
+            break;
+        }
+        pos[k] = p;
+        dst[k] = to;
+        k++;
+        qfs_bitmap_set(ctx->bm, to, 1);
+    }
+
+    // The blocks were only held so stage_block() would not hand them out twice
+    for (uint32_t i = 0; i < k; i++) {
+        qfs_bitmap_set(ctx->bm, dst[i], 0);
+    }
+
+    int err = k > 0 ? move_blocks(ctx, c, pos, dst, k) : QFS_ENOSPC;
+    if (err == QFS_OK && !self && !cd->pending) {
+        cd->pending = 1;
+        ctx->left++;
+    }
+    return err;
+}
+
+// Move a file into [target, target + blocks), returns 1 if any block
+// moved, 0 if it was already there, or an error code
+static int place(defrag_ctx_t *ctx, int c, uint32_t *pos, uint32_t *dst) {
+    defrag_cand_t *cd = &ctx->cand[c];
+    uint32_t t = cd->target, n = cd->blocks;
+    int moved = 0;
+
+    for (;;) {
+        // Positions whose place is free go straight there
+        uint32_t k = 0, first = QFS_NO_BLOCK;
+        for (uint32_t p = 0; p < n && k < QFS_DEFRAG_STAGE; p++) {
+            if (cd->chain[p] == t + p) {
+                continue;
+            }
+            if (ctx->owner[t + p] == OWNER_FREE) {
+                pos[k] = p;
+                dst[k] = t + p;
+                k++;
+            } else if (first == QFS_NO_BLOCK) {
+                first = t + p;
+            }
+        }
+
+        int err;
+        if (k > 0) {
+            err = move_blocks(ctx, c, pos, dst, k);
+        } else if (first != QFS_NO_BLOCK) {
+            err = evict(ctx, t, n, first, pos, dst);
+        } else {
+            return moved;
+        }
+
+        if (err != QFS_OK) {
+            return err;
+        }
+        moved = 1;
+    }
+}
+
+// Find the first block at or after each block that has to stay put
+static void index_fixed(defrag_ctx_t *ctx) {
+    uint32_t nblocks = ctx->bm->nblocks;
+
+    ctx->fixed_at[nblocks] = nblocks;
+    for (uint32_t b = nblocks; b-- > 0; ) {
+        ctx->fixed_at[b] = ctx->owner[b] < OWNER_FREE ? b : ctx->fixed_at[b + 1];
+    }
+}
+
+// Leave a candidate where it is, its blocks become fixed
+static void pin(defrag_ctx_t *ctx, int c) {
+    for (uint32_t b = 0; b < ctx->bm->nblocks; b++) {
+        if (ctx->owner[b] == c) {
+            ctx->owner[b] = OWNER_PINNED;
+        }
+    }
+    ctx->cand[c].target = QFS_NO_BLOCK;
+}
+
+// Order by first block, so the layout keeps the files in their order
+static int cand_cmp(const void *a, const void *b) {
+    const defrag_cand_t *x = a, *y = b;
+    return x->start < y->start ? -1 : (x->start > y->start);
+}
+
+// Collect the files that can move, in disk order, and claim their blocks.
+// Returns QFS_OK or QFS_ESYS.
+static int claim_files(defrag_ctx_t *ctx) {
+    qfs_dir_t *dir = ctx->dir;
+
+    for (uint32_t b = 0; b < ctx->bm->nblocks; b++) {
+        ctx->owner[b] = qfs_bitmap_test(ctx->bm, b) ? OWNER_FIXED : OWNER_FREE;
+    }
+
+    int n_files = 0;
+    for (int slot = 0; slot < dir->n_slots; slot++) {
+        const direntry_t *entry = &dir->entries[slot];
+        if (qfs_dir_is_file(dir, slot) && entry->file_size > 0) {
+            ctx->cand[n_files].slot = slot;
+            ctx->cand[n_files].start = qfs_entry_start(entry, ctx->img->version);
+            n_files++;
+        }
+    }
+    qsort(ctx->cand, n_files, sizeof(defrag_cand_t), cand_cmp);
+
+    for (int i = 0; i < n_files; i++) {
+        const direntry_t *entry = &dir->entries[ctx->cand[i].slot];
+
+        qfs_extent_t *ext;
+        int n = qfs_file_extents(ctx->img, entry, &ext);
+        if (n == QFS_ESYS) {
+            return n;
+        }
+        if (n < 0) {
+            ctx->res->broken++;
+            continue;
+        }
+        if (is_shared(ctx->dd, ctx->img, entry)) {
+            ctx->res->shared += n > 1;
+            free(ext);
+            continue;
+        }
+
+        int c = ctx->n_cand++;
+        defrag_cand_t *cd = &ctx->cand[c];
+        *cd = ctx->cand[i];
+        cd->extents = n;
+        cd->blocks = 0;
+        cd->target = 0;
+        cd->pending = n > 1;
+        cd->worse = 0;
+
+        for (int e = 0; e < n; e++) {
+            cd->blocks += ext[e].count;
+        }
+        cd->chain = malloc(cd->blocks * sizeof(uint32_t));
+        if (!cd->chain) {
+            free(ext);
+            ctx->n_cand--;
+            return QFS_ESYS;
+        }
+
+        // A block that is free or claimed already is a cross-link, left to fsck_qfs
+        int clash = OWNER_FIXED;
+        uint32_t p = 0;
+        for (int e = 0; e < n; e++) {
+            for (uint32_t b = ext[e].start; b < ext[e].start + ext[e].count; b++) {
+                if (ctx->owner[b] != OWNER_FIXED) {
+                    clash = ctx->owner[b];
+                }
+                ctx->owner[b] = c;
+                cd->chain[p++] = b;
+            }
+        }
+        free(ext);
+
+        if (clash != OWNER_FIXED) {
+            if (clash >= 0 && clash != c) {
+                pin(ctx, clash);
+                ctx->cand[clash].pending = 0;
+                ctx->res->broken++;
+            }
+            pin(ctx, c);
+            free(cd->chain);
+            ctx->n_cand--;
+            ctx->res->broken++;
+        }
+    }
+    return QFS_OK;
+}
+
+// First block at or after from where [block, block + n) holds no fixed block
+static uint32_t fit(const defrag_ctx_t *ctx, uint32_t from, uint32_t n) {
+    uint32_t nblocks = ctx->bm->nblocks;
+
+    while (from + n <= nblocks) {
+        uint32_t f = ctx->fixed_at[from];
+        if (f >= from + n) {
+            return from;
+        }
+        from = f + 1;
+    }
+    return QFS_NO_BLOCK;
+}
+
+// Give every candidate the next stretch it fits in whole. One that fits
+// nowhere stays where it is, which fixes its blocks, so start over.
+static void plan_layout(defrag_ctx_t *ctx) {
+    int again;
+
+    do {
+        again = 0;
+        index_fixed(ctx);
+
+        uint32_t cursor = 0;
+        for (int c = 0; c < ctx->n_cand && !again; c++) {
+            defrag_cand_t *cd = &ctx->cand[c];
+            if (cd->target == QFS_NO_BLOCK) {
+                continue;
+            }
+
+            uint32_t t = fit(ctx, cursor, cd->blocks);
+            if (t == QFS_NO_BLOCK) {
+                pin(ctx, c);
+                again = 1;
+            }
+            cd->target = t;
+            cursor = t + cd->blocks;
+        }
+    } while (again);
+}
+
+// Lay the candidates out in order, none past candidate last. Stops at
+// the first file with no room, or once the bytes copied pass budget
+// (0 for no limit). Returns QFS_OK or an error code.
+static int lay_out(defrag_ctx_t *ctx, int last, size_t budget, uint32_t *pos, uint32_t *dst,
+                   void (*progress)(const qfs_image_t *img, int slot, uint32_t old_start, int old_extents)) {
+    ctx->clean = -1;
+
+    for (int c = 0; c <= last && c < ctx->n_cand && ctx->left > 0; c++) {
+        defrag_cand_t *cd = &ctx->cand[c];
+        if (cd->target == QFS_NO_BLOCK) {
+            continue;
+        }
+
+        // With no free block left outside its stretch a file cannot move
+        int r = place(ctx, c, pos, dst);
+        if (r == QFS_ENOSPC) {
+            return QFS_OK;
+        }
+        if (r < 0) {
+            return r;
+        }
+        if (budget > 0 && ctx->res->moved_bytes > budget) {
+            ctx->stopped = 1;
+            return QFS_OK;
+        }
+
+        ctx->left -= cd->pending;
+        cd->pending = 0;
+        if (ctx->spoiled == 0) {
+            ctx->clean = c;
+        }
+
+        if (r > 0) {
+            ctx->res->moved_files++;
+            if (progress) {
+                progress(ctx->img, cd->slot, cd->start, cd->extents);
+            }
+        }
+    }
+    return QFS_OK;
+}
+
+// Play the layout through on copies of the bitmap, the block owners and
+// the chains, and find the last candidate the real run may go up to:
+// within the budget, and with no file in more extents than before the
+// pass. Returns QFS_OK or an error code.
+static int dry_run(const defrag_ctx_t *ctx, size_t budget, uint32_t *pos, uint32_t *dst,
+                   int *last, int *stopped) {
+    defrag_ctx_t sim = *ctx;
+    qfs_bitmap_t bm = *ctx->bm;
+    qfs_defrag_result_t res;
+    uint32_t nblocks = bm.nblocks;
+    int err = QFS_ESYS;
+
+    memset(&res, 0, sizeof(res));
+    sim.dry = 1;
+    sim.bm = &bm;
+    sim.res = &res;
+    bm.words = malloc(bm.nwords * sizeof(uint64_t));
+    bm.dirty = calloc(bm.nwords, sizeof(uint64_t));
+    sim.owner = malloc((nblocks ? nblocks : 1) * sizeof(int32_t));
+    sim.cand = calloc(ctx->n_cand ? ctx->n_cand : 1, sizeof(defrag_cand_t));
+
+    int c = 0;
+    if (bm.words && bm.dirty && sim.owner && sim.cand) {
+        memcpy(bm.words, ctx->bm->words, bm.nwords * sizeof(uint64_t));
+        memcpy(sim.owner, ctx->owner, nblocks * sizeof(int32_t));
+
+        for (; c < ctx->n_cand; c++) {
+            sim.cand[c] = ctx->cand[c];
+            sim.cand[c].chain = malloc(ctx->cand[c].blocks * sizeof(uint32_t));
+            if (!sim.cand[c].chain) {
+                break;
+            }
+            memcpy(sim.cand[c].chain, ctx->cand[c].chain, ctx->cand[c].blocks * sizeof(uint32_t));
+        }
+        if (c == ctx->n_cand) {
+            err = lay_out(&sim, ctx->n_cand - 1, budget, pos, dst, NULL);
+        }
+    }
+    *last = sim.clean;
+    *stopped = sim.stopped;
+
+    while (c-- > 0) {
+        free(sim.cand[c].chain);
+    }
+    free(sim.cand);
+    free(sim.owner);
+    free(bm.words);
+    free(bm.dirty);
+    return err;
+}
+
+int qfs_defrag(qfs_image_t *img, size_t budget, qfs_defrag_result_t *res,
+               void (*progress)(const qfs_image_t *img, int slot, uint32_t old_start, int old_extents)) {
+    memset(res, 0, sizeof(qfs_defrag_result_t));
+
+    defrag_ctx_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.img = img;
+    ctx.res = res;
+    ctx.dir = qfs_get_dir(img);
+    ctx.bm = qfs_get_bitmap(img);
+    ctx.dd = qfs_get_dedup(img);
+    if (!ctx.dir || !ctx.bm || !ctx.dd) {
+        return QFS_ESYS;
+    }
+
+    uint32_t nblocks = ctx.bm->nblocks;
+    uint32_t *pos = malloc(QFS_DEFRAG_STAGE * sizeof(uint32_t));
+    uint32_t *dst = malloc(QFS_DEFRAG_STAGE * sizeof(uint32_t));
+    ctx.cand = calloc(ctx.dir->n_slots ? ctx.dir->n_slots : 1, sizeof(defrag_cand_t));
+    ctx.owner = malloc((nblocks ? nblocks : 1) * sizeof(int32_t));
+    ctx.fixed_at = malloc(((size_t) nblocks + 1) * sizeof(uint32_t));
+    ctx.high = nblocks ? nblocks - 1 : 0;
+
+    int err = pos && dst && ctx.cand && ctx.owner && ctx.fixed_at ? claim_files(&ctx) : QFS_ESYS;
+
+    if (err == QFS_OK) {
+        plan_layout(&ctx);
+        for (int c = 0; c < ctx.n_cand; c++) {
+            ctx.left += ctx.cand[c].pending && ctx.cand[c].target != QFS_NO_BLOCK;
+        }
+    }
+
+    // A run cut short by the budget or a lack of room can leave files slid
+    // aside in more pieces than before, so only go as far as the last file
+    // after which none is. The moves depend on nothing but the state
+    // copied, so the real run does exactly what the dry run did.
+    int last = -1, stopped = 0;
+    if (err == QFS_OK && ctx.left > 0) {
+        err = dry_run(&ctx, budget, pos, dst, &last, &stopped);
+    }
+    if (err == QFS_OK) {
+        err = lay_out(&ctx, last, 0, pos, dst, progress);
+    }
+
+    // Freed blocks are written back with the last commit
+    if (err == QFS_OK) {
+        err = defrag_commit(img);
+    }
+
+    // Without a file moved, a next pass would stop at the same place
+    for (int c = 0; c < ctx.n_cand; c++) {
+        defrag_cand_t *cd = &ctx.cand[c];
+        if (!cd->pending) {
+            continue;
+        }
+        if (!stopped) {
+            res->no_space++;
+        } else if (res->moved_bytes == 0 || (size_t) cd->blocks * img->block_size > budget) {
+            res->too_big++;
+        } else {
+            res->over_budget++;
+        }
+    }
+
+    for (int c = 0; c < ctx.n_cand; c++) {
+        free(ctx.cand[c].chain);
+    }
+    free(pos);
+    free(dst);
+    free(ctx.cand);
+    free(ctx.owner);
+    free(ctx.fixed_at);
+    return err;
+}
@@ -0,0 +1,63 @@
+/*
+**
+** Fragmentation analysis and defragmentation (libqfs)
+**
+** qfs_defrag() packs the files into one contiguous, ascending layout,
+** sliding the blocks of other files out of each file's way. Blocks are
+** moved by copying them, committing the copy, switching the links to it
+** and only then freeing the old blocks. A crash at any point leaves every
+** chain whole, plus blocks fsck_qfs reclaims. Chains shared by several
+** files through the dedup index (see qfs_dedup.h) are not moved.
+**
+** Usage: #include "qfs_defrag.h"
+**
+*/
+
+#ifndef QFS_DEFRAG_H
+#define QFS_DEFRAG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "qfs_image.h"
+#include "qfs_bitmap.h"
+
+// Blocks a defragmentation step copies at most, and so the free space
+// it needs besides the file being moved
+#define QFS_DEFRAG_STAGE  256
+
+// Fragmentation of the files on an image
+typedef struct qfs_frag_stats {
+    uint32_t files;         // Files with at least one block
+    uint32_t fragmented;    // Files stored in more than one extent
+    uint32_t blocks;        // Blocks in all chains
+    uint32_t extents;       // Runs of contiguous blocks in all chains
+    double   score;         // Percent of chain links that jump (0 = all contiguous)
+} qfs_frag_stats_t;
+
+// Result of a defragmentation pass
+typedef struct qfs_defrag_result {
+    uint32_t moved_files;   // Files moved into their place in the layout
+    size_t   moved_bytes;   // Bytes of blocks copied, including those slid aside
+    uint32_t no_space;      // Fragmented files the layout has no room for
+    uint32_t over_budget;   // Fragmented files skipped to stay within the budget
+    uint32_t too_big;       // Fragmented files no pass within the budget can move
+    uint32_t broken;        // Files whose chain leaves the image (left alone)
+    uint32_t shared;        // Fragmented files sharing a deduplicated chain (left alone)
+} qfs_defrag_result_t;
+
+// Function to collect the runs of a file's chain, returns the number of
+// extents (caller frees *ext) or an error code
+int qfs_file_extents(const qfs_image_t *img, const direntry_t *entry, qfs_extent_t **ext);
+
+// Function to measure the fragmentation of every file on an image
+int qfs_frag_stats(qfs_image_t *img, qfs_frag_stats_t *st);
+
+// Function to defragment an image, laying files out from the start of
+// the image in their current order. The pass stops before the bytes
+// copied, including the blocks slid aside, would pass budget (0 for no
+// limit), and never where a file that was in one run is left in pieces.
+// progress is called after each file is moved if not NULL.
+int qfs_defrag(qfs_image_t *img, size_t budget, qfs_defrag_result_t *res,
+               void (*progress)(const qfs_image_t *img, int slot, uint32_t old_start, int old_extents));
+
+#endif // QFS_DEFRAG_H
@@ -0,0 +1,646 @@
+/*
+** Sorted directory index (libqfs)
+**
+** Leaves split in two when they fill and are dropped when they empty, so
+** the leaf array stays a few hundred pointers long at tens of thousands
+** of entries and a search is two short binary searches. Leaves are built
+** three quarters full so inserts rarely split straight after a load.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qfs_dir.h"
+#include "qfs_bitmap.h"
+#include "qfs_chain.h"
+#include "qfs_map.h"
+#include "qfs_dedup.h"
+
+// Compare a stored filename against a lookup name
+static int name_cmp(const direntry_t *entry, const char *name) {
+    return strncmp(entry->filename, name, QFS_NAME_MAX);
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    const direntry_t *x = *(const direntry_t * const *) a;
+    const direntry_t *y = *(const direntry_t * const *) b;
+    return strncmp(x->filename, y->filename, QFS_NAME_MAX);
+}
+
+static const char *slot_name(const qfs_dir_t *d, uint32_t slot) {
+    return d->entries[slot].filename;
+}
+
+// Make room for at least slots entries, free slots and dirty bits
+static int reserve_slots(qfs_dir_t *d, int slots) {
+    if (slots <= d->cap) {
+        return QFS_OK;
+    }
+
+    int cap = d->cap ? d->cap : QFS_DIR_ENTRIES;
+    while (cap < slots) {
+        cap *= 2;
+    }
+
+    direntry_t *entries = realloc(d->entries, (size_t) cap * sizeof(direntry_t));
+    if (!entries) {
+        return QFS_ESYS;
+    }
+    d->entries = entries;
+
+    uint32_t *free_slots = realloc(d->free_slots, (size_t) cap * sizeof(uint32_t));
+    if (!free_slots) {
+        return QFS_ESYS;
+    }
+    d->free_slots = free_slots;
+
+    int old_words = (d->cap + 63) / 64, words = (cap + 63) / 64;
+    uint64_t *dirty = realloc(d->dirty, (size_t) words * sizeof(uint64_t));
+    if (!dirty) {
+        return QFS_ESYS;
+    }
+    memset(dirty + old_words, 0, (size_t) (words - old_words) * sizeof(uint64_t));
+    d->dirty = dirty;
+
+    qfs_blockmap_t **maps = realloc(d->maps, (size_t) cap * sizeof(qfs_blockmap_t *));
+    if (!maps) {
+        return QFS_ESYS;
+    }
+    memset(maps + d->cap, 0, (size_t) (cap - d->cap) * sizeof(qfs_blockmap_t *));
+    d->maps = maps;
+
+    d->cap = cap;
+    return QFS_OK;
+}
+
+static int reserve_leaves(qfs_dir_t *d, int n) {
+    if (n <= d->leaves_cap) {
+        return QFS_OK;
+    }
+
+    int cap = d->leaves_cap ? d->leaves_cap : 8;
+    while (cap < n) {
+        cap *= 2;
+    }
+
+    qfs_dir_leaf_t **leaves = realloc(d->leaves, (size_t) cap * sizeof(qfs_dir_leaf_t *));
+    if (!leaves) {
+        return QFS_ESYS;
+    }
+    d->leaves = leaves;
+    d->leaves_cap = cap;
+    return QFS_OK;
+}
+
+static void free_leaves(qfs_dir_t *d) {
+    for (int i = 0; i < d->n_leaves; i++) {
+        free(d->leaves[i]);
+    }
+    d->n_leaves = 0;
+    d->n_used = 0;
+}
+
+// Rebuild the free slot stack and the sorted index from the entries
+static int build_index(qfs_dir_t *d) {
+    free_leaves(d);
+
+    const direntry_t **used = malloc((size_t) (d->n_slots ? d->n_slots : 1) * sizeof(direntry_t *));
+    if (!used) {
+        return QFS_ESYS;
+    }
+
+    // Stack free slots so the lowest is handed out first
+    int n = 0;
+    d->n_free = 0;
+    for (int i = d->n_slots - 1; i >= 0; i--) {
+        if (d->entries[i].filename[0] == '\0') {
+            d->free_slots[d->n_free++] = (uint32_t) i;
+        } else if (qfs_dir_is_file(d, i)) {
+            used[n++] = &d->entries[i];
+        }
+    }
+    qsort(used, n, sizeof(direntry_t *), entry_cmp);
+
+    int fill = QFS_DIR_LEAF * 3 / 4;
+    int n_leaves = n > 0 ? (n + fill - 1) / fill : 1;
+
+    if (reserve_leaves(d, n_leaves) != QFS_OK) {
+        free(used);
+        return QFS_ESYS;
+    }
+
+    for (int l = 0; l < n_leaves; l++) {
+        qfs_dir_leaf_t *leaf = malloc(sizeof(qfs_dir_leaf_t));
+        if (!leaf) {
+            free(used);
+            return QFS_ESYS;
+        }
+
+        leaf->n = 0;
+        for (int i = l * fill; i < n && leaf->n < fill; i++) {
+            leaf->slots[leaf->n++] = (uint32_t) (used[i] - d->entries);
+        }
+        d->leaves[d->n_leaves++] = leaf;
+    }
+    d->n_used = n;
+
+    free(used);
+    return QFS_OK;
+}
+
+// Position of the first indexed name not before name. Every leaf but a
+// lone empty one holds at least one slot, so leaf first names can be read.
+static void index_seek(const qfs_dir_t *d, const char *name, int *li, int *pos) {
+    // Last leaf whose first name sorts before name
+    int lo = 0, hi = d->n_leaves - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (name_cmp(&d->entries[d->leaves[mid]->slots[0]], name) < 0) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    const qfs_dir_leaf_t *leaf = d->leaves[lo];
+    int a = 0, b = leaf->n;
+    while (a < b) {
+        int mid = (a + b) / 2;
+        if (name_cmp(&d->entries[leaf->slots[mid]], name) < 0) {
+            a = mid + 1;
+        } else {
+            b = mid;
+        }
+    }
+
+    *li = lo;
+    *pos = a;
+}
+
+// Step past the end of a leaf to the start of the next one
+static void index_normalize(const qfs_dir_t *d, int *li, int *pos) {
+    if (*pos == d->leaves[*li]->n && *li + 1 < d->n_leaves) {
+        (*li)++;
+        *pos = 0;
+    }
+}
+
+// Slot at a normalized position whose name matches, or -1
+static int index_match(const qfs_dir_t *d, int li, int pos, const char *name) {
+    const qfs_dir_leaf_t *leaf = d->leaves[li];
+    if (pos < leaf->n && name_cmp(&d->entries[leaf->slots[pos]], name) == 0) {
+        return (int) leaf->slots[pos];
+    }
+    return -1;
+}
+
+// Put a slot into the index at a position, splitting a full leaf
+static int index_add(qfs_dir_t *d, int li, int pos, uint32_t slot) {
+    qfs_dir_leaf_t *leaf = d->leaves[li];
+
+    if (leaf->n == QFS_DIR_LEAF) {
+        qfs_dir_leaf_t *right = malloc(sizeof(qfs_dir_leaf_t));
+        if (!right || reserve_leaves(d, d->n_leaves + 1) != QFS_OK) {
+            free(right);
+            return QFS_ESYS;
+        }
+
+        // Upper half moves to a new leaf after this one
+        int half = QFS_DIR_LEAF / 2;
+        right->n = leaf->n - half;
+        memcpy(right->slots, leaf->slots + half, (size_t) right->n * sizeof(uint32_t));
+        leaf->n = half;
+
+        memmove(&d->leaves[li + 2], &d->leaves[li + 1],
+                (size_t) (d->n_leaves - li - 1) * sizeof(qfs_dir_leaf_t *));
+        d->leaves[li + 1] = right;
+        d->n_leaves++;
+
+        if (pos > half) {
+            leaf = right;
+            pos -= half;
+        }
+    }
+
+    memmove(&leaf->slots[pos + 1], &leaf->slots[pos], (size_t) (leaf->n - pos) * sizeof(uint32_t));
+    leaf->slots[pos] = slot;
+    leaf->n++;
+    d->n_used++;
+    return QFS_OK;
+}
+
+// Take a slot out of the index, dropping its leaf if that empties it
+static void index_del(qfs_dir_t *d, uint32_t slot) {
+    const char *name = slot_name(d, slot);
+    int li, pos;
+
+    index_seek(d, name, &li, &pos);
+    index_normalize(d, &li, &pos);
+
+    // A damaged image can hold a name twice, find this slot among them
+    while (index_match(d, li, pos, name) >= 0 && d->leaves[li]->slots[pos] != slot) {
+        pos++;
+        index_normalize(d, &li, &pos);
+    }
+    if (index_match(d, li, pos, name) < 0) {
+        return;
+    }
+
+    qfs_dir_leaf_t *leaf = d->leaves[li];
+    memmove(&leaf->slots[pos], &leaf->slots[pos + 1], (size_t) (leaf->n - pos - 1) * sizeof(uint32_t));
+    leaf->n--;
+    d->n_used--;
+
+    if (leaf->n == 0 && d->n_leaves > 1) {
+        free(leaf);
+        memmove(&d->leaves[li], &d->leaves[li + 1],
+                (size_t) (d->n_leaves - li - 1) * sizeof(qfs_dir_leaf_t *));
+        d->n_leaves--;
+    }
+}
+
+// Copy the extension's blocks of entries in after the root table. A
+// broken chain keeps the blocks before the break, fsck_qfs cuts the file
+// back to the same point.
+static int load_extension(qfs_dir_t *d) {
+    const qfs_image_t *img = d->img;
+    const direntry_t *ext = &d->entries[d->ext_slot];
+    uint32_t want = ext->file_size / img->payload;
+
+    if (want > img->total_blocks) {
+        want = img->total_blocks;
+    }
+    if (want == 0) {
+        return QFS_OK;
+    }
+
+    d->blocks = malloc(want * sizeof(uint32_t));
+    if (!d->blocks) {
+        return QFS_ESYS;
+    }
+
+    qfs_chain_t chain;
+    qfs_extent_t run;
+
+    qfs_chain_init(&chain, img, qfs_entry_start(ext, img->version), want * img->payload);
+
+    while (qfs_chain_next_run(&chain, &run) > 0) {
+        for (uint32_t b = run.start; b < run.start + run.count; b++) {
+            if (reserve_slots(d, d->n_slots + d->per_block) != QFS_OK) {
+                return QFS_ESYS;
+            }
+
+            const uint8_t *p = qfs_block_get(img, b, QFS_BLK_READ);
+            if (!p) {
+                return QFS_ESYS;
+            }
+            memcpy(&d->entries[d->n_slots], p + 1, (size_t) d->per_block * sizeof(direntry_t));
+            qfs_block_put(img, b);
+
+            d->blocks[d->n_blocks++] = b;
+            d->n_slots += d->per_block;
+        }
+    }
+
+    return QFS_OK;
+}
+
+qfs_dir_t *qfs_get_dir(qfs_image_t *img) {
+    if (img->dirindex) {
+        return img->dirindex;
+    }
+
+    qfs_dir_t *d = malloc(sizeof(qfs_dir_t));
+    if (!d) {
+        return NULL;
+    }
+
+    uint64_t t0 = qfs_phase_begin();
+    int err = qfs_dir_load(d, img);
+    qfs_phase_end(QFS_PHASE_DIR, t0);
+
+    if (err != QFS_OK) {
+        qfs_dir_destroy(d);
+        free(d);
+        return NULL;
+    }
+
+    // Committed and released by qfs_close()
+    img->dirindex = d;
+    return d;
+}
+
+int qfs_dir_load(qfs_dir_t *d, qfs_image_t *img) {
+    memset(d, 0, sizeof(qfs_dir_t));
+    d->img = img;
+    d->ext_slot = -1;
+    d->per_block = (int) (img->payload / sizeof(direntry_t));
+
+    d->n_root = img->sb->total_direntries;
+    if (d->n_root > QFS_DIR_ENTRIES) {
+        d->n_root = QFS_DIR_ENTRIES;
+    }
+    d->n_slots = d->n_root;
+
+    // Whole root table in one copy
+    if (reserve_slots(d, QFS_DIR_ENTRIES) != QFS_OK) {
+        return QFS_ESYS;
+    }
+    memcpy(d->entries, img->dir, sizeof(direntry_t) * QFS_DIR_ENTRIES);
+
+    for (int i = 0; i < d->n_root; i++) {
+        const direntry_t *entry = &d->entries[i];
+        if (entry->filename[0] != '\0' && (entry->permissions & QFS_TYPE_MASK) == QFS_TYPE_DIR) {
+            d->ext_slot = i;
+            break;
+        }
+    }
+
+    if (d->ext_slot >= 0 && d->per_block > 0 && load_extension(d) != QFS_OK) {
+        return QFS_ESYS;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "Directory: %d slots, %d in %d extension block(s)\n",
+            d->n_slots, d->n_slots - d->n_root, d->n_blocks);
+#endif
+
+    return build_index(d);
+}
+
+void qfs_dir_destroy(qfs_dir_t *d) {
+    free_leaves(d);
+    free(d->leaves);
+    free(d->entries);
+    free(d->free_slots);
+    free(d->dirty);
+    free(d->blocks);
+    for (int i = 0; d->maps && i < d->cap; i++) {
+        qfs_blockmap_free(d->maps[i]);
+    }
+    free(d->maps);
+    qfs_dedup_forget(d);
+    memset(d, 0, sizeof(qfs_dir_t));
+}
+
+void qfs_dir_drop_map(qfs_dir_t *d, int slot) {
+    qfs_blockmap_free(d->maps[slot]);
+    d->maps[slot] = NULL;
+}
+
+int qfs_dir_lookup(const qfs_dir_t *d, const char *name) {
+    int li, pos;
+
+    index_seek(d, name, &li, &pos);
+    index_normalize(d, &li, &pos);
+    return index_match(d, li, pos, name);
+}
+
+// Add a block of free slots to the extension, creating the extension in
+// a free root slot the first time. The empty entries and the link from
+// the previous block are written as file data, so they are on disk before
+// the commit that grows the extension's size to take them in.
+static int grow(qfs_dir_t *d) {
+    qfs_image_t *img = d->img;
+
+    if (d->per_block == 0 || (d->ext_slot < 0 && d->n_free == 0)) {
+        return QFS_ENODIR;
+    }
+    if ((uint64_t) (d->n_blocks + 1) * img->payload > UINT32_MAX
+        || d->n_slots > INT32_MAX - d->per_block) {
+        return QFS_ENODIR;
+    }
+
+    qfs_bitmap_t *bm = qfs_get_bitmap(img);
+    uint32_t *blocks = realloc(d->blocks, (size_t) (d->n_blocks + 1) * sizeof(uint32_t));
+    if (blocks) {
+        d->blocks = blocks;
+    }
+    if (!bm || !blocks || reserve_slots(d, d->n_slots + d->per_block) != QFS_OK) {
+        return QFS_ESYS;
+    }
+
+    // Next to the last extension block when there is room
+    uint32_t last = d->n_blocks > 0 ? d->blocks[d->n_blocks - 1] : 0;
+    uint32_t block = qfs_bitmap_alloc(bm, d->n_blocks > 0 ? last + 1 : 0);
+    if (block == QFS_NO_BLOCK) {
+        return QFS_ENOSPC;
+    }
+
+    uint8_t *p = qfs_block_get(img, block, QFS_BLK_WRITE);
+    if (!p) {
+        qfs_bitmap_set(bm, block, 0);
+        return QFS_ESYS;
+    }
+    memset(p + 1, 0, img->payload);
+    qfs_block_put(img, block);
+
+    if (d->ext_slot < 0) {
+        int slot = (int) d->free_slots[--d->n_free];
+        direntry_t *entry = &d->entries[slot];
+
+        memset(entry, 0, sizeof(direntry_t));
+        qfs_dir_set_name(entry, QFS_DIR_EXT_NAME);
+        entry->permissions = QFS_TYPE_DIR;
+        d->ext_slot = slot;
+        img->sb->available_direntries--;
+    }
+
+    direntry_t *ext = &d->entries[d->ext_slot];
+    if (d->n_blocks > 0) {
+        qfs_set_next_block(img, last, block);
+    } else {
+        qfs_entry_set_start(ext, img->version, block);
+    }
+    d->blocks[d->n_blocks++] = block;
+    ext->file_size = (uint32_t) d->n_blocks * img->payload;
+    qfs_dir_touch(d, d->ext_slot);
+
+    // New slots stacked so the lowest is handed out first
+    memset(&d->entries[d->n_slots], 0, (size_t) d->per_block * sizeof(direntry_t));
+    for (int i = d->per_block - 1; i >= 0; i--) {
+        d->free_slots[d->n_free++] = (uint32_t) (d->n_slots + i);
+    }
+    d->n_slots += d->per_block;
+
+    qfs_sb_set_available(img, qfs_sb_available(img) - 1);
+
+#ifdef DEBUG
+    fprintf(stderr, "Directory: extension block %d at block %u, %d slots\n",
+            d->n_blocks, block, d->n_slots);
+#endif
+
+    return QFS_OK;
+}
+
+// Take the lowest free slot, growing the extension if none is left
+static int take_slot(qfs_dir_t *d) {
+    // The extension has to be made while a root slot is left to hold it,
+    // if that fails the last slot still takes the file
+    if (d->n_free == 0 || (d->n_free == 1 && d->ext_slot < 0)) {
+        int err = grow(d);
+        if (err != QFS_OK && d->n_free == 0) {
+            return err;
+        }
+    }
+
+    int slot = (int) d->free_slots[--d->n_free];
+    memset(&d->entries[slot], 0, sizeof(direntry_t));
+    return slot;
+}
+
+// Put a slot back on the free stack, counted if it is in the root table
+static void give_slot(qfs_dir_t *d, int slot) {
+    d->entries[slot].filename[0] = '\0';
+    d->free_slots[d->n_free++] = (uint32_t) slot;
+    qfs_dir_touch(d, slot);
+
+    if (slot < d->n_root) {
+        d->img->sb->available_direntries++;
+    }
+}
+
+int qfs_dir_insert(qfs_dir_t *d, const char *name) {
+    int li, pos;
+
+    index_seek(d, name, &li, &pos);
+
+    int at = li, at_pos = pos;
+    index_normalize(d, &at, &at_pos);
+    if (index_match(d, at, at_pos, name) >= 0) {
+        return QFS_EEXIST;
+    }
+
+    int slot = take_slot(d);
+    if (slot < 0) {
+        return slot;
+    }
+    qfs_dir_set_name(&d->entries[slot], name);
+
+    if (index_add(d, li, pos, (uint32_t) slot) != QFS_OK) {
+        d->entries[slot].filename[0] = '\0';
+        d->n_free++;
+        return QFS_ESYS;
+    }
+
+    qfs_dir_touch(d, slot);
+    if (slot < d->n_root) {
+        d->img->sb->available_direntries--;
+    }
+    return slot;
+}
+
+int qfs_dir_claim(qfs_dir_t *d) {
+    int slot = take_slot(d);
+    if (slot < 0) {
+        return slot;
+    }
+
+    qfs_dir_touch(d, slot);
+    if (slot < d->n_root) {
+        d->img->sb->available_direntries--;
+    }
+    return slot;
+}
+
+void qfs_dir_release(qfs_dir_t *d, int slot) {
+    give_slot(d, slot);
+}
+
+void qfs_dir_remove(qfs_dir_t *d, int slot) {
+    // Only fsck_qfs drops the extension, when its chain is gone. The files
+    // in it go too and their blocks become orphans.
+    if (slot == d->ext_slot) {
+        d->entries[slot].filename[0] = '\0';
+        qfs_dir_touch(d, slot);
+        d->ext_slot = -1;
+        d->n_blocks = 0;
+        d->n_slots = d->n_root;
+        d->img->sb->available_direntries++;
+        build_index(d);
+        return;
+    }
+
+    // A hash entry taken out from under the dedup index (fsck_qfs) means
+    // the index has to be loaded again
+    if ((d->entries[slot].permissions & QFS_TYPE_MASK) == QFS_TYPE_HASH) {
+        qfs_dedup_forget(d);
+    } else {
+        index_del(d, (uint32_t) slot);
+    }
+
+    // Free entry identified by empty filename
+    give_slot(d, slot);
+}
+
+int qfs_dir_listing(const qfs_dir_t *d, direntry_t *out) {
+    int n = 0;
+
+    if (d->ext_slot >= 0) {
+        out[n++] = d->entries[d->ext_slot];
+    }
+    for (int l = 0; l < d->n_leaves; l++) {
+        for (int i = 0; i < d->leaves[l]->n; i++) {
+            out[n++] = d->entries[d->leaves[l]->slots[i]];
+        }
+    }
+    return n;
+}
+
+uint32_t qfs_dir_ext_block(const qfs_dir_t *d, int slot, uint32_t *offset) {
+    int e = slot - d->n_root;
+
+    // Entries follow the busy byte
+    *offset = 1 + (uint32_t) (e % d->per_block) * sizeof(direntry_t);
+    return d->blocks[e / d->per_block];
+}
+
+int qfs_dir_commit(qfs_dir_t *d, qfs_image_t *img) {
+    int written = 0;
+
+    for (int w = 0; w < (d->cap + 63) / 64; w++) {
+        uint64_t bits = d->dirty[w];
+
+        while (bits) {
+            int slot = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            // Left over from a dropped extension
+            if (slot >= d->n_slots) {
+                continue;
+            }
+
+            if (qfs_dir_store_slot(d, img, slot) == QFS_OK) {
+                written++;
+            }
+        }
+
+        d->dirty[w] = 0;
+    }
+
+    return written;
+}
+
+int qfs_dir_store_slot(const qfs_dir_t *d, qfs_image_t *img, int slot) {
+    if (slot < d->n_root) {
+        memcpy(&img->dir[slot], &d->entries[slot], sizeof(direntry_t));
+        return QFS_OK;
+    }
+
+    uint32_t offset;
+    uint32_t block = qfs_dir_ext_block(d, slot, &offset);
+    uint8_t *p = qfs_block_get(img, block, QFS_BLK_WRITE);
+    if (!p) {
+        return QFS_ESYS;
+    }
+    memcpy(p + offset, &d->entries[slot], sizeof(direntry_t));
+    qfs_block_put(img, block);
+    return QFS_OK;
+}
+
+void qfs_dir_set_name(direntry_t *entry, const char *name) {
+    strncpy(entry->filename, name, QFS_NAME_MAX);
+    // Ensure null termination
+    entry->filename[QFS_NAME_MAX] = '\0';
+}
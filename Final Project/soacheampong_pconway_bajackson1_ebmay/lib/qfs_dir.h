@@ -0,0 +1,138 @@
+/*
+**
+** Sorted directory index (libqfs)
+**
+** The 255-entry root table is copied out of the image in one go and
+** indexed by filename in a two-level sorted index: an array of leaves,
+** each holding up to QFS_DIR_LEAF slot numbers in name order. Lookup,
+** insert and remove are O(log n) and listing in name order is a walk of
+** the leaves. Changed slots are written back by qfs_dir_commit().
+**
+** When the root table is full the directory grows into data blocks. The
+** extension is stored as a file in the root table, marked with the
+** QFS_TYPE_DIR file type, whose blocks each hold payload / 32 more
+** entries; tools that predate it see an ordinary file named ".". Slots
+** 0 to 254 are the root table and higher slots are the extension, in
+** chain order. The extension never shrinks.
+**
+** Slots can also be claimed outside the name index, for the hidden hash
+** entries of the dedup index (see qfs_dedup.h).
+**
+** Usage: #include "qfs_dir.h"
+**
+*/
+
+#ifndef QFS_DIR_H
+#define QFS_DIR_H
+
+#include <stdint.h>
+#include "qfs_image.h"
+
+// Slots per leaf of the sorted index
+#define QFS_DIR_LEAF  128
+
+// Name of the root entry that holds the extension
+#define QFS_DIR_EXT_NAME  "."
+
+// Longest filename that fits in a direntry_t (plus NULL terminator)
+#define QFS_NAME_MAX  (sizeof(((direntry_t *) 0)->filename) - 1)
+
+typedef struct qfs_dir_leaf {
+    int      n;                      // Slots in use
+    uint32_t slots[QFS_DIR_LEAF];    // Sorted by filename
+} qfs_dir_leaf_t;
+
+typedef struct qfs_dir {
+    qfs_image_t    *img;             // Image the directory belongs to
+    direntry_t     *entries;         // Private copy: root table, then the extension
+    qfs_dir_leaf_t **leaves;         // Sorted index, leaves in name order
+    int             n_leaves;
+    int             leaves_cap;
+    uint32_t       *free_slots;      // Stack of free slots, lowest on top
+    int             n_free;          // Number of free slots
+    int             n_slots;         // Usable slots (root plus extension)
+    int             n_root;          // Root table slots (total_direntries)
+    int             n_used;          // Files in the index
+    int             cap;             // Slots allocated in entries and free_slots
+    uint64_t       *dirty;           // Slots to write back
+    int             ext_slot;        // Root slot holding the extension, -1 if none
+    uint32_t       *blocks;          // Extension blocks in chain order
+    int             n_blocks;
+    int             per_block;       // Extension slots per block
+    struct qfs_blockmap **maps;      // Cached block maps by slot (see qfs_map.h)
+    struct qfs_dedup *dedup;         // Dedup index, loaded on first use (see qfs_dedup.h)
+} qfs_dir_t;
+
+// Function to get the image's directory index, loading it on first use (NULL on failure)
+qfs_dir_t *qfs_get_dir(qfs_image_t *img);
+
+// Function to load and index the root table and extension of an image,
+// returns QFS_OK or QFS_ESYS
+int qfs_dir_load(qfs_dir_t *d, qfs_image_t *img);
+
+// Function to release the memory of a directory index
+void qfs_dir_destroy(qfs_dir_t *d);
+
+// Function to find a file, returns its slot or -1
+int qfs_dir_lookup(const qfs_dir_t *d, const char *name);
+
+// Function to claim a free slot for a new name, growing the extension by
+// a block if every slot is taken. Returns the slot or QFS_EEXIST,
+// QFS_ENODIR, QFS_ENOSPC or QFS_ESYS. The entry is cleared with only the
+// name set.
+int qfs_dir_insert(qfs_dir_t *d, const char *name);
+
+// Function to remove a file's entry (only the first filename byte is cleared)
+void qfs_dir_remove(qfs_dir_t *d, int slot);
+
+// Function to claim a free slot that stays out of the name index, growing
+// the extension the same way as qfs_dir_insert(). Returns the slot, with
+// the entry cleared, or an error code.
+int qfs_dir_claim(qfs_dir_t *d);
+
+// Function to give back a slot from qfs_dir_claim()
+void qfs_dir_release(qfs_dir_t *d, int slot);
+
+// Function to copy the entries list_information prints into out (room for
+// d->n_used + 1): the extension's root entry if there is one, then every
+// file in filename order. Returns the number copied.
+int qfs_dir_listing(const qfs_dir_t *d, direntry_t *out);
+
+// Function to write changed slots back to the image, returns slots written
+int qfs_dir_commit(qfs_dir_t *d, qfs_image_t *img);
+
+// Function to write one slot back to its home location whether or not it
+// is marked changed, returns QFS_OK or QFS_ESYS
+int qfs_dir_store_slot(const qfs_dir_t *d, qfs_image_t *img, int slot);
+
+// Function to find where an extension slot lives: its block, and the byte
+// offset of the entry in that block
+uint32_t qfs_dir_ext_block(const qfs_dir_t *d, int slot, uint32_t *offset);
+
+// Copy a name into a filename field, truncating it to fit
+void qfs_dir_set_name(direntry_t *entry, const char *name);
+
+// Function to drop the cached block map of a slot
+void qfs_dir_drop_map(qfs_dir_t *d, int slot);
+
+// Mark a slot as changed after editing its entry in place, its block map
+// no longer describes the file
+static inline void qfs_dir_touch(qfs_dir_t *d, int slot) {
+    d->dirty[slot >> 6] |= 1ULL << (slot & 63);
+    if (d->maps[slot]) {
+        qfs_dir_drop_map(d, slot);
+    }
+}
+
+// Test whether a slot was changed since the last commit
+static inline int qfs_dir_is_dirty(const qfs_dir_t *d, int slot) {
+    return (d->dirty[slot >> 6] >> (slot & 63)) & 1;
+}
+
+// Test whether a slot holds a file (used, and not the extension or a hash entry)
+static inline int qfs_dir_is_file(const qfs_dir_t *d, int slot) {
+    return d->entries[slot].filename[0] != '\0' && slot != d->ext_slot
+        && (d->entries[slot].permissions & QFS_TYPE_MASK) != QFS_TYPE_HASH;
+}
+
+#endif // QFS_DIR_H
@@ -0,0 +1,968 @@
+/*
+** File data helpers (libqfs)
+**
+** Data is staged in large reads from the source and laid down a whole
+** run of blocks at a time, with the chain pointers filled in as each
+** block is written rather than patched afterwards.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "qfs_file.h"
+#include "qfs_dir.h"
+#include "qfs_chain.h"
+#include "qfs_map.h"
+#include "qfs_lz.h"
+#include "qfs_dedup.h"
+
+// Blocks staged per read from the source file
+#define STAGE_BLOCKS 256
+
+// Bytes read at a time when hashing or comparing sources
+#define COMPARE_BYTES  (1 << 20)
+
+int qfs_write_extents(qfs_image_t *img, const qfs_extent_t *ext, int n_ext,
+                      FILE *src, uint32_t size) {
+    uint8_t *stage = malloc((size_t) STAGE_BLOCKS * img->payload);
+    if (!stage) {
+        return QFS_ESYS;
+    }
+
+    uint32_t remaining = size;
+
+    for (int e = 0; e < n_ext && remaining > 0; e++) {
+        uint32_t block = ext[e].start;
+        uint32_t left_in_run = ext[e].count;
+        QFS_STAT_ADD(seeks, 1);
+
+        while (left_in_run > 0 && remaining > 0) {
+            // Read as much of this run as fits in the staging buffer at once
+            uint32_t batch = left_in_run < STAGE_BLOCKS ? left_in_run : STAGE_BLOCKS;
+            size_t want = (size_t) batch * img->payload;
+            if (want > remaining) {
+                want = remaining;
+            }
+
+            // One read per batch, the stdio buffer is smaller than a batch
+            QFS_STAT_ADD(syscalls, 1);
+            if (fread(stage, 1, want, src) != want) {
+                free(stage);
+                return QFS_ESYS;
+            }
+
+            // Lay the batch down block by block: data, then next pointer. The
+            // busy bytes go out with the bitmap on qfs_commit()
+            const uint8_t *p = stage;
+            size_t left = want;
+
+            while (left > 0) {
+                uint32_t chunk = left > img->payload ? img->payload : (uint32_t) left;
+                uint8_t *dst = qfs_block_get(img, block, QFS_BLK_WRITE);
+                if (!dst) {
+                    free(stage);
+                    return QFS_ESYS;
+                }
+
+                memcpy(dst + 1, p, chunk);
+                qfs_block_put(img, block);
+                QFS_STAT_ADD(bytes_written, chunk);
+
+                p += chunk;
+                left -= chunk;
+                remaining -= chunk;
+                left_in_run--;
+
+                // Link to the next block in the run or the start of the next run
+                if (remaining > 0) {
+                    uint32_t next = left_in_run > 0 ? block + 1 : ext[e + 1].start;
+                    qfs_set_next_block(img, block, next);
+                }
+
+                block++;
+            }
+        }
+    }
+
+    free(stage);
+    return QFS_OK;
+}
+
+int qfs_writev_all(int fd, struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t done = writev(fd, iov, n);
+        QFS_STAT_ADD(syscalls, 1);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return QFS_ESYS;
+        }
+
+        // Skip the vectors that went out completely
+        while (n > 0 && (size_t) done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+
+    return QFS_OK;
+}
+
+static int read_to_fd(const qfs_image_t *img, const direntry_t *entry, int fd) {
+    struct iovec iov[QFS_IOV_BATCH];
+    uint32_t pinned[QFS_IOV_BATCH];    // Blocks behind iov, unpinned once written
+    int n_iov = 0;
+
+    qfs_chain_t chain;
+    qfs_extent_t run;
+    uint32_t bytes;
+
+    qfs_chain_init(&chain, img, qfs_entry_start(entry, img->version), entry->file_size);
+
+    while ((bytes = qfs_chain_next_run(&chain, &run)) > 0) {
+        // One vector per block payload in the run
+        for (uint32_t b = 0; b < run.count; b++) {
+            uint32_t chunk = bytes > img->payload ? img->payload : bytes;
+
+            uint8_t *p = qfs_block_get(img, run.start + b, QFS_BLK_READ);
+            if (!p) {
+                qfs_blocks_put(img, pinned, n_iov);
+                return QFS_ESYS;
+            }
+
+            pinned[n_iov] = run.start + b;
+            QFS_STAT_ADD(bytes_read, chunk);
+            iov[n_iov].iov_base = p + 1;
+            iov[n_iov].iov_len = chunk;
+            n_iov++;
+            bytes -= chunk;
+
+            if (n_iov == QFS_IOV_BATCH) {
+                int err = qfs_writev_all(fd, iov, n_iov);
+                qfs_blocks_put(img, pinned, n_iov);
+                if (err != QFS_OK) {
+                    return QFS_ESYS;
+                }
+                n_iov = 0;
+            }
+        }
+    }
+
+    if (n_iov > 0) {
+        int err = qfs_writev_all(fd, iov, n_iov);
+        qfs_blocks_put(img, pinned, n_iov);
+        if (err != QFS_OK) {
+            return QFS_ESYS;
+        }
+    }
+
+    return chain.error;
+}
+
+// Decompress a whole file through a map of its chain
+static int read_lz_to_fd(const qfs_image_t *img, const direntry_t *entry, int fd) {
+    int64_t size = qfs_file_size(img, entry);
+    if (size < 0) {
+        return (int) size;
+    }
+
+    qfs_blockmap_t *map;
+    int err = qfs_blockmap_build(img, entry, &map);
+    if (err != QFS_OK) {
+        return err;
+    }
+
+    err = qfs_blockmap_read_to_fd(img, entry, map, 0, (uint32_t) size, fd);
+    qfs_blockmap_free(map);
+    return err;
+}
+
+int qfs_read_to_fd(const qfs_image_t *img, const direntry_t *entry, int fd) {
+    uint64_t t0 = qfs_phase_begin();
+    int err = (entry->permissions & QFS_TYPE_MASK) == QFS_TYPE_LZ ? read_lz_to_fd(img, entry, fd)
+                                                                 : read_to_fd(img, entry, fd);
+    qfs_phase_end(QFS_PHASE_DATA, t0);
+    return err;
+}
+
+int64_t qfs_file_size(const qfs_image_t *img, const direntry_t *entry) {
+    if ((entry->permissions & QFS_TYPE_MASK) != QFS_TYPE_LZ) {
+        return entry->file_size;
+    }
+
+    // The header is at the start of the first block
+    uint32_t start = qfs_entry_start(entry, img->version);
+    if (entry->file_size < sizeof(qfs_lz_hdr_t) || start >= img->total_blocks) {
+        return QFS_EFORMAT;
+    }
+
+    const uint8_t *p = qfs_block_get(img, start, QFS_BLK_READ);
+    if (!p) {
+        return QFS_ESYS;
+    }
+    qfs_lz_hdr_t hdr;
+    memcpy(&hdr, p + 1, sizeof(hdr));
+    qfs_block_put(img, start);
+
+    if (qfs_lz_check_hdr(&hdr, entry->file_size) != QFS_OK) {
+        return QFS_EFORMAT;
+    }
+    return hdr.size;
+}
+
+// Mark a request as failed, keeping errno for system errors
+static void req_fail(qfs_write_req_t *req, int err) {
+    req->status = err;
+    req->sys_errno = (err == QFS_ESYS) ? errno : 0;
+}
+
+// Open the bytes a request stores, from memory or the host file
+static FILE *open_source(const qfs_write_req_t *req) {
+    return req->data ? fmemopen((void *) req->data, req->size, "rb") : fopen(req->path, "rb");
+}
+
+// Hash the bytes a request stores, seeded with the file type so plain and
+// compressed files never match
+static int hash_source(const qfs_write_req_t *req, uint64_t *hash) {
+    qfs_hasher_t h;
+    qfs_hash_init(&h, req->type);
+
+    if (req->data) {
+        qfs_hash_update(&h, req->data, req->size);
+        *hash = qfs_hash_final(&h);
+        return QFS_OK;
+    }
+
+    FILE *src = fopen(req->path, "rb");
+    uint8_t *buf = malloc(COMPARE_BYTES);
+    int err = src && buf ? QFS_OK : QFS_ESYS;
+
+    for (uint32_t left = req->size; err == QFS_OK && left > 0; ) {
+        size_t want = left < COMPARE_BYTES ? left : COMPARE_BYTES;
+        QFS_STAT_ADD(syscalls, 1);
+        if (fread(buf, 1, want, src) != want) {
+            err = QFS_ESYS;
+            break;
+        }
+        qfs_hash_update(&h, buf, want);
+        left -= (uint32_t) want;
+    }
+
+    if (src) {
+        fclose(src);
+    }
+    free(buf);
+    *hash = qfs_hash_final(&h);
+    return err;
+}
+
+// Compare the bytes a request stores with a chain on the image, returns
+// 1 if they match, 0 if not, or an error code
+static int same_as_chain(const qfs_image_t *img, uint32_t start, const qfs_write_req_t *req) {
+    FILE *src = open_source(req);
+    uint8_t *buf = malloc(img->payload);
+    if (!src || !buf) {
+        if (src) {
+            fclose(src);
+        }
+        free(buf);
+        return QFS_ESYS;
+    }
+
+    qfs_chain_t chain;
+    qfs_extent_t run;
+    uint32_t bytes, seen = 0;
+    int same = 1;
+
+    qfs_chain_init(&chain, img, start, req->size);
+
+    while (same && (bytes = qfs_chain_next_run(&chain, &run)) > 0) {
+        for (uint32_t b = run.start; same && bytes > 0; b++) {
+            uint32_t chunk = bytes > img->payload ? img->payload : bytes;
+            const uint8_t *p = qfs_block_get(img, b, QFS_BLK_READ);
+
+            same = p && fread(buf, 1, chunk, src) == chunk && memcmp(p + 1, buf, chunk) == 0;
+            if (p) {
+                qfs_block_put(img, b);
+                QFS_STAT_ADD(bytes_read, chunk);
+            }
+            bytes -= chunk;
+            seen += chunk;
+        }
+    }
+
+    fclose(src);
+    free(buf);
+    return same && chain.error == QFS_OK && seen == req->size;
+}
+
+// Compare the bytes two requests of the same size store, returns 1 if
+// they match, 0 if not, or an error code
+static int same_as_req(const qfs_write_req_t *a, const qfs_write_req_t *b) {
+    if (a->data && b->data) {
+        return memcmp(a->data, b->data, a->size) == 0;
+    }
+
+    FILE *fa = open_source(a), *fb = open_source(b);
+    uint8_t *buf = malloc(2 * (size_t) COMPARE_BYTES);
+    int same = fa && fb && buf ? 1 : QFS_ESYS;
+
+    for (uint32_t left = a->size; same == 1 && left > 0; ) {
+        size_t want = left < COMPARE_BYTES ? left : COMPARE_BYTES;
+        if (fread(buf, 1, want, fa) != want || fread(buf + COMPARE_BYTES, 1, want, fb) != want) {
+            same = QFS_ESYS;
+            break;
+        }
+        same = memcmp(buf, buf + COMPARE_BYTES, want) == 0;
+        left -= (uint32_t) want;
+    }
+
+    if (fa) {
+        fclose(fa);
+    }
+    if (fb) {
+        fclose(fb);
+    }
+    free(buf);
+    return same;
+}
+
+// Find indexed content, on the image or planned earlier in the batch,
+// with the same bytes as a request. Returns its record, QFS_ENOENT if
+// there is none, or an error code.
+static int find_duplicate(const qfs_image_t *img, const qfs_dedup_t *dd,
+                          const qfs_write_req_t *reqs, const qfs_write_req_t *req, uint64_t hash) {
+    for (int r = qfs_dedup_find(dd, hash, -1); r >= 0; r = qfs_dedup_find(dd, hash, r)) {
+        const qfs_dedup_rec_t *rec = &dd->recs[r];
+        if (rec->size != req->size) {
+            continue;
+        }
+
+        int same = rec->req >= 0 ? same_as_req(&reqs[rec->req], req)
+                                 : same_as_chain(img, rec->start, req);
+        if (same != 0) {
+            return same > 0 ? r : same;
+        }
+    }
+    return QFS_ENOENT;
+}
+
+// Index the new content of a request, with a hash entry claimed now and
+// filled in when the file is committed. Without a free slot the file is
+// still written, it just cannot be shared.
+static void index_content(qfs_dir_t *dir, qfs_dedup_t *dd, qfs_write_req_t *req, int i, uint64_t hash) {
+    int slot = qfs_dir_claim(dir);
+    if (slot < 0) {
+        return;
+    }
+
+    int r = qfs_dedup_add(dd, hash, req->ext[0].start, req->size, slot);
+    if (r < 0) {
+        qfs_dir_release(dir, slot);
+        return;
+    }
+    dd->recs[r].req = i;
+    req->dedup_rec = r;
+}
+
+// Order requests by their first block so data is streamed front to back
+static int req_cmp_start(const void *a, const void *b) {
+    const qfs_write_req_t *x = *(qfs_write_req_t * const *) a;
+    const qfs_write_req_t *y = *(qfs_write_req_t * const *) b;
+    uint32_t xs = x->n_ext > 0 ? x->ext[0].start : 0;
+    uint32_t ys = y->n_ext > 0 ? y->ext[0].start : 0;
+    return xs < ys ? -1 : (xs > ys);
+}
+
+int qfs_write_files(qfs_image_t *img, qfs_write_req_t *reqs, int n, int policy) {
+    qfs_bitmap_t *bm = qfs_get_bitmap(img);
+    qfs_dir_t *dir = qfs_get_dir(img);
+    qfs_write_req_t **order = malloc((n ? n : 1) * sizeof(qfs_write_req_t *));
+    qfs_dedup_t *dd = NULL;
+    for (int i = 0; i < n && !dd; i++) {
+        dd = reqs[i].dedup ? qfs_get_dedup(img) : NULL;
+        if (reqs[i].dedup && !dd) {
+            bm = NULL;
+        }
+    }
+    if (!bm || !dir || !order) {
+        for (int i = 0; i < n; i++) {
+            req_fail(&reqs[i], QFS_ESYS);
+        }
+        free(order);
+        return 0;
+    }
+
+    // Planning pass: size every file and reserve its slot and blocks
+    uint64_t t0 = qfs_phase_begin();
+
+    for (int i = 0; i < n; i++) {
+        qfs_write_req_t *req = &reqs[i];
+        req->status = QFS_OK;
+        req->sys_errno = 0;
+        req->slot = -1;
+        req->ext = NULL;
+        req->n_ext = 0;
+        req->shared = 0;
+        req->dedup_rec = -1;
+
+        if (!req->data) {
+            struct stat st;
+            if (stat(req->path, &st) != 0) {
+                req_fail(req, QFS_ESYS);
+                continue;
+            }
+            if (st.st_size > UINT32_MAX) {
+                req_fail(req, QFS_ENOSPC);
+                continue;
+            }
+            req->size = (uint32_t) st.st_size;
+        }
+        if (req->size == 0) {
+            req_fail(req, QFS_EEMPTY);
+            continue;
+        }
+
+        // Content already stored takes a directory slot and no blocks
+        uint64_t hash = 0;
+        if (req->dedup) {
+            int r = hash_source(req, &hash);
+            if (r == QFS_OK) {
+                r = find_duplicate(img, dd, reqs, req, hash);
+            }
+            if (r < 0 && r != QFS_ENOENT) {
+                req_fail(req, r);
+                continue;
+            }
+            if (r >= 0) {
+                int slot = qfs_dir_insert(dir, req->name ? req->name : req->path);
+                if (slot < 0) {
+                    req_fail(req, slot);
+                    continue;
+                }
+                req->slot = slot;
+                req->dedup_rec = r;
+                req->shared = 1;
+                continue;
+            }
+        }
+
+        uint32_t blocks = qfs_blocks_for(img, req->size);
+        if (blocks > bm->free_count) {
+            req_fail(req, QFS_ENOSPC);
+            continue;
+        }
+
+        req->ext = malloc(blocks * sizeof(qfs_extent_t));
+        if (!req->ext) {
+            req_fail(req, QFS_ESYS);
+            continue;
+        }
+
+        // Claim the name: catches names already on the image or earlier in the batch
+        int slot = qfs_dir_insert(dir, req->name ? req->name : req->path);
+        if (slot < 0) {
+            req_fail(req, slot);
+            continue;
+        }
+        req->slot = slot;
+
+        req->n_ext = qfs_bitmap_alloc_extents(bm, blocks, policy, req->ext, blocks);
+        if (req->n_ext < 0) {
+            req_fail(req, req->n_ext);
+            req->n_ext = 0;
+            continue;
+        }
+
+        if (req->dedup) {
+            index_content(dir, dd, req, i, hash);
+        }
+    }
+
+    qfs_phase_end(QFS_PHASE_ALLOC, t0);
+
+    // Stream the data in allocation order so the image is written sequentially
+    t0 = qfs_phase_begin();
+    int n_order = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (reqs[i].status == QFS_OK && !reqs[i].shared) {
+            order[n_order++] = &reqs[i];
+        }
+    }
+    qsort(order, n_order, sizeof(qfs_write_req_t *), req_cmp_start);
+
+    for (int i = 0; i < n_order; i++) {
+        qfs_write_req_t *req = order[i];
+
+        FILE *src = open_source(req);
+        int err = src ? qfs_write_extents(img, req->ext, req->n_ext, src, req->size) : QFS_ESYS;
+        if (err != QFS_OK) {
+            req_fail(req, err);
+        }
+        if (src) {
+            fclose(src);
+        }
+    }
+    free(order);
+    qfs_phase_end(QFS_PHASE_DATA, t0);
+
+    // A file sharing a chain from this batch fails with the file writing it
+    for (int i = 0; i < n; i++) {
+        qfs_write_req_t *req = &reqs[i];
+        if (req->status == QFS_OK && req->shared && dd->recs[req->dedup_rec].req >= 0) {
+            const qfs_write_req_t *owner = &reqs[dd->recs[req->dedup_rec].req];
+            if (owner->status != QFS_OK) {
+                req->status = owner->status;
+                req->sys_errno = owner->sys_errno;
+            }
+        }
+    }
+
+    // Commit: directory entries and the superblock counters, once
+    int written = 0;
+    uint32_t blocks_used = 0;
+
+    for (int i = 0; i < n; i++) {
+        qfs_write_req_t *req = &reqs[i];
+
+        if (req->status != QFS_OK) {
+            // Hand back anything reserved for a file that was not written
+            if (req->slot >= 0) {
+                qfs_dir_remove(dir, req->slot);
+                req->slot = -1;
+            }
+            if (req->dedup_rec >= 0 && !req->shared) {
+                qfs_dir_release(dir, dd->recs[req->dedup_rec].slot);
+                qfs_dedup_del(dd, req->dedup_rec);
+            }
+            req->dedup_rec = -1;
+            req->shared = 0;
+            qfs_bitmap_release(bm, req->ext, req->n_ext);
+            free(req->ext);
+            req->ext = NULL;
+            continue;
+        }
+
+        // Name was set when the slot was claimed
+        direntry_t *entry = &dir->entries[req->slot];
+        entry->permissions = req->type;
+
+        if (req->shared) {
+            qfs_dedup_rec_t *rec = &dd->recs[req->dedup_rec];
+            entry->file_size = rec->size;
+            qfs_entry_set_start(entry, img->version, rec->start);
+            qfs_dir_touch(dir, req->slot);
+            rec->refs++;
+            written++;
+            continue;
+        }
+
+        entry->file_size = req->size;
+        qfs_entry_set_start(entry, img->version, req->ext[0].start);
+        qfs_dir_touch(dir, req->slot);
+
+        // The hash entry goes in with the first file holding the content
+        if (req->dedup_rec >= 0) {
+            qfs_dedup_rec_t *rec = &dd->recs[req->dedup_rec];
+            qfs_dedup_set_entry(img, rec, &dir->entries[rec->slot]);
+            qfs_dir_touch(dir, rec->slot);
+            rec->req = -1;
+            rec->refs++;
+        }
+
+        blocks_used += qfs_blocks_for(img, req->size);
+        written++;
+
+        free(req->ext);
+        req->ext = NULL;
+    }
+
+    // The directory keeps available_direntries itself
+    qfs_sb_set_available(img, qfs_sb_available(img) - blocks_used);
+
+    return written;
+}
+
+int qfs_delete_file(qfs_image_t *img, int slot) {
+    qfs_dir_t *dir = qfs_get_dir(img);
+    qfs_bitmap_t *bm = qfs_get_bitmap(img);
+    qfs_dedup_t *dd = qfs_get_dedup(img);
+    if (!dir || !bm || !dd) {
+        return QFS_ESYS;
+    }
+
+    uint64_t t0 = qfs_phase_begin();
+    direntry_t entry = dir->entries[slot];
+
+    // Mark free directory entry (first char of filename set to '\0' on commit)
+    qfs_dir_remove(dir, slot);
+
+    // A shared chain stays until the last file using it goes, and then
+    // takes its hash entry with it
+    int r = dd->n_recs > 0 ? qfs_dedup_find_start(dd, qfs_entry_start(&entry, img->version)) : -1;
+    if (r >= 0 && dd->recs[r].size == entry.file_size) {
+        if (dd->recs[r].refs > 1) {
+            dd->recs[r].refs--;
+            qfs_phase_end(QFS_PHASE_ALLOC, t0);
+            return QFS_OK;
+        }
+        qfs_dir_release(dir, dd->recs[r].slot);
+        qfs_dedup_del(dd, r);
+    }
+
+    // Free blocks one contiguous run at a time
+    qfs_chain_t chain;
+    qfs_extent_t run;
+
+    uint32_t freed = 0;
+
+    qfs_chain_init(&chain, img, qfs_entry_start(&entry, img->version), entry.file_size);
+
+    while (qfs_chain_next_run(&chain, &run) > 0) {
+        for (uint32_t b = run.start; b < run.start + run.count; b++) {
+            // Mark block as free, count it for the superblock if it was busy
+            if (qfs_bitmap_test(bm, b)) {
+                qfs_bitmap_set(bm, b, 0);
+                freed++;
+            }
+        }
+    }
+
+    qfs_sb_set_available(img, qfs_sb_available(img) + freed);
+
+    qfs_phase_end(QFS_PHASE_ALLOC, t0);
+
+    // A corrupt chain stops the walk instead of freeing blocks outside the image
+    return chain.error;
+}
+
+// A compressed file would have to be packed again, and a chain other
+// files share through the dedup index cannot change under them. A chain
+// only this file uses can, but its hash entry must go once it has.
+int qfs_prepare_change(qfs_image_t *img, int slot, int *rec) {
+    qfs_dir_t *dir = qfs_get_dir(img);
+    qfs_dedup_t *dd = qfs_get_dedup(img);
+    if (!dir || !dd) {
+        return QFS_ESYS;
+    }
+    if (slot < 0 || slot >= dir->n_slots || !qfs_dir_is_file(dir, slot)) {
+        return QFS_EINVAL;
+    }
+
+    const direntry_t *entry = &dir->entries[slot];
+    if ((entry->permissions & QFS_TYPE_MASK) != QFS_TYPE_FILE) {
+        return QFS_ECOMPRESSED;
+    }
+
+    *rec = qfs_dedup_of(dd, img, entry);
+    if (*rec >= 0 && dd->recs[*rec].refs > 1) {
+        return QFS_ESHARED;
+    }
+    return QFS_OK;
+}
+
+void qfs_finish_change(qfs_image_t *img, int rec) {
+    qfs_dedup_t *dd = qfs_get_dedup(img);
+    if (rec >= 0 && dd) {
+        qfs_dir_release(qfs_get_dir(img), dd->recs[rec].slot);
+        qfs_dedup_del(dd, rec);
+    }
+}
+
+int qfs_shared_files(qfs_image_t *img, int slot) {
+    qfs_dir_t *dir = qfs_get_dir(img);
+    qfs_dedup_t *dd = qfs_get_dedup(img);
+    if (!dir || !dd || slot < 0 || slot >= dir->n_slots || !qfs_dir_is_file(dir, slot)) {
+        return 0;
+    }
+
+    int r = qfs_dedup_of(dd, img, &dir->entries[slot]);
+    return r >= 0 ? dd->recs[r].refs : 0;
+}
+
+// Reserve need blocks to follow tail, straight after it if they are free
+static int reserve_after(qfs_bitmap_t *bm, uint32_t tail, uint32_t need,
+                         qfs_extent_t *ext) {
+    uint32_t n = 0;
+    if (tail != QFS_NO_BLOCK && tail + (uint64_t) need < bm->nblocks) {
+        while (n < need && !qfs_bitmap_test(bm, tail + 1 + n)) {
+            n++;
+        }
+    }
+
+    if (n == need) {
+        for (uint32_t b = tail + 1; b <= tail + need; b++) {
+            qfs_bitmap_set(bm, b, 1);
+        }
+        ext[0].start = tail + 1;
+        ext[0].count = need;
+        return 1;
+    }
+    return qfs_bitmap_alloc_extents(bm, need, QFS_ALLOC_BEST_FIT, ext, (int) need);
+}
+
+// Append to a file that qfs_prepare_change() accepted
+static int append_data(qfs_image_t *img, int slot, const void *data, uint32_t len) {
+    int err = QFS_OK;
+    qfs_dir_t *dir = qfs_get_dir(img);
+    qfs_bitmap_t *bm = qfs_get_bitmap(img);
+    if (!bm) {
+        return QFS_ESYS;
+    }
+
+    direntry_t *entry = &dir->entries[slot];
+    uint32_t size = entry->file_size;
+    if (len == 0) {
+        return QFS_OK;
+    }
+    if (len > UINT32_MAX - size) {
+        return QFS_EINVAL;
+    }
+
+    // The tail block comes from the cached map, not a walk of the chain
+    const qfs_blockmap_t *map = NULL;
+    uint32_t tail = QFS_NO_BLOCK;
+    if (size > 0) {
+        err = qfs_get_blockmap(img, slot, &map);
+        if (err != QFS_OK) {
+            return err;
+        }
+        const qfs_extent_t *last = &map->ext[map->n_ext - 1];
+        tail = last->start + last->count - 1;
+    }
+
+    uint32_t used = size % img->payload;
+    uint32_t fill = size > 0 && used > 0 ? img->payload - used : 0;
+    if (fill > len) {
+        fill = len;
+    }
+    uint32_t rest = len - fill;
+    uint32_t need = qfs_blocks_for(img, rest);
+
+    uint64_t t0 = qfs_phase_begin();
+    qfs_extent_t *ext = NULL;
+    int n_ext = 0;
+
+    if (need > 0) {
+        if (need > bm->free_count) {
+            qfs_phase_end(QFS_PHASE_ALLOC, t0);
+            return QFS_ENOSPC;
+        }
+        ext = malloc((size_t) need * sizeof(qfs_extent_t));
+        n_ext = ext ? reserve_after(bm, tail, need, ext) : QFS_ESYS;
+        if (n_ext < 0) {
+            free(ext);
+            qfs_phase_end(QFS_PHASE_ALLOC, t0);
+            return n_ext;
+        }
+    }
+    qfs_phase_end(QFS_PHASE_ALLOC, t0);
+
+    // New blocks first, then the tail's slack: neither is part of the file
+    // until the entry takes the new size
+    t0 = qfs_phase_begin();
+    if (rest > 0) {
+        FILE *src = fmemopen((uint8_t *) data + fill, rest, "rb");
+        err = src ? qfs_write_extents(img, ext, n_ext, src, rest) : QFS_ESYS;
+        if (src) {
+            fclose(src);
+        }
+    }
+    if (err == QFS_OK && fill > 0) {
+        uint8_t *p = qfs_block_get(img, tail, QFS_BLK_WRITE);
+        if (p) {
+            memcpy(p + 1 + used, data, fill);
+            qfs_block_put(img, tail);
+            QFS_STAT_ADD(bytes_written, fill);
+        } else {
+            err = QFS_ESYS;
+        }
+    }
+    qfs_phase_end(QFS_PHASE_DATA, t0);
+
+    if (err != QFS_OK) {
+        qfs_bitmap_release(bm, ext, n_ext);
+        free(ext);
+        return err;
+    }
+
+    // Link the new blocks on, then the entry and counters for qfs_commit()
+    if (n_ext > 0) {
+        if (tail != QFS_NO_BLOCK) {
+            qfs_set_next_block(img, tail, ext[0].start);
+        } else {
+            qfs_entry_set_start(entry, img->version, ext[0].start);
+        }
+    }
+
+    qfs_blockmap_t *grown = qfs_blockmap_resize(map, qfs_blocks_for(img, size), ext, n_ext);
+    entry->file_size = size + len;
+    qfs_dir_touch(dir, slot);
+    if (grown) {
+        qfs_set_blockmap(img, slot, grown);
+    }
+    qfs_sb_set_available(img, qfs_sb_available(img) - need);
+
+    free(ext);
+    return QFS_OK;
+}
+
+int qfs_append_file(qfs_image_t *img, int slot, const void *data, uint32_t len) {
+    int rec;
+    int err = qfs_prepare_change(img, slot, &rec);
+    if (err == QFS_OK) {
+        err = append_data(img, slot, data, len);
+    }
+    if (err == QFS_OK && len > 0) {
+        qfs_finish_change(img, rec);
+    }
+    return err;
+}
+
+// Shrink or grow a file that qfs_prepare_change() accepted
+static int resize_data(qfs_image_t *img, int slot, uint32_t size) {
+    int err;
+    qfs_dir_t *dir = qfs_get_dir(img);
+    qfs_bitmap_t *bm = qfs_get_bitmap(img);
+    if (!bm) {
+        return QFS_ESYS;
+    }
+
+    direntry_t *entry = &dir->entries[slot];
+
+    // Growing is an append of zeros
+    if (size > entry->file_size) {
+        uint8_t *zeros = calloc(size - entry->file_size, 1);
+        if (!zeros) {
+            return QFS_ESYS;
+        }
+        err = append_data(img, slot, zeros, size - entry->file_size);
+        free(zeros);
+        return err;
+    }
+    if (size == entry->file_size) {
+        return QFS_OK;
+    }
+
+    const qfs_blockmap_t *map;
+    err = qfs_get_blockmap(img, slot, &map);
+    if (err != QFS_OK) {
+        return err;
+    }
+
+    // Free only the blocks past the new end, the kept chain is untouched
+    // (its last next_block pointer is bounded by file_size)
+    uint64_t t0 = qfs_phase_begin();
+    uint32_t keep = qfs_blocks_for(img, size);
+    uint32_t freed = 0;
+
+    for (int e = map->n_ext - 1; e >= 0 && map->first[e] + map->ext[e].count > keep; e--) {
+        uint32_t from = map->first[e] < keep ? keep - map->first[e] : 0;
+        for (uint32_t b = map->ext[e].start + from; b < map->ext[e].start + map->ext[e].count; b++) {
+            if (qfs_bitmap_test(bm, b)) {
+                qfs_bitmap_set(bm, b, 0);
+                freed++;
+            }
+        }
+    }
+
+    qfs_blockmap_t *cut = qfs_blockmap_resize(map, keep, NULL, 0);
+    entry->file_size = size;
+    if (size == 0) {
+        qfs_entry_set_start(entry, img->version, 0);
+    }
+    qfs_dir_touch(dir, slot);
+    if (cut) {
+        qfs_set_blockmap(img, slot, cut);
+    }
+    qfs_sb_set_available(img, qfs_sb_available(img) + freed);
+
+    qfs_phase_end(QFS_PHASE_ALLOC, t0);
+    return QFS_OK;
+}
+
+int qfs_truncate_file(qfs_image_t *img, int slot, uint32_t size) {
+    int rec;
+    int err = qfs_prepare_change(img, slot, &rec);
+    if (err != QFS_OK) {
+        return err;
+    }
+
+    uint32_t old_size = img->dirindex->entries[slot].file_size;
+    err = resize_data(img, slot, size);
+    if (err == QFS_OK && size != old_size) {
+        qfs_finish_change(img, rec);
+    }
+    return err;
+}
+
+int64_t qfs_pwrite(qfs_image_t *img, int slot, const void *buf, uint32_t count, uint32_t offset) {
+    int rec;
+    int err = qfs_prepare_change(img, slot, &rec);
+    if (err != QFS_OK) {
+        return err;
+    }
+    if (count > UINT32_MAX - offset) {
+        return QFS_EINVAL;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    // Whatever lands past the end (after zeros up to offset) is appended
+    // first, so a write that runs out of space leaves the file as it was
+    uint32_t size = img->dirindex->entries[slot].file_size;
+    uint32_t inside = offset >= size ? 0 : (count < size - offset ? count : size - offset);
+
+    if (inside < count) {
+        uint32_t gap = offset > size ? offset - size : 0;
+        uint32_t grow = gap + (count - inside);
+        const uint8_t *tail = (const uint8_t *) buf + inside;
+        uint8_t *staged = NULL;
+
+        if (gap > 0) {
+            staged = calloc(grow, 1);
+            if (!staged) {
+                return QFS_ESYS;
+            }
+            memcpy(staged + gap, tail, count - inside);
+            tail = staged;
+        }
+        err = append_data(img, slot, tail, grow);
+        free(staged);
+        if (err != QFS_OK) {
+            return err;
+        }
+    }
+    int changed = inside < count;
+
+    // The map append_data() left cached covers the file as it is now
+    if (inside > 0) {
+        const qfs_blockmap_t *map;
+        err = qfs_get_blockmap(img, slot, &map);
+        if (err == QFS_OK) {
+            uint64_t t0 = qfs_phase_begin();
+            err = qfs_blockmap_write(img, map, offset, inside, buf);
+            qfs_phase_end(QFS_PHASE_DATA, t0);
+            changed = 1;
+        }
+    }
+
+    // The hash entry goes last, once the content may no longer match it
+    // (a block that cannot be read stops the overwrite part way)
+    if (changed) {
+        qfs_finish_change(img, rec);
+    }
+    return err == QFS_OK ? (int64_t) count : err;
+}
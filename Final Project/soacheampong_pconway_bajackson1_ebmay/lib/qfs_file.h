@@ -0,0 +1,111 @@
+/*
+**
+** File data helpers (libqfs)
+**
+** Routines that move file contents between a host stream and the block
+** chains of a mapped QFS image.
+**
+** Usage: #include "qfs_file.h"
+**
+*/
+
+#ifndef QFS_FILE_H
+#define QFS_FILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "qfs_image.h"
+#include "qfs_bitmap.h"
+
+// Vectors per writev call (the Linux IOV_MAX)
+#define QFS_IOV_BATCH 1024
+
+// One host file in a batch written by qfs_write_files()
+typedef struct qfs_write_req {
+    const char   *path;       // Host file to copy in (also the stored name)
+    const char   *name;       // Name to store it under instead, NULL for path
+    const void   *data;       // Contents already in memory (qfsd), NULL to read path
+    uint32_t      size;       // File size, filled in by the planning pass unless data is set
+    int           status;     // QFS_OK, or the error that skipped this file
+    int           sys_errno;  // errno for QFS_ESYS failures
+    uint8_t       type;       // File type bits for the entry, QFS_TYPE_FILE or QFS_TYPE_LZ
+    uint8_t       dedup;      // Share the chain of identical indexed content (see qfs_dedup.h)
+    int           shared;     // Set if the file was stored as a reference to such a chain
+    int           dedup_rec;  // Dedup index record the file uses, -1 if none
+    int           slot;       // Directory slot reserved for the file
+    qfs_extent_t *ext;        // Runs of blocks reserved for the file
+    int           n_ext;      // Number of runs
+} qfs_write_req_t;
+
+// Function to write a batch of host files: one planning pass reserves
+// directory slots and blocks for every file, the data is then streamed
+// in allocation order, and the directory and superblock are committed
+// once at the end. Files with dedup set are hashed in the planning pass
+// and take no blocks if their content is already on the image (or earlier
+// in the batch). Returns the number of files written.
+int qfs_write_files(qfs_image_t *img, qfs_write_req_t *reqs, int n, int policy);
+
+// Function to delete the file in a directory slot and free its blocks
+// (unless other files still share them through the dedup index), returns
+// QFS_OK or QFS_EFORMAT if its chain left the image part way
+int qfs_delete_file(qfs_image_t *img, int slot);
+
+// Function to check that the file in a directory slot can be changed in
+// place, without changing anything. Returns QFS_OK, QFS_EINVAL if the
+// slot holds no file, QFS_ECOMPRESSED for a compressed file, or
+// QFS_ESHARED if other files share its chain through the dedup index.
+// rec gets the dedup record of a chain only this file uses (-1 if none),
+// for qfs_finish_change().
+int qfs_prepare_change(qfs_image_t *img, int slot, int *rec);
+
+// Function to drop the hash entry of a record from qfs_prepare_change()
+// once the file's content has changed (nothing for -1)
+void qfs_finish_change(qfs_image_t *img, int rec);
+
+// Function to count the files sharing the chain of the file in a slot
+// through the dedup index (0 if it is not indexed)
+int qfs_shared_files(qfs_image_t *img, int slot);
+
+// Function to add len bytes to the end of the file in a directory slot.
+// The tail block's unused payload is filled first, then only the blocks
+// the rest needs are allocated (right after the tail when they are free)
+// and linked on; the entry and superblock are changed once, for
+// qfs_commit(). The tail is found through the slot's block map, so the
+// cost follows len, not the file size. Returns QFS_OK, QFS_ENOSPC, or
+// an error of qfs_prepare_change().
+int qfs_append_file(qfs_image_t *img, int slot, const void *data, uint32_t len);
+
+// Function to set the size of the file in a directory slot. Shrinking
+// frees only the blocks past the new end, growing appends zeros. Errors
+// are those of qfs_append_file().
+int qfs_truncate_file(qfs_image_t *img, int slot, uint32_t size);
+
+// Function to copy count bytes from buf over the file in a slot starting
+// at offset. Only the payload bytes of the blocks the range covers are
+// written, found through the block map; a range past the end of the file
+// is added the way qfs_append_file() does it, zero filled from the old
+// end up to offset. The file stays unchanged if the write is refused or
+// runs out of space. Returns count or an error code: those of
+// qfs_prepare_change(), QFS_EINVAL for a range past 4GB, QFS_ENOSPC.
+int64_t qfs_pwrite(qfs_image_t *img, int slot, const void *buf, uint32_t count, uint32_t offset);
+
+// Function to copy size bytes from src into the blocks of a list of
+// extents, filling in the next_block pointers to form a single chain
+int qfs_write_extents(qfs_image_t *img, const qfs_extent_t *ext, int n_ext,
+                      FILE *src, uint32_t size);
+
+// Function to stream a file's contents to a file descriptor. Runs of
+// contiguous blocks are gathered with writev straight from the mapping,
+// skipping each block's busy byte and next_block pointer. Compressed
+// files are decompressed a chunk at a time.
+int qfs_read_to_fd(const qfs_image_t *img, const direntry_t *entry, int fd);
+
+// Function to get the size of a file as it was written (file_size unless
+// it is compressed), or QFS_EFORMAT if its compressed header is damaged
+int64_t qfs_file_size(const qfs_image_t *img, const direntry_t *entry);
+
+// Function to write out a whole iovec array, picking up after short writes
+int qfs_writev_all(int fd, struct iovec *iov, int n);
+
+#endif // QFS_FILE_H
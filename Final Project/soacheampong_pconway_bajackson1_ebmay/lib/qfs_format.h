@@ -0,0 +1,52 @@
+/*
+**
+** QFS formatting engine (libqfs)
+**
+** Lays down the superblock, an empty directory table and the free busy
+** byte of every data block directly in the mapped image. Data areas are
+** never cleared, so old contents stay recoverable.
+**
+** Images that 16-bit block numbers can cover are made in the original
+** version 1 layout, larger ones in version 2 (see qfs_image.h) unless a
+** version is asked for.
+**
+** Usage: #include "qfs_format.h"
+**
+*/
+
+#ifndef QFS_FORMAT_H
+#define QFS_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "qfs_image.h"
+
+// qfs_format() flags
+#define QFS_FMT_SPARSE  0x1    // Leave busy bytes that are already zero untouched
+
+// Largest image the 16-bit block numbers can address (65535 blocks of 2048 bytes)
+#define QFS_MAX_BLOCKS  UINT16_MAX
+
+// Version 2 block numbers also come back as int from some calls
+#define QFS_V2_MAX_BLOCKS  INT32_MAX
+
+// Function to choose the format version for an image of a given size
+int qfs_version_for(size_t image_size);
+
+// Function to choose the block size for an image of a given size and version
+uint32_t qfs_block_size_for(size_t image_size, int version);
+
+// Function to create an image file (or resize an existing one) to size
+// bytes with ftruncate. *zero_from is set to the offset past which the
+// file is known to read as zeros.
+int qfs_create_image(const char *path, size_t size, size_t *zero_from);
+
+// Function to format a mapped image as QFS_V1 or QFS_V2, or 0 to choose
+// by size. Blocks starting at or after zero_from are known to be zero and
+// are skipped (pass img->size if nothing is known). journal_size bytes
+// (rounded up to whole blocks) are set aside for a metadata journal, 0
+// for none.
+int qfs_format(qfs_image_t *img, const char *label, int version, int flags,
+               size_t zero_from, size_t journal_size);
+
+#endif // QFS_FORMAT_H
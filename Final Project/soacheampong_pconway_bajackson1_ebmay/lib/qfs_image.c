@@ -0,0 +1,355 @@
+/*
+** Shared QFS image handle (libqfs)
+**
+** Maps a disk image with mmap so the tools can work on the superblock,
+** directory table and data blocks in place instead of issuing one
+** fseek/fread pair per field.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "qfs_image.h"
+#include "qfs_bitmap.h"
+#include "qfs_dir.h"
+#include "qfs_journal.h"
+
+// Point the superblock, directory and data views into the mapping
+static void map_views(qfs_image_t *img, int version, size_t data_offset) {
+    img->version = version;
+    img->sb = (superblock_t *) img->base;
+    img->sbx = version >= QFS_V2 ? (superblock_ext_t *) (img->base + QFS_SBX_OFFSET) : NULL;
+    img->dir = (direntry_t *) (img->base + (version >= QFS_V2 ? QFS_V2_DIR_OFFSET : QFS_DIR_OFFSET));
+    img->data_offset = data_offset;
+    img->data = img->base + data_offset;
+}
+
+static int open_image(qfs_image_t *img, const char *path, int flags) {
+    memset(img, 0, sizeof(qfs_image_t));
+    img->fd = -1;
+    img->flags = flags;
+
+    int writable = (flags & QFS_RDWR) != 0;
+
+    img->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (img->fd < 0) {
+        return QFS_ESYS;
+    }
+
+    // open, fstat and mmap
+    QFS_STAT_ADD(syscalls, 3);
+
+    struct stat st;
+    if (fstat(img->fd, &st) != 0) {
+        qfs_close(img);
+        return QFS_ESYS;
+    }
+
+    // Image must at least hold the superblock and directory table
+    if ((size_t) st.st_size < QFS_DATA_OFFSET) {
+        qfs_close(img);
+        return QFS_EFORMAT;
+    }
+
+    img->size = (size_t) st.st_size;
+
+    // Map the whole image once, writes go straight back to the file
+    int prot = writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    void *map = mmap(NULL, img->size, prot, MAP_SHARED, img->fd, 0);
+    if (map == MAP_FAILED) {
+        qfs_close(img);
+        return QFS_ESYS;
+    }
+
+    // Raw images (mkfs_qfs) get version 1 views until they are formatted
+    img->base = (uint8_t *) map;
+    map_views(img, QFS_V1, QFS_DATA_OFFSET);
+
+#ifdef DEBUG
+    fprintf(stderr, "Mapped %zu bytes of %s\n", img->size, path);
+#endif
+
+    // Raw images (mkfs_qfs) have no valid superblock yet
+    if (flags & QFS_RAW) {
+        return QFS_OK;
+    }
+
+    int err = qfs_load_geometry(img);
+
+    // Replay a transaction a crash left in the journal
+    if (err == QFS_OK && (img->sb->reserved[QFS_SB_FEATURES] & QFS_FEAT_JOURNAL)) {
+        err = qfs_journal_attach(img);
+    }
+
+    // Blocks come from the cache if a budget is set. The file itself
+    // lacks a replay that only went to a private mapping.
+    size_t budget = qfs_cache_budget();
+    if (err == QFS_OK && budget > 0 && !(img->flags & QFS_PRIVATE)) {
+        img->cache = qfs_cache_create(img->fd, (off_t) img->data_offset, img->block_size,
+                                      img->total_blocks, budget);
+        if (!img->cache) {
+            err = QFS_ESYS;
+        }
+    }
+
+    if (err != QFS_OK) {
+        qfs_close(img);
+        return err;
+    }
+
+    return QFS_OK;
+}
+
+int qfs_open(qfs_image_t *img, const char *path, int flags) {
+    uint64_t t0 = qfs_phase_begin();
+    int err = open_image(img, path, flags);
+    qfs_phase_end(QFS_PHASE_SUPERBLOCK, t0);
+    return err;
+}
+
+// Version 2 geometry comes from the superblock extension
+static int load_geometry_v2(qfs_image_t *img) {
+    size_t table_end = QFS_V2_DIR_OFFSET + sizeof(direntry_t) * QFS_DIR_ENTRIES;
+    if (img->size < table_end) {
+        return QFS_EFORMAT;
+    }
+
+    const superblock_ext_t *x = (const superblock_ext_t *) (img->base + QFS_SBX_OFFSET);
+
+    if (x->bytes_per_block < QFS_V2_BLOCK_MIN || x->bytes_per_block > QFS_V2_BLOCK_MAX) {
+        return QFS_EFORMAT;
+    }
+
+    // Data follows the directory table and all blocks lie inside the image
+    size_t end = x->data_offset + (size_t) x->total_blocks * x->bytes_per_block;
+    if (x->data_offset < table_end || end > img->size) {
+        return QFS_EFORMAT;
+    }
+
+    map_views(img, QFS_V2, x->data_offset);
+    img->total_blocks = x->total_blocks;
+    img->block_size = x->bytes_per_block;
+    img->payload = x->bytes_per_block - 5;
+
+    return QFS_OK;
+}
+
+int qfs_load_geometry(qfs_image_t *img) {
+    superblock_t *sb = (superblock_t *) img->base;
+
+    if (sb->fs_type != QFS_MAGIC) {
+        return QFS_EFORMAT;
+    }
+
+    if (sb->reserved[QFS_SB_VERSION] == QFS_V2) {
+        return load_geometry_v2(img);
+    }
+
+    // A version this library does not know
+    if (sb->reserved[QFS_SB_VERSION] > QFS_V1) {
+        return QFS_EFORMAT;
+    }
+
+    // Block must hold the busy byte, the next pointer and some data
+    if (sb->bytes_per_block <= 3 || sb->bytes_per_block > QFS_BLOCK_MAX) {
+        return QFS_EFORMAT;
+    }
+
+    // All blocks must lie inside the image
+    size_t end = QFS_DATA_OFFSET + (size_t) sb->total_blocks * sb->bytes_per_block;
+    if (end > img->size) {
+        return QFS_EFORMAT;
+    }
+
+    map_views(img, QFS_V1, QFS_DATA_OFFSET);
+    img->total_blocks = sb->total_blocks;
+    img->block_size = sb->bytes_per_block;
+    img->payload = sb->bytes_per_block - 3;
+
+    return QFS_OK;
+}
+
+int qfs_flush(qfs_image_t *img) {
+    if (!img->base || !(img->flags & QFS_RDWR)) {
+        return QFS_OK;
+    }
+
+    // Cached blocks go to the file first, the msync then covers them too
+    if (img->cache && qfs_cache_flush(img->cache, 0, img->total_blocks) != QFS_OK) {
+        return QFS_ESYS;
+    }
+
+    QFS_STAT_ADD(syscalls, 1);
+    if (msync(img->base, img->size, MS_SYNC) != 0) {
+        return QFS_ESYS;
+    }
+
+    return QFS_OK;
+}
+
+int qfs_flush_range(qfs_image_t *img, const void *addr, size_t len) {
+    if (!img->base || !(img->flags & QFS_RDWR) || len == 0) {
+        return QFS_OK;
+    }
+
+    // msync needs a page aligned start
+    uintptr_t start = (uintptr_t) addr & ~((uintptr_t) 4095);
+    len += (uintptr_t) addr - start;
+
+    QFS_STAT_ADD(syscalls, 1);
+    if (msync((void *) start, len, MS_SYNC) != 0) {
+        return QFS_ESYS;
+    }
+
+    return QFS_OK;
+}
+
+int qfs_flush_blocks(qfs_image_t *img, uint32_t first, uint32_t count) {
+    if (!img->base || !(img->flags & QFS_RDWR) || count == 0) {
+        return QFS_OK;
+    }
+
+    if (img->cache && qfs_cache_flush(img->cache, first, count) != QFS_OK) {
+        return QFS_ESYS;
+    }
+
+    return qfs_flush_range(img, qfs_block_addr(img, first), (size_t) count * img->block_size);
+}
+
+static int commit_image(qfs_image_t *img) {
+    if (!img->base || !(img->flags & QFS_RDWR)) {
+        return QFS_OK;
+    }
+
+    if (img->journal) {
+        return qfs_journal_commit(img);
+    }
+
+    // Busy bytes of blocks changed through the bitmap go back first,
+    // then the directory slots that changed
+    if (img->bitmap) {
+        qfs_bitmap_sync(img->bitmap, img);
+    }
+    if (img->dirindex) {
+        qfs_dir_commit(img->dirindex, img);
+    }
+
+    return QFS_OK;
+}
+
+int qfs_commit(qfs_image_t *img) {
+    uint64_t t0 = qfs_phase_begin();
+    int err = commit_image(img);
+    qfs_phase_end(QFS_PHASE_COMMIT, t0);
+    return err;
+}
+
+void qfs_close(qfs_image_t *img) {
+    uint64_t t0 = qfs_phase_begin();
+
+    commit_image(img);
+    qfs_journal_detach(img);
+
+    if (img->bitmap) {
+        qfs_bitmap_destroy(img->bitmap);
+        free(img->bitmap);
+        img->bitmap = NULL;
+    }
+
+    if (img->dirindex) {
+        qfs_dir_destroy(img->dirindex);
+        free(img->dirindex);
+        img->dirindex = NULL;
+    }
+
+    // Writes back what the commit left in the cache
+    qfs_cache_destroy(img->cache);
+    img->cache = NULL;
+
+    if (img->base) {
+        munmap(img->base, img->size);
+        img->base = NULL;
+        QFS_STAT_ADD(syscalls, 1);
+    }
+
+    if (img->fd >= 0) {
+        close(img->fd);
+        img->fd = -1;
+        QFS_STAT_ADD(syscalls, 1);
+    }
+
+    qfs_phase_end(QFS_PHASE_COMMIT, t0);
+}
+
+const char *qfs_strerror(int err) {
+    switch (err) {
+        case QFS_OK:      return "Success";
+        case QFS_ESYS:    return strerror(errno);
+        case QFS_EFORMAT: return "Not a valid QFS image";
+        case QFS_ENOSPC:  return "Not enough free blocks";
+        case QFS_ENODIR:  return "No directory entries available";
+        case QFS_ENOENT:  return "File not found";
+        case QFS_EEXIST:  return "File already exists";
+        case QFS_EINVAL:  return "Invalid argument";
+        case QFS_EEMPTY:  return "Source file is empty";
+        case QFS_EPROTO:  return "Malformed qfsd message";
+        case QFS_ENOIMG:  return "Image is not served by qfsd";
+        case QFS_ECOMPRESSED: return "File is compressed";
+        case QFS_ESHARED: return "File shares its blocks with other files";
+        default:          return "Unknown error";
+    }
+}
+
+int qfs_parse_size(const char *text, uint64_t max, uint64_t *value, const char **rest) {
+    // strtoull() would skip blanks and take a sign, so a count starts with a digit
+    if (*text < '0' || *text > '9') {
+        return QFS_EINVAL;
+    }
+
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(text, &end, 10);
+    if (errno == ERANGE) {
+        return QFS_EINVAL;
+    }
+
+    int shift = 0;
+    switch (*end) {
+        case 'G': case 'g': shift = 30; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'K': case 'k': shift = 10; end++; break;
+    }
+
+    if ((!rest && *end != '\0') || n > (max >> shift)) {
+        return QFS_EINVAL;
+    }
+
+    *value = (uint64_t) n << shift;
+    if (rest) {
+        *rest = end;
+    }
+    return QFS_OK;
+}
+
+int qfs_parse_int(const char *text, int min, int max, int *value) {
+    // As above, no blanks or sign in front of the digits
+    if (*text < '0' || *text > '9') {
+        return QFS_EINVAL;
+    }
+
+    char *end;
+    errno = 0;
+    long n = strtol(text, &end, 10);
+    if (errno == ERANGE || *end != '\0' || n < min || n > max) {
+        return QFS_EINVAL;
+    }
+
+    *value = (int) n;
+    return QFS_OK;
+}
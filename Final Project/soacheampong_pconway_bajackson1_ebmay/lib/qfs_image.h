@@ -0,0 +1,277 @@
+/*
+**
+** Shared QFS image handle (libqfs)
+**
+** The whole disk image is memory-mapped once by qfs_open() and the
+** superblock, directory table and data blocks are handed out as typed
+** pointers straight into the mapping. Nothing is copied and no stdio
+** calls are made after the image has been opened.
+**
+** Data blocks are reached through qfs_block_get() and qfs_block_put().
+** With QFS_CACHE set they come from a block cache (see qfs_cache.h)
+** instead of the mapping.
+**
+** Two on-disk versions are read and written. Version 1 is the original
+** layout with 16-bit block numbers and blocks of up to 2048 bytes, which
+** caps an image at about 128MB. Version 2 keeps the magic byte, sets
+** reserved[QFS_SB_VERSION] to 2 and adds a superblock_ext_t after the
+** superblock, moving the directory table to offset 64 and the data to
+** offset 12288. Block numbers are 32-bit: next_block takes the last four
+** bytes of a block and the high half of starting_block sits in the
+** owner and group bytes of the directory entry. Blocks are 4K to 64K.
+** The accessors below hide the difference from the rest of libqfs.
+**
+** Usage: #include "qfs_image.h"
+**
+*/
+
+#ifndef QFS_IMAGE_H
+#define QFS_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "qfs.h"
+#include "qfs_cache.h"
+#include "qfs_stats.h"
+
+// QFS constants
+#define QFS_MAGIC        0x51
+#define QFS_DIR_ENTRIES  255
+#define QFS_DIR_OFFSET   sizeof(superblock_t)
+#define QFS_DATA_OFFSET  (sizeof(superblock_t) + sizeof(direntry_t) * QFS_DIR_ENTRIES)
+#define QFS_BLOCK_MAX    2048
+
+// Version 2 layout
+#define QFS_SBX_OFFSET      sizeof(superblock_t)
+#define QFS_V2_DIR_OFFSET   (QFS_SBX_OFFSET + sizeof(superblock_ext_t))
+#define QFS_V2_DATA_OFFSET  12288    // First page after the directory table
+#define QFS_V2_BLOCK_MIN    4096
+#define QFS_V2_BLOCK_MAX    65536
+
+// Format versions (reserved[QFS_SB_VERSION] is 0 on version 1 images)
+#define QFS_V1  1
+#define QFS_V2  2
+
+// Never a valid block number
+#define QFS_NO_BLOCK  UINT32_MAX
+
+// Busy byte values (see write_file.c / delete_file.c)
+#define QFS_BLOCK_FREE   0
+#define QFS_BLOCK_BUSY   1
+
+// Superblock reserved bytes (all zero on images that use none of them)
+#define QFS_SB_VERSION    0    // Format version, QFS_V2 or 0 for version 1
+#define QFS_SB_FEATURES   1    // QFS_FEAT_* flags
+#define QFS_SB_JOURNAL    2    // Journal length in blocks (16-bit), after the last data block
+
+// File type bits [6:7] of a directory entry's permissions
+#define QFS_TYPE_MASK   0xC0
+#define QFS_TYPE_FILE   0x00
+#define QFS_TYPE_DIR    0x40    // Directory extension (see qfs_dir.h)
+#define QFS_TYPE_LZ     0x80    // Compressed file (see qfs_lz.h)
+#define QFS_TYPE_HASH   0xC0    // Deduplication index entry (see qfs_dedup.h)
+
+// Feature flags
+#define QFS_FEAT_JOURNAL  0x01    // Metadata journal (see qfs_journal.h)
+
+// qfs_open() flags
+#define QFS_RDONLY  0x0
+#define QFS_RDWR    0x1
+#define QFS_RAW     0x2    // Do not validate the superblock (used by mkfs_qfs)
+#define QFS_PRIVATE 0x4    // Set by qfs_open(): a read-only replay left a private mapping
+
+// Error codes returned by the library (0 is success)
+#define QFS_OK        0
+#define QFS_ESYS     -1    // System call failed, see errno
+#define QFS_EFORMAT  -2    // Not a QFS image or geometry is inconsistent
+#define QFS_ENOSPC   -3    // Not enough free blocks
+#define QFS_ENODIR   -4    // No free directory entries
+#define QFS_ENOENT   -5    // File not found
+#define QFS_EEXIST   -6    // File already exists
+#define QFS_EINVAL   -7    // Bad argument
+#define QFS_EEMPTY   -8    // Source file is empty
+#define QFS_EPROTO   -9    // Malformed qfsd message
+#define QFS_ENOIMG  -10    // Image is not served by this qfsd
+#define QFS_ECOMPRESSED -11  // File is compressed and cannot be changed in place
+#define QFS_ESHARED -12    // File shares its blocks with other files (see qfs_dedup.h)
+
+struct qfs_bitmap;
+struct qfs_dir;
+struct qfs_journal;
+
+// Open image handle
+typedef struct qfs_image {
+    int           fd;              // Underlying file descriptor
+    int           flags;           // Flags passed to qfs_open()
+    size_t        size;            // Size of the image in bytes
+    uint8_t      *base;            // Start of the mapping
+    superblock_t *sb;              // Superblock view (offset 0, or sb_copy when journaled)
+    superblock_ext_t *sbx;         // Superblock extension (offset 32, or sbx_copy), NULL on v1
+    direntry_t   *dir;             // Directory table view (offset 32, 64 on v2)
+    uint8_t      *data;            // First data block (offset 8192, 12288 on v2)
+    size_t        data_offset;     // Byte offset of data
+    int           version;         // QFS_V1 or QFS_V2
+    uint32_t      total_blocks;    // Cached from the superblock
+    uint32_t      block_size;      // Cached bytes_per_block
+    uint32_t      payload;         // Data bytes per block (block_size - 3, - 5 on v2)
+    struct qfs_bitmap *bitmap;     // Free-block bitmap, loaded on first use
+    struct qfs_dir    *dirindex;   // Directory index, loaded on first use
+    struct qfs_journal *journal;   // Metadata journal, if the image has one
+    superblock_t  sb_copy;         // Uncommitted superblock of a journaled image
+    superblock_ext_t sbx_copy;     // and its extension
+    struct qfs_cache   *cache;     // Block cache, NULL to use the mapping
+} qfs_image_t;
+
+// Function to open and map an image, returns QFS_OK or an error code
+int qfs_open(qfs_image_t *img, const char *path, int flags);
+
+// Function to point the views at the mapping and refresh the cached
+// geometry after the superblock is rewritten
+int qfs_load_geometry(qfs_image_t *img);
+
+// Function to flush changes in the mapping back to the image file
+int qfs_flush(qfs_image_t *img);
+
+// Function to flush one range of the mapping (rounded out to whole pages)
+int qfs_flush_range(qfs_image_t *img, const void *addr, size_t len);
+
+// Function to flush data blocks [first, first + count), cached or mapped
+int qfs_flush_blocks(qfs_image_t *img, uint32_t first, uint32_t count);
+
+// Function to write back pending bitmap, directory and superblock changes,
+// as one journal transaction if the image has a journal
+int qfs_commit(qfs_image_t *img);
+
+// Function to write back the bitmap and directory, unmap and close an image
+void qfs_close(qfs_image_t *img);
+
+// Function to describe an error code
+const char *qfs_strerror(int err);
+
+// Function to parse a byte count such as 0, 4096, 64K, 120M or 2G (the
+// suffixes are powers of 1024). Returns QFS_OK, or QFS_EINVAL for text
+// that is not a count, is negative or is larger than max. If rest is
+// NULL the whole text must be the count, otherwise *rest is left just
+// after it (qfs_bench takes a list of sizes).
+int qfs_parse_size(const char *text, uint64_t max, uint64_t *value, const char **rest);
+
+// Most worker threads a tool's -j option may ask for
+#define QFS_THREADS_MAX  1024
+
+// Function to parse a plain decimal number between min and max, such as
+// a -j thread count. Returns QFS_OK, or QFS_EINVAL for anything else.
+int qfs_parse_int(const char *text, int min, int max, int *value);
+
+// Read a 16-bit field from the superblock's reserved bytes
+static inline uint16_t qfs_sb_get16(const superblock_t *sb, int off) {
+    uint16_t v;
+    memcpy(&v, sb->reserved + off, sizeof(v));
+    return v;
+}
+
+// Write a 16-bit field into the superblock's reserved bytes
+static inline void qfs_sb_set16(superblock_t *sb, int off, uint16_t v) {
+    memcpy(sb->reserved + off, &v, sizeof(v));
+}
+
+// Free block count from the superblock
+static inline uint32_t qfs_sb_available(const qfs_image_t *img) {
+    return img->sbx ? img->sbx->available_blocks : img->sb->available_blocks;
+}
+
+// Set the superblock's free block count
+static inline void qfs_sb_set_available(qfs_image_t *img, uint32_t n) {
+    if (img->sbx) {
+        img->sbx->available_blocks = n;
+    } else {
+        img->sb->available_blocks = (uint16_t) n;
+    }
+}
+
+// Starting block of a directory entry on an image of the given version
+static inline uint32_t qfs_entry_start(const direntry_t *entry, int version) {
+    if (version >= QFS_V2) {
+        return ((uint32_t) entry->starting_block_hi << 16) | entry->starting_block;
+    }
+    return entry->starting_block;
+}
+
+// Set the starting block of a directory entry
+static inline void qfs_entry_set_start(direntry_t *entry, int version, uint32_t block) {
+    entry->starting_block = (uint16_t) block;
+    if (version >= QFS_V2) {
+        entry->starting_block_hi = (uint16_t) (block >> 16);
+    }
+}
+
+// Address of a data block in the mapping. This bypasses the block cache
+// and is only for whole-image scans, madvise and journal replay.
+static inline uint8_t *qfs_block_addr(const qfs_image_t *img, uint32_t block) {
+    return img->data + (size_t) block * img->block_size;
+}
+
+// Pin a data block (busy byte first) for reading, or for writing with
+// QFS_BLK_WRITE. Returns NULL if a cached block cannot be read.
+static inline uint8_t *qfs_block_get(const qfs_image_t *img, uint32_t block, int mode) {
+    QFS_STAT_ADD(blocks, 1);
+    if (img->cache) {
+        return qfs_cache_get(img->cache, block, mode);
+    }
+    return qfs_block_addr(img, block);
+}
+
+// Unpin a block returned by qfs_block_get()
+static inline void qfs_block_put(const qfs_image_t *img, uint32_t block) {
+    if (img->cache) {
+        qfs_cache_put(img->cache, block);
+    }
+}
+
+// Unpin n blocks
+static inline void qfs_blocks_put(const qfs_image_t *img, const uint32_t *blocks, int n) {
+    for (int i = 0; img->cache && i < n; i++) {
+        qfs_cache_put(img->cache, blocks[i]);
+    }
+}
+
+// Read the next_block pointer stored in the last two bytes of a block,
+// four on v2 (QFS_NO_BLOCK if the block cannot be read)
+static inline uint32_t qfs_next_block(const qfs_image_t *img, uint32_t block) {
+    const uint8_t *p = qfs_block_get(img, block, QFS_BLK_READ);
+    uint32_t next = QFS_NO_BLOCK;
+
+    if (p) {
+        if (img->version >= QFS_V2) {
+            memcpy(&next, p + img->block_size - 4, sizeof(next));
+        } else {
+            uint16_t next16;
+            memcpy(&next16, p + img->block_size - 2, sizeof(next16));
+            next = next16;
+        }
+        qfs_block_put(img, block);
+    }
+    return next;
+}
+
+// Write the next_block pointer of a block
+static inline void qfs_set_next_block(qfs_image_t *img, uint32_t block, uint32_t next) {
+    uint8_t *p = qfs_block_get(img, block, QFS_BLK_WRITE);
+
+    if (p) {
+        if (img->version >= QFS_V2) {
+            memcpy(p + img->block_size - 4, &next, sizeof(next));
+        } else {
+            uint16_t next16 = (uint16_t) next;
+            memcpy(p + img->block_size - 2, &next16, sizeof(next16));
+        }
+        qfs_block_put(img, block);
+    }
+}
+
+// Number of blocks needed to store a file of a given size
+static inline uint32_t qfs_blocks_for(const qfs_image_t *img, uint32_t file_size) {
+    return (file_size + img->payload - 1) / img->payload;
+}
+
+#endif // QFS_IMAGE_H
@@ -0,0 +1,851 @@
+/*
+** Metadata journal (libqfs)
+**
+** Records hold absolute values, so replaying a transaction twice is
+** harmless. A transaction stays in the journal after its checkpoint until
+** the next commit has flushed that checkpoint, or the image is closed.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "qfs_journal.h"
+#include "qfs_bitmap.h"
+#include "qfs_dir.h"
+#include "qfs_chain.h"
+#include "qfs_dedup.h"
+
+// FNV-1a over a transaction's records, seq and length
+static uint32_t journal_checksum(const qfs_jhdr_t *hdr, const uint8_t *rec) {
+    uint32_t h = 2166136261u;
+
+    for (uint32_t i = 0; i < hdr->length; i++) {
+        h ^= rec[i];
+        h *= 16777619u;
+    }
+
+    const uint8_t *tail[2] = { (const uint8_t *) &hdr->seq, (const uint8_t *) &hdr->length };
+    size_t tail_len[2] = { sizeof(hdr->seq), sizeof(hdr->length) };
+
+    for (int t = 0; t < 2; t++) {
+        for (size_t i = 0; i < tail_len[t]; i++) {
+            h ^= tail[t][i];
+            h *= 16777619u;
+        }
+    }
+    return h;
+}
+
+// Whether the journal holds a complete committed transaction
+static int journal_live(const uint8_t *area, size_t size) {
+    qfs_jhdr_t hdr;
+    memcpy(&hdr, area, sizeof(hdr));
+
+    return hdr.magic == QFS_JOURNAL_MAGIC
+        && hdr.length <= size - sizeof(hdr)
+        && journal_checksum(&hdr, area + sizeof(hdr)) == hdr.checksum;
+}
+
+// Apply a transaction's records to the mapping
+static int journal_replay(qfs_image_t *img, const uint8_t *area, size_t limit) {
+    qfs_jhdr_t hdr;
+    memcpy(&hdr, area, sizeof(hdr));
+
+    const uint8_t *p = area + sizeof(hdr);
+    const uint8_t *end = p + hdr.length;
+
+    for (uint32_t r = 0; r < hdr.n_records; r++) {
+        qfs_jrec_t rec;
+        if (p + sizeof(rec) > end) {
+            return QFS_EFORMAT;
+        }
+        memcpy(&rec, p, sizeof(rec));
+        p += sizeof(rec);
+
+        if (rec.type == QFS_JREC_BYTES) {
+            // Metadata only lives in front of the journal
+            if (p + rec.count > end || (size_t) rec.where + rec.count > limit) {
+                return QFS_EFORMAT;
+            }
+            memcpy(img->base + rec.where, p, rec.count);
+            p += rec.count;
+        } else if (rec.type == QFS_JREC_BLOCK) {
+            // Directory extension slots, addressed by block so any block can be reached
+            uint32_t offset;
+            if (p + sizeof(offset) + rec.count > end || rec.where >= img->total_blocks) {
+                return QFS_EFORMAT;
+            }
+            memcpy(&offset, p, sizeof(offset));
+            p += sizeof(offset);
+            if ((size_t) offset + rec.count > img->block_size) {
+                return QFS_EFORMAT;
+            }
+            memcpy(qfs_block_addr(img, rec.where) + offset, p, rec.count);
+            p += rec.count;
+        } else if (rec.type == QFS_JREC_BUSY) {
+            if (p + 1 > end || (size_t) rec.where + rec.count > img->total_blocks) {
+                return QFS_EFORMAT;
+            }
+            for (uint32_t b = rec.where; b < rec.where + rec.count; b++) {
+                *qfs_block_addr(img, b) = *p;
+            }
+            p++;
+        } else {
+            return QFS_EFORMAT;
+        }
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "Journal: replayed transaction %llu (%u records)\n",
+            (unsigned long long) hdr.seq, hdr.n_records);
+#endif
+
+    return QFS_OK;
+}
+
+// Replace the shared mapping with a private one a replay can write to
+static int remap_private(qfs_image_t *img) {
+    void *map = mmap(NULL, img->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, img->fd, 0);
+    if (map == MAP_FAILED) {
+        return QFS_ESYS;
+    }
+
+    munmap(img->base, img->size);
+    img->base = (uint8_t *) map;
+    img->flags |= QFS_PRIVATE;
+    return qfs_load_geometry(img);
+}
+
+int qfs_journal_attach(qfs_image_t *img) {
+    size_t start = img->data_offset + (size_t) img->total_blocks * img->block_size;
+    size_t size = (size_t) qfs_sb_get16(img->sb, QFS_SB_JOURNAL) * img->block_size;
+
+    if (size < sizeof(qfs_jhdr_t) || start + size > img->size) {
+        return QFS_EFORMAT;
+    }
+
+    qfs_jhdr_t hdr;
+    memcpy(&hdr, img->base + start, sizeof(hdr));
+
+    if (journal_live(img->base + start, size)) {
+        int writable = (img->flags & QFS_RDWR) != 0;
+
+        if (!writable && remap_private(img) != QFS_OK) {
+            return QFS_ESYS;
+        }
+
+        int err = journal_replay(img, img->base + start, start);
+        if (err != QFS_OK) {
+            return err;
+        }
+
+        // Replayed metadata must be on disk before the transaction is retired
+        if (writable) {
+            qfs_flush(img);
+            memset(img->base + start, 0, sizeof(uint32_t));
+            qfs_flush_range(img, img->base + start, sizeof(qfs_jhdr_t));
+        }
+
+        err = qfs_load_geometry(img);
+        if (err != QFS_OK) {
+            return err;
+        }
+    }
+
+    if (!(img->flags & QFS_RDWR)) {
+        return QFS_OK;
+    }
+
+    qfs_journal_t *j = calloc(1, sizeof(qfs_journal_t));
+    if (!j) {
+        return QFS_ESYS;
+    }
+    j->area = img->base + start;
+    j->size = size;
+    j->seq = hdr.seq + 1;
+
+    // Superblock changes stay private until they are committed
+    memcpy(&img->sb_copy, img->sb, sizeof(superblock_t));
+    img->sb = &img->sb_copy;
+    if (img->sbx) {
+        memcpy(&img->sbx_copy, img->sbx, sizeof(superblock_ext_t));
+        img->sbx = &img->sbx_copy;
+    }
+    img->journal = j;
+
+    return QFS_OK;
+}
+
+// Append raw bytes to the transaction being built
+static int journal_append(qfs_journal_t *j, const void *data, size_t len) {
+    size_t need = j->used + len;
+
+    if (need > j->cap) {
+        size_t cap = j->cap ? j->cap : 4096;
+        while (cap < need) {
+            cap *= 2;
+        }
+        uint8_t *grown = realloc(j->buf, cap);
+        if (!grown) {
+            return QFS_ESYS;
+        }
+        j->buf = grown;
+        j->cap = cap;
+    }
+
+    memcpy(j->buf + j->used, data, len);
+    j->used = need;
+    return QFS_OK;
+}
+
+// Append a record and its payload to the transaction being built
+static int journal_add(qfs_journal_t *j, int type, uint32_t where, uint32_t count,
+                       const void *data, size_t len) {
+    qfs_jrec_t rec;
+    rec.type = (uint8_t) type;
+    rec.where = where;
+    rec.count = count;
+
+    if (journal_append(j, &rec, sizeof(rec)) != QFS_OK) {
+        return QFS_ESYS;
+    }
+    return journal_append(j, data, len);
+}
+
+// Collect every pending change, returns the number of records or an error code
+static int journal_collect(qfs_image_t *img) {
+    qfs_journal_t *j = img->journal;
+    qfs_dir_t *dir = img->dirindex;
+    qfs_bitmap_t *bm = img->bitmap;
+    uint32_t dir_offset = (uint32_t) ((uint8_t *) img->dir - img->base);
+    int n = 0;
+
+    j->used = 0;
+
+    if (memcmp(img->base, &img->sb_copy, sizeof(superblock_t)) != 0) {
+        if (journal_add(j, QFS_JREC_BYTES, 0, sizeof(superblock_t),
+                        &img->sb_copy, sizeof(superblock_t)) != QFS_OK) {
+            return QFS_ESYS;
+        }
+        n++;
+    }
+    if (img->sbx && memcmp(img->base + QFS_SBX_OFFSET, &img->sbx_copy, sizeof(superblock_ext_t)) != 0) {
+        if (journal_add(j, QFS_JREC_BYTES, QFS_SBX_OFFSET, sizeof(superblock_ext_t),
+                        &img->sbx_copy, sizeof(superblock_ext_t)) != QFS_OK) {
+            return QFS_ESYS;
+        }
+        n++;
+    }
+
+    // Neighbouring dirty slots share a record, in the root table or within
+    // one extension block
+    for (int slot = 0; dir && slot < dir->n_slots; slot++) {
+        if (!qfs_dir_is_dirty(dir, slot)) {
+            continue;
+        }
+
+        int root = slot < dir->n_root;
+        int end = root ? dir->n_root
+                       : slot + dir->per_block - (slot - dir->n_root) % dir->per_block;
+        int last = slot;
+        while (last + 1 < end && qfs_dir_is_dirty(dir, last + 1)) {
+            last++;
+        }
+
+        uint32_t len = (uint32_t) ((last - slot + 1) * sizeof(direntry_t));
+        int err;
+
+        if (root) {
+            err = journal_add(j, QFS_JREC_BYTES, (uint32_t) (dir_offset + slot * sizeof(direntry_t)),
+                              len, &dir->entries[slot], len);
+        } else {
+            uint32_t offset;
+            uint32_t block = qfs_dir_ext_block(dir, slot, &offset);
+            err = journal_add(j, QFS_JREC_BLOCK, block, len, &offset, sizeof(offset));
+            if (err == QFS_OK) {
+                err = journal_append(j, &dir->entries[slot], len);
+            }
+        }
+        if (err != QFS_OK) {
+            return QFS_ESYS;
+        }
+        n++;
+        slot = last;
+    }
+
+    // Runs of blocks switching to the same state share a record
+    uint32_t run_start = 0, run_len = 0;
+    uint8_t run_value = 0;
+
+    for (uint32_t w = 0; bm && w < bm->nwords; w++) {
+        uint64_t bits = bm->dirty[w];
+
+        while (bits) {
+            uint32_t block = w * 64 + (uint32_t) __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            uint8_t value = qfs_bitmap_test(bm, block) ? QFS_BLOCK_BUSY : QFS_BLOCK_FREE;
+
+            if (run_len > 0 && block == run_start + run_len && value == run_value) {
+                run_len++;
+                continue;
+            }
+            if (run_len > 0) {
+                if (journal_add(j, QFS_JREC_BUSY, run_start, run_len, &run_value, 1) != QFS_OK) {
+                    return QFS_ESYS;
+                }
+                n++;
+            }
+            run_start = block;
+            run_len = 1;
+            run_value = value;
+        }
+    }
+    if (run_len > 0) {
+        if (journal_add(j, QFS_JREC_BUSY, run_start, run_len, &run_value, 1) != QFS_OK) {
+            return QFS_ESYS;
+        }
+        n++;
+    }
+
+    return n;
+}
+
+// Write the pending changes to their home locations
+static void journal_checkpoint(qfs_image_t *img) {
+    memcpy(img->base, &img->sb_copy, sizeof(superblock_t));
+    if (img->sbx) {
+        memcpy(img->base + QFS_SBX_OFFSET, &img->sbx_copy, sizeof(superblock_ext_t));
+    }
+    if (img->dirindex) {
+        qfs_dir_commit(img->dirindex, img);
+    }
+    if (img->bitmap) {
+        qfs_bitmap_sync(img->bitmap, img);
+    }
+}
+
+// Write a transaction of n_records from the buffer, made valid by its
+// checksum in a single flush
+static int journal_write(qfs_image_t *img, int n_records) {
+    qfs_journal_t *j = img->journal;
+
+    qfs_jhdr_t hdr;
+    hdr.magic = QFS_JOURNAL_MAGIC;
+    hdr.length = (uint32_t) j->used;
+    hdr.seq = j->seq;
+    hdr.n_records = (uint32_t) n_records;
+    hdr.checksum = journal_checksum(&hdr, j->buf);
+
+    memcpy(j->area + sizeof(hdr), j->buf, j->used);
+    memcpy(j->area, &hdr, sizeof(hdr));
+
+    int err = qfs_flush_range(img, j->area, sizeof(hdr) + j->used);
+    if (err != QFS_OK) {
+        return err;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "Journal: committed transaction %llu (%d records, %zu bytes)\n",
+            (unsigned long long) hdr.seq, n_records, j->used);
+#endif
+
+    j->seq++;
+    j->commits++;
+    return QFS_OK;
+}
+
+/*
+** Changes that do not fit in the journal are committed as several
+** transactions, each holding whole operations: a directory slot goes with
+** the busy bytes of its chain and with a hash entry changed alongside it,
+** and each transaction carries a superblock counting only what it holds.
+** Slots are taken in an order that keeps a crash between transactions
+** from cross-linking: the extension first, then slots that give blocks
+** up, then the rest. Blocks that became free go last, so a crash before
+** them only leaves blocks fsck_qfs can reclaim.
+*/
+
+// One transaction of a split commit: what it writes back
+typedef struct jgroup {
+    int      *slots;
+    int       n_slots;
+    int       slots_cap;
+    uint32_t *blocks;
+    uint32_t  n_blocks;
+    uint32_t  blocks_cap;
+    int       n_records;
+    size_t    limit;          // Record bytes, leaving room for the superblock
+    int       parts;          // Groups committed so far
+    int       warned;         // An operation alone has overflowed the journal
+} jgroup_t;
+
+// Take a slot into the group and mark it clean
+static int group_push_slot(qfs_dir_t *dir, jgroup_t *g, int slot) {
+    if (g->n_slots == g->slots_cap) {
+        int cap = g->slots_cap ? g->slots_cap * 2 : 64;
+        int *grown = realloc(g->slots, (size_t) cap * sizeof(int));
+        if (!grown) {
+            return QFS_ESYS;
+        }
+        g->slots = grown;
+        g->slots_cap = cap;
+    }
+    g->slots[g->n_slots++] = slot;
+    dir->dirty[slot >> 6] &= ~(1ULL << (slot & 63));
+    return QFS_OK;
+}
+
+// Take a block's busy byte into the group and mark it clean
+static int group_push_block(qfs_bitmap_t *bm, jgroup_t *g, uint32_t block) {
+    if (g->n_blocks == g->blocks_cap) {
+        uint32_t cap = g->blocks_cap ? g->blocks_cap * 2 : 1024;
+        uint32_t *grown = realloc(g->blocks, (size_t) cap * sizeof(uint32_t));
+        if (!grown) {
+            return QFS_ESYS;
+        }
+        g->blocks = grown;
+        g->blocks_cap = cap;
+    }
+    g->blocks[g->n_blocks++] = block;
+    bm->dirty[block >> 6] &= ~(1ULL << (block & 63));
+    return QFS_OK;
+}
+
+// Give back the slots and blocks taken since the given counts, marking
+// them changed again
+static void group_undo(qfs_image_t *img, jgroup_t *g, int n_slots, uint32_t n_blocks) {
+    while (g->n_slots > n_slots) {
+        qfs_dir_touch(img->dirindex, g->slots[--g->n_slots]);
+    }
+    while (g->n_blocks > n_blocks) {
+        uint32_t block = g->blocks[--g->n_blocks];
+        img->bitmap->dirty[block >> 6] |= 1ULL << (block & 63);
+    }
+}
+
+// Take the changed busy bytes of an entry's chain into the group
+static int group_push_chain(qfs_image_t *img, jgroup_t *g, const direntry_t *entry) {
+    qfs_bitmap_t *bm = img->bitmap;
+    uint32_t start = qfs_entry_start(entry, img->version);
+
+    if (!bm || entry->filename[0] == '\0' || entry->file_size == 0) {
+        return QFS_OK;
+    }
+
+    qfs_chain_t chain;
+    qfs_extent_t run;
+    qfs_chain_init(&chain, img, start, entry->file_size);
+
+    while (qfs_chain_next_run(&chain, &run) > 0) {
+        for (uint32_t b = run.start; b < run.start + run.count; b++) {
+            if (((bm->dirty[b >> 6] >> (b & 63)) & 1) && group_push_block(bm, g, b) != QFS_OK) {
+                return QFS_ESYS;
+            }
+        }
+    }
+    return QFS_OK;
+}
+
+// Add records for the slots taken since s0
+static int group_emit_slots(qfs_image_t *img, jgroup_t *g, int s0) {
+    qfs_journal_t *j = img->journal;
+    qfs_dir_t *dir = img->dirindex;
+    uint32_t dir_offset = (uint32_t) ((uint8_t *) img->dir - img->base);
+
+    for (int i = s0; i < g->n_slots; i++) {
+        int slot = g->slots[i];
+        int err;
+
+        if (slot < dir->n_root) {
+            err = journal_add(j, QFS_JREC_BYTES, (uint32_t) (dir_offset + slot * sizeof(direntry_t)),
+                              sizeof(direntry_t), &dir->entries[slot], sizeof(direntry_t));
+        } else {
+            uint32_t offset;
+            uint32_t block = qfs_dir_ext_block(dir, slot, &offset);
+            err = journal_add(j, QFS_JREC_BLOCK, block, sizeof(direntry_t), &offset, sizeof(offset));
+            if (err == QFS_OK) {
+                err = journal_append(j, &dir->entries[slot], sizeof(direntry_t));
+            }
+        }
+        if (err != QFS_OK) {
+            return QFS_ESYS;
+        }
+        g->n_records++;
+    }
+    return QFS_OK;
+}
+
+// Add records for the blocks taken since b0, one per run switching to the
+// same state, stopping before limit bytes. Returns the count of blocks
+// recorded in *b_end.
+static int group_emit_blocks(qfs_image_t *img, jgroup_t *g, uint32_t b0, size_t limit,
+                             uint32_t *b_end) {
+    qfs_journal_t *j = img->journal;
+    uint32_t i = b0;
+
+    while (i < g->n_blocks) {
+        uint32_t run_start = g->blocks[i];
+        uint8_t value = qfs_bitmap_test(img->bitmap, run_start) ? QFS_BLOCK_BUSY : QFS_BLOCK_FREE;
+        uint32_t n = 1;
+
+        while (i + n < g->n_blocks && g->blocks[i + n] == run_start + n
+               && (qfs_bitmap_test(img->bitmap, run_start + n) ? QFS_BLOCK_BUSY : QFS_BLOCK_FREE) == value) {
+            n++;
+        }
+        if (j->used + sizeof(qfs_jrec_t) + 1 > limit) {
+            break;
+        }
+        if (journal_add(j, QFS_JREC_BUSY, run_start, n, &value, 1) != QFS_OK) {
+            return QFS_ESYS;
+        }
+        g->n_records++;
+        i += n;
+    }
+
+    *b_end = i;
+    return QFS_OK;
+}
+
+// Whether a slot's entry in its home location is in use, and its size
+static int home_entry(qfs_image_t *img, int slot, uint32_t *size) {
+    qfs_dir_t *dir = img->dirindex;
+    direntry_t entry;
+
+    if (slot < dir->n_root) {
+        memcpy(&entry, &img->dir[slot], sizeof(entry));
+    } else {
+        uint32_t offset;
+        uint32_t block = qfs_dir_ext_block(dir, slot, &offset);
+        const uint8_t *p = qfs_block_get(img, block, QFS_BLK_READ);
+        if (!p) {
+            return 0;
+        }
+        memcpy(&entry, p + offset, sizeof(entry));
+        qfs_block_put(img, block);
+    }
+
+    *size = entry.file_size;
+    return entry.filename[0] != '\0';
+}
+
+// Write the group as one transaction, with the superblock on disk moved
+// on by just its changes, then check it point and start the next group
+static int group_commit(qfs_image_t *img, jgroup_t *g) {
+    qfs_journal_t *j = img->journal;
+    qfs_dir_t *dir = img->dirindex;
+    qfs_bitmap_t *bm = img->bitmap;
+    superblock_t sb;
+    superblock_ext_t sbx;
+    int64_t blocks = 0;
+    int direntries = 0;
+
+    memcpy(&sb, img->base, sizeof(sb));
+    if (img->sbx) {
+        memcpy(&sbx, img->base + QFS_SBX_OFFSET, sizeof(sbx));
+    }
+
+    for (uint32_t i = 0; i < g->n_blocks; i++) {
+        const uint8_t *p = qfs_block_get(img, g->blocks[i], QFS_BLK_READ);
+        int was_busy = p && *p != QFS_BLOCK_FREE;
+        qfs_block_put(img, g->blocks[i]);
+        blocks += was_busy - qfs_bitmap_test(bm, g->blocks[i]);
+    }
+    for (int i = 0; i < g->n_slots; i++) {
+        int slot = g->slots[i];
+        if (slot < dir->n_root) {
+            direntries += (img->dir[slot].filename[0] != '\0') - (dir->entries[slot].filename[0] != '\0');
+        }
+    }
+
+    sb.available_direntries = (uint8_t) (sb.available_direntries + direntries);
+    if (img->sbx) {
+        sbx.available_blocks = (uint32_t) (sbx.available_blocks + blocks);
+    } else {
+        sb.available_blocks = (uint16_t) (sb.available_blocks + blocks);
+    }
+
+    int err = QFS_OK;
+    if (memcmp(img->base, &sb, sizeof(sb)) != 0) {
+        err = journal_add(j, QFS_JREC_BYTES, 0, sizeof(sb), &sb, sizeof(sb));
+        g->n_records++;
+    }
+    if (err == QFS_OK && img->sbx && memcmp(img->base + QFS_SBX_OFFSET, &sbx, sizeof(sbx)) != 0) {
+        err = journal_add(j, QFS_JREC_BYTES, QFS_SBX_OFFSET, sizeof(sbx), &sbx, sizeof(sbx));
+        g->n_records++;
+    }
+
+    // The previous group's checkpoint reaches the disk before its
+    // transaction is overwritten
+    if (err == QFS_OK && g->parts > 0) {
+        err = qfs_flush(img);
+    }
+    if (err == QFS_OK) {
+        err = journal_write(img, g->n_records);
+    }
+    if (err != QFS_OK) {
+        group_undo(img, g, 0, 0);
+        return err;
+    }
+
+    memcpy(img->base, &sb, sizeof(sb));
+    if (img->sbx) {
+        memcpy(img->base + QFS_SBX_OFFSET, &sbx, sizeof(sbx));
+    }
+    for (int i = 0; i < g->n_slots; i++) {
+        qfs_dir_store_slot(dir, img, g->slots[i]);
+    }
+    for (uint32_t i = 0; i < g->n_blocks; i++) {
+        qfs_bitmap_sync_block(bm, img, g->blocks[i]);
+    }
+
+    g->n_slots = 0;
+    g->n_blocks = 0;
+    g->n_records = 0;
+    g->parts++;
+    j->used = 0;
+    return QFS_OK;
+}
+
+// Take a slot, its chain and a hash entry changed with it into the group,
+// committing the group first when they do not fit
+static int group_add_slot(qfs_image_t *img, jgroup_t *g, int slot) {
+    qfs_journal_t *j = img->journal;
+    qfs_dir_t *dir = img->dirindex;
+    const direntry_t *entry = &dir->entries[slot];
+
+    for (;;) {
+        size_t used = j->used;
+        int n_records = g->n_records;
+        int s0 = g->n_slots;
+        uint32_t b0 = g->n_blocks, b_end;
+
+        int err = group_push_slot(dir, g, slot);
+        if (err == QFS_OK) {
+            err = group_push_chain(img, g, entry);
+        }
+        if (err == QFS_OK && dir->dedup && qfs_dir_is_file(dir, slot)) {
+            int rec = qfs_dedup_of(dir->dedup, img, entry);
+            int hash_slot = rec >= 0 ? dir->dedup->recs[rec].slot : -1;
+            if (hash_slot >= 0 && qfs_dir_is_dirty(dir, hash_slot)) {
+                err = group_push_slot(dir, g, hash_slot);
+            }
+        }
+        if (err == QFS_OK) {
+            err = group_emit_slots(img, g, s0);
+        }
+        if (err == QFS_OK) {
+            err = group_emit_blocks(img, g, b0, SIZE_MAX, &b_end);
+        }
+        if (err != QFS_OK) {
+            group_undo(img, g, s0, b0);
+            return err;
+        }
+        if (j->used <= g->limit) {
+            return QFS_OK;
+        }
+
+        j->used = used;
+        g->n_records = n_records;
+
+        if (s0 == 0 && b0 == 0) {
+            // The operation alone does not fit: its new busy bytes go
+            // ahead in transactions of their own
+            if (!g->warned) {
+                fprintf(stderr, "Warning: Changes to '%.*s' exceed the journal and are not committed atomically.\n",
+                        (int) sizeof(entry->filename), entry->filename);
+                g->warned = 1;
+            }
+            err = group_emit_blocks(img, g, b0, g->limit, &b_end);
+            if (err != QFS_OK) {
+                group_undo(img, g, s0, b0);
+                return err;
+            }
+            group_undo(img, g, s0, b_end);
+        } else {
+            group_undo(img, g, s0, b0);
+        }
+
+        err = group_commit(img, g);
+        if (err != QFS_OK) {
+            return err;
+        }
+    }
+}
+
+// Take a run of changed busy bytes into the group, committing the group
+// first when it does not fit
+static int group_add_run(qfs_image_t *img, jgroup_t *g, uint32_t start, uint32_t count) {
+    for (;;) {
+        uint32_t b0 = g->n_blocks, b_end;
+        int err = QFS_OK;
+
+        for (uint32_t b = start; err == QFS_OK && b < start + count; b++) {
+            err = group_push_block(img->bitmap, g, b);
+        }
+        if (err == QFS_OK) {
+            err = group_emit_blocks(img, g, b0, g->limit, &b_end);
+        }
+        if (err != QFS_OK) {
+            group_undo(img, g, g->n_slots, b0);
+            return err;
+        }
+        if (b_end == g->n_blocks) {
+            return QFS_OK;
+        }
+
+        group_undo(img, g, g->n_slots, b0);
+        err = group_commit(img, g);
+        if (err != QFS_OK) {
+            return err;
+        }
+    }
+}
+
+// Which slots each pass of a split commit takes
+enum { PASS_EXT, PASS_RELEASE, PASS_FILES, PASS_REST, N_PASSES };
+
+static int pass_takes(qfs_image_t *img, int pass, int slot) {
+    qfs_dir_t *dir = img->dirindex;
+    const direntry_t *entry = &dir->entries[slot];
+    uint32_t home_size;
+
+    switch (pass) {
+        case PASS_EXT:
+            return slot == dir->ext_slot;
+        case PASS_RELEASE:
+            return entry->filename[0] == '\0'
+                || (home_entry(img, slot, &home_size) && entry->file_size < home_size);
+        case PASS_FILES:
+            return (entry->permissions & QFS_TYPE_MASK) != QFS_TYPE_HASH;
+        default:
+            return 1;
+    }
+}
+
+// Commit the pending changes as several transactions, leaving only the
+// superblock for the final one
+static int journal_split(qfs_image_t *img) {
+    qfs_journal_t *j = img->journal;
+    qfs_dir_t *dir = img->dirindex;
+    qfs_bitmap_t *bm = img->bitmap;
+    jgroup_t g;
+    int err = QFS_OK;
+
+    memset(&g, 0, sizeof(g));
+    g.limit = j->size - sizeof(qfs_jhdr_t)
+            - 2 * sizeof(qfs_jrec_t) - sizeof(superblock_t) - sizeof(superblock_ext_t);
+    j->used = 0;
+
+    for (int pass = 0; dir && err == QFS_OK && pass < N_PASSES; pass++) {
+        for (int slot = 0; err == QFS_OK && slot < dir->n_slots; slot++) {
+            if (qfs_dir_is_dirty(dir, slot) && pass_takes(img, pass, slot)) {
+                err = group_add_slot(img, &g, slot);
+            }
+        }
+    }
+
+    // Blocks no chain holds any more
+    for (uint32_t w = 0; bm && err == QFS_OK && w < bm->nwords; w++) {
+        while (err == QFS_OK && bm->dirty[w]) {
+            uint32_t start = w * 64 + (uint32_t) __builtin_ctzll(bm->dirty[w]);
+            int value = qfs_bitmap_test(bm, start);
+            uint32_t count = 1;
+
+            while (start + count < bm->nblocks
+                   && ((bm->dirty[(start + count) >> 6] >> ((start + count) & 63)) & 1)
+                   && qfs_bitmap_test(bm, start + count) == value) {
+                count++;
+            }
+            err = group_add_run(img, &g, start, count);
+        }
+    }
+
+    if (err == QFS_OK && (g.n_slots > 0 || g.n_blocks > 0)) {
+        err = group_commit(img, &g);
+    }
+    if (err != QFS_OK) {
+        group_undo(img, &g, 0, 0);
+    }
+
+    free(g.slots);
+    free(g.blocks);
+    return err;
+}
+
+int qfs_journal_commit(qfs_image_t *img) {
+    qfs_journal_t *j = img->journal;
+
+    int n_records = journal_collect(img);
+    if (n_records <= 0) {
+        return n_records;
+    }
+
+    // 1. File data, and the previous checkpoint, reach the disk first
+    int err = qfs_flush(img);
+    if (err != QFS_OK) {
+        return err;
+    }
+
+    // Too much for one transaction: all but the superblock is committed
+    // in parts, and the last part's checkpoint flushed
+    if (sizeof(qfs_jhdr_t) + j->used > j->size) {
+#ifdef DEBUG
+        fprintf(stderr, "Journal: %zu bytes of changes exceed the journal, splitting\n", j->used);
+#endif
+        err = journal_split(img);
+        if (err == QFS_OK) {
+            n_records = journal_collect(img);
+            err = n_records > 0 ? qfs_flush(img) : n_records;
+        }
+        if (err != QFS_OK || n_records == 0) {
+            return err;
+        }
+    }
+
+    // A transaction that still does not fit is written in place, after
+    // the data but no longer atomic
+    if (sizeof(qfs_jhdr_t) + j->used > j->size) {
+        fprintf(stderr, "Warning: Changes exceed the journal, writing them in place.\n");
+        journal_checkpoint(img);
+        return qfs_flush(img);
+    }
+
+    // 2. The transaction
+    err = journal_write(img, n_records);
+    if (err != QFS_OK) {
+        return err;
+    }
+
+    // 3. Home locations, flushed by the next commit or on close
+    journal_checkpoint(img);
+    return QFS_OK;
+}
+
+void qfs_journal_detach(qfs_image_t *img) {
+    qfs_journal_t *j = img->journal;
+    if (!j) {
+        return;
+    }
+
+    // Once the checkpoint is on disk the last transaction can be retired
+    if (j->commits > 0 && qfs_flush(img) == QFS_OK) {
+        memset(j->area, 0, sizeof(uint32_t));
+        qfs_flush_range(img, j->area, sizeof(qfs_jhdr_t));
+    }
+
+    free(j->buf);
+    free(j);
+    img->journal = NULL;
+    img->sb = (superblock_t *) img->base;
+    if (img->sbx) {
+        img->sbx = (superblock_ext_t *) (img->base + QFS_SBX_OFFSET);
+    }
+}
+
+void qfs_journal_format(qfs_image_t *img) {
+    uint8_t *area = qfs_block_addr(img, img->total_blocks);
+    memset(area, 0, sizeof(qfs_jhdr_t));
+}
@@ -0,0 +1,85 @@
+/*
+**
+** Metadata journal (libqfs)
+**
+** Images made with mkfs_qfs --journal keep a write-ahead log in the
+** blocks after the last data block. Metadata changes (superblock,
+** directory slots, including those in directory extension blocks, and
+** busy bytes) are held in memory until qfs_commit(), which writes them
+** to the journal as one checksummed transaction before any of them touch
+** their home location. File data is flushed first, so a committed entry
+** never points at unwritten blocks.
+**
+** Everything changed since the previous commit goes into one transaction,
+** so a batch of writes or deletes costs two flushes however many files
+** it touches. A batch too large for the journal is committed as several
+** transactions, split between files. qfs_open() replays a committed
+** transaction left behind by a crash.
+**
+** Usage: #include "qfs_journal.h"
+**
+*/
+
+#ifndef QFS_JOURNAL_H
+#define QFS_JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "qfs_image.h"
+
+#define QFS_JOURNAL_MAGIC  0x4A534651    // "QFSJ"
+
+// Smallest journal mkfs_qfs will make, room for a --from-list batch of
+// about 500 files in one transaction
+#define QFS_JOURNAL_MIN    32768
+
+// Record types
+#define QFS_JREC_BYTES  1    // count bytes stored at image offset where
+#define QFS_JREC_BUSY   2    // count busy bytes from block where, all set to one value
+#define QFS_JREC_BLOCK  3    // count bytes stored in data block where, after a uint32_t offset
+
+#pragma pack(push,1)
+
+typedef struct qfs_jhdr {
+    uint32_t magic;          // QFS_JOURNAL_MAGIC while a transaction is live
+    uint32_t length;         // Bytes of records after the header
+    uint64_t seq;            // Transaction number
+    uint32_t n_records;
+    uint32_t checksum;       // Over seq, length and the records
+} qfs_jhdr_t;
+
+typedef struct qfs_jrec {
+    uint8_t  type;           // QFS_JREC_*
+    uint32_t where;          // Byte offset or block number
+    uint32_t count;          // Bytes or blocks
+} qfs_jrec_t;
+
+#pragma pack(pop)
+
+typedef struct qfs_journal {
+    uint8_t  *area;          // Start of the journal in the mapping
+    size_t    size;          // Journal length in bytes
+    uint64_t  seq;           // Number of the next transaction
+    uint8_t  *buf;           // Transaction being built
+    size_t    used;
+    size_t    cap;
+    uint32_t  commits;       // Transactions written since open
+} qfs_journal_t;
+
+// Function to find an image's journal and replay a committed transaction.
+// Read-write opens get a private superblock copy that qfs_commit()
+// writes back, read-only opens with a pending transaction switch to a
+// private mapping so the replay is seen without writing the file.
+int qfs_journal_attach(qfs_image_t *img);
+
+// Function to write pending metadata changes as one transaction and then
+// to their home locations
+int qfs_journal_commit(qfs_image_t *img);
+
+// Function to flush the checkpointed metadata, retire the journal and free it
+void qfs_journal_detach(qfs_image_t *img);
+
+// Function to lay down an empty journal (mkfs_qfs)
+void qfs_journal_format(qfs_image_t *img);
+
+#endif // QFS_JOURNAL_H
@@ -0,0 +1,295 @@
+/*
+** LZ compression for stored files (libqfs)
+**
+** Matches are found through a hash of the next four bytes, one candidate
+** per hash slot. The search steps faster through input that keeps
+** missing, so data that does not compress costs little time.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qfs_lz.h"
+#include "qfs_image.h"
+
+#define HASH_BITS      13
+#define MIN_MATCH      4
+#define MAX_OFFSET     65535
+#define LAST_LITERALS  5     // The input always ends in literals
+#define MATCH_LIMIT    12    // No match starts this close to the end
+#define WILD_COPY      16    // Short copies move this many bytes when there is room
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Write a length past the 15 that fits in a token nibble
+static uint8_t *put_length(uint8_t *op, uint32_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t) len;
+    return op;
+}
+
+// Write one sequence (match == NULL for the closing literals), returns
+// NULL if it does not fit before oend
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, uint32_t n_lit,
+                             uint32_t offset, uint32_t match_len) {
+    size_t need = 1 + n_lit / 255 + 1 + n_lit + 2 + match_len / 255 + 1;
+    if (need > (size_t) (oend - op)) {
+        return NULL;
+    }
+
+    uint8_t *token = op++;
+    *token = (uint8_t) ((n_lit < 15 ? n_lit : 15) << 4);
+    if (n_lit >= 15) {
+        op = put_length(op, n_lit - 15);
+    }
+    memcpy(op, lit, n_lit);
+    op += n_lit;
+
+    if (offset > 0) {
+        *op++ = (uint8_t) offset;
+        *op++ = (uint8_t) (offset >> 8);
+        *token |= (uint8_t) (match_len < 15 ? match_len : 15);
+        if (match_len >= 15) {
+            op = put_length(op, match_len - 15);
+        }
+    }
+    return op;
+}
+
+uint32_t qfs_lz_compress(const uint8_t *src, uint32_t n, uint8_t *dst, uint32_t cap) {
+    uint32_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    const uint8_t *ip = src, *anchor = src;
+    const uint8_t *end = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    if (n > MATCH_LIMIT) {
+        const uint8_t *limit = end - MATCH_LIMIT;
+        const uint8_t *match_end = end - LAST_LITERALS;
+        uint32_t misses = 0;
+
+        while (ip < limit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash4(seq);
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint32_t) (ip - src);
+
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+                ip += 1 + (misses++ >> 5);
+                continue;
+            }
+            misses = 0;
+
+            // Extend forwards, then backwards over literals not yet written
+            const uint8_t *mp = ip + MIN_MATCH, *rp = ref + MIN_MATCH;
+            while (mp < match_end && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            op = put_sequence(op, oend, anchor, (uint32_t) (ip - anchor),
+                              (uint32_t) (ip - ref), (uint32_t) (mp - ip) - MIN_MATCH);
+            if (!op) {
+                return 0;
+            }
+            ip = anchor = mp;
+
+            // Seed the table from inside the match, so the next one can
+            // start close behind it
+            if (ip < limit) {
+                table[hash4(read32(ip - 2))] = (uint32_t) (ip - 2 - src);
+            }
+        }
+    }
+
+    op = put_sequence(op, oend, anchor, (uint32_t) (end - anchor), 0, 0);
+    return op ? (uint32_t) (op - dst) : 0;
+}
+
+// Read a length continued past the token nibble, returns 0 if the input ends
+static int get_length(const uint8_t **ip, const uint8_t *iend, uint32_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) {
+            return 0;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255 && *len < UINT32_MAX - 255);
+    return 1;
+}
+
+int qfs_lz_decompress(const uint8_t *src, uint32_t n, uint8_t *dst, uint32_t size) {
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + size;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        uint32_t n_lit = token >> 4;
+        if (n_lit == 15 && !get_length(&ip, iend, &n_lit)) {
+            return QFS_EFORMAT;
+        }
+        if (n_lit > (size_t) (iend - ip) || n_lit > (size_t) (oend - op)) {
+            return QFS_EFORMAT;
+        }
+
+        // A fixed-size copy is cheaper than an exact one, the bytes past
+        // n_lit are overwritten by what follows
+        if (n_lit <= WILD_COPY && iend - ip >= WILD_COPY && oend - op >= WILD_COPY) {
+            memcpy(op, ip, WILD_COPY);
+        } else {
+            memcpy(op, ip, n_lit);
+        }
+        op += n_lit;
+        ip += n_lit;
+
+        // The closing sequence has no match
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return QFS_EFORMAT;
+        }
+        uint32_t offset = ip[0] | (uint32_t) ip[1] << 8;
+        ip += 2;
+
+        uint32_t match_len = token & 15;
+        if (match_len == 15 && !get_length(&ip, iend, &match_len)) {
+            return QFS_EFORMAT;
+        }
+        match_len += MIN_MATCH;
+
+        if (offset == 0 || offset > (size_t) (op - dst) || match_len > (size_t) (oend - op)) {
+            return QFS_EFORMAT;
+        }
+
+        // Overlapping copies repeat the last offset bytes
+        const uint8_t *ref = op - offset;
+        if (offset >= 8 && (size_t) (oend - op) >= match_len + 8) {
+            uint8_t *mend = op + match_len;
+            do {
+                memcpy(op, ref, 8);
+                op += 8;
+                ref += 8;
+            } while (op < mend);
+            op = mend;
+        } else if (offset >= match_len) {
+            memcpy(op, ref, match_len);
+            op += match_len;
+        } else {
+            while (match_len-- > 0) {
+                *op++ = *ref++;
+            }
+        }
+    }
+
+    return op == oend ? QFS_OK : QFS_EFORMAT;
+}
+
+static uint32_t round_up(uint32_t n, uint32_t align) {
+    return (n + align - 1) / align * align;
+}
+
+int qfs_lz_pack(const uint8_t *src, uint32_t size, uint32_t align,
+                uint8_t **out, uint32_t *out_len) {
+    *out = NULL;
+
+    if (size == 0 || align < sizeof(qfs_lz_hdr_t)) {
+        return QFS_OK;
+    }
+
+    qfs_lz_hdr_t hdr;
+    hdr.magic = QFS_LZ_MAGIC;
+    hdr.size = size;
+    hdr.chunk = QFS_LZ_CHUNK;
+    hdr.n_chunks = (uint32_t) (((uint64_t) size + QFS_LZ_CHUNK - 1) / QFS_LZ_CHUNK);
+
+    // Only worth it if it saves at least one block
+    uint64_t table_end = sizeof(hdr) + (uint64_t) hdr.n_chunks * sizeof(qfs_lz_chunk_t);
+    uint64_t limit = (uint64_t) ((size - 1) / align) * align;
+    if (table_end >= limit) {
+        return QFS_OK;
+    }
+
+    uint8_t *buf = malloc(limit);
+    if (!buf) {
+        return QFS_ESYS;
+    }
+
+    memcpy(buf, &hdr, sizeof(hdr));
+    qfs_lz_chunk_t *table = (qfs_lz_chunk_t *) (buf + sizeof(hdr));
+    uint32_t pos = round_up((uint32_t) table_end, align);
+
+    for (uint32_t i = 0; i < hdr.n_chunks; i++) {
+        uint32_t from = i * QFS_LZ_CHUNK;
+        uint32_t len = size - from < QFS_LZ_CHUNK ? size - from : QFS_LZ_CHUNK;
+
+        if (pos >= limit) {
+            free(buf);
+            return QFS_OK;
+        }
+
+        uint32_t room = (uint32_t) (limit - pos);
+        uint32_t stored = qfs_lz_compress(src + from, len, buf + pos, room < len - 1 ? room : len - 1);
+        if (stored == 0) {
+            if (len > room) {
+                free(buf);
+                return QFS_OK;
+            }
+            memcpy(buf + pos, src + from, len);
+            stored = len;
+        }
+
+        qfs_lz_chunk_t c = { pos, stored };
+        memcpy(&table[i], &c, sizeof(c));
+
+        pos += stored;
+        if (i + 1 < hdr.n_chunks) {
+            uint32_t next = round_up(pos, align);
+            memset(buf + pos, 0, next - pos < limit - pos ? next - pos : limit - pos);
+            pos = next;
+        }
+    }
+
+    if (pos > limit) {
+        free(buf);
+        return QFS_OK;
+    }
+
+    memset(buf + table_end, 0, round_up((uint32_t) table_end, align) - table_end);
+    *out = buf;
+    *out_len = pos;
+    return QFS_OK;
+}
+
+int qfs_lz_check_hdr(const qfs_lz_hdr_t *hdr, uint32_t stored) {
+    if (hdr->magic != QFS_LZ_MAGIC || hdr->chunk == 0 || hdr->chunk > QFS_LZ_CHUNK) {
+        return QFS_EFORMAT;
+    }
+    if (hdr->n_chunks != ((uint64_t) hdr->size + hdr->chunk - 1) / hdr->chunk) {
+        return QFS_EFORMAT;
+    }
+    if (sizeof(qfs_lz_hdr_t) + (uint64_t) hdr->n_chunks * sizeof(qfs_lz_chunk_t) > stored) {
+        return QFS_EFORMAT;
+    }
+    return QFS_OK;
+}
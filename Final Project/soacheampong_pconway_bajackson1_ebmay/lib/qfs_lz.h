@@ -0,0 +1,66 @@
+/*
+**
+** LZ compression for stored files (libqfs)
+**
+** The codec is a small LZ77 in the LZ4 block layout: each sequence is a
+** token byte (literal count in the high nibble, match length - 4 in the
+** low one, 15 meaning more length bytes follow), the literals, then a
+** 16-bit little-endian match offset. The last sequence is literals only.
+**
+** A compressed file (file type QFS_TYPE_LZ) stores a qfs_lz_hdr_t, a
+** table of one qfs_lz_chunk_t per QFS_LZ_CHUNK bytes of the original,
+** and then each chunk compressed on its own. Every chunk starts on a
+** block payload boundary of the stored file, so reading any range means
+** reading and decompressing only the chunks, and blocks, it covers. A
+** chunk that does not shrink is stored as it is.
+**
+** Usage: #include "qfs_lz.h"
+**
+*/
+
+#ifndef QFS_LZ_H
+#define QFS_LZ_H
+
+#include <stdint.h>
+
+#define QFS_LZ_MAGIC  0x315A4C51    // "QLZ1"
+
+// Original bytes per chunk
+#define QFS_LZ_CHUNK  65536
+
+#pragma pack(push,1)
+
+typedef struct qfs_lz_hdr {
+    uint32_t magic;          // QFS_LZ_MAGIC
+    uint32_t size;           // Size of the original file
+    uint32_t chunk;          // Original bytes per chunk (the last may be shorter)
+    uint32_t n_chunks;
+} qfs_lz_hdr_t;
+
+typedef struct qfs_lz_chunk {
+    uint32_t offset;         // Where the chunk starts in the stored file
+    uint32_t length;         // Stored bytes, equal to the original length if not compressed
+} qfs_lz_chunk_t;
+
+#pragma pack(pop)
+
+// Function to compress n bytes into at most cap bytes of dst, returns the
+// compressed length or 0 if it does not fit
+uint32_t qfs_lz_compress(const uint8_t *src, uint32_t n, uint8_t *dst, uint32_t cap);
+
+// Function to decompress src into exactly size bytes of dst, returns
+// QFS_OK or QFS_EFORMAT if the data is damaged
+int qfs_lz_decompress(const uint8_t *src, uint32_t n, uint8_t *dst, uint32_t size);
+
+// Function to build the stored form of a file with chunks aligned to
+// align bytes (the block payload). Sets *out (caller frees) and *out_len
+// if that takes fewer align-sized blocks than the original, leaves *out
+// NULL if not. Returns QFS_OK or QFS_ESYS.
+int qfs_lz_pack(const uint8_t *src, uint32_t size, uint32_t align,
+                uint8_t **out, uint32_t *out_len);
+
+// Function to check a stored header against the stored file size,
+// returns QFS_OK or QFS_EFORMAT
+int qfs_lz_check_hdr(const qfs_lz_hdr_t *hdr, uint32_t stored);
+
+#endif // QFS_LZ_H
@@ -0,0 +1,465 @@
+/*
+** Per-file block maps and random-access reads (libqfs)
+**
+** A compressed file is read a chunk at a time: the chunk's table entry
+** and stored bytes are found through the map like any other range, then
+** decompressed into a buffer the size of one chunk.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "qfs_map.h"
+#include "qfs_dir.h"
+#include "qfs_file.h"
+#include "qfs_defrag.h"
+#include "qfs_lz.h"
+
+// Position in the stored bytes of a file being read through its block map
+typedef struct map_cursor {
+    const qfs_blockmap_t *map;
+    int      e;              // Run holding idx
+    uint32_t idx;            // File block
+    uint32_t skip;           // Bytes of this block before the range
+    uint32_t left;           // Bytes of the range still to go
+} map_cursor_t;
+
+// A compressed file being read, one chunk at a time
+typedef struct lz_reader {
+    const qfs_image_t    *img;
+    const qfs_blockmap_t *map;
+    uint32_t      stored;    // Stored file size
+    qfs_lz_hdr_t  hdr;
+    uint8_t      *packed;    // Stored bytes of one chunk
+    uint8_t      *chunk;     // The chunk decompressed
+} lz_reader_t;
+
+void qfs_blockmap_free(qfs_blockmap_t *map) {
+    if (map) {
+        free(map->ext);
+        free(map->first);
+        free(map);
+    }
+}
+
+int qfs_blockmap_build(const qfs_image_t *img, const direntry_t *entry, qfs_blockmap_t **out) {
+    qfs_blockmap_t *map = calloc(1, sizeof(qfs_blockmap_t));
+    if (!map) {
+        return QFS_ESYS;
+    }
+
+    int n = qfs_file_extents(img, entry, &map->ext);
+    if (n < 0) {
+        free(map);
+        return n;
+    }
+
+    map->n_ext = n;
+    map->first = malloc((size_t) (n ? n : 1) * sizeof(uint32_t));
+    if (!map->first) {
+        qfs_blockmap_free(map);
+        return QFS_ESYS;
+    }
+
+    uint32_t idx = 0;
+    for (int e = 0; e < n; e++) {
+        map->first[e] = idx;
+        idx += map->ext[e].count;
+    }
+
+    *out = map;
+    return QFS_OK;
+}
+
+int qfs_get_blockmap(qfs_image_t *img, int slot, const qfs_blockmap_t **map) {
+    qfs_dir_t *dir = qfs_get_dir(img);
+    if (!dir) {
+        return QFS_ESYS;
+    }
+    if (slot < 0 || slot >= dir->n_slots || !qfs_dir_is_file(dir, slot)) {
+        return QFS_EINVAL;
+    }
+
+    qfs_blockmap_t *cached = __atomic_load_n(&dir->maps[slot], __ATOMIC_ACQUIRE);
+    if (cached) {
+        *map = cached;
+        return QFS_OK;
+    }
+
+    uint64_t t0 = qfs_phase_begin();
+    qfs_blockmap_t *built;
+    int err = qfs_blockmap_build(img, &dir->entries[slot], &built);
+    qfs_phase_end(QFS_PHASE_DIR, t0);
+    if (err != QFS_OK) {
+        return err;
+    }
+
+    // Another reader may have stored its map for the slot meanwhile
+    if (!__atomic_compare_exchange_n(&dir->maps[slot], &cached, built, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        qfs_blockmap_free(built);
+        built = cached;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "Block map: slot %d, %d run(s)\n", slot, built->n_ext);
+#endif
+
+    *map = built;
+    return QFS_OK;
+}
+
+qfs_blockmap_t *qfs_blockmap_resize(const qfs_blockmap_t *map, uint32_t blocks,
+                                    const qfs_extent_t *ext, int n_ext) {
+    int n_keep = 0;
+    while (n_keep < (map ? map->n_ext : 0) && map->first[n_keep] < blocks) {
+        n_keep++;
+    }
+
+    int cap = n_keep + n_ext;
+    qfs_blockmap_t *out = calloc(1, sizeof(qfs_blockmap_t));
+    if (out) {
+        out->ext = malloc((size_t) (cap ? cap : 1) * sizeof(qfs_extent_t));
+        out->first = malloc((size_t) (cap ? cap : 1) * sizeof(uint32_t));
+    }
+    if (!out || !out->ext || !out->first) {
+        qfs_blockmap_free(out);
+        return NULL;
+    }
+
+    // Runs kept, the last one cut at blocks
+    for (int e = 0; e < n_keep; e++) {
+        out->ext[e] = map->ext[e];
+        out->first[e] = map->first[e];
+    }
+    if (n_keep > 0 && out->first[n_keep - 1] + out->ext[n_keep - 1].count > blocks) {
+        out->ext[n_keep - 1].count = blocks - out->first[n_keep - 1];
+    }
+    out->n_ext = n_keep;
+
+    // New runs, the first one joining the last kept if it carries straight on
+    uint32_t idx = blocks;
+    for (int e = 0; e < n_ext; e++) {
+        qfs_extent_t *last = out->n_ext > 0 ? &out->ext[out->n_ext - 1] : NULL;
+        if (last && last->start + last->count == ext[e].start) {
+            last->count += ext[e].count;
+        } else {
+            out->ext[out->n_ext] = ext[e];
+            out->first[out->n_ext] = idx;
+            out->n_ext++;
+        }
+        idx += ext[e].count;
+    }
+
+    return out;
+}
+
+void qfs_set_blockmap(qfs_image_t *img, int slot, qfs_blockmap_t *map) {
+    qfs_dir_t *dir = qfs_get_dir(img);
+    if (!dir) {
+        qfs_blockmap_free(map);
+        return;
+    }
+
+    qfs_blockmap_free(dir->maps[slot]);
+    __atomic_store_n(&dir->maps[slot], map, __ATOMIC_RELEASE);
+}
+
+int qfs_blockmap_find(const qfs_blockmap_t *map, uint32_t idx) {
+    // Last run starting at or before idx
+    int lo = 0, hi = map->n_ext - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (map->first[mid] <= idx) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+// Look up the first block of a range of stored bytes
+static void cursor_init(const qfs_image_t *img, const qfs_blockmap_t *map, uint32_t offset,
+                        uint32_t length, map_cursor_t *c) {
+    c->map = map;
+    c->idx = offset / img->payload;
+    c->skip = offset % img->payload;
+    c->left = length;
+    c->e = length > 0 ? qfs_blockmap_find(map, c->idx) : 0;
+    QFS_STAT_ADD(seeks, 1);
+}
+
+// Next piece of the range: its block, the byte offset in it and the length
+static uint32_t cursor_next(const qfs_image_t *img, map_cursor_t *c,
+                            uint32_t *block, uint32_t *at) {
+    const qfs_blockmap_t *map = c->map;
+
+    if (c->left == 0) {
+        return 0;
+    }
+    if (c->idx - map->first[c->e] >= map->ext[c->e].count) {
+        c->e++;
+        QFS_STAT_ADD(seeks, 1);
+    }
+
+    uint32_t chunk = img->payload - c->skip;
+    if (chunk > c->left) {
+        chunk = c->left;
+    }
+
+    *block = map->ext[c->e].start + (c->idx - map->first[c->e]);
+    *at = 1 + c->skip;
+
+    c->idx++;
+    c->skip = 0;
+    c->left -= chunk;
+    return chunk;
+}
+
+// Copy stored bytes [offset, offset + length) into buf, the range must be
+// within the stored file
+static int map_copy(const qfs_image_t *img, const qfs_blockmap_t *map, uint32_t offset,
+                    uint32_t length, void *buf) {
+    map_cursor_t c;
+    cursor_init(img, map, offset, length, &c);
+
+    uint8_t *out = buf;
+    uint32_t block, at, chunk;
+
+    while ((chunk = cursor_next(img, &c, &block, &at)) > 0) {
+        const uint8_t *p = qfs_block_get(img, block, QFS_BLK_READ);
+        if (!p) {
+            return QFS_ESYS;
+        }
+        memcpy(out, p + at, chunk);
+        qfs_block_put(img, block);
+
+        QFS_STAT_ADD(bytes_read, chunk);
+        out += chunk;
+    }
+    return QFS_OK;
+}
+
+int qfs_blockmap_write(qfs_image_t *img, const qfs_blockmap_t *map, uint32_t offset,
+                     uint32_t length, const void *buf) {
+    map_cursor_t c;
+    cursor_init(img, map, offset, length, &c);
+
+    const uint8_t *in = buf;
+    uint32_t block, at, chunk;
+
+    while ((chunk = cursor_next(img, &c, &block, &at)) > 0) {
+        uint8_t *p = qfs_block_get(img, block, QFS_BLK_WRITE);
+        if (!p) {
+            return QFS_ESYS;
+        }
+        memcpy(p + at, in, chunk);
+        qfs_block_put(img, block);
+
+        QFS_STAT_ADD(bytes_written, chunk);
+        in += chunk;
+    }
+    return QFS_OK;
+}
+
+// Stream stored bytes [offset, offset + length) to fd, gathering the
+// block payloads with writev straight from the mapping
+static int map_write(const qfs_image_t *img, const qfs_blockmap_t *map, uint32_t offset,
+                     uint32_t length, int fd) {
+    map_cursor_t c;
+    cursor_init(img, map, offset, length, &c);
+
+    struct iovec iov[QFS_IOV_BATCH];
+    uint32_t pinned[QFS_IOV_BATCH];    // Blocks behind iov, unpinned once written
+    int n_iov = 0;
+    int err = QFS_OK;
+    uint32_t block, at, chunk;
+
+    while ((chunk = cursor_next(img, &c, &block, &at)) > 0) {
+        uint8_t *p = qfs_block_get(img, block, QFS_BLK_READ);
+        if (!p) {
+            err = QFS_ESYS;
+            break;
+        }
+
+        pinned[n_iov] = block;
+        QFS_STAT_ADD(bytes_read, chunk);
+        iov[n_iov].iov_base = p + at;
+        iov[n_iov].iov_len = chunk;
+        n_iov++;
+
+        if (n_iov == QFS_IOV_BATCH) {
+            err = qfs_writev_all(fd, iov, n_iov);
+            qfs_blocks_put(img, pinned, n_iov);
+            n_iov = 0;
+            if (err != QFS_OK) {
+                break;
+            }
+        }
+    }
+
+    if (n_iov > 0) {
+        int werr = qfs_writev_all(fd, iov, n_iov);
+        qfs_blocks_put(img, pinned, n_iov);
+        if (err == QFS_OK) {
+            err = werr;
+        }
+    }
+    return err;
+}
+
+static void lz_close(lz_reader_t *r) {
+    free(r->packed);
+    free(r->chunk);
+}
+
+// Read and check the header of a compressed file
+static int lz_open(lz_reader_t *r, const qfs_image_t *img, const qfs_blockmap_t *map,
+                   uint32_t stored) {
+    memset(r, 0, sizeof(lz_reader_t));
+    r->img = img;
+    r->map = map;
+    r->stored = stored;
+
+    if (stored < sizeof(qfs_lz_hdr_t)) {
+        return QFS_EFORMAT;
+    }
+    int err = map_copy(img, map, 0, sizeof(qfs_lz_hdr_t), &r->hdr);
+    if (err == QFS_OK) {
+        err = qfs_lz_check_hdr(&r->hdr, stored);
+    }
+    if (err != QFS_OK) {
+        return err;
+    }
+
+    r->packed = malloc(r->hdr.chunk);
+    r->chunk = malloc(r->hdr.chunk);
+    if (!r->packed || !r->chunk) {
+        lz_close(r);
+        return QFS_ESYS;
+    }
+    return QFS_OK;
+}
+
+// Decompress chunk i into r->chunk, returns QFS_OK, QFS_EFORMAT or QFS_ESYS
+static int lz_load(lz_reader_t *r, uint32_t i, uint32_t *len) {
+    qfs_lz_chunk_t c;
+    uint32_t from = i * r->hdr.chunk;
+    *len = r->hdr.size - from < r->hdr.chunk ? r->hdr.size - from : r->hdr.chunk;
+
+    int err = map_copy(r->img, r->map, sizeof(qfs_lz_hdr_t) + i * sizeof(c), sizeof(c), &c);
+    if (err != QFS_OK) {
+        return err;
+    }
+    if (c.length > *len || (uint64_t) c.offset + c.length > r->stored) {
+        return QFS_EFORMAT;
+    }
+
+    // A chunk that did not shrink was stored as it is
+    if (c.length == *len) {
+        return map_copy(r->img, r->map, c.offset, c.length, r->chunk);
+    }
+
+    err = map_copy(r->img, r->map, c.offset, c.length, r->packed);
+    if (err == QFS_OK) {
+        err = qfs_lz_decompress(r->packed, c.length, r->chunk, *len);
+    }
+    return err;
+}
+
+// Copy [offset, offset + length) of a compressed file into buf, or
+// stream it to fd if buf is NULL
+static int lz_read(const qfs_image_t *img, const qfs_blockmap_t *map, uint32_t stored,
+                   uint32_t offset, uint32_t length, uint8_t *buf, int fd) {
+    lz_reader_t r;
+    int err = lz_open(&r, img, map, stored);
+    if (err != QFS_OK) {
+        return err;
+    }
+    if ((uint64_t) offset + length > r.hdr.size) {
+        lz_close(&r);
+        return QFS_EINVAL;
+    }
+
+    uint32_t i = length > 0 ? offset / r.hdr.chunk : 0;
+    uint32_t skip = length > 0 ? offset % r.hdr.chunk : 0;
+
+    while (err == QFS_OK && length > 0) {
+        uint32_t len;
+        err = lz_load(&r, i++, &len);
+        if (err != QFS_OK) {
+            break;
+        }
+
+        uint32_t piece = len - skip < length ? len - skip : length;
+        if (buf) {
+            memcpy(buf, r.chunk + skip, piece);
+            buf += piece;
+        } else {
+            struct iovec iov = { r.chunk + skip, piece };
+            err = qfs_writev_all(fd, &iov, 1);
+        }
+        length -= piece;
+        skip = 0;
+    }
+
+    lz_close(&r);
+    return err;
+}
+
+int qfs_blockmap_read_to_fd(const qfs_image_t *img, const direntry_t *entry,
+                            const qfs_blockmap_t *map, uint32_t offset, uint32_t length, int fd) {
+    if ((entry->permissions & QFS_TYPE_MASK) == QFS_TYPE_LZ) {
+        return lz_read(img, map, entry->file_size, offset, length, NULL, fd);
+    }
+    if ((uint64_t) offset + length > entry->file_size) {
+        return QFS_EINVAL;
+    }
+    return map_write(img, map, offset, length, fd);
+}
+
+int64_t qfs_pread(qfs_image_t *img, int slot, void *buf, uint32_t count, uint32_t offset) {
+    const qfs_blockmap_t *map;
+    int err = qfs_get_blockmap(img, slot, &map);
+    if (err != QFS_OK) {
+        return err;
+    }
+
+    const direntry_t *entry = &img->dirindex->entries[slot];
+    int64_t size = qfs_file_size(img, entry);
+    if (size < 0) {
+        return size;
+    }
+    if (offset >= size) {
+        return 0;
+    }
+    if (count > size - offset) {
+        count = (uint32_t) (size - offset);
+    }
+
+    uint64_t t0 = qfs_phase_begin();
+    if ((entry->permissions & QFS_TYPE_MASK) == QFS_TYPE_LZ) {
+        err = lz_read(img, map, entry->file_size, offset, count, buf, -1);
+    } else {
+        err = map_copy(img, map, offset, count, buf);
+    }
+    qfs_phase_end(QFS_PHASE_DATA, t0);
+
+    return err == QFS_OK ? (int64_t) count : err;
+}
+
+int qfs_read_range_to_fd(qfs_image_t *img, int slot, uint32_t offset, uint32_t length, int fd) {
+    const qfs_blockmap_t *map;
+    int err = qfs_get_blockmap(img, slot, &map);
+    if (err != QFS_OK) {
+        return err;
+    }
+
+    uint64_t t0 = qfs_phase_begin();
+    err = qfs_blockmap_read_to_fd(img, &img->dirindex->entries[slot], map, offset, length, fd);
+    qfs_phase_end(QFS_PHASE_DATA, t0);
+    return err;
+}
@@ -0,0 +1,85 @@
+/*
+**
+** Per-file block maps and random-access reads (libqfs)
+**
+** A block map is a file's chain walked once into its runs of contiguous
+** blocks, each tagged with the file block it starts at. Finding the
+** block that holds any offset is then a binary search over the runs
+** (one step for a file stored in a single run) instead of a walk of
+** every next_block pointer in front of it. qfs_pwrite() (qfs_file.h)
+** finds the blocks it overwrites the same way.
+**
+** Maps are built on first use and cached by directory slot for as long
+** as the image is open. qfs_dir_touch() drops a slot's map, so any
+** change to an entry also throws away its stale map. Readers that share
+** an image (qfsd) may build maps side by side, the first one stored wins.
+**
+** Offsets and lengths are in the file as it was written: reads of a
+** compressed file (QFS_TYPE_LZ) decompress only the chunks they cover.
+**
+** Usage: #include "qfs_map.h"
+**
+*/
+
+#ifndef QFS_MAP_H
+#define QFS_MAP_H
+
+#include <stdint.h>
+#include "qfs_image.h"
+#include "qfs_bitmap.h"
+
+typedef struct qfs_blockmap {
+    int           n_ext;     // Runs in the chain
+    qfs_extent_t *ext;       // Runs in file order
+    uint32_t     *first;     // File block index each run starts at
+} qfs_blockmap_t;
+
+// Function to get the block map of the file in a directory slot, building
+// and caching it on first use. Returns QFS_OK, QFS_EINVAL if the slot
+// holds no file, QFS_EFORMAT if its chain leaves the image, or QFS_ESYS.
+int qfs_get_blockmap(qfs_image_t *img, int slot, const qfs_blockmap_t **map);
+
+// Function to build a block map without caching it (caller frees it)
+int qfs_blockmap_build(const qfs_image_t *img, const direntry_t *entry, qfs_blockmap_t **map);
+
+// Function to find the run holding file block idx (idx must be within the file)
+int qfs_blockmap_find(const qfs_blockmap_t *map, uint32_t idx);
+
+// Function to release a block map
+void qfs_blockmap_free(qfs_blockmap_t *map);
+
+// Function to make the map of a chain changed in place: its first blocks
+// blocks as in map (NULL when blocks is 0), then the runs in ext. Returns
+// NULL if out of memory.
+qfs_blockmap_t *qfs_blockmap_resize(const qfs_blockmap_t *map, uint32_t blocks,
+                                    const qfs_extent_t *ext, int n_ext);
+
+// Function to cache a map for a slot in place of any there, so the next
+// change to the file need not walk its chain again. The caller has the
+// image to itself, as for any change to the directory.
+void qfs_set_blockmap(qfs_image_t *img, int slot, qfs_blockmap_t *map);
+
+// Function to copy buf over length bytes from offset of a file through a
+// map of its chain (the range must be within the file). Only payload
+// bytes are written, each block's busy byte and next_block pointer are
+// left as they are. Returns QFS_OK or QFS_ESYS.
+int qfs_blockmap_write(qfs_image_t *img, const qfs_blockmap_t *map, uint32_t offset,
+                       uint32_t length, const void *buf);
+
+// Function to stream length bytes from offset of a file to a descriptor
+// through a map of its chain. Returns QFS_EINVAL if the range runs past
+// the end of the file, QFS_EFORMAT if compressed data is damaged.
+int qfs_blockmap_read_to_fd(const qfs_image_t *img, const direntry_t *entry,
+                            const qfs_blockmap_t *map, uint32_t offset, uint32_t length, int fd);
+
+// Function to copy up to count bytes from offset of the file in a slot
+// into buf. Returns the bytes copied (0 at or past the end of the file)
+// or an error code.
+int64_t qfs_pread(qfs_image_t *img, int slot, void *buf, uint32_t count, uint32_t offset);
+
+// Function to stream length bytes from offset of the file in a slot to a
+// file descriptor, the same way as qfs_read_to_fd(). Errors are those of
+// qfs_get_blockmap() and qfs_blockmap_read_to_fd().
+int qfs_read_range_to_fd(qfs_image_t *img, int slot, uint32_t offset, uint32_t length, int fd);
+
+#endif // QFS_MAP_H
@@ -0,0 +1,174 @@
+/*
+** qfsd wire protocol and client (libqfs)
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "qfs_proto.h"
+
+int qfs_send_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+
+    while (len > 0) {
+        // No SIGPIPE if the peer has gone, the caller sees EPIPE instead
+        ssize_t done = send(fd, p, len, MSG_NOSIGNAL);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return QFS_ESYS;
+        }
+        p += done;
+        len -= (size_t) done;
+    }
+
+    return QFS_OK;
+}
+
+int qfs_recv_all(int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t got = recv(fd, p, len, 0);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return QFS_ESYS;
+        }
+        if (got == 0) {
+            return QFS_EPROTO;
+        }
+        p += got;
+        len -= (size_t) got;
+    }
+
+    return QFS_OK;
+}
+
+const char *qfs_client_socket(void) {
+    const char *path = getenv(QFS_SOCKET_ENV);
+    return (path && path[0] != '\0') ? path : NULL;
+}
+
+int qfs_client_connect(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return QFS_ESYS;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return QFS_ESYS;
+    }
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return QFS_ESYS;
+    }
+
+    return fd;
+}
+
+int qfs_client_call(int fd, int op, int policy, const char *image, const char *name,
+                    const void *data, uint32_t data_len, qfs_resp_hdr_t *resp) {
+    // The daemon knows its images by absolute path
+    char full[PATH_MAX];
+    if (realpath(image, full)) {
+        image = full;
+    }
+
+    size_t image_len = strlen(image);
+    size_t name_len = name ? strlen(name) : 0;
+    if (image_len > UINT16_MAX || name_len > UINT16_MAX) {
+        return QFS_EINVAL;
+    }
+
+    qfs_req_hdr_t hdr;
+    hdr.magic = QFS_PROTO_MAGIC;
+    hdr.op = (uint8_t) op;
+    hdr.policy = (uint8_t) policy;
+    hdr.image_len = (uint16_t) image_len;
+    hdr.name_len = (uint16_t) name_len;
+    hdr.data_len = data_len;
+
+    // Header, image path and name go out in one send
+    size_t head_len = sizeof(hdr) + image_len + name_len;
+    char *head = malloc(head_len);
+    if (!head) {
+        return QFS_ESYS;
+    }
+    memcpy(head, &hdr, sizeof(hdr));
+    memcpy(head + sizeof(hdr), image, image_len);
+    memcpy(head + sizeof(hdr) + image_len, name, name_len);
+
+    int err = qfs_send_all(fd, head, head_len);
+    free(head);
+
+    if (err == QFS_OK && data_len > 0) {
+        err = qfs_send_all(fd, data, data_len);
+    }
+    if (err == QFS_OK) {
+        err = qfs_recv_all(fd, resp, sizeof(qfs_resp_hdr_t));
+    }
+    if (err != QFS_OK) {
+        return err;
+    }
+
+    if (resp->status == QFS_ESYS) {
+        errno = resp->sys_errno;
+    }
+
+    return resp->status;
+}
+
+int qfs_client_copy(int fd, uint32_t len, int out_fd) {
+    static uint8_t buf[1 << 16];
+
+    while (len > 0) {
+        size_t want = len < sizeof(buf) ? len : sizeof(buf);
+        ssize_t got = recv(fd, buf, want, 0);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return QFS_ESYS;
+        }
+        if (got == 0) {
+            return QFS_EPROTO;
+        }
+
+        // Output may be a file or a pipe, both take write()
+        const uint8_t *p = buf;
+        size_t left = (size_t) got;
+        while (left > 0) {
+            ssize_t done = write(out_fd, p, left);
+            if (done < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return QFS_ESYS;
+            }
+            p += done;
+            left -= (size_t) done;
+        }
+
+        len -= (uint32_t) got;
+    }
+
+    return QFS_OK;
+}
@@ -0,0 +1,102 @@
+/*
+**
+** qfsd wire protocol and client (libqfs)
+**
+** Requests and replies are a fixed 12-byte header followed by raw bytes,
+** sent over a Unix domain socket. A request carries the image path, the
+** file name and any file data, a reply carries a status and its data.
+** Structures go over the wire as they are laid out in qfs.h, the client
+** and daemon always run on the same machine.
+**
+** When QFS_SOCKET is set in the environment the command line tools send
+** their operation to the qfsd listening there instead of opening the
+** image themselves.
+**
+** Usage: #include "qfs_proto.h"
+**
+*/
+
+#ifndef QFS_PROTO_H
+#define QFS_PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "qfs_image.h"
+
+// Environment variable naming the qfsd socket
+#define QFS_SOCKET_ENV  "QFS_SOCKET"
+
+#define QFS_PROTO_MAGIC  0x5146    // "QF"
+
+// Operations
+#define QFS_OP_LIST    1    // Reply: superblock_t (and superblock_ext_t on v2), then every used direntry_t
+#define QFS_OP_READ    2    // Reply: the file's contents
+#define QFS_OP_WRITE   3    // Request data: the contents, reply: qfs_file_info_t
+#define QFS_OP_DELETE  4    // Reply: qfs_file_info_t of the removed file
+#define QFS_OP_RANGE   5    // Request data: qfs_range_t, reply: those bytes of the file
+#define QFS_OP_APPEND  6    // Request data: bytes to add, reply: qfs_file_info_t
+#define QFS_OP_TRUNCATE 7   // Request data: uint32_t new size, reply: qfs_file_info_t
+#define QFS_OP_PWRITE  8    // Request data: uint32_t offset then the bytes, reply: qfs_file_info_t
+
+// Flag in the policy byte of QFS_OP_WRITE: qfsd stores the file compressed
+#define QFS_WRITE_LZ   0x80
+
+// Flag in the policy byte of QFS_OP_WRITE: qfsd shares the chain of an
+// identical file written the same way (see qfs_dedup.h)
+#define QFS_WRITE_DEDUP  0x40
+
+#pragma pack(push,1)
+
+typedef struct qfs_req_hdr {
+    uint16_t magic;         // QFS_PROTO_MAGIC
+    uint8_t  op;            // QFS_OP_*
+    uint8_t  policy;        // Allocation policy for QFS_OP_WRITE, plus QFS_WRITE_* flags
+    uint16_t image_len;     // Bytes of image path that follow
+    uint16_t name_len;      // Bytes of file name after the image path
+    uint32_t data_len;      // Bytes of data after the name
+} qfs_req_hdr_t;
+
+typedef struct qfs_resp_hdr {
+    int32_t  status;        // QFS_OK or an error code
+    int32_t  sys_errno;     // errno for QFS_ESYS
+    uint32_t data_len;      // Bytes of data that follow
+} qfs_resp_hdr_t;
+
+// Part of a file to read, cut short at the end of the file
+typedef struct qfs_range {
+    uint32_t offset;
+    uint32_t length;
+} qfs_range_t;
+
+// A file changed through qfsd
+typedef struct qfs_file_info {
+    direntry_t entry;
+    uint32_t   start;       // Starting block (all 32 bits on v2 images)
+    uint32_t   blocks;      // Blocks the file occupies, 0 for a write sharing an identical file's
+} qfs_file_info_t;
+
+#pragma pack(pop)
+
+// Function to send a whole buffer, returns QFS_OK or QFS_ESYS
+int qfs_send_all(int fd, const void *buf, size_t len);
+
+// Function to receive exactly len bytes, returns QFS_OK, QFS_ESYS or
+// QFS_EPROTO if the peer hung up first
+int qfs_recv_all(int fd, void *buf, size_t len);
+
+// Function to get the qfsd socket from the environment (NULL if unset)
+const char *qfs_client_socket(void);
+
+// Function to connect to qfsd, returns the socket descriptor or QFS_ESYS
+int qfs_client_connect(const char *path);
+
+// Function to send one request and read the reply header. The reply data
+// (resp->data_len bytes) is left on the socket for the caller. Returns
+// the reply status, with errno set from the daemon for QFS_ESYS.
+int qfs_client_call(int fd, int op, int policy, const char *image, const char *name,
+                    const void *data, uint32_t data_len, qfs_resp_hdr_t *resp);
+
+// Function to copy len bytes of reply data from the socket to a descriptor
+int qfs_client_copy(int fd, uint32_t len, int out_fd);
+
+#endif // QFS_PROTO_H
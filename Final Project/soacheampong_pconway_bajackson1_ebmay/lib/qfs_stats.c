@@ -0,0 +1,97 @@
+/*
+** I/O instrumentation (libqfs)
+**
+** Page faults come from getrusage, since with the image mapped most
+** reads and writes are faults rather than system calls.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "qfs_stats.h"
+#include "qfs_image.h"
+
+int qfs_stats_mode = QFS_STATS_OFF;
+qfs_stats_t qfs_stats;
+
+static uint64_t start_ns;
+
+static const char *phase_names[QFS_PHASES] = {
+    "superblock_load", "directory_scan", "allocation", "data_transfer", "commit"
+};
+
+static void report_at_exit(void) {
+    qfs_stats_report(stderr);
+}
+
+int qfs_stats_args(int *argc, char **argv) {
+    int mode = QFS_STATS_OFF;
+    int kept = 1;
+
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=text") == 0) {
+            mode = QFS_STATS_TEXT;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            mode = QFS_STATS_JSON;
+        } else if (strncmp(argv[i], "--stats=", 8) == 0) {
+            return QFS_EINVAL;
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argv[kept] = NULL;
+    *argc = kept;
+
+    if (mode != QFS_STATS_OFF) {
+        qfs_stats_mode = mode;
+        start_ns = qfs_phase_begin();
+        atexit(report_at_exit);
+    }
+
+    return QFS_OK;
+}
+
+void qfs_stats_report(FILE *out) {
+    if (qfs_stats_mode == QFS_STATS_OFF) {
+        return;
+    }
+
+    double wall_ms = (double) (qfs_phase_begin() - start_ns) / 1e6;
+
+    struct rusage ru;
+    memset(&ru, 0, sizeof(ru));
+    getrusage(RUSAGE_SELF, &ru);
+
+    const qfs_stats_t *s = &qfs_stats;
+
+    if (qfs_stats_mode == QFS_STATS_JSON) {
+        fprintf(out, "{\"syscalls\": %llu, \"seeks\": %llu, \"bytes_read\": %llu, "
+                "\"bytes_written\": %llu, \"blocks\": %llu, \"chain_hops\": %llu, "
+                "\"minor_faults\": %ld, \"major_faults\": %ld, \"phases_ms\": {",
+                (unsigned long long) s->syscalls, (unsigned long long) s->seeks,
+                (unsigned long long) s->bytes_read, (unsigned long long) s->bytes_written,
+                (unsigned long long) s->blocks, (unsigned long long) s->chain_hops,
+                ru.ru_minflt, ru.ru_majflt);
+        for (int p = 0; p < QFS_PHASES; p++) {
+            fprintf(out, "%s\"%s\": %.3f", p ? ", " : "", phase_names[p],
+                    (double) s->phase_ns[p] / 1e6);
+        }
+        fprintf(out, "}, \"wall_ms\": %.3f}\n", wall_ms);
+        return;
+    }
+
+    fprintf(out, "--- QFS Stats ---\n");
+    fprintf(out, "System calls:   %llu\n", (unsigned long long) s->syscalls);
+    fprintf(out, "Seeks:          %llu\n", (unsigned long long) s->seeks);
+    fprintf(out, "Bytes read:     %llu\n", (unsigned long long) s->bytes_read);
+    fprintf(out, "Bytes written:  %llu\n", (unsigned long long) s->bytes_written);
+    fprintf(out, "Blocks touched: %llu\n", (unsigned long long) s->blocks);
+    fprintf(out, "Chain hops:     %llu\n", (unsigned long long) s->chain_hops);
+    fprintf(out, "Page faults:    %ld minor, %ld major\n", ru.ru_minflt, ru.ru_majflt);
+    for (int p = 0; p < QFS_PHASES; p++) {
+        fprintf(out, "%-16s%10.3f ms\n", phase_names[p], (double) s->phase_ns[p] / 1e6);
+    }
+    fprintf(out, "%-16s%10.3f ms\n", "wall", wall_ms);
+}
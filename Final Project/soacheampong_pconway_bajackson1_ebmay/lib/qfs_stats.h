@@ -0,0 +1,97 @@
+/*
+**
+** I/O instrumentation (libqfs)
+**
+** Counters and phase timers filled in by the library while a tool runs,
+** so a slow operation can be pinned on system calls, scattered block
+** access or copying. Nothing is counted or timed unless a tool turned
+** the stats on with qfs_stats_args() (its --stats flag); a disabled
+** counter costs one predictable branch.
+**
+**   syscalls       system calls made by libqfs (open, mmap, msync,
+**                  madvise, writev, pread, pwrite, host file reads)
+**   seeks          runs of contiguous blocks visited, each one a jump
+**                  a disk head would have to make
+**   bytes_read     file data copied out of the image
+**   bytes_written  file data copied into the image
+**   blocks         data block accesses through qfs_block_get()
+**   chain_hops     next_block pointers followed
+**
+** Phases: superblock load (qfs_open), directory scan, allocation
+** (free-block bitmap, block reservation and release, formatting), data
+** transfer and commit (qfs_commit and qfs_close).
+**
+** Usage: #include "qfs_stats.h"
+**
+*/
+
+#ifndef QFS_STATS_H
+#define QFS_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+// Report formats
+#define QFS_STATS_OFF   0
+#define QFS_STATS_TEXT  1
+#define QFS_STATS_JSON  2
+
+// Phases
+#define QFS_PHASE_SUPERBLOCK  0
+#define QFS_PHASE_DIR         1
+#define QFS_PHASE_ALLOC       2
+#define QFS_PHASE_DATA        3
+#define QFS_PHASE_COMMIT      4
+#define QFS_PHASES            5
+
+typedef struct qfs_stats {
+    uint64_t syscalls;
+    uint64_t seeks;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t blocks;
+    uint64_t chain_hops;
+    uint64_t phase_ns[QFS_PHASES];
+} qfs_stats_t;
+
+extern int qfs_stats_mode;
+extern qfs_stats_t qfs_stats;
+
+// Add n to a counter (threads may count at the same time)
+#define QFS_STAT_ADD(field, n) do { \
+        if (__builtin_expect(qfs_stats_mode != QFS_STATS_OFF, 0)) { \
+            __atomic_fetch_add(&qfs_stats.field, (uint64_t) (n), __ATOMIC_RELAXED); \
+        } \
+    } while (0)
+
+// Start timing a phase, returns 0 when stats are off
+static inline uint64_t qfs_phase_begin(void) {
+    if (__builtin_expect(qfs_stats_mode == QFS_STATS_OFF, 1)) {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+// Charge the time since t0 to a phase
+static inline void qfs_phase_end(int phase, uint64_t t0) {
+    if (__builtin_expect(t0 == 0, 1)) {
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+    __atomic_fetch_add(&qfs_stats.phase_ns[phase], now - t0, __ATOMIC_RELAXED);
+}
+
+// Function to take --stats, --stats=text or --stats=json out of argv.
+// Turns the stats on and prints them to stderr when the program exits.
+// Returns QFS_OK, or QFS_EINVAL for an unknown format.
+int qfs_stats_args(int *argc, char **argv);
+
+// Function to print the stats in the chosen format
+void qfs_stats_report(FILE *out);
+
+#endif // QFS_STATS_H
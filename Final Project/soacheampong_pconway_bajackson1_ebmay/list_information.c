@@ -1,45 +1,56 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "qfs.h"
+#include "qfs_image.h"
+#include "qfs_dir.h"
+#include "qfs_proto.h"
+#include "qfs_analyze.h"
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <disk image file>\n", argv[0]);
-        return 1;
-    }
-    FILE *fp = fopen(argv[1], "rb");
-    if (!fp) {
-        perror("fopen");
-        return 2;
-    }
-
-#ifdef DEBUG
-    printf("Opened disk image: %s\n", argv[1]);
-#endif
-
-    //TODO
+// --analyze output
+#define ANALYZE_OFF   0
+#define ANALYZE_TEXT  1
+#define ANALYZE_JSON  2
 
-    // Read superblock
-    superblock_t sb;
+// Print the superblock and the used directory entries, as qfs_dir_listing()
+// orders them. The counters come from the extension on version 2 images
+// (sbx not NULL).
+static void print_listing(const superblock_t *sb, const superblock_ext_t *sbx,
+                          const direntry_t *dir, int n_entries) {
+    int version = sbx ? QFS_V2 : QFS_V1;
+    uint32_t block_size = sbx ? sbx->bytes_per_block : sb->bytes_per_block;
+    uint32_t payload = block_size - (sbx ? 5 : 3);
+    uint32_t ext_blocks = 0, ext_slots = 0;
 
-    if (fread(&sb, sizeof(superblock_t), 1, fp) != 1) {
-        fprintf(stderr, "Error: Failed to read superblock.\n");
-        fclose(fp);
-        return 3;
+    // A directory extension adds its slots to the root table's
+    for (int i = 0; i < n_entries; i++) {
+        if ((dir[i].permissions & QFS_TYPE_MASK) == QFS_TYPE_DIR && payload > 0) {
+            ext_blocks = dir[i].file_size / payload;
+            ext_slots = ext_blocks * (uint32_t) (payload / sizeof(direntry_t));
+        }
     }
 
     // Print information from superblock
     printf("--- Superblock Information ---\n");
-    printf("Block size: %u\n", sb.bytes_per_block);
-    printf("Total number of blocks: %u\n", sb.total_blocks);
-    printf("Number of free blocks: %u\n", sb.available_blocks);
-    printf("Total number of directory entries: %u\n", sb.total_direntries);
-    printf("Number of free directory entries: %u\n", sb.available_direntries);
+    printf("Format version: %d\n", version);
+    printf("Block size: %u\n", block_size);
+    printf("Total number of blocks: %u\n", sbx ? sbx->total_blocks : sb->total_blocks);
+    printf("Number of free blocks: %u\n", sbx ? sbx->available_blocks : sb->available_blocks);
+    if (ext_blocks == 0) {
+        printf("Total number of directory entries: %u\n", sb->total_direntries);
+        printf("Number of free directory entries: %u\n", sb->available_direntries);
+    } else {
+        uint32_t total = sb->total_direntries + ext_slots;
+        printf("Total number of directory entries: %u\n", total);
+        printf("Number of free directory entries: %u\n", total - (uint32_t) n_entries);
+        printf("Directory extension: %u entries in %u blocks\n", ext_slots, ext_blocks);
+    }
 
     // Print volume label if not empty
-    if (sb.label[0] != '\0') {
-        printf("Label: %s\n", sb.label);
+    if (sb->label[0] != '\0') {
+        printf("Label: %s\n", sb->label);
     }
 
     printf("------------------------------\n");
@@ -49,29 +60,244 @@ int main(int argc, char *argv[]) {
     printf("%-24s %-10s %-10s %-15s\n", "Filename", "Size", "Type", "Start Block");
     printf("----------------------------------------------------------------\n");
 
-    // Make sure at start of directory entries
-    fseek(fp, sizeof(superblock_t), SEEK_SET);
+    // Iterate through directory entries
+    for (int i = 0; i < n_entries; i++) {
+        const direntry_t *entry = &dir[i];
 
-    direntry_t entry;
+        // Directory entry valid if filename not empty, the extension is not a file
+        if (entry->filename[0] != '\0' && (entry->permissions & QFS_TYPE_MASK) != QFS_TYPE_DIR) {
+            printf("%-24s %-10u %-10u %-15u\n",
+                   entry->filename,
+                   entry->file_size,
+                   entry->permissions,
+                   qfs_entry_start(entry, version));
+        }
+    }
+}
 
-    // Iterate through directory entries
-    for (int i = 0; i < sb.total_direntries; i++) {
-        // Read one directory entry at a time
-        if (fread(&entry, sizeof(direntry_t), 1, fp) != 1) {
-            // Stop if end of file or error
-            break;
+// Print a histogram bucket's range of run lengths
+static void print_bucket(int b) {
+    char range[32];
+    if (b == 0) {
+        snprintf(range, sizeof(range), "1");
+    } else if (b == QFS_FREE_BUCKETS - 1) {
+        snprintf(range, sizeof(range), "%u+", 1u << b);
+    } else {
+        snprintf(range, sizeof(range), "%u-%u", 1u << b, (2u << b) - 1);
+    }
+    printf("  %-16s", range);
+}
+
+// Print the analysis after the listing
+static void print_analysis(const qfs_dir_t *dir, const qfs_analysis_t *an) {
+    printf("\n--- Space Analysis ---\n");
+    printf("Files: %d (%d fragmented, %d with a broken chain)\n", an->n_files, an->fragmented, an->broken);
+    printf("Blocks in files: %llu in %llu runs (average run %.1f blocks)\n",
+           (unsigned long long) an->blocks, (unsigned long long) an->extents,
+           an->extents ? (double) an->blocks / (double) an->extents : 0.0);
+    printf("Fragmentation: %.1f%% of chain links jump\n", an->score);
+    printf("Slack in last blocks: %llu bytes\n", (unsigned long long) an->slack_bytes);
+    printf("Busy byte and next pointer framing: %llu bytes\n", (unsigned long long) an->framing_bytes);
+    printf("Free: %u blocks in %u runs, largest run %u blocks\n",
+           an->free_blocks, an->free_runs, an->largest_free);
+
+    printf("\nFree runs by length (blocks):\n");
+    for (int b = 0; b < QFS_FREE_BUCKETS; b++) {
+        if (an->free_hist[b] > 0) {
+            print_bucket(b);
+            printf("%u\n", an->free_hist[b]);
         }
+    }
 
-        // Directory entry valid if filename not empty
-        if (entry.filename[0] != '\0') {
-            printf("%-24s %-10u %-10u %-15u\n",
-                   entry.filename,
-                   entry.file_size,
-                   entry.permissions,
-                   entry.starting_block);
+    printf("\n%-24s %-10s %-8s %-6s %-9s %-6s\n", "Filename", "Size", "Blocks", "Runs", "Avg run", "Slack");
+    printf("----------------------------------------------------------------\n");
+    for (int i = 0; i < an->n_files; i++) {
+        const qfs_file_layout_t *f = &an->files[i];
+        const direntry_t *entry = &dir->entries[f->slot];
+
+        printf("%-24s %-10u %-8u %-6u %-9.1f %-6u%s\n", entry->filename, entry->file_size,
+               f->blocks, f->extents, f->extents ? (double) f->blocks / f->extents : 0.0,
+               f->slack, f->error != QFS_OK ? "  (broken chain)" : "");
+    }
+}
+
+// Print a string as a JSON string literal
+static void json_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        unsigned char c = (unsigned char) *s;
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+// Print the analysis as one JSON object, for monitoring
+static void print_analysis_json(const qfs_image_t *img, const qfs_dir_t *dir,
+                                const qfs_analysis_t *an) {
+    printf("{\"version\": %d, \"block_size\": %u, \"total_blocks\": %u, ",
+           img->version, img->block_size, img->total_blocks);
+    printf("\"files\": %d, \"fragmented_files\": %d, \"broken_files\": %d, ",
+           an->n_files, an->fragmented, an->broken);
+    printf("\"file_bytes\": %llu, \"blocks\": %llu, \"extents\": %llu, \"avg_run\": %.2f, "
+           "\"score\": %.2f, ",
+           (unsigned long long) an->file_bytes, (unsigned long long) an->blocks,
+           (unsigned long long) an->extents,
+           an->extents ? (double) an->blocks / (double) an->extents : 0.0, an->score);
+    printf("\"slack_bytes\": %llu, \"framing_bytes\": %llu, ",
+           (unsigned long long) an->slack_bytes, (unsigned long long) an->framing_bytes);
+    printf("\"free_blocks\": %u, \"free_runs\": %u, \"largest_free_run\": %u, \"free_run_histogram\": [",
+           an->free_blocks, an->free_runs, an->largest_free);
+    for (int b = 0; b < QFS_FREE_BUCKETS; b++) {
+        printf("%s%u", b ? ", " : "", an->free_hist[b]);
+    }
+
+    printf("], \"per_file\": [");
+    for (int i = 0; i < an->n_files; i++) {
+        const qfs_file_layout_t *f = &an->files[i];
+        const direntry_t *entry = &dir->entries[f->slot];
+
+        printf("%s{\"name\": ", i ? ", " : "");
+        json_string(entry->filename);
+        printf(", \"size\": %u, \"blocks\": %u, \"extents\": %u, \"avg_run\": %.2f, "
+               "\"slack\": %u, \"broken\": %s}",
+               entry->file_size, f->blocks, f->extents,
+               f->extents ? (double) f->blocks / f->extents : 0.0, f->slack,
+               f->error != QFS_OK ? "true" : "false");
+    }
+    printf("]}\n");
+}
+
+// Take --analyze or --analyze=json out of argv, returns the mode or -1
+static int analyze_args(int *argc, char **argv) {
+    int mode = ANALYZE_OFF;
+    int kept = 1;
+
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], "--analyze") == 0 || strcmp(argv[i], "--analyze=text") == 0) {
+            mode = ANALYZE_TEXT;
+        } else if (strcmp(argv[i], "--analyze=json") == 0) {
+            mode = ANALYZE_JSON;
+        } else if (strncmp(argv[i], "--analyze=", 10) == 0) {
+            return -1;
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argv[kept] = NULL;
+    *argc = kept;
+    return mode;
+}
+
+// Ask qfsd for the listing instead of opening the image
+static int list_remote(const char *sock_path, const char *image_path) {
+    int fd = qfs_client_connect(sock_path);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot reach qfsd at %s: %s\n", sock_path, qfs_strerror(fd));
+        return 2;
+    }
+
+    qfs_resp_hdr_t resp;
+    int err = qfs_client_call(fd, QFS_OP_LIST, 0, image_path, NULL, NULL, 0, &resp);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", image_path, qfs_strerror(err));
+        close(fd);
+        return 2;
+    }
+
+    // Superblock (and extension) followed by the used entries
+    uint8_t *reply = malloc(resp.data_len);
+    if (!reply || resp.data_len < sizeof(superblock_t)
+        || qfs_recv_all(fd, reply, resp.data_len) != QFS_OK) {
+        fprintf(stderr, "Error: Bad reply from qfsd.\n");
+        free(reply);
+        close(fd);
+        return 3;
+    }
+    close(fd);
+
+    const superblock_t *sb = (const superblock_t *) reply;
+    const superblock_ext_t *sbx = NULL;
+    size_t header = sizeof(superblock_t);
+
+    if (sb->reserved[QFS_SB_VERSION] == QFS_V2) {
+        sbx = (const superblock_ext_t *) (reply + header);
+        header += sizeof(superblock_ext_t);
+    }
+    if (resp.data_len < header) {
+        fprintf(stderr, "Error: Bad reply from qfsd.\n");
+        free(reply);
+        return 3;
+    }
+
+    int n_entries = (int) ((resp.data_len - header) / sizeof(direntry_t));
+    print_listing(sb, sbx, (const direntry_t *) (reply + header), n_entries);
+
+    free(reply);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int analyze = qfs_stats_args(&argc, argv) == QFS_OK ? analyze_args(&argc, argv) : -1;
+    if (analyze < 0 || argc != 2) {
+        fprintf(stderr, "Usage: %s [--analyze[=json]] [--stats[=json]] <disk image file>\n", argv[0]);
+        return 1;
+    }
+
+    // The analysis walks the chains itself, so it always opens the image
+    const char *sock_path = qfs_client_socket();
+    if (sock_path && analyze == ANALYZE_OFF) {
+        return list_remote(sock_path, argv[1]);
+    }
+
+    qfs_image_t img;
+    int err = qfs_open(&img, argv[1], QFS_RDONLY);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", argv[1], qfs_strerror(err));
+        return 2;
+    }
+
+#ifdef DEBUG
+    printf("Opened disk image: %s\n", argv[1]);
+#endif
+
+    // Entries in name order from the directory index
+    qfs_dir_t *dir = qfs_get_dir(&img);
+    direntry_t *entries = dir ? malloc((size_t) (dir->n_used + 1) * sizeof(direntry_t)) : NULL;
+    if (!entries) {
+        fprintf(stderr, "Error: Cannot read the directory of %s.\n", argv[1]);
+        qfs_close(&img);
+        return 3;
+    }
+
+    uint64_t t0 = qfs_phase_begin();
+    if (analyze != ANALYZE_JSON) {
+        print_listing(img.sb, img.sbx, entries, qfs_dir_listing(dir, entries));
+    }
+    qfs_phase_end(QFS_PHASE_DIR, t0);
+
+    if (analyze != ANALYZE_OFF) {
+        qfs_analysis_t an;
+        if (qfs_analyze(&img, 0, &an) != QFS_OK) {
+            fprintf(stderr, "Error: Cannot analyze %s.\n", argv[1]);
+            free(entries);
+            qfs_close(&img);
+            return 4;
+        }
+        if (analyze == ANALYZE_JSON) {
+            print_analysis_json(&img, dir, &an);
+        } else {
+            print_analysis(dir, &an);
         }
+        qfs_analysis_free(&an);
     }
 
-    fclose(fp);
+    free(entries);
+    qfs_close(&img);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,11 +1,15 @@
 /*
 **Program to make a filesystem on a blank file using the qfs parameters
 **
-** Usage: mkfs_qfs <disk image file> [<label>]
+** Usage: mkfs_qfs [-s <size>] [--sparse] [-j <size>] [-V <version>] [--stats[=json]] <disk image file> [<label>]
 **
 ** To create a blank file of a specific size, you can use the following command:
 **   dd if=/dev/zero of=<disk image file> bs=1M count=<size in MB>
 **
+** or let mkfs_qfs create (or resize) it with -s, which takes a size in
+** bytes with an optional K, M or G suffix:
+**   mkfs_qfs -s 4M disk.img MyVolume
+**
 ** Example:
 **   dd if=/dev/zero of=disk.img bs=1M count=4
 **
@@ -14,156 +18,141 @@
 **
 ** This will format 'disk.img' as a 4MB QFS filesystem with the label 'MyVolume'.
 **
+** With --sparse only busy bytes that are not already zero are written,
+** so a freshly created image keeps its holes and formats without
+** touching the disk.
+**
+** With -j (--journal) that many bytes at the end of the image hold a
+** metadata journal, so writes and deletes are made durable with one
+** flush per batch instead of an fsync per tool run:
+**   mkfs_qfs -s 120M -j 256K disk.img
+**
+** Images up to about 128MB are made in the original format (version 1),
+** with 512 to 2048 byte blocks. Larger ones use version 2, which has
+** 32-bit block numbers and 4K to 64K blocks chosen by image size. -V
+** (--format-version) 1 or 2 picks the version instead; a version 1
+** image larger than 128MB only uses its first 65535 blocks:
+**   mkfs_qfs -s 8G disk.img Datasets
+**
+** Like the other tools, --stats (or --stats=json) prints I/O counters
+** and per-phase timings to stderr on exit.
+**
 */
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <getopt.h>
 #include "qfs.h"
+#include "qfs_image.h"
+#include "qfs_format.h"
+#include "qfs_journal.h"
 
-int main(int argc, char *argv[]) {
+static int usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-s <size>[K|M|G]] [--sparse] [-j <journal size>[K|M]] [-V 1|2] [--stats[=json]] <disk image file> [<label>]\n", prog);
+    return 1;
+}
 
-    if (argc < 2 || argc > 3) {
-        fprintf(stderr, "Usage: %s <disk image file> [<label>]\n", argv[0]);
-        return 1;
+int main(int argc, char *argv[]) {
+    size_t create_size = 0;
+    size_t journal_size = 0;
+    int version = 0;
+    int flags = 0;
+    uint64_t value;
+    int opt;
+
+    if (qfs_stats_args(&argc, argv) != QFS_OK) {
+        return usage(argv[0]);
     }
 
-    /*
-    ** Open the disk image file for reading and writing in binary mode
-    **  "rb+" - Open for reading and writing. The file must exist.
-    **           This mode is used to modify an existing file.
-    **  "wb+" - Open for reading and writing. Create an empty file if
-    **           it does not exist or truncate the file to zero length if it does.
-    **  "ab+" - Open for reading and writing. Create an empty file if
-    **           it does not exist. Writing is always done at the end of the file.
-    **           You can use fseek to move the file position indicator for reading.
-    **           Note that writes will always append to the end of the file.
-    */
-    FILE *fp = fopen(argv[1], "rb+");
-    if (!fp) {
-        perror("fopen");
-        return 2;
+    static const struct option long_opts[] = {
+        {"size",   required_argument, NULL, 's'},
+        {"sparse", no_argument,       NULL, 'S'},
+        {"journal", required_argument, NULL, 'j'},
+        {"format-version", required_argument, NULL, 'V'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "s:Sj:V:", long_opts, NULL)) != -1) {
+        if (opt == 's') {
+            if (qfs_parse_size(optarg, SIZE_MAX, &value, NULL) != QFS_OK || value == 0) {
+                fprintf(stderr, "Error: Invalid size '%s'.\n", optarg);
+                return 1;
+            }
+            create_size = (size_t) value;
+        } else if (opt == 'S') {
+            flags |= QFS_FMT_SPARSE;
+        } else if (opt == 'j') {
+            if (qfs_parse_size(optarg, SIZE_MAX, &value, NULL) != QFS_OK || value < QFS_JOURNAL_MIN) {
+                fprintf(stderr, "Error: Journal must be at least %d bytes.\n", QFS_JOURNAL_MIN);
+                return 1;
+            }
+            journal_size = (size_t) value;
+        } else if (opt == 'V') {
+            if (qfs_parse_int(optarg, QFS_V1, QFS_V2, &version) != QFS_OK) {
+                fprintf(stderr, "Error: Format version must be 1 or 2.\n");
+                return 1;
+            }
+        } else {
+            return usage(argv[0]);
+        }
     }
 
-#ifdef DEBUG
-    fprintf(stderr,"Opened disk image: %s\n", argv[1]);
-#endif
+    if (argc - optind < 1 || argc - optind > 2) {
+        return usage(argv[0]);
+    }
 
-    // Initialize superblock structure
-    superblock_t sb;
-    // Set all fields to zero initially
-    memset(&sb, 0, sizeof(superblock_t));
-    // Set QFS magic number
-    sb.fs_type = 0x51; // QFS type
+    const char *image_path = argv[optind];
+    const char *label = (argc - optind == 2) ? argv[optind + 1] : NULL;
 
-    // Set label if provided
-    if (argc == 3) {
-        strncpy((char *)sb.label, argv[2], sizeof(sb.label) - 1); // Make sure filename fits
-        sb.label[sizeof(sb.label) - 1] = '\0'; // Ensure NULL-termination to be safe
+    // Offset past which the image is known to read as zeros
+    size_t zero_from = SIZE_MAX;
 
-#ifdef DEBUG
-    if (argc == 3)
-        fprintf(stderr,"Label: %s\n", argv[2]);
-#endif
+    // Create or resize the image instead of needing dd
+    if (create_size > 0) {
+        if (create_size < QFS_DATA_OFFSET) {
+            fprintf(stderr, "Error: Image must be larger than %zu bytes.\n", QFS_DATA_OFFSET);
+            return 1;
+        }
 
+        int err = qfs_create_image(image_path, create_size, &zero_from);
+        if (err != QFS_OK) {
+            fprintf(stderr, "Error: Cannot create %s: %s\n", image_path, qfs_strerror(err));
+            return 2;
+        }
     }
 
     /*
-    ** Determine file size of disk image
-    **
-    **   fseek sets the file position indicator for the stream pointed to by fp.
-    **
-    **   The second argument of fseek is the offset in bytes from the location specified by the
-    **   third argument. This number can be a positive or negative integer.
-    **
-    **   The third argument is the reference point for the offset:
-    **     SEEK_END sets the position indicator to the end of the file
-    **     SEEK_SET sets the position indicator to the beginning of the file
-    **     SEEK_CUR sets the position indicator to its current location
-    **
-    **   ftell returns the current value of the position indicator
+    ** Map the disk image for reading and writing
     **
+    **   The image has no superblock yet, so it is opened with QFS_RAW to
+    **   skip validation. All writes go straight into the mapping and
+    **   reach the file when it is unmapped.
     */
-    fseek(fp, 0, SEEK_END);
-    long file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-#ifdef DEBUG
-    fprintf(stderr, "File size: %ld bytes\n", file_size);
-#endif
-    
-    // Subtract superblock and dir entries for available space
-    long total_data_available = (file_size - sizeof(superblock_t) - (sizeof(direntry_t) * 255));
-    
-    // Determine block size from disk image size
-    if (file_size <= 31457280) {
-        // <= 30MB (31457280 bytes) = 512 bytes per block
-        sb.bytes_per_block = 512;
-    } else if (file_size <= 62914560) {
-        // > 30MB and <= 60MB (62914560 bytes) = 1024 bytes per block
-        sb.bytes_per_block = 1024;
-    } else {
-        // > 60MB = 2048 bytes per block
-        sb.bytes_per_block = 2048;
+    qfs_image_t img;
+    int err = qfs_open(&img, image_path, QFS_RDWR | QFS_RAW);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", image_path, qfs_strerror(err));
+        return 2;
     }
 
 #ifdef DEBUG
-    fprintf(stderr, "Total data available: %ld\n", total_data_available);
-    fprintf(stderr, "Block size: %d\n", sb.bytes_per_block);
-#endif
-
-    // Divide available data space by determined block size for total blocks
-    sb.total_blocks = (uint16_t) (total_data_available / sb.bytes_per_block);
-
-#ifdef DEBUG
-    fprintf(stderr, "Total blocks: %d\n", sb.total_blocks);
-#endif
-
-    sb.available_blocks = sb.total_blocks;
-
-#ifdef DEBUG
-    fprintf(stderr, "Available blocks: %d\n", sb.available_blocks);
-#endif
-
-    sb.total_direntries = (uint8_t) 255;
-    sb.available_direntries = sb.total_direntries;
-
-#ifdef DEBUG
-    fprintf(stderr, "Total directory entries: %d\n", sb.total_direntries);
-    fprintf(stderr, "Available directory entries: %d\n", sb.available_direntries);
-#endif
-
-    // Create empty block (size of zeroed directory entries)
-    uint8_t dir_zeros[sizeof(direntry_t) * 255] = {0};
-
-#ifdef DEBUG
-    fprintf(stderr, "Size of superblock: %lu bytes\n", sizeof(superblock_t));
-    fprintf(stderr, "Size of directory entries area: %lu bytes\n", sizeof(dir_zeros));
-    fprintf(stderr, "Data blocks start at byte offset: %lu\n", sizeof(superblock_t) + sizeof(dir_zeros));
-#endif
-
-    // Write superblock, directory entries, and data blocks to file
-    fwrite(&sb, sizeof(superblock_t), 1, fp);
-    fwrite(dir_zeros, sizeof(dir_zeros), 1, fp);
-
-#ifdef DEBUG
-    fprintf(stderr,"Clearing data blocks...\n");
+    fprintf(stderr,"Opened disk image: %s\n", image_path);
+    if (label)
+        fprintf(stderr,"Label: %s\n", label);
 #endif
 
-    // Block initialization: mark all data blocks as free (byte 1 of each block = 0)
-    uint8_t data = 0x00;
-    // Move to first data block
-    fseek(fp, sizeof(superblock_t) + sizeof(dir_zeros), SEEK_SET);
-    for (int i = 0; i < sb.total_blocks; i++) {
-        // Set block busy byte to zero
-        fwrite(&data, 1, 1, fp);
-        // Move to next block
-        fseek(fp, sb.bytes_per_block - 1, SEEK_CUR);
+    // Superblock, empty directory and free busy bytes in one pass
+    err = qfs_format(&img, label, version, flags, zero_from, journal_size);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Invalid filesystem geometry.\n");
+        qfs_close(&img);
+        return 3;
     }
 
-    // Flush and close file [IMPORTANT!]
-    fflush(fp);
-    fclose(fp);
+    // Unmap and close file [IMPORTANT!]
+    qfs_close(&img);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -6,6 +6,9 @@
 **
 */
 
+#ifndef QFS_H
+#define QFS_H
+
 #include <stdio.h>
 #include <stdint.h>
 
@@ -23,21 +26,38 @@ typedef struct superblock {
   char      label[15];             // NULL-terminated volume label (optional)
 } superblock_t;
 
+// QFS v2 Superblock Extension (follows the superblock on version 2 images,
+// whose 16-bit superblock counters and block size are left at 0)
+typedef struct superblock_ext {
+  uint32_t  total_blocks;          // Total number of blocks
+  uint32_t  available_blocks;      // Number of blocks available
+  uint32_t  bytes_per_block;       // Number of bytes per block
+  uint32_t  data_offset;           // Byte offset of the first data block
+  uint8_t   reserved[16];          // Reserved, all set to 0
+} superblock_ext_t;
+
 // QFS Directory Entry Structure
 typedef struct direntry {
     char     filename[23];         // NULL-terminated
     uint8_t  permissions;          // File permissions (e.g., read, write, execute)
-    uint8_t  owner_id;             // Owner ID
-    uint8_t  group_id;             // Group ID
-    uint16_t starting_block;       // Starting block number
+    union {
+        struct {
+            uint8_t  owner_id;     // Owner ID
+            uint8_t  group_id;     // Group ID
+        };
+        uint16_t starting_block_hi;  // v2: high 16 bits of the starting block
+    };
+    uint16_t starting_block;       // Starting block number (low 16 bits on v2)
     uint32_t file_size;            // Size of the file in bytes
 } direntry_t;
 
 // QFS File Block Structure (note that the data area size is dynamic based on bytes_per_block)
 typedef struct fileblock {
     uint8_t  is_busy;              // Free/busy byte (1 = free, 0 = busy)
-    uint8_t  *data;                // Data area (of size bytes_per_block - 3)
-    uint16_t next_block;           // Next block number (if applicable)
+    uint8_t  *data;                // Data area (of size bytes_per_block - 3, - 5 on v2)
+    uint16_t next_block;           // Next block number (if applicable, 32-bit on v2)
 } fileblock_t;
 
-#pragma pack(pop)
\ No newline at end of file
+#pragma pack(pop)
+
+#endif // QFS_H
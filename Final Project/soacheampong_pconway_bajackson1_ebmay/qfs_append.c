@@ -0,0 +1,208 @@
+/*
+**Program to add bytes to the end of a file on a QFS image
+**
+** Usage: qfs_append [--stats[=json]] <disk image file> <file> [<host file> | -]
+**
+** The bytes come from the host file, or from standard input when it is
+** '-' or left out, e.g. 'dmesg | qfs_append disk.img boot.log'. The last
+** block of the file is filled before any new block is taken, and only
+** the new blocks are linked on, so appending to a large file costs no
+** more than appending to a small one.
+**
+** Two kinds of file cannot be appended to. A compressed file (write_file
+** -z) would have to be packed again as a whole. A file whose blocks are
+** shared with identical files (write_file -d) would change under the
+** other files; it can be appended to once it is the only one left.
+**
+** Exit status: 0 appended, 3 system error, 4 file not found, 7 no space,
+** 9 file is compressed, 10 file shares its blocks, 11 other error.
+**
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "qfs.h"
+#include "qfs_image.h"
+#include "qfs_dir.h"
+#include "qfs_file.h"
+#include "qfs_proto.h"
+
+// Bytes read from the source at a time
+#define READ_BYTES  (1 << 20)
+
+static int usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--stats[=json]] <disk image file> <file> [<host file> | -]\n", prog);
+    return 1;
+}
+
+// Exit code for a failed append
+static int exit_code(int err) {
+    switch (err) {
+        case QFS_ESYS:        return 3;
+        case QFS_ENOENT:      return 4;
+        case QFS_ENOSPC:      return 7;
+        case QFS_ECOMPRESSED: return 9;
+        case QFS_ESHARED:     return 10;
+        default:              return 11;
+    }
+}
+
+// Read a whole stream into memory (it may be a pipe, so its size is not
+// known up front), returns NULL with errno set on failure
+static uint8_t *load_stream(FILE *src, uint32_t *size) {
+    uint8_t *buf = NULL;
+    size_t len = 0, cap = 0;
+
+    for (;;) {
+        if (cap - len < READ_BYTES) {
+            cap = cap ? cap * 2 : READ_BYTES;
+            if (cap > UINT32_MAX) {
+                free(buf);
+                errno = EFBIG;
+                return NULL;
+            }
+            uint8_t *grown = realloc(buf, cap);
+            if (!grown) {
+                free(buf);
+                return NULL;
+            }
+            buf = grown;
+        }
+
+        size_t got = fread(buf + len, 1, READ_BYTES, src);
+        len += got;
+        if (got < READ_BYTES) {
+            break;
+        }
+    }
+
+    if (ferror(src) || len > UINT32_MAX) {
+        free(buf);
+        errno = ferror(src) ? EIO : EFBIG;
+        return NULL;
+    }
+
+    *size = (uint32_t) len;
+    return buf;
+}
+
+// Have qfsd append to the file instead of opening the image
+static int append_remote(const char *sock_path, const char *image_path, const char *name,
+                         const uint8_t *data, uint32_t len) {
+    int fd = qfs_client_connect(sock_path);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot reach qfsd at %s: %s\n", sock_path, qfs_strerror(fd));
+        return 2;
+    }
+
+    qfs_resp_hdr_t resp;
+    qfs_file_info_t info;
+    int err = qfs_client_call(fd, QFS_OP_APPEND, 0, image_path, name, data, len, &resp);
+
+    if (err == QFS_ENOIMG) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", image_path, qfs_strerror(err));
+        close(fd);
+        return 2;
+    }
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot append to '%s': %s\n", name, qfs_strerror(err));
+        close(fd);
+        return exit_code(err);
+    }
+    if (resp.data_len != sizeof(info) || qfs_recv_all(fd, &info, sizeof(info)) != QFS_OK) {
+        fprintf(stderr, "Error: Bad reply from qfsd.\n");
+        close(fd);
+        return 3;
+    }
+    close(fd);
+
+    printf("Appended %u bytes to '%s' (Size: %u, %u blocks).\n",
+           len, name, info.entry.file_size, info.blocks);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (qfs_stats_args(&argc, argv) != QFS_OK || argc < 3 || argc > 4) {
+        return usage(argv[0]);
+    }
+
+    const char *image_path = argv[1];
+    const char *name = argv[2];
+    const char *src_path = argc == 4 && strcmp(argv[3], "-") != 0 ? argv[3] : NULL;
+
+    FILE *src = src_path ? fopen(src_path, "rb") : stdin;
+    if (!src) {
+        perror("Error: Cannot open source file");
+        return 3;
+    }
+
+    uint32_t len;
+    uint8_t *data = load_stream(src, &len);
+    if (src != stdin) {
+        fclose(src);
+    }
+    if (!data) {
+        perror("Error: Cannot read source");
+        return 3;
+    }
+
+    const char *sock_path = qfs_client_socket();
+    if (sock_path) {
+        int status = append_remote(sock_path, image_path, name, data, len);
+        free(data);
+        return status;
+    }
+
+    qfs_image_t img;
+    int err = qfs_open(&img, image_path, QFS_RDWR);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", image_path, qfs_strerror(err));
+        free(data);
+        return 2;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "Opened disk image: %s\n", image_path);
+#endif
+
+    qfs_dir_t *dir = qfs_get_dir(&img);
+    if (!dir) {
+        fprintf(stderr, "Error: Failed to load directory.\n");
+        free(data);
+        qfs_close(&img);
+        return 3;
+    }
+
+    int slot = qfs_dir_lookup(dir, name);
+    if (slot < 0) {
+        fprintf(stderr, "Error: File '%s' not found.\n", name);
+        free(data);
+        qfs_close(&img);
+        return 4;
+    }
+
+    // The entry, superblock and busy bytes are committed on close
+    err = qfs_append_file(&img, slot, data, len);
+    free(data);
+    if (err != QFS_OK) {
+        if (err == QFS_ESHARED) {
+            fprintf(stderr, "Error: Cannot append to '%s': %s (%d files use them).\n",
+                    name, qfs_strerror(QFS_ESHARED), qfs_shared_files(&img, slot));
+        } else {
+            fprintf(stderr, "Error: Cannot append to '%s': %s\n", name, qfs_strerror(err));
+        }
+        qfs_close(&img);
+        return exit_code(err);
+    }
+
+    const direntry_t *entry = &dir->entries[slot];
+    printf("Appended %u bytes to '%s' (Size: %u, %u blocks).\n",
+           len, name, entry->file_size, qfs_blocks_for(&img, entry->file_size));
+
+    qfs_close(&img);
+    return 0;
+}
@@ -0,0 +1,900 @@
+/*
+**Program to benchmark QFS operations
+**
+** Usage: qfs_bench [-S <seed>] [-s <size>[,<size>...]] [-r <repeats>] [-V <version>] [-d <dir>] [-o <file>]
+**
+** Creates images of each size (default 4M, 30M, 60M and 120M, which cover
+** the 512, 1024 and 2048 byte block sizes mkfs_qfs picks) and times
+** these workloads on every one through libqfs. Images are formatted the
+** way mkfs_qfs would, version 2 past 128MB, unless -V picks a version:
+**
+**   format        qfs_create_image + qfs_format, -r times
+**   write_small   200 files of 4KB
+**   extract_small every small file to /dev/null
+**   delete_small  every small file
+**   write_large   16 files of 1/32 of the image each
+**   extract_large every large file to /dev/null
+**   range_large   2000 seeded 4KB reads at random offsets of the large
+**                 files through qfs_pread
+**   list          every used directory entry formatted, -r times
+**   recover_scan  qfs_carve_blocks over the whole image, -r times
+**   delete_large  every large file
+**   write_lz      as many large files of seeded text, compressed
+**   extract_lz    every compressed file to /dev/null
+**   range_lz      the range reads over the compressed files
+**   delete_lz     every compressed file
+**   write_dup     200 files of 16KB, each a copy of one of 20 seeded
+**                 contents, written plainly
+**   delete_dup    every one of them
+**   write_dedup   the same files written with deduplication
+**   delete_dedup  every one of them
+**   write_tiny    up to 20000 files of 64 bytes, growing the directory
+**                 into extension blocks
+**   lookup        as many seeded lookups by name
+**   list_tiny     the listing with every tiny file in it, -r times
+**   delete_tiny   every tiny file
+**
+** Then the image is aged by rounds of seeded deletes and first-fit
+** writes until its free space is fragmented, and extract, range, list,
+** recover_scan, write_small and delete run again on the aged image.
+**
+** File contents, sizes and the aging are all drawn from one seeded
+** generator, so two runs with the same -S do exactly the same work.
+** Results go to stdout (or -o) as JSON, one record per image, state and
+** workload, with MB/s, ops/s and per-operation latency percentiles. MB/s
+** counts bytes as written, so for the _lz workloads it includes the
+** compression or decompression, and their records add the stored bytes
+** and the compression ratio. write_dup and write_dedup report the bytes
+** written to new blocks the same way, so their ratios compare the space
+** and write I/O deduplication saves. Set
+** QFS_CACHE to benchmark through the block cache.
+**
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include "qfs.h"
+#include "qfs_image.h"
+#include "qfs_bitmap.h"
+#include "qfs_dir.h"
+#include "qfs_file.h"
+#include "qfs_format.h"
+#include "qfs_carve.h"
+#include "qfs_defrag.h"
+#include "qfs_map.h"
+#include "qfs_lz.h"
+
+#define SMALL_FILES      200
+#define SMALL_SIZE       4096
+#define LARGE_FILES      16
+#define AGED_FILES       150      // Leaves directory entries for write_small
+#define AGED_FILL        98       // Percent of blocks in use while aging
+#define AGE_ROUNDS       30
+#define TINY_FILES       20000    // Far past the 255-entry root table
+#define TINY_SIZE        64
+#define RANGE_READS      2000
+#define RANGE_SIZE       4096
+#define DUP_FILES        200
+#define DUP_DISTINCT     20       // Distinct contents among the DUP_FILES
+#define DUP_SIZE         16384
+
+// Timings of one workload
+typedef struct workload {
+    uint64_t *lat;         // Nanoseconds per operation
+    size_t    n, cap;
+    uint64_t  bytes;
+    uint64_t  stored;      // Bytes on disk, when they differ (compressed files)
+    uint64_t  total_ns;    // Whole workload, including the final commit
+} workload_t;
+
+// Where the JSON goes, and whether a record has been written yet
+static FILE *out;
+static int n_records;
+static int format_version;     // -V, 0 to choose by size
+static int image_version;      // Version of the image being measured
+
+static uint64_t rng_state;
+
+static int usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-S <seed>] [-s <size>[,<size>...]] [-r <repeats>] [-V <version>] [-d <dir>] [-o <file>]\n", prog);
+    return 1;
+}
+
+// xorshift64*, the only source of randomness
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static uint32_t rng_below(uint32_t n) {
+    return (uint32_t) (rng_next() % n);
+}
+
+// Fill a buffer with seeded bytes shaped like a JPEG, so recover_scan
+// has markers to find
+static void fill_file(uint8_t *buf, uint32_t len) {
+    for (uint32_t i = 0; i + 8 <= len; i += 8) {
+        uint64_t v = rng_next();
+        memcpy(buf + i, &v, 8);
+    }
+    for (uint32_t i = len & ~7u; i < len; i++) {
+        buf[i] = (uint8_t) rng_next();
+    }
+    if (len >= 4) {
+        buf[0] = 0xFF;
+        buf[1] = QFS_JPEG_SOI;
+        buf[len - 2] = 0xFF;
+        buf[len - 1] = QFS_JPEG_EOI;
+    }
+}
+
+// Fill a buffer with seeded CSV-like text, which compresses about as well
+// as the logs and exports stored in practice
+static void fill_text(uint8_t *buf, uint32_t len) {
+    static const char *const words[] = {
+        "alpha", "bravo", "delta", "block", "write", "read", "ok", "error",
+        "qfs", "image", "chunk", "extent", "user", "group", "2024-05-01", "GET"
+    };
+    uint32_t pos = 0;
+
+    while (pos < len) {
+        char field[32];
+        const char *word = words[rng_below(16)];
+        size_t n = strlen(word);
+        uint32_t number = rng_below(1000);
+
+        memcpy(field, word, n);
+        field[n++] = (char) ('0' + number / 100);
+        field[n++] = (char) ('0' + number / 10 % 10);
+        field[n++] = (char) ('0' + number % 10);
+        field[n++] = pos % 80 > 70 ? '\n' : ',';
+
+        for (size_t i = 0; i < n && pos < len; i++) {
+            buf[pos++] = (uint8_t) field[i];
+        }
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static void wl_start(workload_t *w) {
+    w->n = 0;
+    w->bytes = 0;
+    w->stored = 0;
+    w->total_ns = now_ns();
+}
+
+static void wl_add(workload_t *w, uint64_t ns, uint64_t bytes) {
+    if (w->n == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 256;
+        uint64_t *grown = realloc(w->lat, cap * sizeof(uint64_t));
+        if (!grown) {
+            return;
+        }
+        w->lat = grown;
+        w->cap = cap;
+    }
+    w->lat[w->n++] = ns;
+    w->bytes += bytes;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const workload_t *w, double p) {
+    size_t i = (size_t) (p * (double) (w->n - 1) + 0.5);
+    return (double) w->lat[i] / 1000.0;
+}
+
+// Close a workload and write its JSON record
+static void wl_report(workload_t *w, const char *workload, const char *state,
+                      size_t image_size, uint32_t block_size, const qfs_frag_stats_t *st) {
+    w->total_ns = now_ns() - w->total_ns;
+    if (w->n == 0) {
+        return;
+    }
+    qsort(w->lat, w->n, sizeof(uint64_t), cmp_u64);
+
+    double secs = (double) w->total_ns / 1e9;
+
+    fprintf(out, "%s\n    {\"image_bytes\": %zu, \"version\": %d, \"block_size\": %u, \"state\": \"%s\", "
+            "\"fragmentation\": %.2f, \"fragmented_files\": %u, \"workload\": \"%s\", "
+            "\"ops\": %zu, \"bytes\": %llu, "
+            "\"seconds\": %.6f, \"mb_per_s\": %.2f, \"ops_per_s\": %.1f, "
+            "\"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f",
+            n_records ? "," : "", image_size, image_version, block_size, state, st->score, st->fragmented, workload,
+            w->n, (unsigned long long) w->bytes, secs,
+            secs > 0 ? (double) w->bytes / (1024.0 * 1024.0) / secs : 0.0,
+            secs > 0 ? (double) w->n / secs : 0.0,
+            percentile_us(w, 0.50), percentile_us(w, 0.90), percentile_us(w, 0.99),
+            (double) w->lat[w->n - 1] / 1000.0);
+    if (w->stored) {
+        fprintf(out, ", \"stored_bytes\": %llu, \"ratio\": %.2f",
+                (unsigned long long) w->stored, (double) w->bytes / (double) w->stored);
+    }
+    fprintf(out, "}");
+    n_records++;
+
+    fprintf(stderr, "  %-6s %-14s %6zu ops %10.2f MB/s   p50 %9.1f us   p99 %9.1f us",
+            state, workload, w->n,
+            secs > 0 ? (double) w->bytes / (1024.0 * 1024.0) / secs : 0.0,
+            percentile_us(w, 0.50), percentile_us(w, 0.99));
+    if (w->stored) {
+        fprintf(stderr, "   ratio %.2f", (double) w->bytes / (double) w->stored);
+    }
+    fprintf(stderr, "\n");
+}
+
+// Format a fresh image, returns QFS_OK or an error code
+static int make_image(const char *path, size_t size) {
+    size_t zero_from = SIZE_MAX;
+    int err = qfs_create_image(path, size, &zero_from);
+    if (err != QFS_OK) {
+        return err;
+    }
+
+    qfs_image_t img;
+    err = qfs_open(&img, path, QFS_RDWR | QFS_RAW);
+    if (err != QFS_OK) {
+        return err;
+    }
+    err = qfs_format(&img, "bench", format_version, QFS_FMT_SPARSE, zero_from, 0);
+    qfs_close(&img);
+    return err;
+}
+
+// Write one file of len seeded bytes, returns its slot or an error code
+static int write_one(qfs_image_t *img, const char *name, uint8_t *buf, uint32_t len,
+                     int policy, workload_t *w) {
+    qfs_write_req_t req;
+    memset(&req, 0, sizeof(req));
+    req.path = name;
+    req.data = buf;
+    req.size = len;
+
+    fill_file(buf, len);
+
+    uint64_t t0 = now_ns();
+    qfs_write_files(img, &req, 1, policy);
+    uint64_t t1 = now_ns();
+
+    if (req.status != QFS_OK) {
+        return req.status;
+    }
+    if (w) {
+        wl_add(w, t1 - t0, len);
+    }
+    return req.slot;
+}
+
+// Delete one file by slot
+static int delete_one(qfs_image_t *img, int slot, workload_t *w) {
+    uint32_t size = img->dirindex->entries[slot].file_size;
+
+    uint64_t t0 = now_ns();
+    int err = qfs_delete_file(img, slot);
+    uint64_t t1 = now_ns();
+
+    if (w) {
+        wl_add(w, t1 - t0, size);
+    }
+    return err;
+}
+
+// Copy every file whose name starts with prefix to /dev/null
+static int run_extract(qfs_image_t *img, const char *prefix, workload_t *w, int null_fd) {
+    qfs_dir_t *dir = qfs_get_dir(img);
+    size_t plen = strlen(prefix);
+
+    for (int i = 0; i < dir->n_slots; i++) {
+        const direntry_t *entry = &dir->entries[i];
+        if (!qfs_dir_is_file(dir, i) || strncmp(entry->filename, prefix, plen) != 0) {
+            continue;
+        }
+
+        uint64_t t0 = now_ns();
+        int err = qfs_read_to_fd(img, entry, null_fd);
+        uint64_t t1 = now_ns();
+
+        if (err != QFS_OK) {
+            return err;
+        }
+        wl_add(w, t1 - t0, (uint64_t) qfs_file_size(img, entry));
+        if ((entry->permissions & QFS_TYPE_MASK) == QFS_TYPE_LZ) {
+            w->stored += entry->file_size;
+        }
+    }
+    return QFS_OK;
+}
+
+// Read RANGE_SIZE bytes at seeded offsets of seeded files whose name starts with prefix
+static int run_range(qfs_image_t *img, const char *prefix, uint8_t *buf, workload_t *w) {
+    qfs_dir_t *dir = qfs_get_dir(img);
+    size_t plen = strlen(prefix);
+    int *slots = malloc((size_t) dir->n_slots * sizeof(int));
+    int n = 0;
+    if (!slots) {
+        return QFS_ESYS;
+    }
+
+    for (int i = 0; i < dir->n_slots; i++) {
+        if (qfs_dir_is_file(dir, i) && strncmp(dir->entries[i].filename, prefix, plen) == 0) {
+            slots[n++] = i;
+        }
+    }
+
+    for (int r = 0; n > 0 && r < RANGE_READS; r++) {
+        int slot = slots[rng_below((uint32_t) n)];
+        int64_t size = qfs_file_size(img, &dir->entries[slot]);
+        if (size < 0) {
+            free(slots);
+            return (int) size;
+        }
+        uint32_t offset = rng_below((uint32_t) size);
+
+        uint64_t t0 = now_ns();
+        int64_t got = qfs_pread(img, slot, buf, RANGE_SIZE, offset);
+        uint64_t t1 = now_ns();
+
+        if (got < 0) {
+            free(slots);
+            return (int) got;
+        }
+        wl_add(w, t1 - t0, (uint64_t) got);
+    }
+
+    free(slots);
+    return QFS_OK;
+}
+
+// Delete every file whose name starts with prefix
+static int run_delete(qfs_image_t *img, const char *prefix, workload_t *w) {
+    qfs_dir_t *dir = qfs_get_dir(img);
+    size_t plen = strlen(prefix);
+
+    for (int i = 0; i < dir->n_slots; i++) {
+        const direntry_t *entry = &dir->entries[i];
+        if (!qfs_dir_is_file(dir, i) || strncmp(entry->filename, prefix, plen) != 0) {
+            continue;
+        }
+
+        int err = delete_one(img, i, w);
+        if (err != QFS_OK) {
+            return err;
+        }
+    }
+    return qfs_commit(img);
+}
+
+// Format the listing list_information prints, into a throwaway buffer
+static int run_list(qfs_image_t *img, int repeats, workload_t *w) {
+    static char line[128];
+    qfs_dir_t *dir = qfs_get_dir(img);
+    direntry_t *entries = malloc((size_t) (dir->n_used + 1) * sizeof(direntry_t));
+    if (!entries) {
+        return QFS_ESYS;
+    }
+
+    for (int r = 0; r < repeats; r++) {
+        uint64_t t0 = now_ns();
+        int n = qfs_dir_listing(dir, entries);
+        uint64_t bytes = 0;
+
+        for (int i = 0; i < n; i++) {
+            const direntry_t *entry = &entries[i];
+            if ((entry->permissions & QFS_TYPE_MASK) != QFS_TYPE_DIR) {
+                bytes += (uint64_t) snprintf(line, sizeof(line), "%-24s %-10u %-10u %-15u\n",
+                                             entry->filename, entry->file_size,
+                                             entry->permissions,
+                                             qfs_entry_start(entry, img->version));
+            }
+        }
+        wl_add(w, now_ns() - t0, bytes);
+    }
+
+    free(entries);
+    return QFS_OK;
+}
+
+// Look up count seeded names out of <prefix>0000 to <prefix><count - 1>
+static int run_lookup(qfs_image_t *img, const char *prefix, int count, workload_t *w) {
+    qfs_dir_t *dir = qfs_get_dir(img);
+    char name[sizeof(((direntry_t *) 0)->filename)];
+
+    for (int i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "%s%04d", prefix, (int) rng_below((uint32_t) count));
+
+        uint64_t t0 = now_ns();
+        int slot = qfs_dir_lookup(dir, name);
+        uint64_t t1 = now_ns();
+
+        if (slot < 0) {
+            return QFS_ENOENT;
+        }
+        wl_add(w, t1 - t0, sizeof(direntry_t));
+    }
+    return QFS_OK;
+}
+
+static int run_recover(qfs_image_t *img, int repeats, workload_t *w) {
+    for (int r = 0; r < repeats; r++) {
+        qfs_carved_t *files;
+
+        uint64_t t0 = now_ns();
+        int n = qfs_carve_blocks(img, 0, &files);
+        uint64_t t1 = now_ns();
+
+        if (n < 0) {
+            return n;
+        }
+        qfs_carved_free(files, n);
+        wl_add(w, t1 - t0, (uint64_t) img->total_blocks * img->block_size);
+    }
+    return QFS_OK;
+}
+
+// Write count files of len bytes named <prefix><n>, stopping early if full
+static int run_write(qfs_image_t *img, const char *prefix, int count, uint32_t len,
+                     uint8_t *buf, workload_t *w) {
+    char name[sizeof(((direntry_t *) 0)->filename)];
+
+    for (int i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "%s%04d", prefix, i);
+        int slot = write_one(img, name, buf, len, QFS_ALLOC_BEST_FIT, w);
+        if (slot == QFS_ENOSPC || slot == QFS_ENODIR) {
+            break;
+        }
+        if (slot < 0) {
+            return slot;
+        }
+    }
+    return qfs_commit(img);
+}
+
+// Write count files of len bytes of seeded text, compressed the way
+// write_file -z does it, stopping early if full
+static int run_write_lz(qfs_image_t *img, const char *prefix, int count, uint32_t len,
+                        uint8_t *buf, workload_t *w) {
+    char name[sizeof(((direntry_t *) 0)->filename)];
+
+    for (int i = 0; i < count; i++) {
+        qfs_write_req_t req;
+        memset(&req, 0, sizeof(req));
+        snprintf(name, sizeof(name), "%s%04d", prefix, i);
+        req.path = name;
+
+        fill_text(buf, len);
+
+        uint64_t t0 = now_ns();
+        uint8_t *packed;
+        uint32_t packed_len;
+        int err = qfs_lz_pack(buf, len, img->payload, &packed, &packed_len);
+        if (err != QFS_OK) {
+            return err;
+        }
+        req.data = packed ? packed : buf;
+        req.size = packed ? packed_len : len;
+        req.type = packed ? QFS_TYPE_LZ : QFS_TYPE_FILE;
+        qfs_write_files(img, &req, 1, QFS_ALLOC_BEST_FIT);
+        uint64_t t1 = now_ns();
+
+        free(packed);
+        if (req.status == QFS_ENOSPC || req.status == QFS_ENODIR) {
+            break;
+        }
+        if (req.status != QFS_OK) {
+            return req.status;
+        }
+        wl_add(w, t1 - t0, len);
+        w->stored += req.size;
+    }
+    return qfs_commit(img);
+}
+
+// Write count files of len bytes, file i a copy of content i % DUP_DISTINCT
+// in pool, sharing chains if dedup is set, stopping early if full
+static int run_write_dup(qfs_image_t *img, const char *prefix, int count, uint32_t len,
+                         const uint8_t *pool, int dedup, workload_t *w) {
+    char name[sizeof(((direntry_t *) 0)->filename)];
+
+    for (int i = 0; i < count; i++) {
+        qfs_write_req_t req;
+        memset(&req, 0, sizeof(req));
+        snprintf(name, sizeof(name), "%s%04d", prefix, i);
+        req.path = name;
+        req.data = pool + (size_t) (i % DUP_DISTINCT) * len;
+        req.size = len;
+        req.dedup = (uint8_t) dedup;
+
+        uint64_t t0 = now_ns();
+        qfs_write_files(img, &req, 1, QFS_ALLOC_BEST_FIT);
+        uint64_t t1 = now_ns();
+
+        if (req.status == QFS_ENOSPC || req.status == QFS_ENODIR) {
+            break;
+        }
+        if (req.status != QFS_OK) {
+            return req.status;
+        }
+        wl_add(w, t1 - t0, len);
+        w->stored += req.shared ? 0 : len;
+    }
+    return qfs_commit(img);
+}
+
+// Churn the image with seeded deletes and first-fit writes of mixed sizes.
+// Sizes average what fills the image with AGED_FILES files, so a new file
+// often finds no single hole left by the deletes that is large enough.
+static int age_image(qfs_image_t *img, uint8_t *buf, uint32_t max_len) {
+    qfs_dir_t *dir = qfs_get_dir(img);
+    qfs_bitmap_t *bm = qfs_get_bitmap(img);
+    char name[sizeof(((direntry_t *) 0)->filename)];
+    int serial = 0;
+
+    for (int round = 0; round < AGE_ROUNDS; round++) {
+        // Delete about a third of the files
+        for (int i = 0; i < dir->n_slots; i++) {
+            if (qfs_dir_is_file(dir, i) && rng_below(3) == 0) {
+                int err = delete_one(img, i, NULL);
+                if (err != QFS_OK) {
+                    return err;
+                }
+            }
+        }
+
+        // Refill to the target
+        int files = dir->n_used;
+        while (files < AGED_FILES
+               && (uint64_t) bm->free_count * 100 > (uint64_t) img->total_blocks * (100 - AGED_FILL)) {
+            uint32_t len = 1024 + rng_below(max_len - 1024);
+
+            snprintf(name, sizeof(name), "aged%05d", serial++);
+            int slot = write_one(img, name, buf, len, QFS_ALLOC_FIRST_FIT, NULL);
+            if (slot == QFS_ENOSPC || slot == QFS_ENODIR) {
+                break;
+            }
+            if (slot < 0) {
+                return slot;
+            }
+            files++;
+        }
+    }
+    return qfs_commit(img);
+}
+
+// Every workload on one image size
+static int bench_size(const char *dir, size_t size, int repeats, int null_fd) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench_%zu.img", dir, size);
+
+    image_version = format_version ? format_version : qfs_version_for(size);
+    uint32_t block_size = qfs_block_size_for(size, image_version);
+    uint32_t large = (uint32_t) (size / 32);
+    workload_t w;
+    memset(&w, 0, sizeof(w));
+
+    qfs_frag_stats_t fresh;
+    memset(&fresh, 0, sizeof(fresh));
+
+    fprintf(stderr, "Image of %zu bytes, version %d, %u byte blocks\n", size, image_version, block_size);
+
+    uint8_t *buf = malloc(large > SMALL_SIZE ? large : SMALL_SIZE);
+    if (!buf) {
+        return QFS_ESYS;
+    }
+
+    // format
+    wl_start(&w);
+    for (int r = 0; r < repeats; r++) {
+        unlink(path);
+        uint64_t t0 = now_ns();
+        int err = make_image(path, size);
+        if (err != QFS_OK) {
+            free(buf);
+            free(w.lat);
+            return err;
+        }
+        wl_add(&w, now_ns() - t0, size);
+    }
+    wl_report(&w, "format", "fresh", size, block_size, &fresh);
+
+    // Metadata is loaded up front so it is not charged to the first write
+    qfs_image_t img;
+    int err = qfs_open(&img, path, QFS_RDWR);
+    if (err == QFS_OK && (!qfs_get_dir(&img) || !qfs_get_bitmap(&img))) {
+        qfs_close(&img);
+        err = QFS_ESYS;
+    }
+    if (err != QFS_OK) {
+        free(buf);
+        free(w.lat);
+        return err;
+    }
+
+    // Fresh image
+    wl_start(&w);
+    err = run_write(&img, "small", SMALL_FILES, SMALL_SIZE, buf, &w);
+    wl_report(&w, "write_small", "fresh", size, block_size, &fresh);
+
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_extract(&img, "small", &w, null_fd);
+        wl_report(&w, "extract_small", "fresh", size, block_size, &fresh);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_delete(&img, "small", &w);
+        wl_report(&w, "delete_small", "fresh", size, block_size, &fresh);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_write(&img, "large", LARGE_FILES, large, buf, &w);
+        wl_report(&w, "write_large", "fresh", size, block_size, &fresh);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_extract(&img, "large", &w, null_fd);
+        wl_report(&w, "extract_large", "fresh", size, block_size, &fresh);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_range(&img, "large", buf, &w);
+        wl_report(&w, "range_large", "fresh", size, block_size, &fresh);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_list(&img, repeats, &w);
+        wl_report(&w, "list", "fresh", size, block_size, &fresh);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_recover(&img, repeats, &w);
+        wl_report(&w, "recover_scan", "fresh", size, block_size, &fresh);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_delete(&img, "large", &w);
+        wl_report(&w, "delete_large", "fresh", size, block_size, &fresh);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_write_lz(&img, "lz", LARGE_FILES, large, buf, &w);
+        wl_report(&w, "write_lz", "fresh", size, block_size, &fresh);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_extract(&img, "lz", &w, null_fd);
+        wl_report(&w, "extract_lz", "fresh", size, block_size, &fresh);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_range(&img, "lz", buf, &w);
+        wl_report(&w, "range_lz", "fresh", size, block_size, &fresh);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_delete(&img, "lz", &w);
+        wl_report(&w, "delete_lz", "fresh", size, block_size, &fresh);
+    }
+
+    // Duplicate-heavy files, without and then with deduplication
+    uint8_t *pool = err == QFS_OK ? malloc((size_t) DUP_DISTINCT * DUP_SIZE) : NULL;
+    if (err == QFS_OK && !pool) {
+        err = QFS_ESYS;
+    }
+    if (err == QFS_OK) {
+        fill_file(pool, DUP_DISTINCT * DUP_SIZE);
+        wl_start(&w);
+        err = run_write_dup(&img, "dup", DUP_FILES, DUP_SIZE, pool, 0, &w);
+        wl_report(&w, "write_dup", "fresh", size, block_size, &fresh);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_delete(&img, "dup", &w);
+        wl_report(&w, "delete_dup", "fresh", size, block_size, &fresh);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_write_dup(&img, "dedup", DUP_FILES, DUP_SIZE, pool, 1, &w);
+        wl_report(&w, "write_dedup", "fresh", size, block_size, &fresh);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_delete(&img, "dedup", &w);
+        wl_report(&w, "delete_dedup", "fresh", size, block_size, &fresh);
+    }
+    free(pool);
+
+    // A directory far larger than the root table, as many files as half
+    // the free blocks allow
+    int tiny = TINY_FILES;
+    if (err == QFS_OK && (int) (img.bitmap->free_count / 2) < tiny) {
+        tiny = (int) (img.bitmap->free_count / 2);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_write(&img, "tiny", tiny, TINY_SIZE, buf, &w);
+        wl_report(&w, "write_tiny", "fresh", size, block_size, &fresh);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_lookup(&img, "tiny", tiny, &w);
+        wl_report(&w, "lookup", "fresh", size, block_size, &fresh);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_list(&img, repeats, &w);
+        wl_report(&w, "list_tiny", "fresh", size, block_size, &fresh);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_delete(&img, "tiny", &w);
+        wl_report(&w, "delete_tiny", "fresh", size, block_size, &fresh);
+    }
+
+    // Aged image
+    qfs_frag_stats_t st;
+    memset(&st, 0, sizeof(st));
+
+    if (err == QFS_OK) {
+        uint64_t avg = (uint64_t) img.total_blocks * img.payload / 100 * AGED_FILL / AGED_FILES;
+        err = age_image(&img, buf, (uint32_t) (avg * 2 < large ? avg * 2 : large));
+    }
+    if (err == QFS_OK) {
+        err = qfs_frag_stats(&img, &st);
+        fprintf(stderr, "  aged to %.1f%% fragmentation (%u of %u files fragmented)\n",
+                st.score, st.fragmented, st.files);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_extract(&img, "aged", &w, null_fd);
+        wl_report(&w, "extract", "aged", size, block_size, &st);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_range(&img, "aged", buf, &w);
+        wl_report(&w, "range", "aged", size, block_size, &st);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_list(&img, repeats, &w);
+        wl_report(&w, "list", "aged", size, block_size, &st);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_recover(&img, repeats, &w);
+        wl_report(&w, "recover_scan", "aged", size, block_size, &st);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_write(&img, "small", QFS_DIR_ENTRIES - AGED_FILES, SMALL_SIZE, buf, &w);
+        wl_report(&w, "write_small", "aged", size, block_size, &st);
+    }
+    if (err == QFS_OK) {
+        wl_start(&w);
+        err = run_delete(&img, "", &w);
+        wl_report(&w, "delete", "aged", size, block_size, &st);
+    }
+
+    qfs_close(&img);
+    unlink(path);
+    free(buf);
+    free(w.lat);
+    return err;
+}
+
+int main(int argc, char *argv[]) {
+    const char *sizes = "4M,30M,60M,120M";
+    const char *dir = NULL;
+    const char *out_path = NULL;
+    uint64_t seed = 1;
+    int repeats = 5;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "S:s:r:V:d:o:")) != -1) {
+        if (opt == 'S') {
+            seed = strtoull(optarg, NULL, 10);
+        } else if (opt == 's') {
+            sizes = optarg;
+        } else if (opt == 'r') {
+            if (qfs_parse_int(optarg, 1, INT_MAX, &repeats) != QFS_OK) {
+                return usage(argv[0]);
+            }
+        } else if (opt == 'V') {
+            if (qfs_parse_int(optarg, QFS_V1, QFS_V2, &format_version) != QFS_OK) {
+                return usage(argv[0]);
+            }
+        } else if (opt == 'd') {
+            dir = optarg;
+        } else if (opt == 'o') {
+            out_path = optarg;
+        } else {
+            return usage(argv[0]);
+        }
+    }
+
+    if (optind != argc) {
+        return usage(argv[0]);
+    }
+
+    // Images go to a scratch directory unless -d names one
+    char tmp_dir[] = "/tmp/qfs_bench.XXXXXX";
+    if (!dir) {
+        dir = mkdtemp(tmp_dir);
+        if (!dir) {
+            perror("mkdtemp");
+            return 2;
+        }
+    }
+
+    out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) {
+        perror(out_path);
+        return 2;
+    }
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd < 0) {
+        perror("/dev/null");
+        return 2;
+    }
+
+    // The same seed gives the same contents, sizes and aging
+    rng_state = seed ? seed : 1;
+
+    const char *cache = getenv(QFS_CACHE_ENV);
+    fprintf(out, "{\n  \"seed\": %llu,\n  \"repeats\": %d,\n  \"cache\": \"%s\",\n"
+            "  \"scan\": \"%s\",\n  \"results\": [",
+            (unsigned long long) seed, repeats, cache ? cache : "", qfs_scan_impl());
+
+    int status = 0;
+    const char *p = sizes;
+
+    while (*p) {
+        const char *rest;
+        uint64_t value;
+        if (qfs_parse_size(p, SIZE_MAX, &value, &rest) != QFS_OK || value <= QFS_DATA_OFFSET
+            || (*rest != ',' && *rest != '\0')) {
+            fprintf(stderr, "Error: Invalid image size in '%s'.\n", sizes);
+            status = 1;
+            break;
+        }
+        size_t size = (size_t) value;
+
+        int err = bench_size(dir, size, repeats, null_fd);
+        if (err != QFS_OK) {
+            fprintf(stderr, "Error: Benchmark of %zu byte image failed: %s\n", size, qfs_strerror(err));
+            status = 3;
+            break;
+        }
+
+        p = *rest == ',' ? rest + 1 : rest;
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+
+    close(null_fd);
+    if (out != stdout) {
+        fclose(out);
+    }
+    if (dir == tmp_dir) {
+        rmdir(tmp_dir);
+    }
+
+    return status;
+}
@@ -0,0 +1,165 @@
+/*
+**Program to print part of a file stored in a QFS image
+**
+** Usage: qfs_cat [--stats[=json]] <disk image file> <file> [-o|--offset <bytes>] [-l|--length <bytes>]
+**
+** Writes length bytes of the file, starting at offset, to stdout. The
+** range is cut short at the end of the file and defaults to the rest of
+** it. The block holding the offset is found through the file's block map
+** (see lib/qfs_map.h) rather than by walking the chain from its start.
+** With QFS_SOCKET set the range is read through qfsd, which keeps the
+** maps cached between requests.
+**
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "qfs.h"
+#include "qfs_image.h"
+#include "qfs_dir.h"
+#include "qfs_file.h"
+#include "qfs_map.h"
+#include "qfs_proto.h"
+
+static int usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--stats[=json]] <disk image file> <file> "
+            "[-o|--offset <bytes>] [-l|--length <bytes>]\n", prog);
+    return 1;
+}
+
+// Have qfsd read the range instead of opening the image
+static int cat_remote(const char *sock_path, const char *image_path, const char *name,
+                      const qfs_range_t *range) {
+    int fd = qfs_client_connect(sock_path);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot reach qfsd at %s: %s\n", sock_path, qfs_strerror(fd));
+        return 2;
+    }
+
+    qfs_resp_hdr_t resp;
+    int err = qfs_client_call(fd, QFS_OP_RANGE, 0, image_path, name, range, sizeof(*range), &resp);
+    if (err == QFS_ENOENT) {
+        fprintf(stderr, "Error: File '%s' not found.\n", name);
+        close(fd);
+        return 4;
+    }
+    if (err == QFS_EFORMAT) {
+        fprintf(stderr, "Error: Failed to read '%s': %s\n", name, qfs_strerror(err));
+        close(fd);
+        return 6;
+    }
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", image_path, qfs_strerror(err));
+        close(fd);
+        return 2;
+    }
+
+    err = qfs_client_copy(fd, resp.data_len, STDOUT_FILENO);
+    close(fd);
+
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Failed to read '%s': %s\n", name, qfs_strerror(err));
+        return 6;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (qfs_stats_args(&argc, argv) != QFS_OK) {
+        return usage(argv[0]);
+    }
+
+    int64_t offset = 0, length = -1;
+    int opt;
+
+    static const struct option long_opts[] = {
+        {"offset", required_argument, NULL, 'o'},
+        {"length", required_argument, NULL, 'l'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "o:l:", long_opts, NULL)) != -1) {
+        if (opt == 'o' || opt == 'l') {
+            uint64_t value;
+            if (qfs_parse_size(optarg, UINT32_MAX, &value, NULL) != QFS_OK) {
+                fprintf(stderr, "Error: Invalid %s '%s'.\n", opt == 'o' ? "offset" : "length", optarg);
+                return 1;
+            }
+            if (opt == 'o') {
+                offset = value;
+            } else {
+                length = value;
+            }
+        } else {
+            return usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 2) {
+        return usage(argv[0]);
+    }
+
+    const char *image_path = argv[optind];
+    const char *name = argv[optind + 1];
+
+    qfs_range_t range;
+    range.offset = (uint32_t) offset;
+    range.length = length < 0 ? UINT32_MAX : (uint32_t) length;
+
+    const char *sock_path = qfs_client_socket();
+    if (sock_path) {
+        return cat_remote(sock_path, image_path, name, &range);
+    }
+
+    qfs_image_t img;
+    int err = qfs_open(&img, image_path, QFS_RDONLY);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", image_path, qfs_strerror(err));
+        return 2;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "Opened disk image: %s\n", image_path);
+#endif
+
+    qfs_dir_t *dir = qfs_get_dir(&img);
+    if (!dir) {
+        fprintf(stderr, "Error: Failed to load directory.\n");
+        qfs_close(&img);
+        return 3;
+    }
+
+    int slot = qfs_dir_lookup(dir, name);
+    if (slot < 0) {
+        fprintf(stderr, "Error: File '%s' not found.\n", name);
+        qfs_close(&img);
+        return 4;
+    }
+
+    // Cut the range short at the end of the file (as written, if compressed)
+    int64_t size = qfs_file_size(&img, &dir->entries[slot]);
+    if (size < 0) {
+        fprintf(stderr, "Error: Failed to read '%s': %s\n", name, qfs_strerror((int) size));
+        qfs_close(&img);
+        return 6;
+    }
+    if (range.offset > size) {
+        range.offset = (uint32_t) size;
+    }
+    if (range.length > size - range.offset) {
+        range.length = (uint32_t) (size - range.offset);
+    }
+
+    err = qfs_read_range_to_fd(&img, slot, range.offset, range.length, STDOUT_FILENO);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Failed to read '%s': %s\n", name, qfs_strerror(err));
+        qfs_close(&img);
+        return 6;
+    }
+
+    qfs_close(&img);
+    return 0;
+}
@@ -0,0 +1,127 @@
+/*
+**Program to defragment a QFS image
+**
+** Usage: qfs_defrag [-n] [-b|--budget <bytes>[K|M|G]] <disk image file>
+**
+** Files are packed into one contiguous, ascending layout from the start
+** of the image, in the order they are on disk, until every fragmented
+** file is in a single run. Blocks of other files in the way are slid
+** aside a few hundred at a time, so a nearly full image can be
+** defragmented too. Copies are flushed before anything links to them and
+** old blocks are freed last, so an interrupted run never loses a file.
+** --budget caps the bytes moved in one pass, blocks slid aside included,
+** -n only reports the fragmentation score.
+**
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include "qfs.h"
+#include "qfs_image.h"
+#include "qfs_dir.h"
+#include "qfs_defrag.h"
+
+static int usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n] [-b|--budget <bytes>[K|M|G]] <disk image file>\n", prog);
+    return 1;
+}
+
+static void print_stats(const char *when, const qfs_frag_stats_t *st) {
+    printf("Fragmentation %s: %.1f%% (%u of %u files fragmented, %u extents in %u blocks)\n",
+           when, st->score, st->fragmented, st->files, st->extents, st->blocks);
+}
+
+static void print_move(const qfs_image_t *img, int slot, uint32_t old_start, int old_extents) {
+    const direntry_t *entry = &img->dirindex->entries[slot];
+
+    printf("Moved '%s' (%u blocks in %d extents) from block %u to %u\n",
+           entry->filename, qfs_blocks_for(img, entry->file_size), old_extents,
+           old_start, qfs_entry_start(entry, img->version));
+}
+
+int main(int argc, char *argv[]) {
+    size_t budget = 0;
+    int dry_run = 0;
+    int opt;
+
+    static const struct option long_opts[] = {
+        {"budget", required_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "b:n", long_opts, NULL)) != -1) {
+        if (opt == 'b') {
+            uint64_t value;
+            if (qfs_parse_size(optarg, SIZE_MAX, &value, NULL) != QFS_OK || value == 0) {
+                fprintf(stderr, "Error: Invalid budget '%s'.\n", optarg);
+                return 1;
+            }
+            budget = (size_t) value;
+        } else if (opt == 'n') {
+            dry_run = 1;
+        } else {
+            return usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 1) {
+        return usage(argv[0]);
+    }
+
+    qfs_image_t img;
+    int err = qfs_open(&img, argv[optind], dry_run ? QFS_RDONLY : QFS_RDWR);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", argv[optind], qfs_strerror(err));
+        return 2;
+    }
+
+#ifdef DEBUG
+    printf("Opened disk image: %s\n", argv[optind]);
+#endif
+
+    qfs_frag_stats_t st;
+    if (qfs_frag_stats(&img, &st) != QFS_OK) {
+        fprintf(stderr, "Error: Failed to load directory.\n");
+        qfs_close(&img);
+        return 3;
+    }
+    print_stats("before", &st);
+
+    if (dry_run || st.fragmented == 0) {
+        qfs_close(&img);
+        return 0;
+    }
+
+    qfs_defrag_result_t res;
+    err = qfs_defrag(&img, budget, &res, print_move);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Defragmentation stopped: %s\n", qfs_strerror(err));
+        qfs_close(&img);
+        return 3;
+    }
+
+    printf("%u file(s) moved, %zu bytes copied\n", res.moved_files, res.moved_bytes);
+    if (res.over_budget > 0) {
+        printf("%u file(s) left for the next pass (budget reached)\n", res.over_budget);
+    }
+    if (res.too_big > 0) {
+        printf("%u file(s) left fragmented: moving them takes more than the budget\n", res.too_big);
+    }
+    if (res.no_space > 0) {
+        printf("%u file(s) left fragmented: no room for them in the layout\n", res.no_space);
+    }
+    if (res.broken > 0) {
+        printf("%u file(s) with a broken chain skipped, run fsck_qfs\n", res.broken);
+    }
+    if (res.shared > 0) {
+        printf("%u file(s) sharing a deduplicated chain left in place\n", res.shared);
+    }
+
+    qfs_frag_stats(&img, &st);
+    print_stats("after", &st);
+
+    qfs_close(&img);
+    return 0;
+}
@@ -0,0 +1,277 @@
+/*
+**Program to pack a host directory into a new QFS image
+**
+** Usage: qfs_pack [-V 1|2] [-j <journal size>[K|M]] [-f <free space>[K|M|G]] [--stats[=json]] <directory> <disk image file> [<label>]
+**
+** Every regular file under the directory is stored under its path
+** relative to it, e.g. 'logs/a.txt'. Empty files and paths longer than
+** a file name can hold are skipped.
+**
+** The image is sized to hold exactly the files (plus -f bytes of free
+** space and the -j journal), created, formatted the way mkfs_qfs would
+** and filled by a single qfs_write_files() call. Every file's blocks are
+** planned before any data is copied, so on the empty image each file is
+** one contiguous run, in name order, and the data goes out as one
+** sequential pass over the image. qfs_unpack reverses it.
+**
+** Exit status: 0 every file packed, 5 if any were skipped or failed.
+**
+*/
+
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "qfs.h"
+#include "qfs_image.h"
+#include "qfs_dir.h"
+#include "qfs_file.h"
+#include "qfs_format.h"
+#include "qfs_journal.h"
+
+// Host directory descriptors nftw may keep open
+#define WALK_FDS  64
+
+typedef struct pack_file {
+    char     *path;         // Host path
+    char     *name;         // Name in the image (points into path)
+    uint32_t  size;
+} pack_file_t;
+
+// Files found by the walk (nftw passes no context to its callback)
+static pack_file_t *files;
+static int n_files, cap_files;
+static size_t root_len;
+static int n_skipped;
+
+static int usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-V 1|2] [-j <journal size>[K|M]] [-f <free space>[K|M|G]] [--stats[=json]] "
+            "<directory> <disk image file> [<label>]\n", prog);
+    return 1;
+}
+
+// Remember every regular file that fits in the image
+static int add_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void) ftw;
+    if (type != FTW_F || !S_ISREG(st->st_mode)) {
+        return 0;
+    }
+
+    const char *name = path + root_len;
+    while (*name == '/') {
+        name++;
+    }
+
+    if (strlen(name) > QFS_NAME_MAX) {
+        fprintf(stderr, "Skipping '%s': name longer than %zu characters.\n", name, QFS_NAME_MAX);
+        n_skipped++;
+        return 0;
+    }
+    if (st->st_size == 0 || st->st_size > UINT32_MAX) {
+        fprintf(stderr, "Skipping '%s': %s.\n", name, st->st_size == 0 ? "file is empty" : "file too large");
+        n_skipped++;
+        return 0;
+    }
+
+    if (n_files == cap_files) {
+        cap_files = cap_files ? cap_files * 2 : 256;
+        pack_file_t *grown = realloc(files, cap_files * sizeof(pack_file_t));
+        if (!grown) {
+            return -1;
+        }
+        files = grown;
+    }
+
+    pack_file_t *f = &files[n_files++];
+    f->path = strdup(path);
+    if (!f->path) {
+        return -1;
+    }
+    f->name = f->path + (name - path);
+    f->size = (uint32_t) st->st_size;
+    return 0;
+}
+
+static int name_cmp(const void *a, const void *b) {
+    return strcmp(((const pack_file_t *) a)->name, ((const pack_file_t *) b)->name);
+}
+
+// Image bytes that hold every file plus free bytes of space and the
+// journal. The block size grows with the image, so the size is raised
+// until it holds the files at the block size it gets.
+static size_t plan_size(int version, size_t journal, size_t free_space, int *out_version) {
+    uint64_t data = 0;
+    for (int i = 0; i < n_files; i++) {
+        data += files[i].size;
+    }
+
+    size_t size = QFS_DATA_OFFSET + (size_t) data + free_space + journal;
+
+    for (;;) {
+        int v = version ? version : qfs_version_for(size);
+        uint32_t block_size = qfs_block_size_for(size, v);
+        uint32_t payload = block_size - (v >= QFS_V2 ? 5 : 3);
+        size_t offset = v >= QFS_V2 ? QFS_V2_DATA_OFFSET : QFS_DATA_OFFSET;
+
+        uint64_t blocks = 0;
+        for (int i = 0; i < n_files; i++) {
+            blocks += (files[i].size + payload - 1) / payload;
+        }
+
+        // Slots past the root table go in extension blocks, one of the
+        // root slots holds the extension itself
+        uint32_t per_block = payload / sizeof(direntry_t);
+        if (n_files + 1 > QFS_DIR_ENTRIES) {
+            blocks += (n_files + 1 - QFS_DIR_ENTRIES + per_block - 1) / per_block;
+        }
+        blocks += (free_space + block_size - 1) / block_size;
+        blocks += (journal + block_size - 1) / block_size;
+
+        size_t need = offset + (size_t) blocks * block_size;
+        if (need <= size && (version || qfs_version_for(size) == v)) {
+            *out_version = v;
+            return size;
+        }
+        size = need;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    size_t journal_size = 0;
+    size_t free_space = 0;
+    int version = 0;
+    uint64_t value;
+    int opt;
+
+    if (qfs_stats_args(&argc, argv) != QFS_OK) {
+        return usage(argv[0]);
+    }
+
+    static const struct option long_opts[] = {
+        {"journal", required_argument, NULL, 'j'},
+        {"free", required_argument, NULL, 'f'},
+        {"format-version", required_argument, NULL, 'V'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "j:f:V:", long_opts, NULL)) != -1) {
+        if (opt == 'j') {
+            if (qfs_parse_size(optarg, SIZE_MAX, &value, NULL) != QFS_OK || value < QFS_JOURNAL_MIN) {
+                fprintf(stderr, "Error: Journal must be at least %d bytes.\n", QFS_JOURNAL_MIN);
+                return 1;
+            }
+            journal_size = (size_t) value;
+        } else if (opt == 'f') {
+            if (qfs_parse_size(optarg, SIZE_MAX, &value, NULL) != QFS_OK || value == 0) {
+                fprintf(stderr, "Error: Invalid size '%s'.\n", optarg);
+                return 1;
+            }
+            free_space = (size_t) value;
+        } else if (opt == 'V') {
+            if (qfs_parse_int(optarg, QFS_V1, QFS_V2, &version) != QFS_OK) {
+                fprintf(stderr, "Error: Format version must be 1 or 2.\n");
+                return 1;
+            }
+        } else {
+            return usage(argv[0]);
+        }
+    }
+
+    if (argc - optind < 2 || argc - optind > 3) {
+        return usage(argv[0]);
+    }
+
+    const char *src_dir = argv[optind];
+    const char *image_path = argv[optind + 1];
+    const char *label = (argc - optind == 3) ? argv[optind + 2] : NULL;
+
+    // Every file is found and sized before the image exists
+    root_len = strlen(src_dir);
+    if (nftw(src_dir, add_file, WALK_FDS, FTW_PHYS) != 0) {
+        perror("Error: Cannot read directory");
+        return 4;
+    }
+    if (n_files == 0) {
+        fprintf(stderr, "Error: No files to pack in %s.\n", src_dir);
+        return 4;
+    }
+    qsort(files, n_files, sizeof(pack_file_t), name_cmp);
+
+    int v;
+    size_t size = plan_size(version, journal_size, free_space, &v);
+    if (v == QFS_V1 && (size - QFS_DATA_OFFSET) / qfs_block_size_for(size, v) > QFS_MAX_BLOCKS) {
+        fprintf(stderr, "Error: %d file(s) do not fit in a version 1 image.\n", n_files);
+        return 1;
+    }
+
+    size_t zero_from;
+    int err = qfs_create_image(image_path, size, &zero_from);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot create %s: %s\n", image_path, qfs_strerror(err));
+        return 2;
+    }
+
+    qfs_image_t img;
+    err = qfs_open(&img, image_path, QFS_RDWR | QFS_RAW);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", image_path, qfs_strerror(err));
+        return 2;
+    }
+    err = qfs_format(&img, label, v, QFS_FMT_SPARSE, zero_from, journal_size);
+    qfs_close(&img);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Invalid filesystem geometry.\n");
+        return 3;
+    }
+
+    err = qfs_open(&img, image_path, QFS_RDWR);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", image_path, qfs_strerror(err));
+        return 2;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "Packing %d file(s) into %zu bytes, version %d\n", n_files, size, v);
+#endif
+
+    qfs_write_req_t *reqs = calloc(n_files, sizeof(qfs_write_req_t));
+    if (!reqs) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        qfs_close(&img);
+        return 4;
+    }
+
+    // Host paths are opened by qfs_write_files(), but stored under their names
+    for (int i = 0; i < n_files; i++) {
+        reqs[i].path = files[i].path;
+        reqs[i].name = files[i].name;
+    }
+
+    // One plan for the whole tree, first fit lays it out front to back
+    int written = qfs_write_files(&img, reqs, n_files, QFS_ALLOC_FIRST_FIT);
+    uint64_t bytes = 0;
+
+    for (int i = 0; i < n_files; i++) {
+        if (reqs[i].status != QFS_OK) {
+            fprintf(stderr, "Error: Could not pack '%s': %s\n", files[i].name, qfs_strerror(reqs[i].status));
+            continue;
+        }
+        bytes += reqs[i].size;
+    }
+
+    printf("Packed %d file(s), %llu bytes, into %s (%u blocks of %u bytes, version %d).\n",
+           written, (unsigned long long) bytes, image_path, img.total_blocks, img.block_size, v);
+
+    qfs_close(&img);
+    for (int i = 0; i < n_files; i++) {
+        free(files[i].path);
+    }
+    free(files);
+    free(reqs);
+
+    return written == n_files && n_skipped == 0 ? 0 : 5;
+}
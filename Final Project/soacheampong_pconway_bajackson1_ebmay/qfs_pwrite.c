@@ -0,0 +1,228 @@
+/*
+**Program to overwrite part of a file on a QFS image
+**
+** Usage: qfs_pwrite [--stats[=json]] <disk image file> <file> <offset> [<host file> | -]
+**
+** The bytes come from the host file, or from standard input when it is
+** '-' or left out, and replace the file's bytes from offset on, e.g.
+** 'printf OK | qfs_pwrite disk.img table.dat 4096'. Only the payload of
+** the blocks they cover is written, so patching a record costs a block
+** or two however large the file is. Bytes past the end of the file are
+** appended the way qfs_append does it, with zeros between the old end
+** and offset.
+**
+** As with qfs_append, a compressed file (write_file -z) cannot be
+** overwritten, since its bytes are not stored as they are, and neither
+** can a file whose blocks are shared with identical files (write_file -d)
+** until it is the only one left.
+**
+** Exit status: 0 written, 3 system error, 4 file not found, 7 no space,
+** 9 file is compressed, 10 file shares its blocks, 11 other error.
+**
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "qfs.h"
+#include "qfs_image.h"
+#include "qfs_dir.h"
+#include "qfs_file.h"
+#include "qfs_proto.h"
+
+// Bytes read from the source at a time
+#define READ_BYTES  (1 << 20)
+
+static int usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--stats[=json]] <disk image file> <file> <offset> [<host file> | -]\n", prog);
+    return 1;
+}
+
+// Exit code for a failed write
+static int exit_code(int err) {
+    switch (err) {
+        case QFS_ESYS:        return 3;
+        case QFS_ENOENT:      return 4;
+        case QFS_ENOSPC:      return 7;
+        case QFS_ECOMPRESSED: return 9;
+        case QFS_ESHARED:     return 10;
+        default:              return 11;
+    }
+}
+
+// Read a whole stream into memory (it may be a pipe, so its size is not
+// known up front), returns NULL with errno set on failure
+static uint8_t *load_stream(FILE *src, uint32_t *size) {
+    uint8_t *buf = NULL;
+    size_t len = 0, cap = 0;
+
+    for (;;) {
+        if (cap - len < READ_BYTES) {
+            cap = cap ? cap * 2 : READ_BYTES;
+            if (cap > UINT32_MAX) {
+                free(buf);
+                errno = EFBIG;
+                return NULL;
+            }
+            uint8_t *grown = realloc(buf, cap);
+            if (!grown) {
+                free(buf);
+                return NULL;
+            }
+            buf = grown;
+        }
+
+        size_t got = fread(buf + len, 1, READ_BYTES, src);
+        len += got;
+        if (got < READ_BYTES) {
+            break;
+        }
+    }
+
+    if (ferror(src) || len > UINT32_MAX) {
+        free(buf);
+        errno = ferror(src) ? EIO : EFBIG;
+        return NULL;
+    }
+
+    *size = (uint32_t) len;
+    return buf;
+}
+
+// Have qfsd overwrite the bytes instead of opening the image
+static int pwrite_remote(const char *sock_path, const char *image_path, const char *name,
+                         uint32_t offset, const uint8_t *data, uint32_t len) {
+    // The request carries the offset in front of the bytes
+    uint8_t *req = len <= UINT32_MAX - sizeof(offset) ? malloc((size_t) len + sizeof(offset)) : NULL;
+    if (!req) {
+        fprintf(stderr, "Error: Cannot send %u bytes to qfsd.\n", len);
+        return 3;
+    }
+    memcpy(req, &offset, sizeof(offset));
+    memcpy(req + sizeof(offset), data, len);
+
+    int fd = qfs_client_connect(sock_path);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot reach qfsd at %s: %s\n", sock_path, qfs_strerror(fd));
+        free(req);
+        return 2;
+    }
+
+    qfs_resp_hdr_t resp;
+    qfs_file_info_t info;
+    int err = qfs_client_call(fd, QFS_OP_PWRITE, 0, image_path, name, req,
+                              len + (uint32_t) sizeof(offset), &resp);
+    free(req);
+
+    if (err == QFS_ENOIMG) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", image_path, qfs_strerror(err));
+        close(fd);
+        return 2;
+    }
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot write to '%s': %s\n", name, qfs_strerror(err));
+        close(fd);
+        return exit_code(err);
+    }
+    if (resp.data_len != sizeof(info) || qfs_recv_all(fd, &info, sizeof(info)) != QFS_OK) {
+        fprintf(stderr, "Error: Bad reply from qfsd.\n");
+        close(fd);
+        return 3;
+    }
+    close(fd);
+
+    printf("Wrote %u bytes at offset %u of '%s' (Size: %u).\n",
+           len, offset, name, info.entry.file_size);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (qfs_stats_args(&argc, argv) != QFS_OK || argc < 4 || argc > 5) {
+        return usage(argv[0]);
+    }
+
+    const char *image_path = argv[1];
+    const char *name = argv[2];
+    const char *src_path = argc == 5 && strcmp(argv[4], "-") != 0 ? argv[4] : NULL;
+
+    uint64_t offset;
+    if (qfs_parse_size(argv[3], UINT32_MAX, &offset, NULL) != QFS_OK) {
+        fprintf(stderr, "Error: Invalid offset '%s'.\n", argv[3]);
+        return 1;
+    }
+
+    FILE *src = src_path ? fopen(src_path, "rb") : stdin;
+    if (!src) {
+        perror("Error: Cannot open source file");
+        return 3;
+    }
+
+    uint32_t len;
+    uint8_t *data = load_stream(src, &len);
+    if (src != stdin) {
+        fclose(src);
+    }
+    if (!data) {
+        perror("Error: Cannot read source");
+        return 3;
+    }
+
+    const char *sock_path = qfs_client_socket();
+    if (sock_path) {
+        int status = pwrite_remote(sock_path, image_path, name, (uint32_t) offset, data, len);
+        free(data);
+        return status;
+    }
+
+    qfs_image_t img;
+    int err = qfs_open(&img, image_path, QFS_RDWR);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", image_path, qfs_strerror(err));
+        free(data);
+        return 2;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "Opened disk image: %s\n", image_path);
+#endif
+
+    qfs_dir_t *dir = qfs_get_dir(&img);
+    if (!dir) {
+        fprintf(stderr, "Error: Failed to load directory.\n");
+        free(data);
+        qfs_close(&img);
+        return 3;
+    }
+
+    int slot = qfs_dir_lookup(dir, name);
+    if (slot < 0) {
+        fprintf(stderr, "Error: File '%s' not found.\n", name);
+        free(data);
+        qfs_close(&img);
+        return 4;
+    }
+
+    // Changed payload bytes, and for a write past the end the entry,
+    // superblock and busy bytes, are committed on close
+    int64_t done = qfs_pwrite(&img, slot, data, len, (uint32_t) offset);
+    free(data);
+    if (done < 0) {
+        if ((int) done == QFS_ESHARED) {
+            fprintf(stderr, "Error: Cannot write to '%s': %s (%d files use them).\n",
+                    name, qfs_strerror(QFS_ESHARED), qfs_shared_files(&img, slot));
+        } else {
+            fprintf(stderr, "Error: Cannot write to '%s': %s\n", name, qfs_strerror((int) done));
+        }
+        qfs_close(&img);
+        return exit_code((int) done);
+    }
+
+    printf("Wrote %u bytes at offset %u of '%s' (Size: %u).\n",
+           len, (uint32_t) offset, name, dir->entries[slot].file_size);
+
+    qfs_close(&img);
+    return 0;
+}
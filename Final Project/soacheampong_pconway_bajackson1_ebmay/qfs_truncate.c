@@ -0,0 +1,143 @@
+/*
+**Program to set the size of a file on a QFS image
+**
+** Usage: qfs_truncate [--stats[=json]] <disk image file> <file> <size>[K|M|G]
+**
+** Shrinking frees only the blocks past the new end of the file, the rest
+** of its chain is left where it is. Growing adds zero bytes the way
+** qfs_append adds data. Truncating to 0 keeps the (empty) entry.
+**
+** As with qfs_append, a compressed file (write_file -z) cannot be
+** resized, since it would have to be packed again, and neither can a file
+** whose blocks are shared with identical files (write_file -d) until it
+** is the only one left.
+**
+** Exit status: 0 resized, 3 system error, 4 file not found, 7 no space,
+** 9 file is compressed, 10 file shares its blocks, 11 other error.
+**
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "qfs.h"
+#include "qfs_image.h"
+#include "qfs_dir.h"
+#include "qfs_file.h"
+#include "qfs_proto.h"
+
+static int usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--stats[=json]] <disk image file> <file> <size>[K|M|G]\n", prog);
+    return 1;
+}
+
+// Exit code for a failed truncate
+static int exit_code(int err) {
+    switch (err) {
+        case QFS_ESYS:        return 3;
+        case QFS_ENOENT:      return 4;
+        case QFS_ENOSPC:      return 7;
+        case QFS_ECOMPRESSED: return 9;
+        case QFS_ESHARED:     return 10;
+        default:              return 11;
+    }
+}
+
+// Have qfsd resize the file instead of opening the image
+static int truncate_remote(const char *sock_path, const char *image_path, const char *name,
+                           uint32_t size) {
+    int fd = qfs_client_connect(sock_path);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot reach qfsd at %s: %s\n", sock_path, qfs_strerror(fd));
+        return 2;
+    }
+
+    qfs_resp_hdr_t resp;
+    qfs_file_info_t info;
+    int err = qfs_client_call(fd, QFS_OP_TRUNCATE, 0, image_path, name, &size, sizeof(size), &resp);
+
+    if (err == QFS_ENOIMG) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", image_path, qfs_strerror(err));
+        close(fd);
+        return 2;
+    }
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot truncate '%s': %s\n", name, qfs_strerror(err));
+        close(fd);
+        return exit_code(err);
+    }
+    if (resp.data_len != sizeof(info) || qfs_recv_all(fd, &info, sizeof(info)) != QFS_OK) {
+        fprintf(stderr, "Error: Bad reply from qfsd.\n");
+        close(fd);
+        return 3;
+    }
+    close(fd);
+
+    printf("Truncated '%s' to %u bytes (%u blocks).\n", name, info.entry.file_size, info.blocks);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (qfs_stats_args(&argc, argv) != QFS_OK || argc != 4) {
+        return usage(argv[0]);
+    }
+
+    const char *image_path = argv[1];
+    const char *name = argv[2];
+    uint64_t size;
+    if (qfs_parse_size(argv[3], UINT32_MAX, &size, NULL) != QFS_OK) {
+        fprintf(stderr, "Error: Invalid size '%s'.\n", argv[3]);
+        return 1;
+    }
+
+    const char *sock_path = qfs_client_socket();
+    if (sock_path) {
+        return truncate_remote(sock_path, image_path, name, (uint32_t) size);
+    }
+
+    qfs_image_t img;
+    int err = qfs_open(&img, image_path, QFS_RDWR);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", image_path, qfs_strerror(err));
+        return 2;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "Opened disk image: %s\n", image_path);
+#endif
+
+    qfs_dir_t *dir = qfs_get_dir(&img);
+    if (!dir) {
+        fprintf(stderr, "Error: Failed to load directory.\n");
+        qfs_close(&img);
+        return 3;
+    }
+
+    int slot = qfs_dir_lookup(dir, name);
+    if (slot < 0) {
+        fprintf(stderr, "Error: File '%s' not found.\n", name);
+        qfs_close(&img);
+        return 4;
+    }
+
+    // The entry, superblock and busy bytes are committed on close
+    err = qfs_truncate_file(&img, slot, (uint32_t) size);
+    if (err != QFS_OK) {
+        if (err == QFS_ESHARED) {
+            fprintf(stderr, "Error: Cannot truncate '%s': %s (%d files use them).\n",
+                    name, qfs_strerror(QFS_ESHARED), qfs_shared_files(&img, slot));
+        } else {
+            fprintf(stderr, "Error: Cannot truncate '%s': %s\n", name, qfs_strerror(err));
+        }
+        qfs_close(&img);
+        return exit_code(err);
+    }
+
+    printf("Truncated '%s' to %u bytes (%u blocks).\n",
+           name, (uint32_t) size, qfs_blocks_for(&img, (uint32_t) size));
+
+    qfs_close(&img);
+    return 0;
+}
@@ -0,0 +1,165 @@
+/*
+**Program to extract every file of a QFS image into a host directory
+**
+** Usage: qfs_unpack [--stats[=json]] <disk image file> <directory>
+**
+** Files are extracted in the order of their first block rather than by
+** name, so an image made by qfs_pack is read front to back in one pass.
+** Names with a '/' are recreated as subdirectories of the target, which
+** is created if needed. Names that are absolute or step out of the target
+** through '..' are skipped.
+**
+** Exit status: 0 every file extracted, 5 if any were skipped or failed.
+**
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "qfs.h"
+#include "qfs_image.h"
+#include "qfs_dir.h"
+#include "qfs_file.h"
+
+// A file to extract and where its chain starts
+typedef struct unpack_file {
+    int      slot;
+    uint32_t start;
+} unpack_file_t;
+
+static int usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--stats[=json]] <disk image file> <directory>\n", prog);
+    return 1;
+}
+
+static int start_cmp(const void *a, const void *b) {
+    const unpack_file_t *x = a, *y = b;
+    if (x->start != y->start) {
+        return x->start < y->start ? -1 : 1;
+    }
+    return x->slot - y->slot;
+}
+
+// Test whether a stored name stays inside the target directory
+static int safe_name(const char *name) {
+    if (name[0] == '/') {
+        return 0;
+    }
+    for (const char *p = name; *p; ) {
+        size_t len = strcspn(p, "/");
+        if (len == 2 && p[0] == '.' && p[1] == '.') {
+            return 0;
+        }
+        p += len;
+        p += *p == '/';
+    }
+    return 1;
+}
+
+// Create every directory leading up to the last component of path
+static int make_parents(char *path) {
+    for (char *p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        int err = mkdir(path, 0755) != 0 && errno != EEXIST;
+        *p = '/';
+        if (err) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (qfs_stats_args(&argc, argv) != QFS_OK || argc != 3) {
+        return usage(argv[0]);
+    }
+
+    const char *image_path = argv[1];
+    const char *out_dir = argv[2];
+
+    qfs_image_t img;
+    int err = qfs_open(&img, image_path, QFS_RDONLY);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", image_path, qfs_strerror(err));
+        return 2;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "Opened disk image: %s\n", image_path);
+#endif
+
+    qfs_dir_t *dir = qfs_get_dir(&img);
+    unpack_file_t *order = dir ? malloc((dir->n_slots ? dir->n_slots : 1) * sizeof(unpack_file_t)) : NULL;
+    if (!order) {
+        fprintf(stderr, "Error: Failed to load directory.\n");
+        qfs_close(&img);
+        return 3;
+    }
+
+    if (mkdir(out_dir, 0755) != 0 && errno != EEXIST) {
+        perror("Error: Cannot create directory");
+        free(order);
+        qfs_close(&img);
+        return 4;
+    }
+
+    // Physical order, so the image is read sequentially
+    int n = 0;
+    for (int slot = 0; slot < dir->n_slots; slot++) {
+        if (qfs_dir_is_file(dir, slot)) {
+            order[n].slot = slot;
+            order[n].start = qfs_entry_start(&dir->entries[slot], img.version);
+            n++;
+        }
+    }
+    qsort(order, n, sizeof(unpack_file_t), start_cmp);
+
+    int extracted = 0;
+    uint64_t bytes = 0;
+    size_t dir_len = strlen(out_dir);
+    char *path = malloc(dir_len + QFS_NAME_MAX + 2);
+
+    for (int i = 0; path && i < n; i++) {
+        const direntry_t *entry = &dir->entries[order[i].slot];
+        char name[QFS_NAME_MAX + 1];
+
+        memcpy(name, entry->filename, QFS_NAME_MAX);
+        name[QFS_NAME_MAX] = '\0';
+
+        if (!safe_name(name)) {
+            fprintf(stderr, "Skipping '%s': name leaves %s.\n", name, out_dir);
+            continue;
+        }
+
+        snprintf(path, dir_len + QFS_NAME_MAX + 2, "%s/%s", out_dir, name);
+        int fd = make_parents(path) == 0 ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+        if (fd < 0) {
+            fprintf(stderr, "Error: Cannot create %s: %s\n", path, strerror(errno));
+            continue;
+        }
+
+        err = qfs_read_to_fd(&img, entry, fd);
+        close(fd);
+        if (err != QFS_OK) {
+            fprintf(stderr, "Error: Failed to read '%s': %s\n", name, qfs_strerror(err));
+            continue;
+        }
+
+        int64_t size = qfs_file_size(&img, entry);
+        bytes += size > 0 ? (uint64_t) size : 0;
+        extracted++;
+    }
+
+    printf("Unpacked %d of %d file(s), %llu bytes, into %s.\n",
+           extracted, n, (unsigned long long) bytes, out_dir);
+
+    free(path);
+    free(order);
+    qfs_close(&img);
+    return extracted == n ? 0 : 5;
+}
@@ -0,0 +1,659 @@
+/*
+**Long-running QFS server
+**
+** Usage: qfsd [-s <socket>] <disk image file> [<disk image file> ...]
+**
+** Opens each image once, loads its directory index and free-block bitmap
+** and then serves list, read, write, delete, append, truncate and
+** overwrite requests from the command line tools over a Unix domain socket (see lib/qfs_proto.h).
+** Range reads (qfs_cat) go through each file's block map, which stays
+** cached for as long as the file is unchanged (an append or truncate
+** updates it in place, so appending to a log never rewalks its chain).
+** The socket is taken from -s or from QFS_SOCKET. Run the tools with the
+** same QFS_SOCKET and they go through the daemon instead of opening the
+** image themselves:
+**
+**   qfsd -s /tmp/qfs.sock disk.img &
+**   QFS_SOCKET=/tmp/qfs.sock ./read_file disk.img photo.jpg out.jpg
+**
+** Each connection gets its own thread. Reads and listings of an image run
+** side by side, changes take the image exclusively. A read holds the
+** image only while it copies the next megabyte out, never while sending,
+** and a client that leaves a reply unread for 30 seconds is dropped.
+** Requests carrying more data than the largest image are refused. A change is answered
+** only once it has been committed with qfs_commit(). Commits are shared:
+** the first client to wait commits everything applied so far,
+** and the clients whose changes landed meanwhile wait for that commit
+** instead of making their own, so on a journaled image one flush covers
+** a whole burst of writes. While qfsd serves an image, other changes to
+** it must go through qfsd too.
+**
+** With QFS_CACHE set (see lib/qfs_cache.h) blocks are served from a block
+** cache shared by all connections, and its counters are printed when
+** qfsd stops.
+**
+** SIGINT or SIGTERM closes the images and removes the socket.
+**
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "qfs.h"
+#include "qfs_image.h"
+#include "qfs_bitmap.h"
+#include "qfs_dir.h"
+#include "qfs_file.h"
+#include "qfs_map.h"
+#include "qfs_lz.h"
+#include "qfs_proto.h"
+
+// Bytes of a file copied out under the read lock at a time
+#define SEND_CHUNK  (1 << 20)
+
+// Seconds a reply may wait for a client that does not read it
+#define SEND_TIMEOUT  30
+
+// One image kept open for the life of the daemon
+typedef struct served_image {
+    char             path[PATH_MAX];   // Absolute path clients refer to it by
+    qfs_image_t      img;
+    pthread_rwlock_t lock;             // Shared for list/read, exclusive for write/delete
+
+    // Group commit, changes are numbered in the order they were applied
+    pthread_mutex_t  commit_mu;
+    pthread_cond_t   commit_cv;
+    uint64_t         applied;          // Last change applied (under lock)
+    uint64_t         committed;        // Last change known to be committed
+    uint64_t         failed;           // Last change whose commit failed
+    int              committing;       // A client is running qfs_commit()
+} served_image_t;
+
+static served_image_t *images;
+static int n_images;
+static size_t max_data;              // Largest request data accepted
+
+static volatile sig_atomic_t stopping;
+
+static int usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-s <socket>] <disk image file> [<disk image file> ...]\n", prog);
+    return 1;
+}
+
+static void on_signal(int sig) {
+    (void) sig;
+    stopping = 1;
+}
+
+static served_image_t *find_image(const char *path) {
+    for (int i = 0; i < n_images; i++) {
+        if (strcmp(images[i].path, path) == 0) {
+            return &images[i];
+        }
+    }
+    return NULL;
+}
+
+// Send a reply header and its data (an error may carry data too). With
+// data NULL only the header goes out and the caller sends the len bytes.
+static int reply(int fd, int status, const void *data, uint32_t len) {
+    qfs_resp_hdr_t resp;
+    resp.status = status;
+    resp.sys_errno = status == QFS_ESYS ? errno : 0;
+    resp.data_len = len;
+
+    int err = qfs_send_all(fd, &resp, sizeof(resp));
+    if (err == QFS_OK && data && resp.data_len > 0) {
+        err = qfs_send_all(fd, data, resp.data_len);
+    }
+    return err;
+}
+
+// Superblock followed by the used directory entries in listing order,
+// copied out under the lock and sent once it is released
+static int do_list(int fd, served_image_t *si) {
+    pthread_rwlock_rdlock(&si->lock);
+
+    qfs_dir_t *dir = qfs_get_dir(&si->img);
+    size_t ext_len = si->img.sbx ? sizeof(superblock_ext_t) : 0;
+    size_t head = sizeof(superblock_t) + ext_len;
+    uint8_t *buf = malloc(head + (size_t) (dir->n_used + 1) * sizeof(direntry_t));
+    if (!buf) {
+        pthread_rwlock_unlock(&si->lock);
+        return reply(fd, QFS_ESYS, NULL, 0);
+    }
+
+    memcpy(buf, si->img.sb, sizeof(superblock_t));
+    if (ext_len > 0) {
+        memcpy(buf + sizeof(superblock_t), si->img.sbx, ext_len);
+    }
+    int n = qfs_dir_listing(dir, (direntry_t *) (buf + head));
+
+    pthread_rwlock_unlock(&si->lock);
+
+    int err = reply(fd, QFS_OK, buf, (uint32_t) (head + n * sizeof(direntry_t)));
+    free(buf);
+    return err;
+}
+
+// Look a file up under the lock for a read: its entry, its size, and its
+// chain checked so a broken one is reported before any data goes out
+static int find_for_read(served_image_t *si, const char *name, direntry_t *entry, int64_t *size) {
+    qfs_dir_t *dir = qfs_get_dir(&si->img);
+    int slot = qfs_dir_lookup(dir, name);
+    if (slot < 0) {
+        return QFS_ENOENT;
+    }
+
+    memcpy(entry, &dir->entries[slot], sizeof(direntry_t));
+
+    // Compressed files go out as they were written
+    *size = qfs_file_size(&si->img, entry);
+    if (*size < 0) {
+        return (int) *size;
+    }
+
+    const qfs_blockmap_t *map;
+    return qfs_get_blockmap(&si->img, slot, &map);
+}
+
+// Reply with length bytes from offset of a file, a chunk at a time. Each
+// chunk is copied out under the read lock and sent with it released, so
+// a client that stops reading holds up only itself. The header goes out
+// with the first chunk, so an error reading it (damaged compressed data)
+// is answered as such. A file deleted or resized, or an error, part way
+// through ends the reply early (the client sees it cut short); bytes
+// overwritten in place are sent as they are found.
+static int send_file(int fd, served_image_t *si, const char *name, const direntry_t *entry,
+                     uint32_t offset, uint32_t length) {
+    uint8_t *buf = malloc(length < SEND_CHUNK ? length : SEND_CHUNK);
+    if (!buf && length > 0) {
+        return reply(fd, QFS_ESYS, NULL, 0);
+    }
+
+    int err = QFS_OK;
+    int started = 0;
+    if (length == 0) {
+        err = reply(fd, QFS_OK, NULL, 0);
+    }
+    while (err == QFS_OK && length > 0) {
+        uint32_t count = length < SEND_CHUNK ? length : SEND_CHUNK;
+
+        pthread_rwlock_rdlock(&si->lock);
+        qfs_dir_t *dir = qfs_get_dir(&si->img);
+        int slot = qfs_dir_lookup(dir, name);
+        int64_t got = QFS_EPROTO;
+        if (slot >= 0 && memcmp(&dir->entries[slot], entry, sizeof(direntry_t)) == 0) {
+            got = qfs_pread(&si->img, slot, buf, count, offset);
+        }
+        pthread_rwlock_unlock(&si->lock);
+
+        if (got != (int64_t) count) {
+            err = got < 0 ? (int) got : QFS_EPROTO;
+            if (!started) {
+                err = reply(fd, err, NULL, 0);
+            }
+            break;
+        }
+        if (!started) {
+            err = reply(fd, QFS_OK, NULL, length);
+            started = 1;
+        }
+        if (err == QFS_OK) {
+            err = qfs_send_all(fd, buf, count);
+        }
+        offset += count;
+        length -= count;
+    }
+
+    free(buf);
+    return err;
+}
+
+// File contents, copied out of the image a chunk at a time
+static int do_read(int fd, served_image_t *si, const char *name) {
+    direntry_t entry;
+    int64_t size;
+
+    pthread_rwlock_rdlock(&si->lock);
+    int err = find_for_read(si, name, &entry, &size);
+    pthread_rwlock_unlock(&si->lock);
+
+    if (err != QFS_OK) {
+        return reply(fd, err, NULL, 0);
+    }
+
+    return send_file(fd, si, name, &entry, 0, (uint32_t) size);
+}
+
+// Part of a file, found through its cached block map
+static int do_range(int fd, served_image_t *si, const char *name, const void *data,
+                    uint32_t len) {
+    qfs_range_t range;
+    if (len != sizeof(range)) {
+        return reply(fd, QFS_EPROTO, NULL, 0);
+    }
+    memcpy(&range, data, sizeof(range));
+
+    direntry_t entry;
+    int64_t size;
+
+    pthread_rwlock_rdlock(&si->lock);
+    int err = find_for_read(si, name, &entry, &size);
+    pthread_rwlock_unlock(&si->lock);
+
+    if (err != QFS_OK) {
+        return reply(fd, err, NULL, 0);
+    }
+    if (range.offset > size) {
+        range.offset = (uint32_t) size;
+    }
+    if (range.length > size - range.offset) {
+        range.length = (uint32_t) (size - range.offset);
+    }
+
+    return send_file(fd, si, name, &entry, range.offset, range.length);
+}
+
+// Wait until change number ticket is committed, committing it (and every
+// change applied before it) if no other client is already doing so
+static int wait_committed(served_image_t *si, uint64_t ticket) {
+    int err = QFS_OK;
+
+    pthread_mutex_lock(&si->commit_mu);
+    while (si->committed < ticket) {
+        if (si->failed >= ticket) {
+            err = QFS_ESYS;
+            break;
+        }
+        if (si->committing) {
+            pthread_cond_wait(&si->commit_cv, &si->commit_mu);
+            continue;
+        }
+
+        // This client commits for everyone applied so far
+        si->committing = 1;
+        pthread_mutex_unlock(&si->commit_mu);
+
+        pthread_rwlock_wrlock(&si->lock);
+        uint64_t upto = si->applied;
+        int c = qfs_commit(&si->img);
+        pthread_rwlock_unlock(&si->lock);
+
+        pthread_mutex_lock(&si->commit_mu);
+        if (c == QFS_OK) {
+            si->committed = upto;
+        } else {
+            si->failed = upto;
+        }
+        si->committing = 0;
+        pthread_cond_broadcast(&si->commit_cv);
+    }
+    pthread_mutex_unlock(&si->commit_mu);
+
+    return err;
+}
+
+static int do_write(served_image_t *si, const char *name, const void *data,
+                    uint32_t len, int type, int policy, qfs_file_info_t *info) {
+    qfs_write_req_t req;
+    memset(&req, 0, sizeof(req));
+    req.path = name;
+    req.data = data;
+    req.size = len;
+    req.type = (uint8_t) type;
+    req.dedup = (policy & QFS_WRITE_DEDUP) != 0;
+
+    policy &= ~QFS_WRITE_DEDUP;
+    if (policy != QFS_ALLOC_FIRST_FIT) {
+        policy = QFS_ALLOC_BEST_FIT;
+    }
+
+    qfs_write_files(&si->img, &req, 1, policy);
+    if (req.status != QFS_OK) {
+        errno = req.sys_errno;
+        return req.status;
+    }
+
+    info->entry = si->img.dirindex->entries[req.slot];
+    info->start = qfs_entry_start(&info->entry, si->img.version);
+    info->blocks = req.shared ? 0 : qfs_blocks_for(&si->img, req.size);
+    return QFS_OK;
+}
+
+static int do_delete(served_image_t *si, const char *name, qfs_file_info_t *info) {
+    qfs_dir_t *dir = qfs_get_dir(&si->img);
+    int slot = qfs_dir_lookup(dir, name);
+    if (slot < 0) {
+        return QFS_ENOENT;
+    }
+
+    info->entry = dir->entries[slot];
+    info->start = qfs_entry_start(&info->entry, si->img.version);
+    info->blocks = qfs_blocks_for(&si->img, info->entry.file_size);
+
+    // A truncated chain is still deleted, QFS_EFORMAT tells the client
+    return qfs_delete_file(&si->img, slot);
+}
+
+// Append to, truncate or overwrite part of a file in place
+static int do_update(served_image_t *si, int op, const char *name, const void *data,
+                     uint32_t len, qfs_file_info_t *info) {
+    qfs_dir_t *dir = qfs_get_dir(&si->img);
+    int slot = qfs_dir_lookup(dir, name);
+    if (slot < 0) {
+        return QFS_ENOENT;
+    }
+
+    int err;
+    if (op == QFS_OP_APPEND) {
+        err = qfs_append_file(&si->img, slot, data, len);
+    } else if (op == QFS_OP_PWRITE) {
+        uint32_t offset;
+        if (len < sizeof(offset)) {
+            return QFS_EPROTO;
+        }
+        memcpy(&offset, data, sizeof(offset));
+        int64_t done = qfs_pwrite(&si->img, slot, (const uint8_t *) data + sizeof(offset),
+                                  len - sizeof(offset), offset);
+        err = done < 0 ? (int) done : QFS_OK;
+    } else {
+        uint32_t size;
+        if (len != sizeof(size)) {
+            return QFS_EPROTO;
+        }
+        memcpy(&size, data, sizeof(size));
+        err = qfs_truncate_file(&si->img, slot, size);
+    }
+    if (err != QFS_OK) {
+        return err;
+    }
+
+    info->entry = dir->entries[slot];
+    info->start = qfs_entry_start(&info->entry, si->img.version);
+    info->blocks = qfs_blocks_for(&si->img, info->entry.file_size);
+    return QFS_OK;
+}
+
+// Apply a write, delete or in-place change, then answer once it is committed
+static int do_change(int fd, served_image_t *si, int op, const char *name,
+                     const void *data, uint32_t len, int policy) {
+    qfs_file_info_t info;
+    memset(&info, 0, sizeof(info));
+
+    // Compressed before the image is taken, so readers are not held up
+    uint8_t *packed = NULL;
+    uint32_t packed_len = 0;
+    if (op == QFS_OP_WRITE && (policy & QFS_WRITE_LZ)
+        && qfs_lz_pack(data, len, si->img.payload, &packed, &packed_len) != QFS_OK) {
+        return reply(fd, QFS_ESYS, NULL, 0);
+    }
+    policy &= ~QFS_WRITE_LZ;
+
+    pthread_rwlock_wrlock(&si->lock);
+    int status = op == QFS_OP_DELETE ? do_delete(si, name, &info)
+               : op != QFS_OP_WRITE ? do_update(si, op, name, data, len, &info)
+               : packed ? do_write(si, name, packed, packed_len, QFS_TYPE_LZ, policy, &info)
+                        : do_write(si, name, data, len, QFS_TYPE_FILE, policy, &info);
+    int saved_errno = errno;
+
+    // A failed write or in-place change leaves nothing behind, a delete
+    // changes the image unless the file was not there
+    int changed = op == QFS_OP_DELETE ? status != QFS_ENOENT : status == QFS_OK;
+    uint64_t ticket = changed ? ++si->applied : 0;
+    pthread_rwlock_unlock(&si->lock);
+    free(packed);
+
+    if (ticket > 0) {
+        int err = wait_committed(si, ticket);
+        if (err != QFS_OK) {
+            status = err;
+            saved_errno = EIO;
+        }
+    }
+
+    errno = saved_errno;
+    if (status != QFS_OK && status != QFS_EFORMAT) {
+        return reply(fd, status, NULL, 0);
+    }
+    return reply(fd, status, &info, sizeof(info));
+}
+
+// Read one request and answer it, returns QFS_OK to keep the connection open
+static int serve_one(int fd) {
+    qfs_req_hdr_t hdr;
+    int err = qfs_recv_all(fd, &hdr, sizeof(hdr));
+    if (err != QFS_OK) {
+        return err;
+    }
+    if (hdr.magic != QFS_PROTO_MAGIC) {
+        reply(fd, QFS_EPROTO, NULL, 0);
+        return QFS_EPROTO;
+    }
+
+    // Image path, name and data are read in full before anything is answered
+    char image[PATH_MAX];
+    char name[UINT16_MAX + 1];
+    uint8_t *data = NULL;
+
+    // No request carries more than a whole image
+    if (hdr.image_len >= sizeof(image) || hdr.data_len > max_data) {
+        reply(fd, QFS_EPROTO, NULL, 0);
+        return QFS_EPROTO;
+    }
+    err = qfs_recv_all(fd, image, hdr.image_len);
+    if (err == QFS_OK) {
+        err = qfs_recv_all(fd, name, hdr.name_len);
+    }
+    if (err == QFS_OK && hdr.data_len > 0) {
+        data = malloc(hdr.data_len);
+        err = data ? qfs_recv_all(fd, data, hdr.data_len) : QFS_ESYS;
+    }
+    if (err != QFS_OK) {
+        free(data);
+        return err;
+    }
+    image[hdr.image_len] = '\0';
+    name[hdr.name_len] = '\0';
+
+#ifdef DEBUG
+    fprintf(stderr, "qfsd: op %u on %s '%s' (%u bytes)\n", hdr.op, image, name, hdr.data_len);
+#endif
+
+    served_image_t *si = find_image(image);
+    if (!si) {
+        free(data);
+        return reply(fd, QFS_ENOIMG, NULL, 0);
+    }
+
+    // Reads take the lock themselves, only while copying out of the image
+    switch (hdr.op) {
+        case QFS_OP_LIST:
+            err = do_list(fd, si);
+            break;
+        case QFS_OP_READ:
+            err = do_read(fd, si, name);
+            break;
+        case QFS_OP_RANGE:
+            err = do_range(fd, si, name, data, hdr.data_len);
+            break;
+        case QFS_OP_WRITE:
+        case QFS_OP_DELETE:
+        case QFS_OP_APPEND:
+        case QFS_OP_TRUNCATE:
+        case QFS_OP_PWRITE:
+            err = do_change(fd, si, hdr.op, name, data, hdr.data_len, hdr.policy);
+            break;
+        default:
+            err = reply(fd, QFS_EPROTO, NULL, 0);
+            break;
+    }
+
+    free(data);
+    return err;
+}
+
+static void *connection_thread(void *arg) {
+    int fd = (int) (intptr_t) arg;
+
+    // A client may send any number of requests before hanging up
+    while (!stopping && serve_one(fd) == QFS_OK) {
+    }
+
+    close(fd);
+    return NULL;
+}
+
+// Create the listening socket, replacing a stale one left by an earlier run
+static int listen_on(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path too long.\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    const char *sock_path = qfs_client_socket();
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        if (opt == 's') {
+            sock_path = optarg;
+        } else {
+            return usage(argv[0]);
+        }
+    }
+
+    if (argc - optind < 1 || !sock_path) {
+        return usage(argv[0]);
+    }
+
+    n_images = argc - optind;
+    images = calloc(n_images, sizeof(served_image_t));
+    if (!images) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 3;
+    }
+
+    // Open every image and load its metadata once
+    for (int i = 0; i < n_images; i++) {
+        const char *path = argv[optind + i];
+        served_image_t *si = &images[i];
+
+        int err = qfs_open(&si->img, path, QFS_RDWR);
+        if (err == QFS_OK && (!realpath(path, si->path) || !qfs_get_dir(&si->img)
+                              || !qfs_get_bitmap(&si->img))) {
+            err = QFS_ESYS;
+        }
+        if (err != QFS_OK) {
+            fprintf(stderr, "Error: Cannot open %s: %s\n", path, qfs_strerror(err));
+            for (int j = 0; j <= i; j++) {
+                qfs_close(&images[j].img);
+            }
+            return 2;
+        }
+
+        pthread_rwlock_init(&si->lock, NULL);
+        pthread_mutex_init(&si->commit_mu, NULL);
+        pthread_cond_init(&si->commit_cv, NULL);
+
+        // A pwrite's offset comes before its bytes
+        if (si->img.size + sizeof(uint32_t) > max_data) {
+            max_data = si->img.size + sizeof(uint32_t);
+        }
+
+        if (si->img.bitmap->free_count != qfs_sb_available(&si->img)) {
+            fprintf(stderr, "Warning: %s: superblock lists %u free blocks but %u are free.\n",
+                    path, qfs_sb_available(&si->img), si->img.bitmap->free_count);
+        }
+    }
+
+    int listen_fd = listen_on(sock_path);
+    if (listen_fd < 0) {
+        for (int i = 0; i < n_images; i++) {
+            qfs_close(&images[i].img);
+        }
+        return 4;
+    }
+
+    // No SA_RESTART, so a signal interrupts accept()
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("qfsd: serving %d image(s) on %s\n", n_images, sock_path);
+    fflush(stdout);
+
+    while (!stopping) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                perror("accept");
+            }
+            continue;
+        }
+
+        // A client that stops reading its reply is dropped
+        struct timeval tv = { SEND_TIMEOUT, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, connection_thread, (void *) (intptr_t) fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+
+    close(listen_fd);
+    unlink(sock_path);
+
+    // Wait for requests in flight, then write everything back
+    for (int i = 0; i < n_images; i++) {
+        pthread_rwlock_wrlock(&images[i].lock);
+
+        if (images[i].img.cache) {
+            qfs_cache_stats_t st;
+            qfs_cache_stats(images[i].img.cache, &st);
+            printf("qfsd: %s: cache %llu hits, %llu misses, %llu evictions, %llu write-backs\n",
+                   images[i].path, (unsigned long long) st.hits, (unsigned long long) st.misses,
+                   (unsigned long long) st.evictions, (unsigned long long) st.writebacks);
+        }
+        qfs_close(&images[i].img);
+    }
+
+    printf("qfsd: stopped\n");
+    return 0;
+}
@@ -1,26 +1,138 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "qfs.h"
+#include "qfs_image.h"
+#include "qfs_dir.h"
+#include "qfs_file.h"
+#include "qfs_proto.h"
+
+// Open the output file, or use stdout for "-"
+static int open_output(const char *path) {
+    if (strcmp(path, "-") == 0) {
+        return STDOUT_FILENO;
+    }
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+// Have qfsd stream the file instead of opening the image
+static int read_remote(const char *sock_path, const char *image_path, const char *name,
+                       const char *out_path) {
+    int fd = qfs_client_connect(sock_path);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot reach qfsd at %s: %s\n", sock_path, qfs_strerror(fd));
+        return 2;
+    }
+
+    qfs_resp_hdr_t resp;
+    int err = qfs_client_call(fd, QFS_OP_READ, 0, image_path, name, NULL, 0, &resp);
+    if (err == QFS_ENOENT) {
+        fprintf(stderr, "Error: File '%s' not found.\n", name);
+        close(fd);
+        return 4;
+    }
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", image_path, qfs_strerror(err));
+        close(fd);
+        return 2;
+    }
+
+    int to_stdout = strcmp(out_path, "-") == 0;
+    int out_fd = open_output(out_path);
+
+    if (out_fd < 0) {
+        perror("open output file");
+        close(fd);
+        return 5;
+    }
+
+    err = qfs_client_copy(fd, resp.data_len, out_fd);
+    close(fd);
+
+    if (!to_stdout) {
+        close(out_fd);
+    }
+
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Failed to read '%s': %s\n", name, qfs_strerror(err));
+        return 6;
+    }
+
+    if (!to_stdout) {
+        printf("Read '%s' (%u bytes) into '%s'.\n", name, resp.data_len, out_path);
+    }
+
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <disk image file> <file to read> <output file>\n", argv[0]);
+    if (qfs_stats_args(&argc, argv) != QFS_OK || argc != 4) {
+        fprintf(stderr, "Usage: %s [--stats[=json]] <disk image file> <file to read> <output file | ->\n", argv[0]);
         return 1;
     }
 
-    FILE *fp = fopen(argv[1], "rb");
-    if (!fp) {
-        perror("fopen");
+    const char *sock_path = qfs_client_socket();
+    if (sock_path) {
+        return read_remote(sock_path, argv[1], argv[2], argv[3]);
+    }
+
+    qfs_image_t img;
+    int err = qfs_open(&img, argv[1], QFS_RDONLY);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", argv[1], qfs_strerror(err));
         return 2;
     }
 
 #ifdef DEBUG
-    printf("Opened disk image: %s\n", argv[1]);
+    fprintf(stderr, "Opened disk image: %s\n", argv[1]);
 #endif
 
-    // TODO
+    // Find file through the directory index
+    qfs_dir_t *dir = qfs_get_dir(&img);
+    if (!dir) {
+        fprintf(stderr, "Error: Failed to load directory.\n");
+        qfs_close(&img);
+        return 3;
+    }
+
+    int slot = qfs_dir_lookup(dir, argv[2]);
+    if (slot < 0) {
+        fprintf(stderr, "Error: File '%s' not found.\n", argv[2]);
+        qfs_close(&img);
+        return 4;
+    }
+
+    const direntry_t *entry = &dir->entries[slot];
+
+    // "-" streams the file to stdout so it can be piped
+    int to_stdout = strcmp(argv[3], "-") == 0;
+    int out_fd = open_output(argv[3]);
+
+    if (out_fd < 0) {
+        perror("open output file");
+        qfs_close(&img);
+        return 5;
+    }
+
+    err = qfs_read_to_fd(&img, entry, out_fd);
+
+    if (!to_stdout) {
+        close(out_fd);
+    }
+
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Failed to read '%s': %s\n", argv[2], qfs_strerror(err));
+        qfs_close(&img);
+        return 6;
+    }
+
+    if (!to_stdout) {
+        printf("Read '%s' (%lld bytes) into '%s'.\n", entry->filename,
+               (long long) qfs_file_size(&img, entry), argv[3]);
+    }
 
-    fclose(fp);
+    qfs_close(&img);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,206 +1,393 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "qfs.h"
+#include "qfs_image.h"
+#include "qfs_bitmap.h"
+#include "qfs_file.h"
+#include "qfs_lz.h"
+#include "qfs_proto.h"
 
-int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <disk image file> <file to add>\n", argv[0]);
-        return 1;
-    }
+// Original bytes of files loaded and compressed per qfs_write_files() call
+#define LZ_BATCH_BYTES  (64u << 20)
 
-    FILE *fp = fopen(argv[1], "rb+");
-    if (!fp) {
-        perror("fopen");
-        return 2;
+static int usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-p best|first] [-z] [-d] [--stats[=json]] <disk image file> <file to add> [<file to add> ...]\n", prog);
+    fprintf(stderr, "       %s [-p best|first] [-z] [-d] [--stats[=json]] --from-list <list file> <disk image file> [<file to add> ...]\n", prog);
+    return 1;
+}
+
+// Exit code for the first file that could not be written
+static int exit_code(int err) {
+    switch (err) {
+        case QFS_ESYS:   return 3;
+        case QFS_EEMPTY: return 5;
+        case QFS_ENODIR: return 6;
+        case QFS_ENOSPC: return 7;
+        case QFS_EEXIST: return 8;
+        default:         return 9;
     }
+}
 
-#ifdef DEBUG
-    printf("Opened disk image: %s\n", argv[1]);
-#endif
+// Add a copy of a path to the list, growing it as needed. Returns -1 if
+// out of memory, leaving the list as it was.
+static int add_path(char ***paths, int *count, int *cap, const char *path) {
+    if (*count == *cap) {
+        int grown_cap = *cap ? *cap * 2 : 64;
+        char **grown = realloc(*paths, grown_cap * sizeof(char *));
+        if (!grown) {
+            return -1;
+        }
+        *paths = grown;
+        *cap = grown_cap;
+    }
 
-    // Open source file to read data
-    FILE *src_fp = fopen(argv[2], "rb");
-    
-    if (!src_fp) {
-        perror("fopen source file");
-        fclose(fp);
-        return 3;
+    char *copy = strdup(path);
+    if (!copy) {
+        return -1;
     }
+    (*paths)[(*count)++] = copy;
+    return 0;
+}
 
-    // Read superblock to get filesystem details
-    superblock_t sb;
+// Free a list of paths
+static void free_paths(char **paths, int count) {
+    for (int i = 0; i < count; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+}
 
-    if (fread(&sb, sizeof(superblock_t), 1, fp) != 1) {
-        fprintf(stderr, "Error: Failed to read superblock.\n");
-        fclose(src_fp);
-        fclose(fp);
-        return 4;
+// Append every non-empty line of a manifest to the list of paths. Returns
+// -1 if it cannot be read, -2 if out of memory.
+static int read_list(const char *list_path, char ***paths, int *count, int *cap) {
+    FILE *list = fopen(list_path, "r");
+    if (!list) {
+        perror("fopen list file");
+        return -1;
     }
 
-    // Determine size of source file
-    fseek(src_fp, 0, SEEK_END);
-    long src_file_size = ftell(src_fp);
-    fseek(src_fp, 0, SEEK_SET);
-
-    if (src_file_size == 0) {
-        fprintf(stderr, "Error: Source file is empty.\n");
-        fclose(src_fp);
-        fclose(fp);
-        return 5;
-    }
-
-    // Check for enough space
-    uint32_t data_per_block = sb.bytes_per_block - 3;
-    uint32_t blocks_needed = (src_file_size + data_per_block - 1) / data_per_block;
-
-    if (sb.available_direntries == 0) {
-        fprintf(stderr, "Error: No directory entries available.\n");
-        fclose(src_fp);
-        fclose(fp);
-        return 6;
-    }
-
-    if (sb.available_blocks < blocks_needed) {
-        fprintf(stderr, "Error: Not enough free blocks. Needed: %u, Available: %u\n", 
-                blocks_needed, sb.available_blocks);
-        fclose(src_fp);
-        fclose(fp);
-        return 7;
-    }
-
-    // Find free directory entry
-    int dir_index = -1;
-    long dir_entry_offset = 0;
-    direntry_t entry;
-    
-    // Seek to start of directory entries
-    fseek(fp, sizeof(superblock_t), SEEK_SET);
-    
-    for (int i = 0; i < sb.total_direntries; i++) {
-        long pos = ftell(fp);
-        
-        if (fread(&entry, sizeof(direntry_t), 1, fp) != 1) break;
-        
-        // Free entry identified by empty filename
-        if (entry.filename[0] == '\0') {
-            dir_index = i;
-            dir_entry_offset = pos;
-            break;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    int err = 0;
+
+    while (err == 0 && (len = getline(&line, &line_cap, list)) != -1) {
+        // Strip the line ending
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len > 0 && add_path(paths, count, cap, line) != 0) {
+            err = -2;
         }
     }
 
-    // Error handling for no free directory slot
-    if (dir_index == -1) {
-        fprintf(stderr, "Error: Could not locate free directory entry slot.\n");
-        fclose(src_fp);
-        fclose(fp);
-        return 8;
-    }
+    free(line);
+    fclose(list);
+    return err;
+}
 
-    // Writing data blocks
-    // Track previous block to update next_block pointer
-    int prev_block_idx = -1;
-    int first_block_idx = -1;
-    long data_start_offset = sizeof(superblock_t) + (sizeof(direntry_t) * 255);
-    
-    // Max block size buffer
-    uint8_t buffer[2048];
-    long bytes_remaining = src_file_size;
-    // Searching where we left off
-    int search_start_idx = 0;
+// Load a host file into memory, returns NULL with errno set on failure
+static void *load_file(const char *path, uint32_t *size) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return NULL;
+    }
+    if (st.st_size > UINT32_MAX) {
+        errno = EFBIG;
+        return NULL;
+    }
+    *size = (uint32_t) st.st_size;
 
-    printf("Writing '%s' (%ld bytes) requiring %u blocks...\n", argv[2], src_file_size, blocks_needed);
+    // One spare byte so an empty file still gets a buffer
+    void *buf = malloc(*size + 1);
+    FILE *src = buf ? fopen(path, "rb") : NULL;
+    if (!src || fread(buf, 1, *size, src) != *size) {
+        int saved = errno;
+        if (src) {
+            fclose(src);
+        }
+        free(buf);
+        errno = saved ? saved : EIO;
+        return NULL;
+    }
 
-    while (bytes_remaining > 0) {
-        int curr_block_idx = -1;
-        long curr_block_offset = 0;
+    fclose(src);
+    return buf;
+}
 
-        // Find free block
-        // Seek to start of block area to search
-        fseek(fp, data_start_offset + (search_start_idx * sb.bytes_per_block), SEEK_SET);
+// Write files compressed (-z), loading and packing a batch at a time so
+// only one batch is held in memory. A file that does not shrink by at
+// least a block is stored as it is, one that cannot be loaded is left
+// for qfs_write_files() to report. orig gets each file's own size.
+static int write_compressed(qfs_image_t *img, qfs_write_req_t *reqs, int n, int policy,
+                            uint32_t *orig) {
+    int written = 0;
+    int first = 0;
 
-        for (int i = search_start_idx; i < sb.total_blocks; i++) {
-            uint8_t busy;
+    while (first < n) {
+        uint64_t batch = 0;
+        int last = first;
 
-            if (fread(&busy, 1, 1, fp) != 1) break;
+        for (; last < n && batch < LZ_BATCH_BYTES; last++) {
+            qfs_write_req_t *req = &reqs[last];
+            uint8_t *raw = load_file(req->path, &orig[last]);
+            if (!raw) {
+                continue;
+            }
 
-            // Free block
-            if (busy == 0) {
-                curr_block_idx = i;
-                curr_block_offset = data_start_offset + (i * sb.bytes_per_block);
-                // Start next search after this one
-                search_start_idx = i + 1;
-                break;
+            uint8_t *packed;
+            uint32_t packed_len;
+            if (qfs_lz_pack(raw, orig[last], img->payload, &packed, &packed_len) == QFS_OK && packed) {
+                free(raw);
+                req->data = packed;
+                req->size = packed_len;
+                req->type = QFS_TYPE_LZ;
+            } else {
+                req->data = raw;
+                req->size = orig[last];
             }
+            batch += orig[last];
+        }
+
+        written += qfs_write_files(img, reqs + first, last - first, policy);
+
+        for (int i = first; i < last; i++) {
+            free((void *) reqs[i].data);
+            reqs[i].data = NULL;
+        }
+        first = last;
+    }
+
+    return written;
+}
+
+// Send every file to qfsd over one connection instead of opening the image
+static int write_remote(const char *sock_path, const char *image_path, char **paths,
+                        int n_paths, int policy, int compress, int dedup) {
+    int fd = qfs_client_connect(sock_path);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot reach qfsd at %s: %s\n", sock_path, qfs_strerror(fd));
+        return 2;
+    }
+
+    int written = 0;
+    int status = 0;
+
+    for (int i = 0; i < n_paths; i++) {
+        uint32_t size = 0;
+        void *data = load_file(paths[i], &size);
+        int err = QFS_ESYS;
+        qfs_resp_hdr_t resp;
+        qfs_file_info_t info;
+
+        if (data) {
+            int flags = (compress ? QFS_WRITE_LZ : 0) | (dedup ? QFS_WRITE_DEDUP : 0);
+            err = qfs_client_call(fd, QFS_OP_WRITE, policy | flags, image_path, paths[i], data, size, &resp);
+            free(data);
+        }
+        if (err == QFS_OK && (resp.data_len != sizeof(info)
+                              || qfs_recv_all(fd, &info, sizeof(info)) != QFS_OK)) {
+            err = QFS_EPROTO;
+        }
+
+        if (err == QFS_OK && dedup && info.blocks == 0) {
+            printf("Wrote '%s' (%u bytes, shared with an identical file)\n", paths[i], size);
+            written++;
+            continue;
+        }
+        if (err == QFS_OK && (info.entry.permissions & QFS_TYPE_MASK) == QFS_TYPE_LZ) {
+            printf("Wrote '%s' (%u bytes, compressed to %u, %u blocks)\n", paths[i], size,
+                   info.entry.file_size, info.blocks);
+            written++;
+            continue;
+        }
+        if (err == QFS_OK) {
+            printf("Wrote '%s' (%u bytes, %u blocks)\n", paths[i], size, info.blocks);
+            written++;
+            continue;
+        }
 
-            // Skip to next block busy byte
-            fseek(fp, sb.bytes_per_block - 1, SEEK_CUR);
+        fprintf(stderr, "Error: Could not write '%s': %s\n", paths[i], qfs_strerror(err));
+        if (status == 0) {
+            status = exit_code(err);
         }
 
-        if (curr_block_idx == -1) {
-            fprintf(stderr, "Error: Unexpectedly ran out of blocks during write.\n");
+        // The connection is out of step after a bad reply, stop here
+        if (err == QFS_EPROTO || err == QFS_ENOIMG) {
             break;
         }
+    }
+    close(fd);
+
+    if (written == n_paths) {
+        printf("%d file(s) written successfully.\n", written);
+    } else {
+        printf("%d of %d file(s) written.\n", written, n_paths);
+    }
 
-        // Mark block as busy
-        fseek(fp, curr_block_offset, SEEK_SET);
-        uint8_t busy_val = 1;
-        fwrite(&busy_val, 1, 1, fp);
+    return status;
+}
 
-        // Link previous block to this one
-        if (prev_block_idx != -1) {
-            // Pointer at end of previous block
-            long prev_ptr_offset = data_start_offset + (prev_block_idx * sb.bytes_per_block) + sb.bytes_per_block - 2;
-            fseek(fp, prev_ptr_offset, SEEK_SET);
-            uint16_t next_val = (uint16_t)curr_block_idx;
-            fwrite(&next_val, sizeof(uint16_t), 1, fp);
+int main(int argc, char *argv[]) {
+    // Allocation policy for each file's run of blocks
+    int policy = QFS_ALLOC_BEST_FIT;
+    const char *list_path = NULL;
+    int compress = 0;
+    int dedup = 0;
+    int opt;
+
+    if (qfs_stats_args(&argc, argv) != QFS_OK) {
+        return usage(argv[0]);
+    }
+
+    static const struct option long_opts[] = {
+        {"from-list", required_argument, NULL, 'l'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "p:l:zd", long_opts, NULL)) != -1) {
+        if (opt == 'p' && strcmp(optarg, "best") == 0) {
+            policy = QFS_ALLOC_BEST_FIT;
+        } else if (opt == 'p' && strcmp(optarg, "first") == 0) {
+            policy = QFS_ALLOC_FIRST_FIT;
+        } else if (opt == 'l') {
+            list_path = optarg;
+        } else if (opt == 'z') {
+            compress = 1;
+        } else if (opt == 'd') {
+            dedup = 1;
         } else {
-            // First block
-            first_block_idx = curr_block_idx;
-        }
-
-        // Write data
-        uint32_t chunk_size = (bytes_remaining > data_per_block) ? data_per_block : bytes_remaining;
-        
-        // Clear buffer
-        memset(buffer, 0, sb.bytes_per_block);
-        // Read from source file
-        fread(buffer, 1, chunk_size, src_fp);
-        
-        // Write data to disk
-        fseek(fp, curr_block_offset + 1, SEEK_SET);
-        fwrite(buffer, 1, chunk_size, fp);
-
-        // Update state
-        bytes_remaining -= chunk_size;
-        prev_block_idx = curr_block_idx;
-        sb.available_blocks--;
-    }
-
-    // Write directory entry
-    memset(&entry, 0, sizeof(direntry_t));
-    // Copy filename
-    strncpy(entry.filename, argv[2], 22);
-    // Ensure null termination
-    entry.filename[22] = '\0';
-    entry.file_size = (uint32_t)src_file_size;
-    entry.starting_block = (uint16_t)first_block_idx;
-    // Default permissions
-    entry.permissions = 0;
-    
-    fseek(fp, dir_entry_offset, SEEK_SET);
-    fwrite(&entry, sizeof(direntry_t), 1, fp);
-
-    // Update superblock stats
-    sb.available_direntries--;
-    fseek(fp, 0, SEEK_SET);
-    fwrite(&sb, sizeof(superblock_t), 1, fp);
-
-    printf("File written successfully.\n");
-
-    fclose(src_fp);
-
-    fclose(fp);
-    return 0;
-}
\ No newline at end of file
+            return usage(argv[0]);
+        }
+    }
+
+    // Need the image and at least one file (or a list)
+    if (argc - optind < 1 || (!list_path && argc - optind < 2)) {
+        return usage(argv[0]);
+    }
+
+    const char *image_path = argv[optind];
+
+    // Files named on the command line, then those in the list
+    char **paths = NULL;
+    int n_paths = 0, cap = 0;
+
+    for (int i = optind + 1; i < argc; i++) {
+        if (add_path(&paths, &n_paths, &cap, argv[i]) != 0) {
+            fprintf(stderr, "Error: Out of memory.\n");
+            free_paths(paths, n_paths);
+            return 4;
+        }
+    }
+
+    int listed = list_path ? read_list(list_path, &paths, &n_paths, &cap) : 0;
+    if (listed != 0) {
+        if (listed == -2) {
+            fprintf(stderr, "Error: Out of memory.\n");
+        }
+        free_paths(paths, n_paths);
+        return 4;
+    }
+
+    if (n_paths == 0) {
+        fprintf(stderr, "Error: No files to add.\n");
+        free(paths);
+        return 1;
+    }
+
+    const char *sock_path = qfs_client_socket();
+    if (sock_path) {
+        int status = write_remote(sock_path, image_path, paths, n_paths, policy, compress, dedup);
+        free_paths(paths, n_paths);
+        return status;
+    }
+
+    qfs_image_t img;
+    int err = qfs_open(&img, image_path, QFS_RDWR);
+    if (err != QFS_OK) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", image_path, qfs_strerror(err));
+        return 2;
+    }
+
+#ifdef DEBUG
+    printf("Opened disk image: %s\n", image_path);
+#endif
+
+    // Build the free-block bitmap in one pass over the busy bytes
+    qfs_bitmap_t *bm = qfs_get_bitmap(&img);
+    if (!bm) {
+        fprintf(stderr, "Error: Failed to build free-block bitmap.\n");
+        qfs_close(&img);
+        return 4;
+    }
+
+    if (bm->free_count != qfs_sb_available(&img)) {
+        fprintf(stderr, "Warning: Superblock lists %u free blocks but %u are free.\n",
+                qfs_sb_available(&img), bm->free_count);
+    }
+
+    qfs_write_req_t *reqs = calloc(n_paths, sizeof(qfs_write_req_t));
+    uint32_t *orig = compress ? calloc(n_paths, sizeof(uint32_t)) : NULL;
+    if (!reqs || (compress && !orig)) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        qfs_close(&img);
+        return 4;
+    }
+
+    for (int i = 0; i < n_paths; i++) {
+        reqs[i].path = paths[i];
+        reqs[i].dedup = (uint8_t) dedup;
+    }
+
+    // Plan, stream and commit every file in one pass over the image
+    int written = compress ? write_compressed(&img, reqs, n_paths, policy, orig)
+                           : qfs_write_files(&img, reqs, n_paths, policy);
+
+    int status = 0;
+
+    for (int i = 0; i < n_paths; i++) {
+        if (reqs[i].status == QFS_OK && reqs[i].shared) {
+            printf("Wrote '%s' (%u bytes, shared with an identical file)\n", reqs[i].path,
+                   compress ? orig[i] : reqs[i].size);
+            continue;
+        }
+        if (reqs[i].status == QFS_OK && reqs[i].type == QFS_TYPE_LZ) {
+            printf("Wrote '%s' (%u bytes, compressed to %u, %u blocks)\n", reqs[i].path, orig[i],
+                   reqs[i].size, qfs_blocks_for(&img, reqs[i].size));
+            continue;
+        }
+        if (reqs[i].status == QFS_OK) {
+            printf("Wrote '%s' (%u bytes, %u blocks)\n", reqs[i].path, reqs[i].size,
+                   qfs_blocks_for(&img, reqs[i].size));
+            continue;
+        }
+
+        const char *reason = reqs[i].status == QFS_ESYS ? strerror(reqs[i].sys_errno)
+                                                       : qfs_strerror(reqs[i].status);
+        fprintf(stderr, "Error: Could not write '%s': %s\n", reqs[i].path, reason);
+
+        if (status == 0) {
+            status = exit_code(reqs[i].status);
+        }
+    }
+
+    if (written == n_paths) {
+        printf("%d file(s) written successfully.\n", written);
+    } else {
+        printf("%d of %d file(s) written.\n", written, n_paths);
+    }
+
+    free_paths(paths, n_paths);
+    free(reqs);
+    free(orig);
+
+    qfs_close(&img);
+    return status;
+}